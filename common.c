@@ -9,6 +9,11 @@
  */
 
 #include "common.h"
+#include "crc32c.h"
+#include <arpa/inet.h>
+#include <linux/sock_diag.h>
+#include <netinet/udp.h>
+#include <errno.h>
 
 #define CRASHWITHERROR(message) perror(message);exit(EXIT_FAILURE)
 #define LISTENING_PORT 23456
@@ -16,6 +21,17 @@
 int debugLevel = 0;
 int loss = 0;
 int corrupt = 0;
+int packetIntegrity = INTEGRITY_CHECKSUM16;
+atomic_int segmentationOffload = 1;
+
+// Number of bytes the packet takes up on the wire, including the CRC32C trailer if it has one
+static unsigned int PacketLength(const packet* packet)
+{
+    unsigned int length = PACKET_HEADER_LENGTH + packet->dataLength;
+    if (packet->integrity == INTEGRITY_CRC32C)
+        length += CRC32C_TRAILER_LENGTH;
+    return length;
+}
 
 int InitializeSocket()
 {
@@ -28,6 +44,102 @@ int InitializeSocket()
         return socket_fd;
 }
 
+// Makes sure the socket's SO_SNDBUF or SO_RCVBUF (option) can hold at least 'bytes'. Buffers are only ever grown.
+// The kernel caps the size at net.core.[rw]mem_max, so the actual size is returned.
+
+int GrowSocketBuffer(int socket_fd, int option, int bytes)
+{
+    int currentSize = 0;
+    socklen_t optionLength = sizeof(currentSize);
+    if (getsockopt(socket_fd, SOL_SOCKET, option, &currentSize, &optionLength) < 0)
+    {
+        DEBUGMESSAGE(1, "getsockopt() in GrowSocketBuffer() failed");
+        return -1;
+    }
+    // The kernel reports double the requested size, the other half is its own bookkeeping
+    if (currentSize / 2 >= bytes)
+        return currentSize;
+
+    if (setsockopt(socket_fd, SOL_SOCKET, option, &bytes, sizeof(bytes)) < 0)
+    {
+        DEBUGMESSAGE(1, "setsockopt() in GrowSocketBuffer() failed");
+        return currentSize;
+    }
+    optionLength = sizeof(currentSize);
+    getsockopt(socket_fd, SOL_SOCKET, option, &currentSize, &optionLength);
+    if (currentSize / 2 < bytes)
+    { // Capped by [rw]mem_max. The FORCE variants ignore the cap, but only work with CAP_NET_ADMIN
+        int forceOption = (option == SO_RCVBUF) ? SO_RCVBUFFORCE : SO_SNDBUFFORCE;
+        if (setsockopt(socket_fd, SOL_SOCKET, forceOption, &bytes, sizeof(bytes)) == 0)
+        {
+            optionLength = sizeof(currentSize);
+            getsockopt(socket_fd, SOL_SOCKET, option, &currentSize, &optionLength);
+        }
+    }
+    DEBUGMESSAGE(2, "Socket %s grown to %d bytes (wanted %d)", option == SO_RCVBUF ? "SO_RCVBUF" : "SO_SNDBUF",
+                 currentSize, bytes);
+    return currentSize;
+}
+
+// Returns how many bytes the socket's receive buffer can still take before the kernel starts dropping datagrams.
+// Falls back to the whole buffer size if the kernel can't tell us how much is in use.
+
+int SocketReceiveBufferFree(int socket_fd)
+{
+    unsigned int memoryInfo[SK_MEMINFO_VARS];
+    socklen_t optionLength = sizeof(memoryInfo);
+    if (getsockopt(socket_fd, SOL_SOCKET, SO_MEMINFO, memoryInfo, &optionLength) == 0)
+    {
+        int freeBytes = (int) memoryInfo[SK_MEMINFO_RCVBUF] - (int) memoryInfo[SK_MEMINFO_RMEM_ALLOC];
+        return freeBytes > 0 ? freeBytes : 0;
+    }
+
+    int bufferSize = 0;
+    optionLength = sizeof(bufferSize);
+    getsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, &optionLength);
+    return bufferSize;
+}
+
+// Parses a comma separated list of receivers, each an IPv4 address with an optional ':<port>' (LISTENING_PORT if
+// left out). Returns the number of receivers, or -1 if the list is malformed or longer than maxReceivers.
+
+int ParseFanoutReceivers(const char* list, struct sockaddr_in* addresses, int maxReceivers)
+{
+    char* copy;
+    if ((copy = strdup(list)) == NULL)
+    {
+        CRASHWITHERROR("strdup() in ParseFanoutReceivers() failed");
+    }
+    int count = 0;
+    char* position;
+    for (char* entry = strtok_r(copy, ",", &position); entry != NULL; entry = strtok_r(NULL, ",", &position))
+    {
+        if (count == maxReceivers)
+        {
+            count = -1;
+            break;
+        }
+        long port = LISTENING_PORT;
+        char* portString = strchr(entry, ':');
+        if (portString != NULL)
+        {
+            *portString++ = '\0';
+            port = strtol(portString, NULL, 10);
+        }
+        memset(&addresses[count], 0, sizeof(struct sockaddr_in));
+        addresses[count].sin_family = AF_INET;
+        addresses[count].sin_port = htons(port);
+        if (port < 1 || port > 65535 || inet_pton(AF_INET, entry, &addresses[count].sin_addr) != 1)
+        {
+            count = -1;
+            break;
+        }
+        count++;
+    }
+    free(copy);
+    return count;
+}
+
 /*ssize_t SendMessage(int socket_fd, const char* dataBuffer, int length, const struct sockaddr_in* receiverAddress,
                     unsigned int addressLength)
 {
@@ -53,30 +165,142 @@ ReceiveMessage(int socket_fd, char* packetBuffer, struct sockaddr_in* senderAddr
         return retval;
 }*/
 
-ssize_t
-SendPacket(int socket_fd, packet* packetToSend, const struct sockaddr_in* receiverAddress, unsigned int addressLength)
+// Fills in the checksum or the CRC32C trailer, whichever the packet's integrity byte asks for.
+// Returns the number of bytes the packet takes up on the wire.
+
+int SealPacket(packet* packetToSend)
 {
     packetToSend->checksum = 0;
-    packetToSend->checksum = (CalculateChecksum(packetToSend) ^ 65535u);
+    if (packetToSend->integrity == INTEGRITY_CRC32C)
+    { // The trailer fits, data[] is larger than anything a UDP datagram can carry
+        unsigned int crc = htonl(Crc32c(0, packetToSend, PACKET_HEADER_LENGTH + packetToSend->dataLength));
+        memcpy(packetToSend->data + packetToSend->dataLength, &crc, CRC32C_TRAILER_LENGTH);
+    }
+    else
+        packetToSend->checksum = (CalculateChecksum(packetToSend) ^ 65535u);
+    return PacketLength(packetToSend);
+}
 
-    int packetLength = PACKET_HEADER_LENGTH + packetToSend->dataLength;
+static ssize_t SendDatagram(int socket_fd, const void* datagram, int length, const struct sockaddr_in* receiverAddress,
+                            unsigned int addressLength)
+{
+    int retval = sendto(socket_fd, datagram, length, MSG_CONFIRM, (struct sockaddr*) receiverAddress, addressLength);
+    if (retval < 0)
+    {
+        CRASHWITHERROR("SendPacket() failed");
+    }
+    else
+        return retval;
+}
+
+ssize_t
+SendPacket(int socket_fd, packet* packetToSend, const struct sockaddr_in* receiverAddress, unsigned int addressLength)
+{
+    SealPacket(packetToSend);
+    int packetLength = PacketLength(packetToSend);
 
     // Run the packet through the Error Generator before sending it (or losing it)
     if (ErrorGenerator(packetToSend) != 0)
+        return SendDatagram(socket_fd, packetToSend, packetLength, receiverAddress, addressLength);
+    else
+        return packetLength;
+}
+
+void InitializeBatch(datagramBatch* batch, int socket_fd, const struct sockaddr_in* address, unsigned int addressLength)
+{
+    batch->socket_fd = socket_fd;
+    batch->address = address;
+    batch->addressLength = addressLength;
+    batch->segmentSize = 0;
+    batch->segments = 0;
+    batch->length = 0;
+}
+
+// Like SendPacket(), but the packet may wait in the batch until FlushBatch(). Flushes by itself whenever the packet
+// can't join the batch, or ends it by being shorter than the ones before it.
+
+void BatchPacket(datagramBatch* batch, packet* packetToSend)
+{
+    int packetLength = SealPacket(packetToSend);
+    BatchDatagram(batch, packetToSend, packetLength);
+}
+
+// Like BatchPacket(), for a packet that has already been sealed, such as one that goes to several receivers.
+// The Error Generator gets the batch's copy of it, the datagram itself is left as it is.
+
+void BatchDatagram(datagramBatch* batch, const void* datagram, int length)
+{
+    if (batch->segments > 0 && (length > batch->segmentSize || batch->length + length > MAX_BATCH_LENGTH))
+        FlushBatch(batch);
+    byte* copy = batch->buffer + batch->length;
+    memcpy(copy, datagram, length);
+
+    // Lost packets are left out of the batch, corrupted ones go in as they come out of the Error Generator
+    if (ErrorGenerator((packet*) copy) == 0)
+        return;
+    if (!atomic_load_explicit(&segmentationOffload, memory_order_relaxed))
+    {
+        SendDatagram(batch->socket_fd, copy, length, batch->address, batch->addressLength);
+        return;
+    }
+
+    if (batch->segments == 0)
+        batch->segmentSize = length;
+    batch->segments++;
+    batch->length += length;
+    if (length < batch->segmentSize || batch->segments == MAX_BATCH_SEGMENTS)
+        FlushBatch(batch);
+}
+
+// Sends whatever is waiting in the batch with one sendmsg(). If the kernel can't segment UDP the datagrams are sent
+// one at a time instead, and so is every batch after that. Returns the number of datagrams sent.
+
+int FlushBatch(datagramBatch* batch)
+{
+    int segments = batch->segments;
+    if (segments == 0)
+        return 0;
+
+    int sent = 0;
+    if (segments > 1)
     {
-        int retval = sendto(socket_fd, packetToSend, packetLength, MSG_CONFIRM, (struct sockaddr*) receiverAddress,
-                            addressLength);
-        if (retval < 0)
+        struct iovec iov = {batch->buffer, batch->length};
+        char control[CMSG_SPACE(sizeof(uint16_t))];
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        memset(control, 0, sizeof(control));
+        message.msg_name = (void*) batch->address;
+        message.msg_namelen = batch->addressLength;
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        struct cmsghdr* controlMessage = CMSG_FIRSTHDR(&message);
+        controlMessage->cmsg_level = SOL_UDP;
+        controlMessage->cmsg_type = UDP_SEGMENT;
+        controlMessage->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t segmentSize = batch->segmentSize;
+        memcpy(CMSG_DATA(controlMessage), &segmentSize, sizeof(segmentSize));
+
+        if (sendmsg(batch->socket_fd, &message, MSG_CONFIRM) >= 0)
+            sent = 1;
+        else if (atomic_exchange(&segmentationOffload, 0))
         {
-            CRASHWITHERROR("SendPacket() failed");
+            DEBUGMESSAGE(1, "UDP_SEGMENT not available (%s), sending datagrams one at a time", strerror(errno));
         }
-        else
-            return retval;
     }
-    else
+    if (!sent)
     {
-        return packetLength;
+        for (int offset = 0; offset < batch->length; offset += batch->segmentSize)
+        {
+            int length = batch->length - offset < batch->segmentSize ? batch->length - offset : batch->segmentSize;
+            SendDatagram(batch->socket_fd, batch->buffer + offset, length, batch->address, batch->addressLength);
+        }
     }
+
+    batch->segments = 0;
+    batch->length = 0;
+    return segments;
 }
 
 ssize_t
@@ -90,6 +314,34 @@ ReceivePacket(int socket_fd, packet* packetBuffer, struct sockaddr_in* senderAdd
         return -1;
     }
     else
+        return VerifyPacket(packetBuffer, retval);
+}
+
+// Checks a received datagram of 'retval' bytes with whatever integrity algorithm it names.
+// Returns retval if it is intact, -1 otherwise.
+
+int VerifyPacket(packet* packetBuffer, int retval)
+{
+    if (retval < PACKET_HEADER_LENGTH || retval != (int) PacketLength(packetBuffer))
+    { // Also catches a corrupted dataLength, which would otherwise make us check bytes that never arrived
+        DEBUGMESSAGE(2, "VerifyPacket() failed: got %d bytes, header says %d", retval, PacketLength(packetBuffer));
+        return -1;
+    }
+    else if (packetBuffer->integrity == INTEGRITY_CRC32C)
+    {
+        unsigned int crc;
+        memcpy(&crc, packetBuffer->data + packetBuffer->dataLength, CRC32C_TRAILER_LENGTH);
+        unsigned int expectedCrc = Crc32c(0, packetBuffer, PACKET_HEADER_LENGTH + packetBuffer->dataLength);
+        if (ntohl(crc) == expectedCrc)
+            return retval;
+        else
+        {
+            DEBUGMESSAGE(2, "VerifyPacket() failed: CRC32C incorrect\nExpected %08x, got %08x\n", expectedCrc,
+                         ntohl(crc));
+            return -1;
+        }
+    }
+    else if (packetBuffer->integrity == INTEGRITY_CHECKSUM16)
     {
         packetBuffer->checksum = ntohs(
                 packetBuffer->checksum);
@@ -98,11 +350,16 @@ ReceivePacket(int socket_fd, packet* packetBuffer, struct sockaddr_in* senderAdd
             return retval;
         else
         {
-            DEBUGMESSAGE(2, "ReceivePacket() failed: checksum incorrect\nExpected 65535, got %d (off by %d)\n",
+            DEBUGMESSAGE(2, "VerifyPacket() failed: checksum incorrect\nExpected 65535, got %d (off by %d)\n",
                          checksum, 65535 - checksum);
             return -1;
         }
     }
+    else
+    {
+        DEBUGMESSAGE(2, "VerifyPacket() failed: unknown integrity algorithm %d", packetBuffer->integrity);
+        return -1;
+    }
 }
 
 // Sets a flag in a packet to the specified value
@@ -217,14 +474,60 @@ int WritePacket(packet* packet, uint flags, void* data, unsigned short dataLengt
     packet->dataLength = dataLength;
 
     packet->sequenceNumber = sequenceNumber;
-    packet->nothing = packet->nothing;
+    packet->integrity = packetIntegrity;
+    packet->fragmentIndex = 0;
+    packet->fragmentCount = 1;
+    packet->fragmentSize = dataLength;
+    packet->stream = 0;
+    packet->streamSequence = 0;
     return 1; // 1 is returned on success
 }
 
+// How much data each fragment of a frame carries so that header, data and CRC32C trailer fit in one pathMTU sized
+// IP packet. Frames that would need more than MAX_FRAGMENTS pieces get larger ones.
+
+int FragmentDataLength(int frameLength, int pathMTU)
+{
+    int fragmentDataLength = pathMTU - IP_UDP_HEADER_LENGTH - PACKET_HEADER_LENGTH - CRC32C_TRAILER_LENGTH;
+    if (fragmentDataLength < 1)
+        fragmentDataLength = 1;
+    if (FragmentCount(frameLength, fragmentDataLength) > MAX_FRAGMENTS)
+        fragmentDataLength = (frameLength + MAX_FRAGMENTS - 1) / MAX_FRAGMENTS;
+    return fragmentDataLength;
+}
+
+int FragmentCount(int frameLength, int fragmentDataLength)
+{
+    if (frameLength <= fragmentDataLength)
+        return 1;
+    return (frameLength + fragmentDataLength - 1) / fragmentDataLength;
+}
+
+// Room a frame takes up in a socket buffer once it has been split into fragments
+
+int FrameSocketBufferCost(int frameLength, int pathMTU)
+{
+    int fragments = FragmentCount(frameLength, FragmentDataLength(frameLength, pathMTU));
+    return frameLength + fragments * (PACKET_HEADER_LENGTH + SOCKET_BUFFER_OVERHEAD);
+}
+
+const char* IntegrityName(int integrity)
+{
+    switch (integrity)
+    {
+        case INTEGRITY_CHECKSUM16:
+            return "checksum16";
+        case INTEGRITY_CRC32C:
+            return "crc32c";
+        default:
+            return "unknown";
+    }
+}
+
 int ErrorGenerator(packet* packet)
 {
     byte* packetBytes = (byte*) packet;
-    unsigned int numBytesInPacket = PACKET_HEADER_LENGTH + packet->dataLength;
+    unsigned int numBytesInPacket = PacketLength(packet);
 
     DEBUGMESSAGE_EXACT(DEBUGLEVEL_ERRORGENERATOR, RED
             "\n-----------------------------------------------------["
@@ -17,6 +17,10 @@
 // 15: Checksum calculation
 // 20: roundTime calculation
 // 25: Error generator
+// 30: Reading packets (sender)
+// 35: Packet reordering (receiver)
+// 40: Pacing (sender)
+// 45: Pipeline queue depths, once a second (receiver)
 
 #ifndef DVA218_LAB3B_COMMON_H
 #define DVA218_LAB3B_COMMON_H
@@ -28,6 +32,7 @@
 #include <string.h>
 #include <sys/time.h>
 #include <time.h>
+#include <stdatomic.h>
 
 //-------------------------- A bit of color plz
 #define RED   "\x1B[31m"
@@ -61,71 +66,225 @@ extern int debugLevel;
 #define DEBUGLEVEL_ERRORGENERATOR 25
 #define DEBUGLEVEL_READPACKETS 30
 #define DEBUGLEVEL_REORDER 35
+#define DEBUGLEVEL_PACING 40
+#define DEBUGLEVEL_PIPELINE 45
 
 #define LISTENING_PORT 23456
 #define DATA_BUFFER_SIZE 65535
-#define PACKET_HEADER_LENGTH 8
+#define PACKET_HEADER_LENGTH 16
 #define byte unsigned char
 
 #define PACKETFLAG_SYN 1u
 #define PACKETFLAG_ACK 2u
 #define PACKETFLAG_NAK 4u
 #define PACKETFLAG_FIN 8u
+#define PACKETFLAG_CONTROL 16u // In-sequence control frame, data[0] holds one of the CONTROL_ opcodes below
+#define PACKETFLAG_PARITY 32u  // Forward error correction parity, see MAX_FEC_GROUP_SIZE. Never ACKed or resent.
+#define PACKETFLAG_SIGNATURE 64u // Block signature request (with ACK: reply) for delta transfers, see CONTROL_DELTAFILE
+#define PACKETFLAG_COMPRESSED 128u // Data frame compressed with the negotiated codec, see CODEC_LZ
 
-#define ACK_TABLE_SIZE 2000
+// Any of these flags set means the packet is not part of the data stream
+#define PACKETFLAGS_HANDSHAKE (PACKETFLAG_SYN | PACKETFLAG_ACK | PACKETFLAG_NAK | PACKETFLAG_FIN)
+
+#define CONTROL_NEXTFILE 1 // Followed by a file name, the following data frames belong to that file
+#define CONTROL_FRAMESIZE 2 // Followed by a frame size (network byte order), the frames after this one use it
+#define CONTROL_DELTAFILE 3 // Like NEXTFILE, but the file is rebuilt from a basis, see below
+#define CONTROL_COPY 4 // Followed by copy instructions, see below
+#define CONTROL_STRIPE 5 // Like NEXTFILE, for one stripe of a striped transfer, see below
+#define CONTROL_FILENAME_LENGTH 255
+
+// Delta transfers: before sending a file the sender asks for the block signature of the newest copy of it the
+// receiver got over an earlier connection (the basis, see delta.h). A request is a SIGNATURE packet holding the first
+// block wanted (4 bytes) and the file name, numbered so the replies can be matched to it. The receiver answers with
+// up to DELTA_SIGNATURE_BURST SIGNATURE+ACK packets, each a header (basis file size 8 bytes, block size 4, block
+// count 4, first block 4, basis connection id 4) followed by DELTA_SIGNATURE_ENTRY_LENGTH bytes per block (rolling
+// checksum 4, strong hash 8), all in network byte order. A block size of 0 means the basis is still being hashed,
+// a block count of 0 that there is no basis. The sender then sends CONTROL_DELTAFILE with the basis connection id
+// (4 bytes) and file size (8 bytes) before the name, and CONTROL_COPY frames with basis offset (8 bytes) and length
+// (4 bytes) pairs between the data frames, which only carry the bytes the basis doesn't have.
+#define DELTA_SIGNATURE_HEADER_LENGTH 24
+#define DELTA_SIGNATURE_ENTRY_LENGTH 12
+#define DELTA_SIGNATURE_ENTRIES ((DEFAULT_PATH_MTU - IP_UDP_HEADER_LENGTH - PACKET_HEADER_LENGTH - \
+                                  CRC32C_TRAILER_LENGTH - DELTA_SIGNATURE_HEADER_LENGTH) / DELTA_SIGNATURE_ENTRY_LENGTH)
+#define DELTA_SIGNATURE_BURST 32
+#define DELTA_FILE_HEADER_LENGTH 13 // Opcode, basis connection id, basis file size
+#define DELTA_COPY_LENGTH 12
+
+// SYN data: window size, frame size, the integrity algorithm the sender wants, the forward error correction group
+// size and parity count it wants (0 for none), the id of a resumable transfer (network byte order, 0 for none), then
+// the payload codec it wants. A sender with a session ticket appends it (network byte order), and the receiver
+// appends a fresh ticket to every SYN+ACK. After the ticket, the SYN+ACK says where a resumable transfer continues:
+// how many files the receiver has started (4 bytes) and how many bytes of the last of them it has on disk (8 bytes),
+// both in network byte order.
+#define SYN_DATA_LENGTH 11
+#define SYN_TICKET_DATA_LENGTH 15
+#define SYN_RESUME_DATA_LENGTH 27
+// A sender on the same host as the receiver offers its shared memory ring (see sharedring.h) by always sending the
+// ticket (0 for none), followed by its process id and the ring's file descriptor (4 bytes each) and the ring's token
+// (8 bytes), all in network byte order. The SYN+ACK then has one more byte, 1 if the receiver reads the data frames
+// from the ring. Frames can't get lost or corrupted in there, so the SYN+ACK also turns FEC and compression down.
+#define SYN_SHARED_RING_DATA_LENGTH 31
+#define SYN_SHARED_RING_ACK_LENGTH 28
+// The SYN+ACK ends with the connection's join key (4 bytes, network byte order), see MAX_SUBFLOWS
+#define SYN_JOIN_KEY_DATA_LENGTH 32
+#define SESSION_TICKET_LIFETIME 3600 // Seconds
+
+// Striped transfers: a sender opens up to MAX_STRIPES connections, and stripe i of n sends bytes [size * i / n,
+// size * (i + 1) / n) of every file, each file announced with CONTROL_STRIPE: the transfer's group id (4 bytes),
+// stripe index and count (1 byte each), the file size and where the stripe starts in it (8 bytes each, all in
+// network byte order), then the name. The data frames after it are written to "received/<group>/<name>" from there.
+// A stripe's FIN is only answered once the FIN of every stripe of its group is in. Group ids start at
+// STRIPE_GROUP_MIN so that they never name the same directory as a connection id.
+#define MAX_STRIPES 16
+#define STRIPE_HEADER_LENGTH 23
+#define STRIPE_GROUP_MIN 10000000
+
+// Multiplexed streams: a connection's frames belong to stream 0, its own, unless the sender multiplexes several files
+// at once. Then every data frame and CONTROL_NEXTFILE names one of streams 1 to MAX_STREAMS - 1 in its header, and is
+// numbered within it by streamSequence, a sequence space of its own next to the connection's. The connection's
+// sequence numbers still decide what is ACKed and resent, but a frame goes on to be written as soon as the frames
+// before it in its own stream are in, without waiting for the ones other streams lost. Each stream carries one file
+// after the other, every one starting with a CONTROL_NEXTFILE.
+#define MAX_STREAMS 16
+
+// Multipath transfers: besides the connection's own path, a sender with several addresses may send over up to
+// MAX_SUBFLOWS - 1 more subflows, each from a source address of its own to a receiver address of its own. Every
+// subflow joins the connection with a SYN+CONTROL packet holding the join key from the SYN+ACK, which the receiver
+// answers with SYN+CONTROL+ACK. From then on datagrams from the subflow's address count as the connection's, and
+// their ACKs go back the way they came, so that the sender can tell the subflows' round trips apart.
+#define MAX_SUBFLOWS 8
+#define SUBFLOW_JOIN_DATA_LENGTH 4
+
+// Payload codecs. Once the SYN+ACK agrees on one, the sender compresses every data frame on its own (so that it can be
+// resent or decoded without any other) and sends it with PACKETFLAG_COMPRESSED if that made it shorter. Such a frame
+// holds the original data length (network byte order) followed by the compressed data.
+#define CODEC_NONE 0
+#define CODEC_LZ 1 // See compression.h
+#define COMPRESSED_HEADER_LENGTH 2
+
+// ACKs carry the receiver's advertised window: data[0-1] is the next sequence it expects, data[2-3] how many frames
+// from there on it has room for (both in network byte order). The sender keeps its frames below their sum.
+#define ACK_WINDOW_DATA_LENGTH 4
+// An ACK for a frame that is only partly in also carries a bitmap of the fragments the receiver has (data[4-11],
+// network byte order, bit i for fragment i). The frame itself is still missing, the sender only resends the rest.
+#define ACK_FRAGMENTS_DATA_LENGTH 12
+
+// Frames larger than what fits in one datagram on the path are split into up to MAX_FRAGMENTS fragments, so that a
+// lost piece only costs us that piece instead of the whole frame (which is what IP fragmentation would do).
+#define MAX_FRAGMENTS 64
+#define DEFAULT_PATH_MTU 1500
+#define IP_UDP_HEADER_LENGTH 28
+
+// Kernel bookkeeping per queued datagram, on top of the datagram itself. Used to turn socket buffer bytes into frames.
+#define SOCKET_BUFFER_OVERHEAD 512
+
+// How a packet is protected, stored in the packet's integrity byte. CHECKSUM16 uses the checksum header field,
+// CRC32C zeroes it and appends CRC32C_TRAILER_LENGTH bytes after the data instead (covering header and data).
+#define INTEGRITY_CHECKSUM16 0
+#define INTEGRITY_CRC32C 1
+#define CRC32C_TRAILER_LENGTH 4
+
+// Largest frame that still fits in one UDP datagram together with the header and a CRC32C trailer
+#define MAX_FRAME_DATA_LENGTH (65507 - PACKET_HEADER_LENGTH - CRC32C_TRAILER_LENGTH)
+
+// Forward error correction: the data stream is cut into groups of fecGroupSize frames, a power of two so that groups
+// line up when sequence numbers wrap. The frame at offset i in a group belongs to parity class i % fecParityCount.
+// After the last frame of a group the sender sends one PARITY frame per class, numbered like the class's first frame,
+// holding the XOR of the flags, data lengths, stream fields and (zero padded) data of the class's frames (see fec.h).
+// A receiver missing exactly one frame of a class rebuilds it from the parity and the others, without waiting for a
+// resend.
+#define MAX_FEC_GROUP_SIZE 32
+#define MAX_FEC_PARITY_COUNT 8
+// XORed flags, data length, stream and stream sequence (network byte order), then the XORed data
+#define FEC_PARITY_HEADER_LENGTH 7
+
+// Datagrams are handed to the kernel in batches with UDP_SEGMENT (GSO), one sendmsg() for up to MAX_BATCH_SEGMENTS
+// of them, and split up again further down the stack. Every datagram in a batch but the last has the same length.
+#define MAX_BATCH_SEGMENTS 64
+#define MAX_BATCH_LENGTH 65507
+
+// ACK_TABLE_SIZE has to divide 65536 so that table slots line up when the 16 bit sequence numbers wrap around
+#define ACK_TABLE_SIZE 2048
+#define ACK_SLOT(sequence) ((unsigned short) (sequence) % ACK_TABLE_SIZE)
+// True if sequence number a comes after b, taking wraparound into account
+#define SEQUENCE_AFTER(a, b) ((short) ((unsigned short) (a) - (unsigned short) (b)) > 0)
 
 //#define PACKET_LOSS 0
 //#define PACKET_CORRUPT 0
 extern int loss;
 extern int corrupt;
+extern int packetIntegrity; // Integrity algorithm WritePacket() gives new packets
+extern atomic_int segmentationOffload; // Batches go out with UDP_SEGMENT, cleared if the kernel turns it down
 
 
 typedef struct packet packet; 
 struct packet
 {
     byte flags;   // Flags that details what a packet contains, such as data, FIN, SYN, ACK etc.
-    byte nothing; // Only here in order to make the packet a even eight bytes long, otherwise the dataLength displays erratic behaviours
+    byte integrity; // One of the INTEGRITY_ algorithms, also keeps the header an even eight bytes long
     unsigned short dataLength;      // Length of the packets data
     unsigned short sequenceNumber;  // Used to keep track of packet order so we can avoid jumbled data
     unsigned short checksum;        // Stores the calculated "internet checksum" used for detecting corrupted packets
+    byte fragmentIndex;             // Which piece of the frame this packet carries
+    byte fragmentCount;             // How many pieces the frame was split into, 1 if it fits in one packet
+    unsigned short fragmentSize;    // Data length of every piece but the last, tells the receiver where this one goes
+    unsigned short stream;          // Which stream of the connection the frame belongs to, see MAX_STREAMS
+    unsigned short streamSequence;  // Where the frame goes in its stream, 0 in stream 0
     byte data[DATA_BUFFER_SIZE];    // The actual data being sent
 };
 
+// Shared between the thread sending frames, ReadPackets() and ResendTimeouts(). Which frames are in flight is the
+// sender's sendWindow, see sendwindow.h.
 typedef struct ACKmngr ACKmngr;
 struct ACKmngr
 {
-    int Missing;                 // Keeps track of how many ACKs are still unaccounted for
-    int Table[ACK_TABLE_SIZE];   // Stores a '1' or '0' for each currently active ACK, '0' indicating that we are missing a ACK for this packet.
+    atomic_int Missing;                 // Keeps track of how many ACKs are still unaccounted for
+    atomic_ullong Fragments[ACK_TABLE_SIZE]; // Fragments of each frame in flight the receiver has
 };
 
-typedef struct timeoutHandlerData timeoutHandlerData;
-struct timeoutHandlerData
+// Packets waiting to be sent together, see MAX_BATCH_SEGMENTS. Only one thread may use a batch at a time.
+typedef struct datagramBatch datagramBatch;
+struct datagramBatch
 {
-    packet* dataBufferArray;
-    ACKmngr* ACKsPointer;
-    byte flags;
-    int sequenceNumber;
-    int bufferSlot;
+    int socket_fd;
+    const struct sockaddr_in* address;
+    unsigned int addressLength;
+    int segmentSize;    // Length of the first datagram, the ones after it have to match (the last may be shorter)
+    int segments;
+    int length;
+    byte buffer[MAX_BATCH_LENGTH];
 };
 
-typedef struct roundTimeHandler roundTimeHandler; // Used as an array in Sender.c in order to keep track of how long it takes to receive ACKs on sent packets
-struct roundTimeHandler
+typedef struct timeoutHandlerData timeoutHandlerData;
+struct timeoutHandlerData
 {
-    struct timeval timeStampStart;  // stores a time value that is set when a packet is sent or re-sent
-    struct timeval timeStampEnd;    // stores a time value that is set when a packets ACK is received.
-    unsigned int sequence;          // keeps track of what packet / ACK this time data is attached to
+    int sequenceNumber;
+    int negotiationAttempt;
 };
 
 int InitializeSocket();
+int GrowSocketBuffer(int socket_fd, int option, int bytes);
+int SocketReceiveBufferFree(int socket_fd);
+int ParseFanoutReceivers(const char* list, struct sockaddr_in* addresses, int maxReceivers);
 //ssize_t SendMessage(int socket_fd, const char* dataBuffer, int length, const struct sockaddr_in* receiverAddress, unsigned int addressLength);
 //ssize_t ReceiveMessage(int socket_fd, char* packetBuffer, struct sockaddr_in* senderAddress, unsigned int* addressLength);
 
 ssize_t SendPacket(int socket_fd, packet* packetToSend, const struct sockaddr_in* receiverAddress, unsigned int addressLength);
 ssize_t ReceivePacket(int socket_fd, packet* packetBuffer, struct sockaddr_in* senderAddress, unsigned int* addressLength);
+int VerifyPacket(packet* packetBuffer, int retval);
+void InitializeBatch(datagramBatch* batch, int socket_fd, const struct sockaddr_in* address, unsigned int addressLength);
+void BatchPacket(datagramBatch* batch, packet* packetToSend);
+void BatchDatagram(datagramBatch* batch, const void* datagram, int length);
+int FlushBatch(datagramBatch* batch);
 
+int SealPacket(packet* packetToSend);
 int SetPacketFlag(packet* packet, uint flagToModify, int value);
 unsigned short CalculateChecksum(const packet* packet);
+const char* IntegrityName(int integrity);
 int WritePacket(packet* packet, uint flags, void* data, unsigned short dataLength, unsigned short sequenceNumber);
+int FragmentDataLength(int frameLength, int pathMTU);
+int FragmentCount(int frameLength, int fragmentDataLength);
+int FrameSocketBufferCost(int frameLength, int pathMTU);
 
 int ErrorGenerator(packet* packet);
 int PrintPacketData(const packet* packet);
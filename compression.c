@@ -0,0 +1,182 @@
+/* File: compression.c
+ *
+ * Description:
+ * The LZ payload codec, see compression.h.
+ */
+
+#include "compression.h"
+#include <stdint.h>
+
+#define LZ_HASH_BITS 13
+// Every 2^LZ_SKIP_SHIFT positions without a match the search takes bigger steps, so data that doesn't compress
+// is gone through quickly
+#define LZ_SKIP_SHIFT 5
+
+static uint32_t ReadFour(const byte* data)
+{
+    uint32_t value;
+    memcpy(&value, data, 4);
+    return value;
+}
+
+static unsigned int HashFour(const byte* data)
+{
+    return (ReadFour(data) * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// How many bytes from a and b on are the same, b being later in the buffer and limit where the buffer ends
+static int MatchLength(const byte* a, const byte* b, const byte* limit)
+{
+    const byte* start = b;
+    while (limit - b >= 8)
+    {
+        uint64_t x, y;
+        memcpy(&x, a, 8);
+        memcpy(&y, b, 8);
+        if (x != y)
+            return b - start + (__builtin_ctzll(x ^ y) >> 3); // Little endian: the lowest set bit is the first byte
+        a += 8;
+        b += 8;
+    }
+    while (b < limit && *a == *b)
+    {
+        a++;
+        b++;
+    }
+    return b - start;
+}
+
+// Writes a length that didn't fit in its nibble, 15 already being in the token
+static byte* WriteExtraLength(byte* out, int length)
+{
+    for (length -= 15; length >= 255; length -= 255)
+        *out++ = 255;
+    *out++ = length;
+    return out;
+}
+
+// Writes a sequence of literals followed by a match, or just the literals if matchLength is 0.
+// Returns where the next sequence goes, or NULL if it doesn't fit before end.
+static byte* WriteSequence(byte* out, const byte* end, const byte* literals, int literalLength, int offset,
+                           int matchLength)
+{
+    if (end - out < 1 + literalLength + literalLength / 255 + 1 + 2 + matchLength / 255 + 1)
+        return NULL;
+    byte* token = out++;
+    *token = (literalLength < 15 ? literalLength : 15) << 4;
+    if (literalLength >= 15)
+        out = WriteExtraLength(out, literalLength);
+    memcpy(out, literals, literalLength);
+    out += literalLength;
+    if (matchLength == 0)
+        return out;
+
+    *out++ = offset & 0xff;
+    *out++ = offset >> 8;
+    matchLength -= LZ_MIN_MATCH;
+    *token |= matchLength < 15 ? matchLength : 15;
+    if (matchLength >= 15)
+        out = WriteExtraLength(out, matchLength);
+    return out;
+}
+
+int LzCompress(const byte* source, int length, byte* destination, int capacity)
+{
+    int table[1 << LZ_HASH_BITS];
+    memset(table, 0xff, sizeof(table)); // Every slot -1
+    const byte* end = destination + capacity;
+    byte* out = destination;
+    int anchor = 0;     // Start of the literals not written yet
+    int position = 0;
+
+    while (position <= length - LZ_MIN_MATCH)
+    {
+        unsigned int hash = HashFour(source + position);
+        int candidate = table[hash];
+        table[hash] = position;
+        if (candidate < 0 || position - candidate > LZ_MAX_OFFSET ||
+            ReadFour(source + candidate) != ReadFour(source + position))
+        {
+            position += 1 + ((position - anchor) >> LZ_SKIP_SHIFT);
+            continue;
+        }
+
+        int matchLength = LZ_MIN_MATCH + MatchLength(source + candidate + LZ_MIN_MATCH,
+                                                     source + position + LZ_MIN_MATCH, source + length);
+        while (position > anchor && candidate > 0 && source[position - 1] == source[candidate - 1])
+        { // The match may start before where the hash found it
+            position--;
+            candidate--;
+            matchLength++;
+        }
+        if ((out = WriteSequence(out, end, source + anchor, position - anchor, position - candidate, matchLength)) == NULL)
+            return 0;
+        position += matchLength;
+        anchor = position;
+        if (position - 2 <= length - LZ_MIN_MATCH)
+            table[HashFour(source + position - 2)] = position - 2;
+    }
+
+    if ((out = WriteSequence(out, end, source + anchor, length - anchor, 0, 0)) == NULL)
+        return 0;
+    return out - destination;
+}
+
+// Reads a length that didn't fit in its nibble. Returns -1 if the data ends first.
+static int ReadExtraLength(const byte** in, const byte* end, int length)
+{
+    byte next;
+    do
+    {
+        if (*in >= end)
+            return -1;
+        next = *(*in)++;
+        length += next;
+    } while (next == 255);
+    return length;
+}
+
+int LzDecompress(const byte* source, int length, byte* destination, int capacity)
+{
+    const byte* in = source;
+    const byte* inEnd = source + length;
+    byte* out = destination;
+    const byte* outEnd = destination + capacity;
+
+    while (in < inEnd)
+    {
+        byte token = *in++;
+        int literalLength = token >> 4;
+        if (literalLength == 15 && (literalLength = ReadExtraLength(&in, inEnd, literalLength)) == -1)
+            return -1;
+        if (literalLength > inEnd - in || literalLength > outEnd - out)
+            return -1;
+        memcpy(out, in, literalLength);
+        in += literalLength;
+        out += literalLength;
+        if (in == inEnd)
+            break; // The last sequence has no match
+
+        if (inEnd - in < 2)
+            return -1;
+        int offset = in[0] | (in[1] << 8);
+        in += 2;
+        int matchLength = token & 15;
+        if (matchLength == 15 && (matchLength = ReadExtraLength(&in, inEnd, matchLength)) == -1)
+            return -1;
+        matchLength += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out - destination || matchLength > outEnd - out)
+            return -1;
+
+        const byte* match = out - offset;
+        if (offset >= matchLength)
+            memcpy(out, match, matchLength);
+        else
+        { // The match overlaps what it produces, a run of a short pattern
+            for (int i = 0; i < matchLength; i++)
+                out[i] = match[i];
+        }
+        out += matchLength;
+    }
+    return out - destination;
+}
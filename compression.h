@@ -0,0 +1,26 @@
+/* File: compression.h
+ *
+ * Description:
+ * The LZ payload codec, see CODEC_LZ in common.h. A fast LZ77 variant in the spirit of LZ4: matches of at least
+ * LZ_MIN_MATCH bytes are found through a hash table of the four bytes at each position and coded as sequences of a
+ * token byte (literal count in the high nibble, match length - LZ_MIN_MATCH in the low one, 15 meaning more length
+ * bytes follow, each 255 meaning yet another), the literals, then a two byte little endian offset back to the match.
+ * The last sequence has literals only. Every buffer is compressed on its own, with nothing carried over between them.
+ */
+
+#ifndef DVA218_LAB3B_COMPRESSION_H
+#define DVA218_LAB3B_COMPRESSION_H
+
+#include "common.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+// Compresses length bytes into at most capacity bytes. Returns the compressed length, or 0 if it doesn't fit.
+int LzCompress(const byte* source, int length, byte* destination, int capacity);
+
+// Decompresses into at most capacity bytes. Returns the decompressed length, or -1 if the data is malformed or
+// doesn't fit.
+int LzDecompress(const byte* source, int length, byte* destination, int capacity);
+
+#endif //DVA218_LAB3B_COMPRESSION_H
@@ -0,0 +1,168 @@
+/* File: compressionbenchmark.c
+ *
+ * Description:
+ * Measures what the LZ codec in compression.c costs against what it saves. For a range of frame sizes it cuts the
+ * input into frames, compresses every one on its own (what the sender does) and decompresses them again (what the
+ * receiver does), and prints the share of bytes saved, the throughput of both directions in MB of frame data per
+ * second, and the compression CPU time per kB saved. Without a file it runs on generated text and on random bytes,
+ * the two extremes of what the sender sees.
+ * Usage: CompressionBenchmark [file] [MB per frame size]
+ */
+
+#include "common.h"
+#include "compression.h"
+#include <time.h>
+
+double SecondsSince(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Fills data with lines of words from a small vocabulary, about as repetitive as the message file
+void GenerateText(byte* data, long length)
+{
+    static const char* words[] = {"the", "sender", "receiver", "frame", "packet", "window", "sequence", "ACK",
+                                  "timeout", "data", "of", "and", "is", "a", "to", "in", "checksum", "connection"};
+    long position = 0;
+    while (position < length)
+    {
+        const char* word = words[random() % (sizeof(words) / sizeof(words[0]))];
+        for (int i = 0; word[i] != '\0' && position < length; i++)
+            data[position++] = word[i];
+        if (position < length)
+            data[position++] = random() % 12 == 0 ? '\n' : ' ';
+    }
+}
+
+void RunBenchmark(const char* name, const byte* input, long inputLength, long bytesPerSize)
+{
+    const int frameSizes[] = {128, 512, 1400, 8192, 32768, MAX_FRAME_DATA_LENGTH};
+    byte* decompressed;
+    if ((decompressed = malloc(DATA_BUFFER_SIZE)) == NULL)
+    {
+        CRASHWITHERROR("CompressionBenchmark malloc() failed");
+    }
+
+    printf("%s, %ld bytes, %ld MB per frame size\n", name, inputLength, bytesPerSize / 1000000);
+    printf("%10s %8s %14s %14s %16s\n", "frame", "saved", "compress MB/s", "decompress MB/s", "us per kB saved");
+    for (int sizeIndex = 0; sizeIndex < (int) (sizeof(frameSizes) / sizeof(frameSizes[0])); sizeIndex++)
+    {
+        int frameSize = frameSizes[sizeIndex];
+        if (frameSize > inputLength)
+            break;
+        long frameCount = inputLength / frameSize;
+        long rounds = bytesPerSize / ((long) frameCount * frameSize);
+        if (rounds < 1)
+            rounds = 1;
+
+        // Every frame's compressed copy, kept from the first round. A length of 0 means the frame didn't shrink
+        // and goes out as it is.
+        int* lengths;
+        byte* store;
+        if ((lengths = malloc(sizeof(int) * frameCount)) == NULL || (store = malloc(frameCount * frameSize)) == NULL)
+        {
+            CRASHWITHERROR("CompressionBenchmark malloc() failed");
+        }
+        long long savedBytes = 0;
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long round = 0; round < rounds; round++)
+        {
+            for (long frame = 0; frame < frameCount; frame++)
+            {
+                int length = LzCompress(input + frame * frameSize, frameSize, store + frame * frameSize,
+                                        frameSize - COMPRESSED_HEADER_LENGTH - 1);
+                if (round == 0)
+                {
+                    lengths[frame] = length;
+                    if (length > 0)
+                        savedBytes += frameSize - length - COMPRESSED_HEADER_LENGTH;
+                }
+            }
+        }
+        double compressSeconds = SecondsSince(&start);
+
+        int mismatches = 0;
+        long decompressedFrames = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long round = 0; round < rounds; round++)
+        {
+            for (long frame = 0; frame < frameCount; frame++)
+            {
+                if (lengths[frame] == 0)
+                    continue;
+                if (LzDecompress(store + frame * frameSize, lengths[frame], decompressed, frameSize) != frameSize ||
+                    (round == 0 && memcmp(decompressed, input + frame * frameSize, frameSize) != 0))
+                    mismatches++;
+                decompressedFrames++;
+            }
+        }
+        double decompressSeconds = SecondsSince(&start);
+
+        double megabytes = (double) rounds * frameCount * frameSize / 1e6;
+        double decompressedMegabytes = (double) decompressedFrames * frameSize / 1e6;
+        printf("%10d %7.1f%% %14.1f ", frameSize, 100.0 * savedBytes / ((double) frameCount * frameSize),
+               megabytes / compressSeconds);
+        if (decompressedFrames > 0 && decompressSeconds > 0)
+            printf("%15.1f ", decompressedMegabytes / decompressSeconds);
+        else
+            printf("%15s ", "-");
+        if (savedBytes > 0)
+            printf("%16.2f", compressSeconds / rounds * 1e6 / (savedBytes / 1000.0));
+        else
+            printf("%16s", "-");
+        printf("%s\n", mismatches > 0 ? REDTEXT("  frames decompressed wrong!") : "");
+        free(lengths);
+        free(store);
+    }
+    printf("\n");
+    free(decompressed);
+}
+
+int main(int argc, char* argv[])
+{
+    long bytesPerSize = (argc > 2 ? atol(argv[2]) : 64) * 1000000;
+    if (bytesPerSize <= 0)
+    {
+        printf("Usage: %s [file] [MB per frame size]\n", argv[0]);
+        return 1;
+    }
+
+    if (argc > 1)
+    {
+        FILE* fp;
+        long length;
+        byte* input;
+        if ((fp = fopen(argv[1], "rb")) == NULL)
+        {
+            CRASHWITHERROR("CompressionBenchmark couldn't open the file");
+        }
+        fseek(fp, 0, SEEK_END);
+        length = ftell(fp);
+        rewind(fp);
+        if (length <= 0 || (input = malloc(length)) == NULL || fread(input, 1, length, fp) != (size_t) length)
+        {
+            CRASHWITHMESSAGE("CompressionBenchmark couldn't read the file");
+        }
+        fclose(fp);
+        RunBenchmark(argv[1], input, length, bytesPerSize);
+        free(input);
+        return 0;
+    }
+
+    long length = 4 * 1000 * 1000;
+    byte* input;
+    if ((input = malloc(length)) == NULL)
+    {
+        CRASHWITHERROR("CompressionBenchmark malloc() failed");
+    }
+    GenerateText(input, length);
+    RunBenchmark("Generated text", input, length, bytesPerSize);
+    for (long i = 0; i < length; i++)
+        input[i] = (byte) random();
+    RunBenchmark("Random bytes", input, length, bytesPerSize);
+    free(input);
+    return 0;
+}
@@ -0,0 +1,131 @@
+/* File: crc32c.c
+ *
+ * Description:
+ * CRC32C for the packet integrity check, see crc32c.h. The implementation is picked once at startup.
+ */
+
+#include "crc32c.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42 1
+#endif
+
+#define CRC32C_POLYNOMIAL 0x82F63B78u // Reversed Castagnoli polynomial
+
+// crc32cTable[0] is the classic byte-at-a-time table, crc32cTable[k] advances a byte that is k bytes further back
+static uint32_t crc32cTable[8][256];
+
+static uint32_t Crc32cSlicingBy8(uint32_t crc, const unsigned char* bytes, size_t length)
+{
+    // Byte at a time until the pointer is aligned for the 8 byte loads
+    while (length > 0 && ((uintptr_t) bytes & 7) != 0)
+    {
+        crc = crc32cTable[0][(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+        length--;
+    }
+    while (length >= 8)
+    {
+        uint32_t low, high;
+        memcpy(&low, bytes, 4);
+        memcpy(&high, bytes + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        low = __builtin_bswap32(low);
+        high = __builtin_bswap32(high);
+#endif
+        low ^= crc;
+        crc = crc32cTable[7][low & 0xFF] ^ crc32cTable[6][(low >> 8) & 0xFF] ^
+              crc32cTable[5][(low >> 16) & 0xFF] ^ crc32cTable[4][low >> 24] ^
+              crc32cTable[3][high & 0xFF] ^ crc32cTable[2][(high >> 8) & 0xFF] ^
+              crc32cTable[1][(high >> 16) & 0xFF] ^ crc32cTable[0][high >> 24];
+        bytes += 8;
+        length -= 8;
+    }
+    while (length > 0)
+    {
+        crc = crc32cTable[0][(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+        length--;
+    }
+    return crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t Crc32cHardware(uint32_t crc, const unsigned char* bytes, size_t length)
+{
+    while (length > 0 && ((uintptr_t) bytes & 7) != 0)
+    {
+        crc = _mm_crc32_u8(crc, *bytes++);
+        length--;
+    }
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        bytes += 8;
+        length -= 8;
+    }
+    crc = (uint32_t) crc64;
+#endif
+    while (length >= 4)
+    {
+        uint32_t word;
+        memcpy(&word, bytes, 4);
+        crc = _mm_crc32_u32(crc, word);
+        bytes += 4;
+        length -= 4;
+    }
+    while (length > 0)
+    {
+        crc = _mm_crc32_u8(crc, *bytes++);
+        length--;
+    }
+    return crc;
+}
+#endif
+
+static uint32_t (* crc32cFunction)(uint32_t, const unsigned char*, size_t) = Crc32cSlicingBy8;
+
+// Runs before main(), so both programs' threads only ever read the tables and the function pointer
+__attribute__((constructor))
+static void InitializeCrc32c()
+{
+    for (int i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+        crc32cTable[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++)
+    {
+        for (int slice = 1; slice < 8; slice++)
+            crc32cTable[slice][i] = crc32cTable[0][crc32cTable[slice - 1][i] & 0xFF] ^
+                                    (crc32cTable[slice - 1][i] >> 8);
+    }
+
+#ifdef CRC32C_HAVE_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32cFunction = Crc32cHardware;
+#endif
+}
+
+unsigned int Crc32c(unsigned int crc, const void* data, size_t length)
+{
+    return ~crc32cFunction(~crc, (const unsigned char*) data, length);
+}
+
+const char* Crc32cImplementation()
+{
+#ifdef CRC32C_HAVE_SSE42
+    if (crc32cFunction == Crc32cHardware)
+        return "sse4.2";
+#endif
+    return "slicing-by-8";
+}
@@ -0,0 +1,20 @@
+/* File: crc32c.h
+ *
+ * Description:
+ * CRC32C (Castagnoli polynomial, the one iSCSI and ext4 use). Uses the SSE4.2 crc32 instruction when the CPU has it
+ * and falls back to a slicing-by-8 table implementation otherwise.
+ */
+
+#ifndef DVA218_LAB3B_CRC32C_H
+#define DVA218_LAB3B_CRC32C_H
+
+#include <stddef.h>
+
+// Calculates the CRC32C of 'length' bytes. Pass 0 as crc to start a new checksum, or the result of an earlier call
+// to continue it over more data.
+unsigned int Crc32c(unsigned int crc, const void* data, size_t length);
+
+// "sse4.2" or "slicing-by-8", whichever Crc32c() ended up using
+const char* Crc32cImplementation();
+
+#endif //DVA218_LAB3B_CRC32C_H
@@ -0,0 +1,400 @@
+/* File: delta.c
+ *
+ * Description:
+ * Block signatures and delta encoding, see delta.h. Files are mapped into memory so that the worker threads can
+ * each go through their own part of it without any copying or locking.
+ */
+
+#include "delta.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+unsigned int RollingChecksum(const byte* data, int length)
+{
+    unsigned int a = 0, b = 0;
+    for (int i = 0; i < length; i++)
+    {
+        a += data[i];
+        b += (unsigned int) (length - i) * data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+unsigned int RollChecksum(unsigned int checksum, byte out, byte in, int length)
+{
+    unsigned int a = checksum & 0xffff, b = checksum >> 16;
+    a = (a - out + in) & 0xffff;
+    b = (b - (unsigned int) length * out + a) & 0xffff;
+    return a | (b << 16);
+}
+
+// MurmurHash64A, eight bytes at a time
+unsigned long long StrongHash(const byte* data, int length)
+{
+    const unsigned long long multiplier = 0xc6a4a7935bd1e995ull;
+    unsigned long long hash = 0x8445d61a4e774912ull ^ (length * multiplier);
+    int i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        unsigned long long word;
+        memcpy(&word, data + i, 8);
+        word *= multiplier;
+        word ^= word >> 47;
+        word *= multiplier;
+        hash ^= word;
+        hash *= multiplier;
+    }
+    if (i < length)
+    {
+        unsigned long long word = 0;
+        memcpy(&word, data + i, length - i);
+        hash ^= word;
+        hash *= multiplier;
+    }
+    hash ^= hash >> 47;
+    hash *= multiplier;
+    hash ^= hash >> 47;
+    return hash;
+}
+
+int DeltaBlockSize(long long fileSize)
+{
+    int blockSize = DELTA_MIN_BLOCK_SIZE;
+    while (fileSize / blockSize > DELTA_MAX_BLOCKS)
+        blockSize *= 2;
+    return blockSize;
+}
+
+int DeltaThreadCount()
+{
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (processors < 1)
+        return 1;
+    return processors < DELTA_MAX_THREADS ? (int) processors : DELTA_MAX_THREADS;
+}
+
+// Maps a whole file read-only. Returns the mapping, or NULL if the file is empty or can't be read. Only an empty
+// file sets size to 0, it is left alone otherwise.
+static const byte* MapFile(const char* path, long long* size)
+{
+    int fileDescriptor;
+    struct stat fileStatus;
+    if ((fileDescriptor = open(path, O_RDONLY)) == -1)
+        return NULL;
+    if (fstat(fileDescriptor, &fileStatus) == -1)
+    {
+        close(fileDescriptor);
+        return NULL;
+    }
+    if (fileStatus.st_size == 0)
+    {
+        close(fileDescriptor);
+        *size = 0;
+        return NULL;
+    }
+    void* mapping = mmap(NULL, fileStatus.st_size, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+    close(fileDescriptor);
+    if (mapping == MAP_FAILED)
+        return NULL;
+    madvise(mapping, fileStatus.st_size, MADV_SEQUENTIAL);
+    *size = fileStatus.st_size;
+    return mapping;
+}
+
+//---------------------------------------------------------------------------------------------------------------
+
+typedef struct signatureWork signatureWork;
+struct signatureWork
+{
+    const byte* data;
+    fileSignature* signature;
+    int firstBlock;
+    int endBlock;
+};
+
+static void* HashBlocks(void* argument)
+{
+    signatureWork* work = argument;
+    int blockSize = work->signature->blockSize;
+    for (int i = work->firstBlock; i < work->endBlock; i++)
+    {
+        const byte* block = work->data + (long long) i * blockSize;
+        work->signature->blocks[i].rolling = RollingChecksum(block, blockSize);
+        work->signature->blocks[i].strong = StrongHash(block, blockSize);
+    }
+    return NULL;
+}
+
+int ComputeSignature(const char* path, fileSignature* signature, int threadCount)
+{
+    memset(signature, 0, sizeof(fileSignature));
+    long long size = -1;
+    const byte* data = MapFile(path, &size);
+    if (data == NULL)
+        return size == 0 ? 0 : -1;
+
+    signature->fileSize = size;
+    signature->blockSize = DeltaBlockSize(size);
+    signature->blockCount = (int) (size / signature->blockSize);
+    if (signature->blockCount > 0 &&
+        (signature->blocks = malloc(sizeof(blockSignature) * signature->blockCount)) == NULL)
+    {
+        munmap((void*) data, size);
+        return -1;
+    }
+
+    if (threadCount > signature->blockCount)
+        threadCount = signature->blockCount > 0 ? signature->blockCount : 1;
+    pthread_t threads[DELTA_MAX_THREADS];
+    signatureWork work[DELTA_MAX_THREADS];
+    for (int i = 0; i < threadCount; i++)
+    {
+        work[i].data = data;
+        work[i].signature = signature;
+        work[i].firstBlock = (int) ((long long) signature->blockCount * i / threadCount);
+        work[i].endBlock = (int) ((long long) signature->blockCount * (i + 1) / threadCount);
+        if (i == 0 || pthread_create(&threads[i], NULL, HashBlocks, &work[i]) != 0)
+            threads[i] = 0;
+    }
+    HashBlocks(&work[0]); // This thread takes the first part itself
+    for (int i = 1; i < threadCount; i++)
+    {
+        if (threads[i] != 0)
+            pthread_join(threads[i], NULL);
+        else
+            HashBlocks(&work[i]);
+    }
+
+    munmap((void*) data, size);
+    return 0;
+}
+
+void FreeSignature(fileSignature* signature)
+{
+    free(signature->blocks);
+    memset(signature, 0, sizeof(fileSignature));
+}
+
+//---------------------------------------------------------------------------------------------------------------
+
+// Finds blocks by rolling checksum: heads[] holds the first block in each bucket, next[] chains the rest
+typedef struct blockIndex blockIndex;
+struct blockIndex
+{
+    int* heads;
+    int* next;
+    unsigned int mask;
+};
+
+static unsigned int BucketOf(const blockIndex* index, unsigned int rolling)
+{
+    return (rolling * 0x9e3779b1u) >> 7 & index->mask;
+}
+
+typedef struct deltaWork deltaWork;
+struct deltaWork
+{
+    const byte* data;
+    long long start;    // Matches are looked for in [start, end), and have to end within it
+    long long end;
+    const fileSignature* signature;
+    const blockIndex* index;
+    deltaScript script;
+    int failed;
+};
+
+static int AddOperation(deltaScript* script, long long offset, long long basisOffset, long long length)
+{
+    if (length <= 0)
+        return 0;
+    if (basisOffset >= 0)
+        script->copiedBytes += length;
+    else
+        script->literalBytes += length;
+
+    if (script->count > 0)
+    { // Runs of consecutive basis blocks, or of literal data, become one operation
+        deltaOperation* last = &script->operations[script->count - 1];
+        if (last->offset + last->length == offset &&
+            ((basisOffset < 0 && last->basisOffset < 0) ||
+             (basisOffset >= 0 && last->basisOffset >= 0 && last->basisOffset + last->length == basisOffset)))
+        {
+            last->length += length;
+            return 0;
+        }
+    }
+    if (script->count == script->capacity)
+    {
+        int capacity = script->capacity > 0 ? script->capacity * 2 : 64;
+        deltaOperation* grown;
+        if ((grown = realloc(script->operations, sizeof(deltaOperation) * capacity)) == NULL)
+            return -1;
+        script->operations = grown;
+        script->capacity = capacity;
+    }
+    deltaOperation* operation = &script->operations[script->count++];
+    operation->offset = offset;
+    operation->basisOffset = basisOffset;
+    operation->length = length;
+    return 0;
+}
+
+// The basis block the data at 'block' is a copy of, or -1. The block right after the previous match is tried first,
+// so that runs of unchanged data map onto runs of basis blocks even when the basis repeats itself.
+static int MatchBlock(const deltaWork* work, const byte* block, unsigned int rolling, int expectedBlock)
+{
+    const fileSignature* signature = work->signature;
+    int blockSize = signature->blockSize;
+    unsigned long long strong = 0;
+    int strongKnown = 0;
+    if (expectedBlock >= 0 && expectedBlock < signature->blockCount && signature->blocks[expectedBlock].rolling == rolling)
+    {
+        strong = StrongHash(block, blockSize);
+        strongKnown = 1;
+        if (signature->blocks[expectedBlock].strong == strong)
+            return expectedBlock;
+    }
+    for (int candidate = work->index->heads[BucketOf(work->index, rolling)]; candidate != -1;
+         candidate = work->index->next[candidate])
+    {
+        if (signature->blocks[candidate].rolling != rolling)
+            continue;
+        if (!strongKnown)
+        {
+            strong = StrongHash(block, blockSize);
+            strongKnown = 1;
+        }
+        if (signature->blocks[candidate].strong == strong)
+            return candidate;
+    }
+    return -1;
+}
+
+static void* MatchSegment(void* argument)
+{
+    deltaWork* work = argument;
+    int blockSize = work->signature->blockSize;
+    long long position = work->start;
+    long long literalStart = work->start;
+    int expectedBlock = -1;
+    unsigned int rolling = 0;
+    if (position + blockSize <= work->end)
+        rolling = RollingChecksum(work->data + position, blockSize);
+
+    while (position + blockSize <= work->end)
+    {
+        int block = MatchBlock(work, work->data + position, rolling, expectedBlock);
+        if (block >= 0)
+        {
+            if (AddOperation(&work->script, literalStart, -1, position - literalStart) == -1 ||
+                AddOperation(&work->script, position, (long long) block * blockSize, blockSize) == -1)
+            {
+                work->failed = 1;
+                return NULL;
+            }
+            position += blockSize;
+            literalStart = position;
+            expectedBlock = block + 1;
+            if (position + blockSize <= work->end)
+                rolling = RollingChecksum(work->data + position, blockSize);
+            continue;
+        }
+        if (position + blockSize == work->end)
+            break;
+        rolling = RollChecksum(rolling, work->data[position], work->data[position + blockSize], blockSize);
+        position++;
+        expectedBlock = -1;
+    }
+    if (AddOperation(&work->script, literalStart, -1, work->end - literalStart) == -1)
+        work->failed = 1;
+    return NULL;
+}
+
+int ComputeDelta(const char* path, const fileSignature* signature, deltaScript* script, int threadCount)
+{
+    memset(script, 0, sizeof(deltaScript));
+    long long size = -1;
+    const byte* data = MapFile(path, &size);
+    if (data == NULL)
+        return size == 0 ? 0 : -1;
+
+    blockIndex index;
+    unsigned int buckets = 1;
+    while (buckets < 2u * signature->blockCount)
+        buckets *= 2;
+    index.mask = buckets - 1;
+    index.heads = malloc(sizeof(int) * buckets);
+    index.next = malloc(sizeof(int) * (signature->blockCount > 0 ? signature->blockCount : 1));
+    if (index.heads == NULL || index.next == NULL)
+    {
+        free(index.heads);
+        free(index.next);
+        munmap((void*) data, size);
+        return -1;
+    }
+    for (unsigned int i = 0; i < buckets; i++)
+        index.heads[i] = -1;
+    for (int i = signature->blockCount - 1; i >= 0; i--)
+    { // Built backwards so that every chain starts with the earliest block
+        unsigned int bucket = BucketOf(&index, signature->blocks[i].rolling);
+        index.next[i] = index.heads[bucket];
+        index.heads[bucket] = i;
+    }
+
+    // Every thread needs a good number of blocks to look through, or a match across its edges is likely to be lost
+    long long minimumSegment = (long long) signature->blockSize * 64;
+    if (threadCount > size / minimumSegment)
+        threadCount = size / minimumSegment > 0 ? (int) (size / minimumSegment) : 1;
+    pthread_t threads[DELTA_MAX_THREADS];
+    deltaWork work[DELTA_MAX_THREADS];
+    for (int i = 0; i < threadCount; i++)
+    {
+        memset(&work[i], 0, sizeof(deltaWork));
+        work[i].data = data;
+        work[i].start = size * i / threadCount;
+        work[i].end = size * (i + 1) / threadCount;
+        work[i].signature = signature;
+        work[i].index = &index;
+        if (i == 0 || pthread_create(&threads[i], NULL, MatchSegment, &work[i]) != 0)
+            threads[i] = 0;
+    }
+    MatchSegment(&work[0]);
+    int failed = work[0].failed;
+    for (int i = 1; i < threadCount; i++)
+    {
+        if (threads[i] != 0)
+            pthread_join(threads[i], NULL);
+        else
+            MatchSegment(&work[i]);
+        failed |= work[i].failed;
+    }
+
+    for (int i = 0; i < threadCount && !failed; i++)
+    {
+        for (int j = 0; j < work[i].script.count && !failed; j++)
+        {
+            const deltaOperation* operation = &work[i].script.operations[j];
+            failed = AddOperation(script, operation->offset, operation->basisOffset, operation->length) == -1;
+        }
+    }
+    for (int i = 0; i < threadCount; i++)
+        FreeDeltaScript(&work[i].script);
+    free(index.heads);
+    free(index.next);
+    munmap((void*) data, size);
+    if (failed)
+    {
+        FreeDeltaScript(script);
+        return -1;
+    }
+    return 0;
+}
+
+void FreeDeltaScript(deltaScript* script)
+{
+    free(script->operations);
+    memset(script, 0, sizeof(deltaScript));
+}
@@ -0,0 +1,76 @@
+/* File: delta.h
+ *
+ * Description:
+ * Block level delta encoding for sending a file the receiver has an older copy of, the way rsync does it.
+ * The receiver cuts its copy (the basis) into blocks and publishes a weak rolling checksum and a strong hash of each.
+ * The sender slides a window over the new file, rolling the weak checksum one byte at a time, and wherever both
+ * match a basis block it tells the receiver to copy that block instead of sending the bytes.
+ * Both the hashing and the matching split the file between worker threads.
+ */
+
+#ifndef DVA218_LAB3B_DELTA_H
+#define DVA218_LAB3B_DELTA_H
+
+#include "common.h"
+
+// Blocks are at least this long, and doubled until the basis has at most DELTA_MAX_BLOCKS of them
+#define DELTA_MIN_BLOCK_SIZE 1024
+#define DELTA_MAX_BLOCKS 65536
+#define DELTA_MAX_THREADS 8
+
+typedef struct blockSignature blockSignature;
+struct blockSignature
+{
+    unsigned int rolling;       // RollingChecksum() of the block
+    unsigned long long strong;  // StrongHash() of the block
+};
+
+// Only whole blocks are in it, the tail of the basis after the last one is never copied
+typedef struct fileSignature fileSignature;
+struct fileSignature
+{
+    long long fileSize;
+    int blockSize;
+    int blockCount;
+    blockSignature* blocks;
+};
+
+// One step of rebuilding the new file: copy 'length' bytes from basisOffset in the basis, or if basisOffset is -1,
+// take 'length' bytes from 'offset' in the new file (which the sender has to send)
+typedef struct deltaOperation deltaOperation;
+struct deltaOperation
+{
+    long long offset;
+    long long basisOffset;
+    long long length;
+};
+
+typedef struct deltaScript deltaScript;
+struct deltaScript
+{
+    deltaOperation* operations;
+    int count;
+    int capacity;
+    long long copiedBytes;
+    long long literalBytes;
+};
+
+unsigned int RollingChecksum(const byte* data, int length);
+// Moves a RollingChecksum() of 'length' bytes one byte on: 'out' leaves the window and 'in' enters it
+unsigned int RollChecksum(unsigned int checksum, byte out, byte in, int length);
+unsigned long long StrongHash(const byte* data, int length);
+
+int DeltaBlockSize(long long fileSize);
+// How many worker threads to use, one per CPU up to DELTA_MAX_THREADS
+int DeltaThreadCount();
+
+// Hashes every whole block of the file at 'path'. Returns 0, or -1 if the file can't be read.
+int ComputeSignature(const char* path, fileSignature* signature, int threadCount);
+void FreeSignature(fileSignature* signature);
+
+// Works out how to build the file at 'path' from a basis with this signature. Returns 0, or -1 if the file can't be
+// read or memory ran out.
+int ComputeDelta(const char* path, const fileSignature* signature, deltaScript* script, int threadCount);
+void FreeDeltaScript(deltaScript* script);
+
+#endif //DVA218_LAB3B_DELTA_H
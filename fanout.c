@@ -0,0 +1,589 @@
+/* File: fanout.c
+ *
+ * Description:
+ * One-to-many transfers, see fanout.h. Three threads share the state below under fanoutMutex: the calling thread
+ * reads the files and builds the frames, FanoutReadPackets() handles what the receivers send back and sends the
+ * frames their ACKs make room for, and FanoutTimeouts() resends whatever a receiver hasn't ACKed in time.
+ */
+
+#include "fanout.h"
+#include "sendwindow.h"
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <endian.h>
+
+// Frames a fast receiver may get ahead of the slowest one, which is what the shared buffers hold at most. Has to stay
+// below ACK_TABLE_SIZE / 2 so that table slots are never shared.
+//Change FANOUT_MAX_BUFFERED_FRAMES to let fast receivers get further ahead of slow ones, at the cost of memory
+#define FANOUT_MAX_BUFFERED_FRAMES 512
+//Change FANOUT_SILENCE_SECONDS to give up on a receiver that stops answering sooner or later
+#define FANOUT_SILENCE_SECONDS 10
+// Like MAX_FIN_RETRIES in batch mode: once every frame is ACKed, the FIN+ACK is all that can be missing
+#define FANOUT_FIN_RETRIES 10
+// How often FanoutTimeouts() looks for frames to resend, in microseconds. Often enough that no timeout runs over by
+// much.
+#define FANOUT_TICK (SEND_WINDOW_MIN_TIMEOUT / 4)
+
+#define FANOUT_FAILED (-1)
+#define FANOUT_CONNECTING 0
+#define FANOUT_ACTIVE 1
+#define FANOUT_FINISHING 2  // Has every frame, waiting for the FIN+ACK
+#define FANOUT_DONE 3
+
+// A frame as it goes out on the wire: its fragments, sealed, back to back
+typedef struct sharedFrame sharedFrame;
+struct sharedFrame
+{
+    int references;             // Receivers that haven't ACKed it yet
+    int fragmentCount;
+    int fragmentLength;         // Wire length of every fragment but the last
+    int length;                 // Wire length of all the fragments together
+    byte wire[];
+};
+
+typedef struct fanoutReceiver fanoutReceiver;
+struct fanoutReceiver
+{
+    struct sockaddr_in address;
+    char name[32];              // Address and port, for messages
+    int status;                 // One of the FANOUT_ states
+    datagramBatch* batch;
+    sendWindow window;          // Its frames in flight, round trip and congestion window, on MonotonicMicroseconds()
+    long long handshakeSentAt;  // When the last SYN or FIN went out
+    long long heardAt;          // When it last sent us anything, or when we started waiting for it
+    int finsSent;
+    unsigned long long fragments[ACK_TABLE_SIZE]; // Fragments of a frame it reported having, see SendWireImage()
+};
+
+static pthread_mutex_t fanoutMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fanoutCondition; // Broadcast whenever a receiver's status changes or a frame is freed
+static fanoutOptions settings;
+static fanoutReceiver* receivers;
+static int receiverCount;
+static sharedFrame* frames[ACK_TABLE_SIZE];
+static unsigned short oldestFrame; // Frames from here to nextFrame may still be buffered
+static unsigned short nextFrame;   // Only FanoutTransfer() moves it, under fanoutMutex
+static int stopping;
+static unsigned long framesBuilt, datagramsSealed;
+static unsigned long long datagramsSent;
+
+// The clock every receiver's sendWindow runs on
+
+static long long MonotonicMicroseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static fanoutReceiver* FindReceiver(const struct sockaddr_in* address)
+{
+    for (int i = 0; i < receiverCount; i++)
+    {
+        if (receivers[i].address.sin_addr.s_addr == address->sin_addr.s_addr &&
+            receivers[i].address.sin_port == address->sin_port)
+            return &receivers[i];
+    }
+    return NULL;
+}
+
+static int ActiveReceivers()
+{
+    int active = 0;
+    for (int i = 0; i < receiverCount; i++)
+        active += receivers[i].status == FANOUT_ACTIVE;
+    return active;
+}
+
+// Drops one receiver's reference to a frame, and frees the frame if that was the last one
+
+static void ReleaseFrame(unsigned short sequence)
+{
+    sharedFrame* frame = frames[ACK_SLOT(sequence)];
+    if (--frame->references > 0)
+        return;
+    free(frame);
+    frames[ACK_SLOT(sequence)] = NULL;
+    while (oldestFrame != nextFrame && frames[ACK_SLOT(oldestFrame)] == NULL)
+        oldestFrame++;
+    pthread_cond_broadcast(&fanoutCondition);
+}
+
+static void SendHandshake(fanoutReceiver* receiver, uint flags)
+{
+    packet handshake;
+    if (flags == PACKETFLAG_SYN)
+    { // See SYN_DATA_LENGTH. No FEC, resume or codec, those aren't shared between receivers.
+        byte synData[SYN_DATA_LENGTH];
+        memset(synData, 0, sizeof(synData));
+        synData[0] = receiver->window.windowSize;
+        memcpy(synData + 1, &settings.frameSize, 2); // As NegotiateConnection() does it
+        synData[3] = settings.integrity;
+        WritePacket(&handshake, PACKETFLAG_SYN, synData, SYN_DATA_LENGTH, 0);
+    }
+    else
+    {
+        WritePacket(&handshake, flags, NULL, 0, 1);
+        handshake.integrity = settings.integrity;
+    }
+    SendPacket(settings.socket_fd, &handshake, &receiver->address, sizeof(receiver->address));
+    receiver->handshakeSentAt = MonotonicMicroseconds();
+}
+
+// Gives up on a receiver, letting go of every frame it still holds
+
+static void GiveUp(fanoutReceiver* receiver, const char* reason)
+{
+    DEBUGMESSAGE(0, REDTEXT("Fan-out: giving up on %s")", %s", receiver->name, reason);
+    if (receiver->status == FANOUT_ACTIVE)
+    {
+        for (unsigned short sequence = receiver->window.base; sequence != nextFrame; sequence++)
+        {
+            if (!receiver->window.acked[ACK_SLOT(sequence)])
+                ReleaseFrame(sequence);
+        }
+    }
+    receiver->status = FANOUT_FAILED;
+    pthread_cond_broadcast(&fanoutCondition);
+}
+
+// Adds the frame's fragments to the receiver's batch, leaving out the ones whose bit is set in fragmentsToSkip
+
+static void SendSharedFrame(fanoutReceiver* receiver, const sharedFrame* frame, unsigned long long fragmentsToSkip)
+{
+    for (int i = 0; i < frame->fragmentCount; i++)
+    {
+        if (fragmentsToSkip & (1ull << i))
+            continue;
+        int offset = i * frame->fragmentLength;
+        int length = frame->length - offset < frame->fragmentLength ? frame->length - offset : frame->fragmentLength;
+        BatchDatagram(receiver->batch, frame->wire + offset, length);
+        datagramsSent++;
+    }
+}
+
+// Sends the receiver every frame its congestion window and advertised window have room for
+
+static void SendNewFrames(fanoutReceiver* receiver)
+{
+    long long now = MonotonicMicroseconds();
+    while (receiver->status == FANOUT_ACTIVE && receiver->window.next != nextFrame &&
+           SendWindowHasRoom(&receiver->window))
+    {
+        int slot = ACK_SLOT(receiver->window.next);
+        receiver->fragments[slot] = 0;
+        SendSharedFrame(receiver, frames[slot], 0);
+        DEBUGMESSAGE(3, "Fan-out: sequence %d to %s", receiver->window.next, receiver->name);
+        SendWindowSent(&receiver->window, now);
+    }
+    FlushBatch(receiver->batch);
+}
+
+// Sends a frame the receiver may have lost again, only the fragments it hasn't reported having. The resendFunction of
+// its sendWindow.
+
+static void ResendFrame(void* context, unsigned short sequence)
+{
+    fanoutReceiver* receiver = context;
+    int slot = ACK_SLOT(sequence);
+    const sharedFrame* frame = frames[slot];
+    unsigned long long fragmentsToSkip = receiver->fragments[slot];
+    if (fragmentsToSkip == 0 && frame->fragmentCount > 1)
+    { // We don't know what got through. Probe with the last fragment, the receiver answers with what it has.
+        fragmentsToSkip = ~(1ull << (frame->fragmentCount - 1));
+    }
+    DEBUGMESSAGE(2, "Fan-out: resending sequence %d to %s", sequence, receiver->name);
+    SendSharedFrame(receiver, frame, fragmentsToSkip);
+}
+
+static void Acknowledge(fanoutReceiver* receiver, unsigned short sequence, long long now)
+{
+    if (!SendWindowAcknowledge(&receiver->window, sequence, now))
+        return;
+    ReleaseFrame(sequence);
+    if (receiver->window.base == nextFrame)
+        pthread_cond_broadcast(&fanoutCondition); // FanoutTransfer() may be waiting for exactly this
+}
+
+static void HandleSynAnswer(fanoutReceiver* receiver, const packet* answer)
+{
+    byte suggestedWindowSize = answer->data[0];
+    unsigned short suggestedFrameSize = ntohs((answer->data[1] * 256) + answer->data[2]);
+    int integrity = answer->dataLength >= SYN_DATA_LENGTH ? answer->data[3] : INTEGRITY_CHECKSUM16;
+
+    if (answer->flags == (PACKETFLAG_SYN | PACKETFLAG_NAK) && suggestedFrameSize == settings.frameSize &&
+        suggestedWindowSize >= 1 && suggestedWindowSize < receiver->window.windowSize)
+    { // Only the window is per receiver, so that is all we can give in on
+        DEBUGMESSAGE(1, "Fan-out: %s wants a window of %d, asking again", receiver->name, suggestedWindowSize);
+        receiver->window.windowSize = suggestedWindowSize;
+        SendHandshake(receiver, PACKETFLAG_SYN);
+    }
+    else if (answer->flags != (PACKETFLAG_SYN | PACKETFLAG_ACK) || suggestedWindowSize != receiver->window.windowSize ||
+             suggestedFrameSize != settings.frameSize || integrity != settings.integrity)
+    {
+        DEBUGMESSAGE(0, "Fan-out: %s answered with window %d, frame %d and %s", receiver->name,
+                     suggestedWindowSize, suggestedFrameSize, IntegrityName(integrity));
+        GiveUp(receiver, "it doesn't agree to the frame size and integrity the others use");
+    }
+    else
+    {
+        receiver->status = FANOUT_ACTIVE;
+        SendWindowOpen(&receiver->window, suggestedWindowSize, nextFrame);
+        DEBUGMESSAGE(0, GRNTEXT("Fan-out: connected to %s")" with window %d", receiver->name, suggestedWindowSize);
+        pthread_cond_broadcast(&fanoutCondition);
+    }
+}
+
+static void HandleACK(fanoutReceiver* receiver, const packet* ack)
+{
+    long long now = MonotonicMicroseconds();
+    sendWindow* window = &receiver->window;
+    if (ack->dataLength >= ACK_WINDOW_DATA_LENGTH)
+    {
+        unsigned short nextExpected, advertisedWindow;
+        memcpy(&nextExpected, ack->data, 2);
+        memcpy(&advertisedWindow, ack->data + 2, 2);
+        nextExpected = ntohs(nextExpected);
+        advertisedWindow = ntohs(advertisedWindow);
+        SendWindowAdvertised(window, nextExpected, advertisedWindow);
+        // Everything before nextExpected is in, even if the ACKs for it got lost
+        while (window->base != window->next && SEQUENCE_AFTER(nextExpected, window->base))
+            Acknowledge(receiver, window->base, now);
+    }
+    unsigned short sequence = ack->sequenceNumber;
+    if (ack->dataLength >= ACK_FRAGMENTS_DATA_LENGTH)
+    {
+        unsigned long long fragmentsReceived;
+        memcpy(&fragmentsReceived, ack->data + ACK_WINDOW_DATA_LENGTH, 8);
+        if ((unsigned short) (sequence - window->base) < (unsigned short) (window->next - window->base))
+            receiver->fragments[ACK_SLOT(sequence)] |= be64toh(fragmentsReceived);
+    }
+    else
+    {
+        Acknowledge(receiver, sequence, now);
+        // Resends right away, without waiting for their timeout, the frames sent before this one that are still missing
+        int overtaken = SendWindowResendOvertaken(window, sequence, now, ResendFrame, receiver);
+        if (overtaken > 0)
+        {
+            DEBUGMESSAGE(1, "Fan-out: %d frames to %s were overtaken by %d, resending them", overtaken,
+                         receiver->name, sequence);
+        }
+    }
+    SendNewFrames(receiver);
+}
+
+static void* FanoutReadPackets(void* unused)
+{
+    (void) unused;
+    packet packetBuffer;
+    struct sockaddr_in senderAddress;
+    while (1)
+    {
+        unsigned int senderAddressLength = sizeof(senderAddress);
+        int retval = ReceivePacket(settings.socket_fd, &packetBuffer, &senderAddress, &senderAddressLength);
+        pthread_mutex_lock(&fanoutMutex);
+        if (stopping)
+        {
+            pthread_mutex_unlock(&fanoutMutex);
+            break;
+        }
+        fanoutReceiver* receiver = FindReceiver(&senderAddress);
+        if (retval < 0 || receiver == NULL)
+        {
+            pthread_mutex_unlock(&fanoutMutex);
+            continue; // Corrupted ones are resent when they time out
+        }
+        receiver->heardAt = MonotonicMicroseconds();
+
+        if (receiver->status == FANOUT_CONNECTING &&
+            (packetBuffer.flags == (PACKETFLAG_SYN | PACKETFLAG_ACK) ||
+             packetBuffer.flags == (PACKETFLAG_SYN | PACKETFLAG_NAK)))
+            HandleSynAnswer(receiver, &packetBuffer);
+        else if (packetBuffer.integrity != settings.integrity)
+        {
+            DEBUGMESSAGE(2, "Fan-out: dropped packet from %s protected by %s", receiver->name,
+                         IntegrityName(packetBuffer.integrity));
+        }
+        else if (packetBuffer.flags == PACKETFLAG_ACK && receiver->status == FANOUT_ACTIVE)
+            HandleACK(receiver, &packetBuffer);
+        else if (packetBuffer.flags == (PACKETFLAG_FIN | PACKETFLAG_ACK) && receiver->status == FANOUT_FINISHING)
+        {
+            receiver->status = FANOUT_DONE;
+            DEBUGMESSAGE(1, "Fan-out: %s has everything", receiver->name);
+            pthread_cond_broadcast(&fanoutCondition);
+        }
+        pthread_mutex_unlock(&fanoutMutex);
+    }
+    return NULL;
+}
+
+// Resends the frames the receiver has had longer than its timeout without ACKing them, see
+// SendWindowResendExpired()
+
+static void ResendExpired(fanoutReceiver* receiver, long long now)
+{
+    int expired = SendWindowResendExpired(&receiver->window, now, ResendFrame, receiver);
+    FlushBatch(receiver->batch);
+    if (expired == 0)
+        return;
+
+    DEBUGMESSAGE(1, REDTEXT("TIMEOUT")" for %d packets to %s. Resending...", expired, receiver->name);
+    if (now - receiver->heardAt > FANOUT_SILENCE_SECONDS * 1000000LL)
+        GiveUp(receiver, "it stopped answering");
+}
+
+static void* FanoutTimeouts(void* unused)
+{
+    (void) unused;
+    pthread_mutex_lock(&fanoutMutex);
+    while (!stopping)
+    {
+        long long now = MonotonicMicroseconds();
+        for (int i = 0; i < receiverCount; i++)
+        {
+            fanoutReceiver* receiver = &receivers[i];
+            if (receiver->status == FANOUT_ACTIVE)
+                ResendExpired(receiver, now);
+            else if ((receiver->status == FANOUT_CONNECTING || receiver->status == FANOUT_FINISHING) &&
+                     now - receiver->handshakeSentAt >= receiver->window.timeout * receiver->window.backoff)
+            {
+                if (receiver->status == FANOUT_CONNECTING &&
+                    now - receiver->heardAt > FANOUT_SILENCE_SECONDS * 1000000LL)
+                {
+                    GiveUp(receiver, "it doesn't answer the SYN");
+                    continue;
+                }
+                if (receiver->status == FANOUT_FINISHING && receiver->finsSent >= FANOUT_FIN_RETRIES)
+                {
+                    DEBUGMESSAGE(0, YELTEXT("Fan-out: no FIN+ACK from %s, closing anyway"), receiver->name);
+                    receiver->status = FANOUT_DONE;
+                    pthread_cond_broadcast(&fanoutCondition);
+                    continue;
+                }
+                SendHandshake(receiver, receiver->status == FANOUT_CONNECTING ? PACKETFLAG_SYN : PACKETFLAG_FIN);
+                receiver->finsSent += receiver->status == FANOUT_FINISHING;
+                SendWindowBackOff(&receiver->window);
+            }
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += FANOUT_TICK * 1000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&fanoutCondition, &fanoutMutex, &deadline);
+    }
+    pthread_mutex_unlock(&fanoutMutex);
+    return NULL;
+}
+
+// Builds the next frame of the stream, fragmented and sealed, and sends it to every receiver with room for it.
+// Waits while the slowest receiver is FANOUT_MAX_BUFFERED_FRAMES behind. Returns -1 if no receiver is left.
+
+static int QueueFrame(uint flags, const void* data, int dataLength)
+{
+    static packet fragment; // Only the thread in FanoutTransfer() builds frames
+    int fragmentDataLength = FragmentDataLength(dataLength, settings.pathMTU);
+    int fragmentCount = FragmentCount(dataLength, fragmentDataLength);
+    int trailerLength = settings.integrity == INTEGRITY_CRC32C ? CRC32C_TRAILER_LENGTH : 0;
+    sharedFrame* frame;
+    if ((frame = malloc(sizeof(sharedFrame) + dataLength + fragmentCount * (PACKET_HEADER_LENGTH + trailerLength)))
+        == NULL)
+    {
+        CRASHWITHERROR("malloc() for a shared frame in QueueFrame() failed");
+    }
+    frame->fragmentCount = fragmentCount;
+    frame->length = 0;
+    for (int i = 0; i < fragmentCount; i++)
+    {
+        int offset = i * fragmentDataLength;
+        int length = dataLength - offset < fragmentDataLength ? dataLength - offset : fragmentDataLength;
+        WritePacket(&fragment, flags, (byte*) data + offset, length, nextFrame);
+        fragment.integrity = settings.integrity;
+        fragment.fragmentIndex = i;
+        fragment.fragmentCount = fragmentCount;
+        fragment.fragmentSize = fragmentDataLength;
+        int wireLength = SealPacket(&fragment);
+        memcpy(frame->wire + frame->length, &fragment, wireLength);
+        if (i == 0)
+            frame->fragmentLength = wireLength;
+        frame->length += wireLength;
+    }
+    framesBuilt++;
+    datagramsSealed += fragmentCount;
+
+    pthread_mutex_lock(&fanoutMutex);
+    while ((unsigned short) (nextFrame - oldestFrame) >= FANOUT_MAX_BUFFERED_FRAMES && ActiveReceivers() > 0)
+        pthread_cond_wait(&fanoutCondition, &fanoutMutex);
+    if ((frame->references = ActiveReceivers()) == 0)
+    {
+        pthread_mutex_unlock(&fanoutMutex);
+        free(frame);
+        return -1;
+    }
+    frames[ACK_SLOT(nextFrame)] = frame;
+    nextFrame++;
+    for (int i = 0; i < receiverCount; i++)
+        SendNewFrames(&receivers[i]);
+    pthread_mutex_unlock(&fanoutMutex);
+    return 0;
+}
+
+// Queues a file the way SendFile() does: CONTROL_NEXTFILE, then frames of frameSize, the last one with what is left
+
+static int QueueFile(const char* path)
+{
+    FILE* fp;
+    if ((fp = fopen(path, "rb")) == NULL)
+    {
+        DEBUGMESSAGE(0, YELTEXT("Couldn't open file '%s', skipping it"), path);
+        return 0;
+    }
+    const char* fileName = strrchr(path, '/');
+    fileName = (fileName == NULL) ? path : fileName + 1;
+    int fileNameLength = strlen(fileName);
+    if (fileNameLength > CONTROL_FILENAME_LENGTH)
+        fileNameLength = CONTROL_FILENAME_LENGTH;
+    byte controlData[1 + CONTROL_FILENAME_LENGTH];
+    controlData[0] = CONTROL_NEXTFILE;
+    memcpy(controlData + 1, fileName, fileNameLength);
+    int result = QueueFrame(PACKETFLAG_CONTROL, controlData, 1 + fileNameLength);
+
+    byte* frameData;
+    if ((frameData = malloc(settings.frameSize)) == NULL)
+    {
+        CRASHWITHERROR("malloc() for frameData in QueueFile() failed");
+    }
+    size_t bytesRead;
+    int frames = 0;
+    while (result == 0 && (bytesRead = fread(frameData, 1, settings.frameSize, fp)) > 0)
+    {
+        result = QueueFrame(0, frameData, bytesRead);
+        frames++;
+    }
+    free(frameData);
+    fclose(fp);
+    DEBUGMESSAGE(1, GRNTEXT("Fan-out: queued '%s' in [")" %d "GRNTEXT("] frames"), path, frames);
+    return result;
+}
+
+int FanoutTransfer(const fanoutOptions* options, const struct sockaddr_in* addresses, int count,
+                   char** fileList, int fileCount)
+{
+    settings = *options;
+    receiverCount = count;
+    oldestFrame = nextFrame = 0;
+    stopping = 0;
+    pthread_condattr_t conditionAttributes; // Timed waits use CLOCK_MONOTONIC, like everything else in here
+    pthread_condattr_init(&conditionAttributes);
+    pthread_condattr_setclock(&conditionAttributes, CLOCK_MONOTONIC);
+    if (pthread_cond_init(&fanoutCondition, &conditionAttributes) != 0)
+    {
+        CRASHWITHMESSAGE("Condition variable fanoutCondition initialization failed in FanoutTransfer()");
+    }
+    pthread_condattr_destroy(&conditionAttributes);
+    if ((receivers = calloc(receiverCount, sizeof(fanoutReceiver))) == NULL)
+    {
+        CRASHWITHERROR("calloc() for receivers in FanoutTransfer() failed");
+    }
+    for (int i = 0; i < receiverCount; i++)
+    {
+        fanoutReceiver* receiver = &receivers[i];
+        receiver->address = addresses[i];
+        char addressText[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &receiver->address.sin_addr, addressText, sizeof(addressText));
+        snprintf(receiver->name, sizeof(receiver->name), "%s:%d", addressText, ntohs(receiver->address.sin_port));
+        SendWindowInitialize(&receiver->window, settings.windowSize);
+        if ((receiver->batch = malloc(sizeof(datagramBatch))) == NULL)
+        {
+            CRASHWITHERROR("malloc() for a batch in FanoutTransfer() failed");
+        }
+        InitializeBatch(receiver->batch, settings.socket_fd, &receiver->address, sizeof(receiver->address));
+    }
+    GrowSocketBuffer(settings.socket_fd, SO_SNDBUF,
+                     receiverCount * settings.windowSize * FrameSocketBufferCost(settings.frameSize, settings.pathMTU));
+
+    // Before FanoutTimeouts() starts, which would otherwise find receivers that have never been sent a SYN
+    for (int i = 0; i < receiverCount; i++)
+    {
+        SendHandshake(&receivers[i], PACKETFLAG_SYN);
+        receivers[i].heardAt = receivers[i].handshakeSentAt;
+    }
+    pthread_t readThread, timeoutThread;
+    if (pthread_create(&readThread, NULL, FanoutReadPackets, NULL) != 0 ||
+        pthread_create(&timeoutThread, NULL, FanoutTimeouts, NULL) != 0)
+    {
+        CRASHWITHERROR("pthread_create() failed in FanoutTransfer()");
+    }
+
+    pthread_mutex_lock(&fanoutMutex);
+    int connecting = 1;
+    while (connecting)
+    {
+        connecting = 0;
+        for (int i = 0; i < receiverCount; i++)
+            connecting |= receivers[i].status == FANOUT_CONNECTING;
+        if (connecting)
+            pthread_cond_wait(&fanoutCondition, &fanoutMutex);
+    }
+    DEBUGMESSAGE(0, CYNTEXT("Fan-out: %d of %d receivers connected"), ActiveReceivers(), receiverCount);
+    pthread_mutex_unlock(&fanoutMutex);
+
+    for (int i = 0; i < fileCount; i++)
+    {
+        if (QueueFile(fileList[i]) == -1)
+            break; // Nobody left to send to
+    }
+
+    pthread_mutex_lock(&fanoutMutex);
+    int waiting = 1;
+    while (waiting)
+    {
+        waiting = 0;
+        for (int i = 0; i < receiverCount; i++)
+        {
+            fanoutReceiver* receiver = &receivers[i];
+            if (receiver->status == FANOUT_ACTIVE && receiver->window.base == nextFrame)
+            { // Has every frame, close its connection
+                receiver->status = FANOUT_FINISHING;
+                receiver->window.backoff = 1;
+                SendHandshake(receiver, PACKETFLAG_FIN);
+                receiver->finsSent = 1;
+            }
+            waiting |= receiver->status == FANOUT_ACTIVE || receiver->status == FANOUT_FINISHING;
+        }
+        if (waiting)
+            pthread_cond_wait(&fanoutCondition, &fanoutMutex);
+    }
+    stopping = 1;
+    pthread_cond_broadcast(&fanoutCondition);
+    pthread_mutex_unlock(&fanoutMutex);
+    shutdown(settings.socket_fd, SHUT_RDWR); // Unblocks FanoutReadPackets(), which is still stuck in recvfrom()
+    pthread_join(readThread, NULL);
+    pthread_join(timeoutThread, NULL);
+
+    int delivered = 0;
+    printf(CYNTEXT("Fan-out: %lu frames in %lu datagrams, each sealed once and sent %.2f times on average")"\n",
+           framesBuilt, datagramsSealed, datagramsSealed > 0 ? (double) datagramsSent / datagramsSealed : 0);
+    for (int i = 0; i < receiverCount; i++)
+    {
+        fanoutReceiver* receiver = &receivers[i];
+        delivered += receiver->status == FANOUT_DONE;
+        printf("  %-21s %s, %lu frames sent, %lu resent, round trip %.0f us\n", receiver->name,
+               receiver->status == FANOUT_DONE ? GRNTEXT("done") : REDTEXT("failed"), receiver->window.framesSent,
+               receiver->window.framesResent, receiver->window.roundTime);
+        free(receiver->batch);
+    }
+    for (int i = 0; i < ACK_TABLE_SIZE; i++)
+    {
+        free(frames[i]); // Only frames nobody ACKed are left
+        frames[i] = NULL;
+    }
+    free(receivers);
+    receivers = NULL;
+    return delivered;
+}
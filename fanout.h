@@ -0,0 +1,34 @@
+/* File: fanout.h
+ *
+ * Description:
+ * One-to-many transfers: the sender sends the same batch of files to several receivers at once over one socket.
+ * Every frame is cut into fragments and sealed (checksum or CRC32C) once, into a reference counted buffer that all
+ * receivers are sent from. Each receiver has its own handshake, ACK table, round trip estimate and congestion window,
+ * and only the receivers that are missing a frame get it again. A frame's buffer is freed once the last receiver
+ * still holding a reference to it has ACKed it, or has been given up on.
+ * The receivers share the frame size and integrity algorithm, the window size is negotiated with each of them.
+ */
+
+#ifndef DVA218_LAB3B_FANOUT_H
+#define DVA218_LAB3B_FANOUT_H
+
+#include "common.h"
+
+#define MAX_FANOUT_RECEIVERS 32
+
+typedef struct fanoutOptions fanoutOptions;
+struct fanoutOptions
+{
+    int socket_fd;
+    byte windowSize;            // Asked for, receivers may answer with less
+    unsigned short frameSize;   // Every receiver has to agree to it
+    int integrity;              // Every receiver has to agree to it
+    int pathMTU;
+};
+
+// Sends the files to every receiver, one after the other as in batch mode, then closes each connection with a FIN.
+// Returns the number of receivers that got all of them.
+int FanoutTransfer(const fanoutOptions* options, const struct sockaddr_in* addresses, int receiverCount,
+                   char** fileList, int fileCount);
+
+#endif //DVA218_LAB3B_FANOUT_H
@@ -0,0 +1,126 @@
+/* File: fec.c
+ *
+ * Description:
+ * XOR parity for forward error correction, see fec.h.
+ */
+
+#include "fec.h"
+#include <arpa/inet.h>
+#include <stdint.h>
+
+// 32 bytes at a time, which the compiler turns into one AVX or two SSE2 operations
+typedef uint64_t xorBlock __attribute__((vector_size(32)));
+
+void XorBytes(byte* destination, const byte* source, size_t length)
+{
+    while (length >= sizeof(xorBlock))
+    {
+        xorBlock a, b;
+        memcpy(&a, destination, sizeof(a));
+        memcpy(&b, source, sizeof(b));
+        a ^= b;
+        memcpy(destination, &a, sizeof(a));
+        destination += sizeof(xorBlock);
+        source += sizeof(xorBlock);
+        length -= sizeof(xorBlock);
+    }
+    while (length > 0)
+    {
+        *destination++ ^= *source++;
+        length--;
+    }
+}
+
+void FecParityInitialize(fecParity* parity)
+{
+    memset(parity, 0, sizeof(fecParity));
+}
+
+// Empties the accumulator, keeping its memory for the next group
+void FecParityReset(fecParity* parity)
+{
+    memset(parity->data, 0, parity->length);
+    parity->flags = 0;
+    parity->dataLength = 0;
+    parity->stream = 0;
+    parity->streamSequence = 0;
+    parity->length = 0;
+}
+
+void FecParityFree(fecParity* parity)
+{
+    free(parity->data);
+    FecParityInitialize(parity);
+}
+
+// XORs data into the accumulator, growing it first if the data is longer than anything added before
+static int AddData(fecParity* parity, const byte* data, int length)
+{
+    if (length > parity->capacity)
+    {
+        byte* grown;
+        if ((grown = realloc(parity->data, length)) == NULL)
+            return -1;
+        memset(grown + parity->capacity, 0, length - parity->capacity);
+        parity->data = grown;
+        parity->capacity = length;
+    }
+    XorBytes(parity->data, data, length);
+    if (length > parity->length)
+        parity->length = length;
+    return 0;
+}
+
+int FecParityAdd(fecParity* parity, const packet* frame)
+{
+    if (AddData(parity, frame->data, frame->dataLength) == -1)
+        return -1;
+    parity->flags ^= frame->flags;
+    parity->dataLength ^= frame->dataLength;
+    parity->stream ^= frame->stream;
+    parity->streamSequence ^= frame->streamSequence;
+    return 0;
+}
+
+int FecParityAddParity(fecParity* parity, const packet* parityPacket)
+{
+    if (parityPacket->dataLength < FEC_PARITY_HEADER_LENGTH)
+        return -1;
+    unsigned short dataLength, stream, streamSequence;
+    memcpy(&dataLength, parityPacket->data + 1, 2);
+    memcpy(&stream, parityPacket->data + 3, 2);
+    memcpy(&streamSequence, parityPacket->data + 5, 2);
+    if (AddData(parity, parityPacket->data + FEC_PARITY_HEADER_LENGTH,
+                parityPacket->dataLength - FEC_PARITY_HEADER_LENGTH) == -1)
+        return -1;
+    parity->flags ^= parityPacket->data[0];
+    parity->dataLength ^= ntohs(dataLength);
+    parity->stream ^= ntohs(stream);
+    parity->streamSequence ^= ntohs(streamSequence);
+    return 0;
+}
+
+void FecParityWrite(const fecParity* parity, packet* parityPacket, unsigned short sequence)
+{
+    WritePacket(parityPacket, PACKETFLAG_PARITY, NULL, 0, sequence);
+    unsigned short dataLength = htons(parity->dataLength);
+    unsigned short stream = htons(parity->stream);
+    unsigned short streamSequence = htons(parity->streamSequence);
+    parityPacket->data[0] = parity->flags;
+    memcpy(parityPacket->data + 1, &dataLength, 2);
+    memcpy(parityPacket->data + 3, &stream, 2);
+    memcpy(parityPacket->data + 5, &streamSequence, 2);
+    memcpy(parityPacket->data + FEC_PARITY_HEADER_LENGTH, parity->data, parity->length);
+    parityPacket->dataLength = FEC_PARITY_HEADER_LENGTH + parity->length;
+    parityPacket->fragmentSize = parityPacket->dataLength;
+}
+
+int FecParityRebuild(const fecParity* parity, packet* frame, unsigned short sequence)
+{
+    if (parity->dataLength > parity->length || (parity->flags & (PACKETFLAGS_HANDSHAKE | PACKETFLAG_PARITY)) != 0)
+        return -1;
+    WritePacket(frame, parity->flags, parity->data, parity->dataLength, sequence);
+    frame->stream = parity->stream;
+    frame->streamSequence = parity->streamSequence;
+    return 0;
+}
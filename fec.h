@@ -0,0 +1,45 @@
+/* File: fec.h
+ *
+ * Description:
+ * Forward error correction kernels, see MAX_FEC_GROUP_SIZE in common.h for how the protocol uses them.
+ * A parity accumulator holds the XOR of the flags, data lengths, stream fields and (zero padded) data of the frames
+ * added to it.
+ * The sender adds the frames of a parity class and sends the result; the receiver adds the same parity and every
+ * frame of the class it got, which leaves exactly the one frame that is missing.
+ */
+
+#ifndef DVA218_LAB3B_FEC_H
+#define DVA218_LAB3B_FEC_H
+
+#include "common.h"
+
+typedef struct fecParity fecParity;
+struct fecParity
+{
+    byte flags;                 // XOR of the frames' flags
+    unsigned short dataLength;  // XOR of the frames' data lengths
+    unsigned short stream;      // XOR of the frames' streams
+    unsigned short streamSequence; // XOR of the frames' stream sequences
+    int length;                 // Longest frame added so far, data[] is all zeroes past it
+    int capacity;               // Bytes allocated for data[]
+    byte* data;
+};
+
+// XORs 'length' bytes of source into destination
+void XorBytes(byte* destination, const byte* source, size_t length);
+
+void FecParityInitialize(fecParity* parity);
+void FecParityReset(fecParity* parity);
+void FecParityFree(fecParity* parity);
+
+// Adds a data frame, or a PARITY packet made by FecParityWrite(). Returns 0, or -1 if out of memory or if the
+// parity packet is too short to be one.
+int FecParityAdd(fecParity* parity, const packet* frame);
+int FecParityAddParity(fecParity* parity, const packet* parityPacket);
+
+// Makes a PARITY packet of the accumulator (encoding), or the frame the accumulator is left holding (decoding).
+// FecParityRebuild() returns -1 if what is left can't be a frame, which means the accumulator got a frame twice.
+void FecParityWrite(const fecParity* parity, packet* parityPacket, unsigned short sequence);
+int FecParityRebuild(const fecParity* parity, packet* frame, unsigned short sequence);
+
+#endif //DVA218_LAB3B_FEC_H
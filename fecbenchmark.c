@@ -0,0 +1,117 @@
+/* File: fecbenchmark.c
+ *
+ * Description:
+ * Measures the forward error correction kernels in fec.c. For a range of frame sizes it encodes groups of frames into
+ * parity (what the sender does per group) and decodes them again with one frame per class missing (what the receiver
+ * does), and prints the throughput of both in MB of frame data per second.
+ * Usage: FecBenchmark [group size] [parity count] [MB per frame size]
+ */
+
+#include "common.h"
+#include "fec.h"
+#include <time.h>
+
+double SecondsSince(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char* argv[])
+{
+    int groupSize = argc > 1 ? atoi(argv[1]) : 8;
+    int parityCount = argc > 2 ? atoi(argv[2]) : 2;
+    long bytesPerSize = (argc > 3 ? atol(argv[3]) : 256) * 1000000;
+    if (groupSize < 1 || groupSize > MAX_FEC_GROUP_SIZE || parityCount < 1 || parityCount > groupSize ||
+        parityCount > MAX_FEC_PARITY_COUNT || bytesPerSize <= 0)
+    {
+        printf("Usage: %s [group size up to %d] [parity count up to %d and the group size] [MB per frame size]\n",
+               argv[0], MAX_FEC_GROUP_SIZE, MAX_FEC_PARITY_COUNT);
+        return 1;
+    }
+
+    packet* frames;
+    packet* parityPackets;
+    packet* rebuilt;
+    if ((frames = malloc(sizeof(packet) * groupSize)) == NULL ||
+        (parityPackets = malloc(sizeof(packet) * parityCount)) == NULL || (rebuilt = malloc(sizeof(packet))) == NULL)
+    {
+        CRASHWITHERROR("FecBenchmark malloc() failed");
+    }
+    fecParity classes[MAX_FEC_PARITY_COUNT];
+    for (int i = 0; i < parityCount; i++)
+        FecParityInitialize(&classes[i]);
+
+    const int frameSizes[] = {64, 512, 1400, 8192, 32768, MAX_FRAME_DATA_LENGTH};
+    printf("%d parity frames per %d frames, %ld MB per frame size\n", parityCount, groupSize, bytesPerSize / 1000000);
+    printf("%10s %14s %14s\n", "frame", "encode MB/s", "decode MB/s");
+    for (int sizeIndex = 0; sizeIndex < (int) (sizeof(frameSizes) / sizeof(frameSizes[0])); sizeIndex++)
+    {
+        int frameSize = frameSizes[sizeIndex];
+        for (int i = 0; i < groupSize; i++)
+        {
+            WritePacket(&frames[i], 0, NULL, 0, i);
+            for (int j = 0; j < frameSize; j++)
+                frames[i].data[j] = (byte) random();
+            frames[i].dataLength = frameSize - (i == groupSize - 1 ? frameSize / 3 : 0); // A short last frame
+        }
+        long groups = bytesPerSize / ((long) frameSize * groupSize);
+        if (groups < 1)
+            groups = 1;
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long group = 0; group < groups; group++)
+        {
+            for (int i = 0; i < parityCount; i++)
+                FecParityReset(&classes[i]);
+            for (int i = 0; i < groupSize; i++)
+                FecParityAdd(&classes[i % parityCount], &frames[i]);
+            for (int i = 0; i < parityCount; i++)
+                FecParityWrite(&classes[i], &parityPackets[i], i);
+        }
+        double encodeSeconds = SecondsSince(&start);
+
+        // Every class loses the frame that rotates through its members, and gets it back from its parity
+        int mismatches = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long group = 0; group < groups; group++)
+        {
+            int classSize = (groupSize + parityCount - 1) / parityCount;
+            int lostMember = group % classSize;
+            for (int i = 0; i < parityCount; i++)
+            {
+                FecParityReset(&classes[i]);
+                FecParityAddParity(&classes[i], &parityPackets[i]);
+            }
+            for (int i = 0; i < groupSize; i++)
+            {
+                if (i / parityCount != lostMember)
+                    FecParityAdd(&classes[i % parityCount], &frames[i]);
+            }
+            for (int i = 0; i < parityCount; i++)
+            {
+                int lost = lostMember * parityCount + i;
+                if (lost >= groupSize)
+                    continue;
+                if (FecParityRebuild(&classes[i], rebuilt, lost) == -1 ||
+                    rebuilt->dataLength != frames[lost].dataLength ||
+                    memcmp(rebuilt->data, frames[lost].data, rebuilt->dataLength) != 0)
+                    mismatches++;
+            }
+        }
+        double decodeSeconds = SecondsSince(&start);
+
+        double megabytes = (double) groups * groupSize * frameSize / 1e6;
+        printf("%10d %14.1f %14.1f%s\n", frameSize, megabytes / encodeSeconds, megabytes / decodeSeconds,
+               mismatches > 0 ? REDTEXT("  frames rebuilt wrong!") : "");
+    }
+
+    for (int i = 0; i < parityCount; i++)
+        FecParityFree(&classes[i]);
+    free(frames);
+    free(parityPackets);
+    free(rebuilt);
+    return 0;
+}
@@ -0,0 +1,611 @@
+/* File: loadgen.c
+ *
+ * Description:
+ * Load generator for the Receiver: thousands of virtual senders from a few threads, to find out where it falls over
+ * as the number of concurrent connections grows. Every virtual sender has a socket of its own, so that the receiver
+ * sees a connection per source port, and runs what a batch mode sender does without the files: SYN, frames of a
+ * fixed pattern through a sendWindow (the fan-out sender's window, round trip and congestion control), and a FIN once
+ * everything is ACKed. Then it closes its socket and waits for its next turn. New connections either start at a
+ * fixed rate, or, without --rate, as soon as a virtual sender is free again.
+ * Each thread waits on its senders' sockets with epoll and batches the frames it sends with UDP_SEGMENT. Every second
+ * it prints the connections finished, the goodput, the connections open and the receiver's resident memory (with
+ * --pid), and at the end the totals and the handshake latencies.
+ * The receiver writes what it gets to ./received/<id>, so it is best run in a scratch directory.
+ * Usage: LoadGen [receiver[:port]] [--senders=<n>] [--threads=<n>] [--rate=<connections/s>] [--seconds=<s>]
+ *                [--bytes=<kB>] [--sender-rate=<kB/s>] [--window=<frames>] [--frame=<bytes>] [--pid=<receiver pid>]
+ */
+
+#include "common.h"
+#include "sendwindow.h"
+#include <pthread.h>
+#include <math.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <errno.h>
+
+//Change LOADGEN_SILENCE_SECONDS to give up on a connection the receiver stopped answering sooner or later
+#define LOADGEN_SILENCE_SECONDS 10
+// Like MAX_FIN_RETRIES in batch mode: once every frame is ACKed, the FIN+ACK is all that can be missing
+#define LOADGEN_FIN_RETRIES 10
+// How often each thread looks for timeouts and connections to start, in microseconds. Looking through thousands of
+// senders takes CPU time the receiver may be short of when it runs on the same host.
+//Change LOADGEN_TICK to resend sooner after a timeout, at the cost of CPU time
+#define LOADGEN_TICK 1000
+#define LOADGEN_MAX_EVENTS 256
+// Frames go out whole, in one datagram each
+#define LOADGEN_MAX_FRAME_SIZE (DEFAULT_PATH_MTU - IP_UDP_HEADER_LENGTH - PACKET_HEADER_LENGTH - CRC32C_TRAILER_LENGTH)
+
+#define SENDER_IDLE 0
+#define SENDER_CONNECTING 1
+#define SENDER_SENDING 2
+#define SENDER_FINISHING 3  // Everything is ACKed, waiting for the FIN+ACK
+
+typedef struct virtualSender virtualSender;
+struct virtualSender
+{
+    int socket_fd;              // -1 while idle
+    int status;                 // One of the SENDER_ states
+    sendWindow window;
+    long long connectedAt;      // When the first SYN went out, and then when the SYN+ACK came back
+    long long handshakeSentAt;  // When the last SYN or FIN went out
+    long long heardAt;          // When the receiver last sent anything, or when we started waiting for it
+    int finsSent;
+    long framesTotal;           // Frames of the connection, and how many of them have gone out
+    long framesQueued;
+    struct loadThread* thread;
+};
+
+typedef struct loadThread loadThread;
+struct loadThread
+{
+    pthread_t thread;
+    int epoll_fd;
+    virtualSender* senders;
+    int senderCount;
+    int* idle;                  // Stack of the senders that are free to start a connection
+    int idleCount;
+    long long nextStartAt;      // With --rate, when this thread starts its next connection
+    datagramBatch* batch;       // Shared by its senders, each flushes it before the next one uses it
+    double* handshakeTimes;     // Microseconds, of every handshake that got an answer
+    unsigned long handshakeCount, handshakeCapacity;
+};
+
+typedef struct loadSettings loadSettings;
+struct loadSettings
+{
+    int senders;
+    int threads;
+    double rate;                // New connections per second over all threads, 0 to start them as senders get free
+    double seconds;
+    long long bytes;            // Per connection
+    double senderRate;          // Bytes per second per connection, 0 for as fast as the window lets it
+    int windowSize;
+    int frameSize;
+    int receiverPid;            // 0 if the receiver's memory isn't watched
+};
+
+loadSettings settings = {1000, 4, 0, 10, 64 * 1000, 0, 16, 1400, 0};
+struct sockaddr_in receiverAddress;
+byte framePattern[MAX_FRAME_DATA_LENGTH];
+atomic_int stopping;
+long long startedAt;
+
+atomic_ulong connectionsStarted, connectionsDone, connectionsFailed, finsUnanswered, startsSkipped, startsFailed,
+    framesSent, framesResent;
+atomic_ullong bytesACKed;
+
+long long MonotonicMicroseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// Resident memory of the receiver in kB, -1 if it can't be read
+
+long ReceiverMemory()
+{
+    char path[64], line[128];
+    snprintf(path, sizeof(path), "/proc/%d/status", settings.receiverPid);
+    FILE* status;
+    if (settings.receiverPid == 0 || (status = fopen(path, "r")) == NULL)
+        return -1;
+    long kilobytes = -1;
+    while (fgets(line, sizeof(line), status) != NULL)
+    {
+        if (strncmp(line, "VmRSS:", 6) == 0)
+            kilobytes = strtol(line + 6, NULL, 10);
+    }
+    fclose(status);
+    return kilobytes;
+}
+
+// Length of a frame in flight, all of them are frameSize but the last
+
+int FrameLength(const virtualSender* sender, unsigned short sequence)
+{
+    long frameIndex = sender->framesQueued - (unsigned short) (sender->window.next - sequence);
+    if (frameIndex == sender->framesTotal - 1)
+        return settings.bytes - frameIndex * (long long) settings.frameSize;
+    return settings.frameSize;
+}
+
+void BatchFrame(virtualSender* sender, unsigned short sequence)
+{
+    packet frame;
+    WritePacket(&frame, 0, framePattern, FrameLength(sender, sequence), sequence);
+    BatchPacket(sender->thread->batch, &frame);
+}
+
+// The resendFunction of every sender's window
+
+void ResendFrame(void* context, unsigned short sequence)
+{
+    BatchFrame(context, sequence);
+    atomic_fetch_add_explicit(&framesResent, 1, memory_order_relaxed);
+}
+
+void SendHandshake(virtualSender* sender, uint flags, long long now)
+{
+    packet handshake;
+    if (flags == PACKETFLAG_SYN)
+    { // See SYN_DATA_LENGTH. No FEC, resume, codec or session ticket.
+        byte synData[SYN_DATA_LENGTH];
+        memset(synData, 0, sizeof(synData));
+        synData[0] = sender->window.windowSize;
+        unsigned short frameSize = settings.frameSize;
+        memcpy(synData + 1, &frameSize, 2); // As NegotiateConnection() does it
+        synData[3] = packetIntegrity;
+        WritePacket(&handshake, PACKETFLAG_SYN, synData, SYN_DATA_LENGTH, 0);
+    }
+    else
+        WritePacket(&handshake, flags, NULL, 0, sender->window.next);
+    SendPacket(sender->socket_fd, &handshake, &receiverAddress, sizeof(receiverAddress));
+    sender->handshakeSentAt = now;
+}
+
+// Returns 0 if there was no file descriptor left for the sender's socket. The sender goes back on the idle stack then,
+// to try again on a later tick.
+
+int StartConnection(virtualSender* sender, long long now)
+{
+    if ((sender->socket_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+        if (errno != EMFILE && errno != ENFILE)
+        {
+            CRASHWITHERROR("socket() in StartConnection() failed");
+        }
+        sender->thread->idle[sender->thread->idleCount++] = sender - sender->thread->senders;
+        atomic_fetch_add_explicit(&startsFailed, 1, memory_order_relaxed);
+        return 0;
+    }
+    struct epoll_event event = {EPOLLIN, {.ptr = sender}};
+    if (epoll_ctl(sender->thread->epoll_fd, EPOLL_CTL_ADD, sender->socket_fd, &event) == -1)
+    {
+        CRASHWITHERROR("epoll_ctl() in StartConnection() failed");
+    }
+    SendWindowInitialize(&sender->window, settings.windowSize);
+    sender->status = SENDER_CONNECTING;
+    sender->framesTotal = (settings.bytes + settings.frameSize - 1) / settings.frameSize;
+    sender->framesQueued = 0;
+    sender->finsSent = 0;
+    sender->connectedAt = sender->heardAt = now;
+    SendHandshake(sender, PACKETFLAG_SYN, now);
+    atomic_fetch_add_explicit(&connectionsStarted, 1, memory_order_relaxed);
+    return 1;
+}
+
+void EndConnection(virtualSender* sender, int done)
+{
+    close(sender->socket_fd); // Takes it out of the epoll set too
+    sender->socket_fd = -1;
+    sender->status = SENDER_IDLE;
+    sender->thread->idle[sender->thread->idleCount++] = sender - sender->thread->senders;
+    atomic_fetch_add_explicit(done ? &connectionsDone : &connectionsFailed, 1, memory_order_relaxed);
+}
+
+// With --sender-rate, true if the connection hasn't yet sent what its rate allows since the SYN+ACK
+
+int PaceAllows(const virtualSender* sender, long long now)
+{
+    double allowedBytes = (now - sender->connectedAt) * settings.senderRate / 1e6;
+    return settings.senderRate == 0 || sender->framesQueued * (double) settings.frameSize <= allowedBytes;
+}
+
+// Sends every frame the window has room for and, with --sender-rate, the connection's pace allows. Once every frame
+// is ACKed, sends the FIN instead.
+
+void SendFrames(virtualSender* sender, long long now)
+{
+    sendWindow* window = &sender->window;
+    InitializeBatch(sender->thread->batch, sender->socket_fd, &receiverAddress, sizeof(receiverAddress));
+    while (sender->framesQueued < sender->framesTotal && SendWindowHasRoom(window) && PaceAllows(sender, now))
+    {
+        unsigned short sequence = window->next;
+        SendWindowSent(window, now);
+        sender->framesQueued++;
+        BatchFrame(sender, sequence);
+        atomic_fetch_add_explicit(&framesSent, 1, memory_order_relaxed);
+    }
+    FlushBatch(sender->thread->batch);
+    if (sender->framesQueued == sender->framesTotal && window->base == window->next)
+    {
+        sender->status = SENDER_FINISHING;
+        sender->window.backoff = 1;
+        SendHandshake(sender, PACKETFLAG_FIN, now);
+        sender->finsSent = 1;
+    }
+}
+
+void Acknowledge(virtualSender* sender, unsigned short sequence, long long now)
+{
+    int length = SendWindowInFlight(&sender->window, sequence) ? FrameLength(sender, sequence) : 0;
+    if (SendWindowAcknowledge(&sender->window, sequence, now))
+        atomic_fetch_add_explicit(&bytesACKed, length, memory_order_relaxed);
+}
+
+// Handles an ACK the way the fan-out sender does, see HandleACK() in fanout.c
+
+void HandleACK(virtualSender* sender, const packet* ack, long long now)
+{
+    sendWindow* window = &sender->window;
+    if (ack->dataLength >= ACK_WINDOW_DATA_LENGTH)
+    {
+        unsigned short nextExpected, advertisedWindow;
+        memcpy(&nextExpected, ack->data, 2);
+        memcpy(&advertisedWindow, ack->data + 2, 2);
+        nextExpected = ntohs(nextExpected);
+        advertisedWindow = ntohs(advertisedWindow);
+        SendWindowAdvertised(window, nextExpected, advertisedWindow);
+        while (window->base != window->next && SEQUENCE_AFTER(nextExpected, window->base))
+            Acknowledge(sender, window->base, now);
+    }
+    if (ack->dataLength < ACK_FRAGMENTS_DATA_LENGTH) // Frames are never fragmented here
+    {
+        Acknowledge(sender, ack->sequenceNumber, now);
+        InitializeBatch(sender->thread->batch, sender->socket_fd, &receiverAddress, sizeof(receiverAddress));
+        SendWindowResendOvertaken(window, ack->sequenceNumber, now, ResendFrame, sender);
+        FlushBatch(sender->thread->batch);
+    }
+    SendFrames(sender, now);
+}
+
+void HandlePacket(virtualSender* sender, long long now)
+{
+    packet packetBuffer;
+    struct sockaddr_in senderAddress;
+    unsigned int senderAddressLength = sizeof(senderAddress);
+    if (ReceivePacket(sender->socket_fd, &packetBuffer, &senderAddress, &senderAddressLength) < 0)
+        return; // Whatever it was is resent when it times out
+    sender->heardAt = now;
+    loadThread* thread = sender->thread;
+
+    if (sender->status == SENDER_CONNECTING && packetBuffer.flags == (PACKETFLAG_SYN | PACKETFLAG_NAK) &&
+        packetBuffer.data[0] >= 1 && packetBuffer.data[0] < sender->window.windowSize)
+    { // Only ever asked for a window the receiver doesn't take
+        sender->window.windowSize = packetBuffer.data[0];
+        SendHandshake(sender, PACKETFLAG_SYN, now);
+    }
+    else if (sender->status == SENDER_CONNECTING && packetBuffer.flags == (PACKETFLAG_SYN | PACKETFLAG_ACK))
+    {
+        if (thread->handshakeCount == thread->handshakeCapacity)
+        {
+            thread->handshakeCapacity = thread->handshakeCapacity > 0 ? thread->handshakeCapacity * 2 : 4096;
+            if ((thread->handshakeTimes = realloc(thread->handshakeTimes,
+                                                  thread->handshakeCapacity * sizeof(double))) == NULL)
+            {
+                CRASHWITHERROR("LoadGen realloc() for handshake times failed");
+            }
+        }
+        thread->handshakeTimes[thread->handshakeCount++] = now - sender->connectedAt;
+        sender->status = SENDER_SENDING;
+        sender->connectedAt = now;
+        SendWindowOpen(&sender->window, packetBuffer.data[0], 0);
+        SendFrames(sender, now);
+    }
+    else if (sender->status == SENDER_SENDING && packetBuffer.flags == PACKETFLAG_ACK)
+        HandleACK(sender, &packetBuffer, now);
+    else if (sender->status == SENDER_FINISHING && packetBuffer.flags == (PACKETFLAG_FIN | PACKETFLAG_ACK))
+        EndConnection(sender, 1);
+}
+
+// Resends what has timed out and gives up on connections the receiver stopped answering
+
+void CheckTimeouts(virtualSender* sender, long long now)
+{
+    if (now - sender->heardAt > LOADGEN_SILENCE_SECONDS * 1000000LL)
+    {
+        EndConnection(sender, 0);
+        return;
+    }
+    if (sender->status == SENDER_SENDING)
+    {
+        InitializeBatch(sender->thread->batch, sender->socket_fd, &receiverAddress, sizeof(receiverAddress));
+        SendWindowResendExpired(&sender->window, now, ResendFrame, sender);
+        FlushBatch(sender->thread->batch);
+        if (settings.senderRate > 0)
+            SendFrames(sender, now); // Its pace may have room for more by now
+    }
+    else if (now - sender->handshakeSentAt >= sender->window.timeout * sender->window.backoff)
+    {
+        if (sender->status == SENDER_FINISHING && sender->finsSent >= LOADGEN_FIN_RETRIES)
+        { // Every frame got there, so it counts as done like in the fan-out sender
+            atomic_fetch_add_explicit(&finsUnanswered, 1, memory_order_relaxed);
+            EndConnection(sender, 1);
+            return;
+        }
+        SendHandshake(sender, sender->status == SENDER_CONNECTING ? PACKETFLAG_SYN : PACKETFLAG_FIN, now);
+        sender->finsSent += sender->status == SENDER_FINISHING;
+        SendWindowBackOff(&sender->window);
+    }
+}
+
+void* RunLoadThread(void* argument)
+{
+    loadThread* thread = argument;
+    double threadRate = settings.rate / settings.threads;
+    struct epoll_event events[LOADGEN_MAX_EVENTS];
+    long long nextTickAt = 0;
+    while (!atomic_load_explicit(&stopping, memory_order_relaxed))
+    {
+        int eventCount = epoll_wait(thread->epoll_fd, events, LOADGEN_MAX_EVENTS, 1);
+        long long now = MonotonicMicroseconds();
+        for (int i = 0; i < eventCount; i++)
+        {
+            virtualSender* sender = events[i].data.ptr;
+            if (sender->status != SENDER_IDLE)
+                HandlePacket(sender, now);
+        }
+        if (now < nextTickAt)
+            continue;
+        nextTickAt = now + LOADGEN_TICK;
+
+        for (int i = 0; i < thread->senderCount; i++)
+        {
+            if (thread->senders[i].status != SENDER_IDLE)
+                CheckTimeouts(&thread->senders[i], now);
+        }
+        if (threadRate == 0)
+        {
+            while (thread->idleCount > 0 && StartConnection(&thread->senders[thread->idle[--thread->idleCount]], now))
+                ;
+        }
+        else
+        {
+            while (now >= thread->nextStartAt)
+            {
+                if (thread->idleCount > 0)
+                    StartConnection(&thread->senders[thread->idle[--thread->idleCount]], now);
+                else
+                    atomic_fetch_add_explicit(&startsSkipped, 1, memory_order_relaxed);
+                thread->nextStartAt += (long long) (1e6 / threadRate);
+            }
+        }
+    }
+    for (int i = 0; i < thread->senderCount; i++)
+    {
+        if (thread->senders[i].socket_fd != -1)
+            close(thread->senders[i].socket_fd);
+    }
+    return NULL;
+}
+
+int CompareDoubles(const void* a, const void* b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// Of sorted values, in milliseconds
+
+double Percentile(const double* values, unsigned long count, double fraction)
+{
+    if (count == 0)
+        return 0;
+    return values[(unsigned long) (fraction * (count - 1) + 0.5)] / 1000;
+}
+
+int ParseArguments(int argc, char* argv[])
+{
+    memset(&receiverAddress, 0, sizeof(receiverAddress));
+    receiverAddress.sin_family = AF_INET;
+    receiverAddress.sin_port = htons(LISTENING_PORT);
+    receiverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int i = 1; i < argc; i++)
+    {
+        const char* argument = argv[i];
+        const char* value = strchr(argument, '=') != NULL ? strchr(argument, '=') + 1 : "";
+        if (strncmp(argument, "--", 2) != 0)
+        {
+            if (ParseFanoutReceivers(argument, &receiverAddress, 1) != 1)
+                return -1;
+        }
+        else if (strncmp(argument, "--senders=", 10) == 0)
+            settings.senders = atoi(value);
+        else if (strncmp(argument, "--threads=", 10) == 0)
+            settings.threads = atoi(value);
+        else if (strncmp(argument, "--rate=", 7) == 0)
+            settings.rate = atof(value);
+        else if (strncmp(argument, "--seconds=", 10) == 0)
+            settings.seconds = atof(value);
+        else if (strncmp(argument, "--bytes=", 8) == 0)
+            settings.bytes = (long long) (atof(value) * 1000);
+        else if (strncmp(argument, "--sender-rate=", 14) == 0)
+            settings.senderRate = atof(value) * 1000;
+        else if (strncmp(argument, "--window=", 9) == 0)
+            settings.windowSize = atoi(value);
+        else if (strncmp(argument, "--frame=", 8) == 0)
+            settings.frameSize = atoi(value);
+        else if (strncmp(argument, "--pid=", 6) == 0)
+            settings.receiverPid = atoi(value);
+        else
+            return -1;
+    }
+    if (settings.threads < 1 || settings.senders < settings.threads || settings.rate < 0 || settings.seconds <= 0 ||
+        settings.bytes < 1 || settings.senderRate < 0 || settings.windowSize < 1 || settings.windowSize > 255 ||
+        settings.frameSize < 1 || settings.frameSize > LOADGEN_MAX_FRAME_SIZE)
+        return -1;
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (ParseArguments(argc, argv) == -1)
+    {
+        printf("Usage: %s [receiver[:port]] [--senders=<n>] [--threads=<n>] [--rate=<connections/s>]\n"
+               "       [--seconds=<s>] [--bytes=<kB per connection>] [--sender-rate=<kB/s per connection>]\n"
+               "       [--window=<frames>] [--frame=<bytes up to %d>] [--pid=<receiver pid>]\n",
+               argv[0], LOADGEN_MAX_FRAME_SIZE);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < (int) sizeof(framePattern); i++)
+        framePattern[i] = 'a' + i % 26;
+
+    // A socket per virtual sender
+    struct rlimit files;
+    getrlimit(RLIMIT_NOFILE, &files);
+    rlim_t filesNeeded = (rlim_t) settings.senders + 64;
+    if (files.rlim_cur < filesNeeded)
+    {
+        files.rlim_cur = files.rlim_max < filesNeeded ? files.rlim_max : filesNeeded;
+        setrlimit(RLIMIT_NOFILE, &files);
+        if (files.rlim_cur < filesNeeded)
+        {
+            DEBUGMESSAGE(0, YELTEXT("Only %ld file descriptors allowed, fewer senders than asked for will connect"),
+                         (long) files.rlim_cur);
+        }
+    }
+
+    loadThread* threads;
+    virtualSender* senders;
+    if ((threads = calloc(settings.threads, sizeof(loadThread))) == NULL ||
+        (senders = calloc(settings.senders, sizeof(virtualSender))) == NULL)
+    {
+        CRASHWITHERROR("LoadGen calloc() failed");
+    }
+    startedAt = MonotonicMicroseconds();
+    for (int t = 0, first = 0; t < settings.threads; t++)
+    {
+        loadThread* thread = &threads[t];
+        thread->senders = senders + first;
+        thread->senderCount = settings.senders / settings.threads + (t < settings.senders % settings.threads);
+        first += thread->senderCount;
+        thread->nextStartAt = startedAt;
+        if ((thread->epoll_fd = epoll_create1(0)) == -1)
+        {
+            CRASHWITHERROR("epoll_create1() failed");
+        }
+        if ((thread->idle = malloc(thread->senderCount * sizeof(int))) == NULL ||
+            (thread->batch = malloc(sizeof(datagramBatch))) == NULL)
+        {
+            CRASHWITHERROR("LoadGen malloc() failed");
+        }
+        for (int i = 0; i < thread->senderCount; i++)
+        {
+            thread->senders[i].socket_fd = -1;
+            thread->senders[i].thread = thread;
+            thread->idle[i] = thread->senderCount - 1 - i;
+        }
+        thread->idleCount = thread->senderCount;
+    }
+
+    char addressText[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &receiverAddress.sin_addr, addressText, sizeof(addressText));
+    printf("%d virtual senders on %d threads to %s:%d, %.0f kB per connection, window %d, frames of %d bytes\n",
+           settings.senders, settings.threads, addressText, ntohs(receiverAddress.sin_port), settings.bytes / 1e3,
+           settings.windowSize, settings.frameSize);
+    long memoryAtStart = ReceiverMemory(), memoryPeak = memoryAtStart, memory = memoryAtStart;
+    for (int t = 0; t < settings.threads; t++)
+    {
+        if (pthread_create(&threads[t].thread, NULL, RunLoadThread, &threads[t]) != 0)
+        {
+            CRASHWITHERROR("pthread_create() failed in LoadGen");
+        }
+    }
+
+    printf("%8s %14s %12s %8s %8s %12s\n", "second", "connections/s", "Mbit/s", "open", "failed", "receiver MB");
+    unsigned long lastDone = 0;
+    unsigned long long lastBytes = 0;
+    for (int second = 1; second <= (int) ceil(settings.seconds); second++)
+    {
+        long long wakeAt = startedAt + (long long) ((second < settings.seconds ? second : settings.seconds) * 1e6);
+        long long now = MonotonicMicroseconds();
+        if (wakeAt > now)
+            usleep(wakeAt - now);
+        unsigned long done = atomic_load(&connectionsDone);
+        unsigned long long bytes = atomic_load(&bytesACKed);
+        unsigned long ended = done + atomic_load(&connectionsFailed);
+        if ((memory = ReceiverMemory()) > memoryPeak)
+            memoryPeak = memory;
+        printf("%8d %14lu %12.2f %8lu %8lu %12.1f\n", second, done - lastDone, (bytes - lastBytes) * 8 / 1e6,
+               atomic_load(&connectionsStarted) - ended, atomic_load(&connectionsFailed),
+               memory >= 0 ? memory / 1000.0 : 0);
+        lastDone = done;
+        lastBytes = bytes;
+    }
+    atomic_store(&stopping, 1);
+    unsigned long handshakeCount = 0;
+    for (int t = 0; t < settings.threads; t++)
+    {
+        pthread_join(threads[t].thread, NULL);
+        handshakeCount += threads[t].handshakeCount;
+    }
+    double elapsed = (MonotonicMicroseconds() - startedAt) / 1e6;
+
+    double* handshakeTimes;
+    if ((handshakeTimes = malloc((handshakeCount + 1) * sizeof(double))) == NULL)
+    {
+        CRASHWITHERROR("LoadGen malloc() failed");
+    }
+    double handshakeSum = 0;
+    handshakeCount = 0;
+    for (int t = 0; t < settings.threads; t++)
+    {
+        for (unsigned long i = 0; i < threads[t].handshakeCount; i++)
+        {
+            handshakeTimes[handshakeCount++] = threads[t].handshakeTimes[i];
+            handshakeSum += threads[t].handshakeTimes[i];
+        }
+    }
+    qsort(handshakeTimes, handshakeCount, sizeof(double), CompareDoubles);
+
+    unsigned long done = atomic_load(&connectionsDone), failed = atomic_load(&connectionsFailed);
+    printf(CYNTEXT("LoadGen: %lu connections in %.1f s, %.1f per second")"\n", done, elapsed, done / elapsed);
+    printf("  goodput       %.2f Mbit/s, %.3f GB ACKed\n", atomic_load(&bytesACKed) * 8 / elapsed / 1e6,
+           atomic_load(&bytesACKed) / 1e9);
+    printf("  connections   %lu started, %lu failed, %lu still open at the end, %lu closed without a FIN+ACK",
+           atomic_load(&connectionsStarted), failed, atomic_load(&connectionsStarted) - done - failed,
+           atomic_load(&finsUnanswered));
+    if (settings.rate > 0)
+        printf(", %lu starts skipped with every sender busy", atomic_load(&startsSkipped));
+    if (atomic_load(&startsFailed) > 0)
+        printf(", %lu starts failed with no file descriptor left", atomic_load(&startsFailed));
+    printf("\n  frames        %lu sent, %lu resent (%.2f%%)\n", atomic_load(&framesSent), atomic_load(&framesResent),
+           atomic_load(&framesSent) > 0 ? 100.0 * atomic_load(&framesResent) / atomic_load(&framesSent) : 0);
+    printf("  handshake     mean %.2f ms, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           handshakeCount > 0 ? handshakeSum / handshakeCount / 1000 : 0,
+           Percentile(handshakeTimes, handshakeCount, 0.5),
+           Percentile(handshakeTimes, handshakeCount, 0.9), Percentile(handshakeTimes, handshakeCount, 0.99),
+           Percentile(handshakeTimes, handshakeCount, 1));
+    if (memoryAtStart >= 0)
+    {
+        printf("  receiver      %.1f MB resident at the start, %.1f MB at the peak, %.1f MB at the end (%+.1f MB)\n",
+               memoryAtStart / 1000.0, memoryPeak / 1000.0, memory / 1000.0, (memory - memoryAtStart) / 1000.0);
+    }
+    else
+        printf("  receiver      memory not watched, see --pid\n");
+
+    for (int t = 0; t < settings.threads; t++)
+    {
+        close(threads[t].epoll_fd);
+        free(threads[t].idle);
+        free(threads[t].batch);
+        free(threads[t].handshakeTimes);
+    }
+    free(handshakeTimes);
+    free(senders);
+    free(threads);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,457 @@
+/* File: protosim.c
+ *
+ * Description:
+ * Deterministic discrete-event simulator for the sending state machine in sendwindow.c, the one the fan-out sender
+ * runs. Many connections share one bottleneck link with a drop-tail buffer, each with its own round trip and random
+ * loss in both directions. Every connection shakes hands, sends a file of random size, waits a random think time and
+ * starts over, for hours of virtual time. The receivers run receivewindow.c like receiver.c does and ACK every frame
+ * the same way, with the frame's sequence number, the next one they expect and their advertised window, which
+ * assumes a disk that keeps up.
+ * Nothing in the model reads a clock, sleeps or waits for a thread, and all randomness comes from one seeded
+ * generator, so the same options always give the same results, event for event. At the end it prints goodput, link
+ * utilization, drops, resends and flow completion times on stdout, and how fast the simulation itself ran on stderr.
+ * Usage: ProtoSim [--connections=<n>] [--hours=<h>] [--bandwidth=<Mbit/s>] [--buffer=<kB>] [--rtt=<ms>-<ms>]
+ *                 [--loss=<percent>] [--window=<frames>] [--frame=<bytes>] [--file=<kB>] [--think=<s>] [--seed=<n>]
+ */
+
+#include "common.h"
+#include "sendwindow.h"
+#include "receivewindow.h"
+#include <math.h>
+
+// Wire bytes of a frame beyond its data: our header plus UDP and IPv4. ACKs go the other way and never queue.
+#define PROTOSIM_FRAME_OVERHEAD (PACKET_HEADER_LENGTH + IP_UDP_HEADER_LENGTH)
+// The SYN has a byte for it. The default is the most receiver.c agrees to, larger ones are for trying things out.
+#define PROTOSIM_MAX_WINDOW_SIZE 255
+
+#define EVENT_START 0   // The connection starts its next transfer with a SYN
+#define EVENT_OPEN 1    // The SYN+ACK is back, the window opens
+#define EVENT_FRAME 2   // A frame reaches the receiver
+#define EVENT_ACK 3     // An ACK reaches the sender
+#define EVENT_TIMER 4   // The earliest resend timeout of the connection runs out
+
+typedef struct simEvent simEvent;
+struct simEvent
+{
+    long long time;             // Virtual microseconds
+    unsigned long long order;   // Events at the same time run in the order they were scheduled
+    int type;                   // One of the EVENT_ types
+    int connection;
+    unsigned int transfer;      // Events of a transfer that has finished are dropped
+    unsigned short sequence;
+    unsigned short nextExpected; // ACKs only, as in receiver.c's SendACK()
+    unsigned short advertisedWindow;
+};
+
+typedef struct simConnection simConnection;
+struct simConnection
+{
+    sendWindow window;
+    long long delay;            // One way propagation delay in microseconds
+    long long timerAt;          // When the EVENT_TIMER that counts fires, -1 if none is pending
+    unsigned int transfer;      // How many transfers it has started
+    long long startedAt;        // When the transfer being sent started
+    long long bytes;            // Size of the transfer being sent
+    long framesTotal;           // Frames in the transfer being sent, and how many of them have gone out
+    long framesQueued;
+    receiveWindow receiver;     // The receiver's window, its buffer holds the connection itself for every frame
+};
+
+typedef struct simSettings simSettings;
+struct simSettings
+{
+    int connections;
+    double hours;
+    double bandwidth;           // Bits per second
+    double buffer;              // Bytes
+    double roundTimeMin, roundTimeMax; // Microseconds
+    double loss;                // Probability, in each direction
+    int windowSize;
+    int frameSize;
+    double fileMean;            // Bytes
+    double thinkMean;           // Microseconds
+    unsigned long long seed;
+};
+
+simSettings settings = {1000, 1, 1000e6, 1000e3, 1e3, 20e3, 0.001, 16, 1400, 256e3, 30e6, 1};
+simConnection* connections;
+simEvent* events;
+int eventCount, eventCapacity;
+unsigned long long eventOrder;
+unsigned long long randomState;
+long long now;
+double linkFreeAt;              // When the bottleneck has sent everything queued on it, in microseconds
+
+unsigned long long eventsRun, transfersDone, framesOnLink, queueDrops, lossDrops, ackDrops, overtakenResends,
+    expiredResends, firstSends;
+double bytesDelivered, linkBytes;
+double* completionTimes;        // Milliseconds, of every transfer that finished
+unsigned long completionCount, completionCapacity;
+
+// xorshift64*, in [0, 1)
+
+double Uniform()
+{
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return ((randomState * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+double Exponential(double mean)
+{
+    return -mean * log(1 - Uniform());
+}
+
+// Binary min-heap on (time, order)
+
+int EventBefore(const simEvent* a, const simEvent* b)
+{
+    return a->time < b->time || (a->time == b->time && a->order < b->order);
+}
+
+void Schedule(long long time, int type, int connection, unsigned short sequence, unsigned short nextExpected,
+              unsigned short advertisedWindow)
+{
+    if (eventCount == eventCapacity)
+    {
+        eventCapacity = eventCapacity > 0 ? eventCapacity * 2 : 4096;
+        if ((events = realloc(events, eventCapacity * sizeof(simEvent))) == NULL)
+        {
+            CRASHWITHERROR("ProtoSim realloc() for events failed");
+        }
+    }
+    simEvent event = {time, eventOrder++, type, connection, connections[connection].transfer, sequence, nextExpected,
+                      advertisedWindow};
+    int position = eventCount++;
+    while (position > 0 && EventBefore(&event, &events[(position - 1) / 2]))
+    {
+        events[position] = events[(position - 1) / 2];
+        position = (position - 1) / 2;
+    }
+    events[position] = event;
+}
+
+simEvent NextEvent()
+{
+    simEvent first = events[0];
+    simEvent last = events[--eventCount];
+    int position = 0;
+    while (1)
+    {
+        int child = 2 * position + 1;
+        if (child >= eventCount)
+            break;
+        if (child + 1 < eventCount && EventBefore(&events[child + 1], &events[child]))
+            child++;
+        if (!EventBefore(&events[child], &last))
+            break;
+        events[position] = events[child];
+        position = child;
+    }
+    if (eventCount > 0)
+        events[position] = last;
+    return first;
+}
+
+// Puts a frame on the bottleneck link, unless its buffer is full or the frame is lost, and schedules its arrival
+
+void Transmit(int connectionIndex, unsigned short sequence)
+{
+    simConnection* connection = &connections[connectionIndex];
+    // Which frame of the transfer this is, to tell the short one at the end from the rest
+    long frameIndex = connection->framesQueued - (unsigned short) (connection->window.next - sequence);
+    long long frameBytes = settings.frameSize;
+    if (frameIndex == connection->framesTotal - 1)
+        frameBytes = connection->bytes - frameIndex * (long long) settings.frameSize;
+    double wireBytes = frameBytes + PROTOSIM_FRAME_OVERHEAD;
+
+    double queuedFor = linkFreeAt > now ? linkFreeAt - now : 0;
+    if (queuedFor * settings.bandwidth / 8e6 + wireBytes > settings.buffer)
+    {
+        queueDrops++;
+        return;
+    }
+    linkFreeAt = (linkFreeAt > now ? linkFreeAt : now) + wireBytes * 8e6 / settings.bandwidth;
+    framesOnLink++;
+    linkBytes += wireBytes;
+    if (Uniform() < settings.loss)
+    {
+        lossDrops++;
+        return;
+    }
+    Schedule((long long) ceil(linkFreeAt) + connection->delay, EVENT_FRAME, connectionIndex, sequence, 0, 0);
+}
+
+// The resendFunction of every connection's window
+
+void Resend(void* context, unsigned short sequence)
+{
+    Transmit((int) ((simConnection*) context - connections), sequence);
+}
+
+void SendFrames(int connectionIndex)
+{
+    simConnection* connection = &connections[connectionIndex];
+    while (connection->framesQueued < connection->framesTotal && SendWindowHasRoom(&connection->window))
+    {
+        unsigned short sequence = connection->window.next;
+        SendWindowSent(&connection->window, now);
+        connection->framesQueued++;
+        firstSends++;
+        Transmit(connectionIndex, sequence);
+    }
+}
+
+// Makes sure an EVENT_TIMER is pending for the earliest resend timeout. A later one that is already pending finds
+// nothing to do when it fires, and arms the next.
+
+void ArmTimer(int connectionIndex)
+{
+    simConnection* connection = &connections[connectionIndex];
+    long long expiry = SendWindowNextExpiry(&connection->window);
+    if (expiry == -1 || (connection->timerAt != -1 && connection->timerAt <= expiry))
+        return;
+    connection->timerAt = expiry;
+    Schedule(expiry, EVENT_TIMER, connectionIndex, 0, 0, 0);
+}
+
+void StartTransfer(int connectionIndex)
+{
+    simConnection* connection = &connections[connectionIndex];
+    connection->transfer++;
+    connection->timerAt = -1;
+    connection->startedAt = now;
+    connection->bytes = 1 + (long long) Exponential(settings.fileMean);
+    connection->framesTotal = (connection->bytes + settings.frameSize - 1) / settings.frameSize;
+    connection->framesQueued = 0;
+    ReceiveWindowInitialize(&connection->receiver, settings.windowSize, 0);
+    SendWindowInitialize(&connection->window, settings.windowSize);
+    // The handshake itself isn't lost or queued, it only takes its round trip
+    Schedule(now + 2 * connection->delay, EVENT_OPEN, connectionIndex, 0, 0, 0);
+}
+
+void FinishTransfer(int connectionIndex)
+{
+    simConnection* connection = &connections[connectionIndex];
+    transfersDone++;
+    bytesDelivered += connection->bytes;
+    if (completionCount == completionCapacity)
+    {
+        completionCapacity = completionCapacity > 0 ? completionCapacity * 2 : 4096;
+        if ((completionTimes = realloc(completionTimes, completionCapacity * sizeof(double))) == NULL)
+        {
+            CRASHWITHERROR("ProtoSim realloc() for completion times failed");
+        }
+    }
+    completionTimes[completionCount++] = (now - connection->startedAt) / 1000.0;
+    connection->transfer++; // Whatever is still on its way belongs to the finished transfer
+    connection->timerAt = -1;
+    Schedule(now + (long long) Exponential(settings.thinkMean), EVENT_START, connectionIndex, 0, 0, 0);
+}
+
+// The receiver: keeps what fits its window, ACKs it along with the next frame it expects and its advertised window.
+// The disk is taken to keep up, so the whole window is always free.
+
+void ReceiveFrame(int connectionIndex, unsigned short sequence)
+{
+    simConnection* connection = &connections[connectionIndex];
+    receiveWindow* receiver = &connection->receiver;
+    int place = ReceiveWindowClassify(receiver, sequence);
+    if (place == RECEIVE_WINDOW_NEXT)
+    {
+        ReceiveWindowDelivered(receiver);
+        while (ReceiveWindowTakeNext(receiver) != NULL); // The frames it kept are all in order now
+    }
+    else if (place == RECEIVE_WINDOW_AHEAD)
+        ReceiveWindowStore(receiver, sequence, connection);
+    else if (place == RECEIVE_WINDOW_BEYOND)
+        return; // Beyond what it advertised, dropped without an ACK
+    if (Uniform() < settings.loss)
+    {
+        ackDrops++;
+        return;
+    }
+    Schedule(now + connection->delay, EVENT_ACK, connectionIndex, sequence, receiver->expected,
+             ReceiveWindowAdvertised(receiver, settings.windowSize));
+}
+
+void ReceiveACK(int connectionIndex, unsigned short sequence, unsigned short nextExpected,
+                unsigned short advertisedWindow)
+{
+    simConnection* connection = &connections[connectionIndex];
+    sendWindow* window = &connection->window;
+    SendWindowAdvertised(window, nextExpected, advertisedWindow);
+    while (window->base != window->next && SEQUENCE_AFTER(nextExpected, window->base))
+        SendWindowAcknowledge(window, window->base, now);
+    SendWindowAcknowledge(window, sequence, now);
+    overtakenResends += SendWindowResendOvertaken(window, sequence, now, Resend, connection);
+    if (connection->framesQueued == connection->framesTotal && window->base == window->next)
+    {
+        FinishTransfer(connectionIndex);
+        return;
+    }
+    SendFrames(connectionIndex);
+    ArmTimer(connectionIndex);
+}
+
+void RunEvent(const simEvent* event)
+{
+    simConnection* connection = &connections[event->connection];
+    if (event->transfer != connection->transfer)
+        return;
+    switch (event->type)
+    {
+        case EVENT_START:
+            StartTransfer(event->connection);
+            break;
+        case EVENT_OPEN:
+            SendWindowOpen(&connection->window, settings.windowSize, 0);
+            SendFrames(event->connection);
+            ArmTimer(event->connection);
+            break;
+        case EVENT_FRAME:
+            ReceiveFrame(event->connection, event->sequence);
+            break;
+        case EVENT_ACK:
+            ReceiveACK(event->connection, event->sequence, event->nextExpected, event->advertisedWindow);
+            break;
+        case EVENT_TIMER:
+            if (event->time != connection->timerAt)
+                break; // Superseded by an earlier one
+            connection->timerAt = -1;
+            expiredResends += SendWindowResendExpired(&connection->window, now, Resend, connection);
+            ArmTimer(event->connection);
+            break;
+    }
+}
+
+int CompareDoubles(const void* a, const void* b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+double Percentile(double fraction)
+{
+    if (completionCount == 0)
+        return 0;
+    unsigned long index = (unsigned long) (fraction * (completionCount - 1) + 0.5);
+    return completionTimes[index];
+}
+
+int ParseArguments(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const char* argument = argv[i];
+        char* value = strchr(argument, '=');
+        if (value == NULL)
+            return -1;
+        value++;
+        if (strncmp(argument, "--connections=", 14) == 0)
+            settings.connections = atoi(value);
+        else if (strncmp(argument, "--hours=", 8) == 0)
+            settings.hours = atof(value);
+        else if (strncmp(argument, "--bandwidth=", 12) == 0)
+            settings.bandwidth = atof(value) * 1e6;
+        else if (strncmp(argument, "--buffer=", 9) == 0)
+            settings.buffer = atof(value) * 1e3;
+        else if (strncmp(argument, "--rtt=", 6) == 0)
+        {
+            char* end;
+            settings.roundTimeMin = settings.roundTimeMax = strtod(value, &end) * 1e3;
+            if (*end == '-')
+                settings.roundTimeMax = atof(end + 1) * 1e3;
+        }
+        else if (strncmp(argument, "--loss=", 7) == 0)
+            settings.loss = atof(value) / 100;
+        else if (strncmp(argument, "--window=", 9) == 0)
+            settings.windowSize = atoi(value);
+        else if (strncmp(argument, "--frame=", 8) == 0)
+            settings.frameSize = atoi(value);
+        else if (strncmp(argument, "--file=", 7) == 0)
+            settings.fileMean = atof(value) * 1e3;
+        else if (strncmp(argument, "--think=", 8) == 0)
+            settings.thinkMean = atof(value) * 1e6;
+        else if (strncmp(argument, "--seed=", 7) == 0)
+            settings.seed = strtoull(value, NULL, 10);
+        else
+            return -1;
+    }
+    if (settings.connections < 1 || settings.hours <= 0 || settings.bandwidth <= 0 || settings.buffer <= 0 ||
+        settings.roundTimeMin < 0 || settings.roundTimeMax < settings.roundTimeMin || settings.loss < 0 ||
+        settings.loss >= 1 || settings.windowSize < 1 || settings.windowSize > PROTOSIM_MAX_WINDOW_SIZE ||
+        settings.frameSize < 1 || settings.frameSize > DEFAULT_PATH_MTU - PROTOSIM_FRAME_OVERHEAD ||
+        settings.fileMean < 1 || settings.thinkMean < 0)
+        return -1;
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (ParseArguments(argc, argv) == -1)
+    {
+        printf("Usage: %s [--connections=<n>] [--hours=<h>] [--bandwidth=<Mbit/s>] [--buffer=<kB>]\n"
+               "       [--rtt=<ms>-<ms>] [--loss=<percent>] [--window=<frames up to %d>] [--frame=<bytes up to %d>]\n"
+               "       [--file=<mean kB>] [--think=<mean s>] [--seed=<n>]\n",
+               argv[0], PROTOSIM_MAX_WINDOW_SIZE, DEFAULT_PATH_MTU - PROTOSIM_FRAME_OVERHEAD);
+        return EXIT_FAILURE;
+    }
+    // Any seed, 0 included, gives a state that isn't 0
+    randomState = settings.seed * 0x9e3779b97f4a7c15ull + 0x2545f4914f6cdd1dull;
+    if ((connections = calloc(settings.connections, sizeof(simConnection))) == NULL)
+    {
+        CRASHWITHERROR("ProtoSim calloc() for connections failed");
+    }
+    for (int i = 0; i < settings.connections; i++)
+    {
+        connections[i].delay = (long long) ((settings.roundTimeMin +
+                                             Uniform() * (settings.roundTimeMax - settings.roundTimeMin)) / 2);
+        Schedule((long long) (Uniform() * settings.thinkMean), EVENT_START, i, 0, 0, 0);
+    }
+
+    long long duration = (long long) (settings.hours * 3600e6);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (eventCount > 0 && events[0].time <= duration)
+    {
+        simEvent event = NextEvent();
+        now = event.time;
+        RunEvent(&event);
+        eventsRun++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double wallSeconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    qsort(completionTimes, completionCount, sizeof(double), CompareDoubles);
+    double completionSum = 0;
+    for (unsigned long i = 0; i < completionCount; i++)
+        completionSum += completionTimes[i];
+    double seconds = duration / 1e6;
+    unsigned long long resends = overtakenResends + expiredResends;
+
+    printf("%d connections, %.2f hours, %.0f Mbit/s with a %.0f kB buffer, round trips %.0f-%.0f ms, %.2f%% loss\n",
+           settings.connections, settings.hours, settings.bandwidth / 1e6, settings.buffer / 1e3,
+           settings.roundTimeMin / 1e3, settings.roundTimeMax / 1e3, settings.loss * 100);
+    printf("window %d frames of %d bytes, files of %.0f kB and think times of %.1f s on average, seed %llu\n",
+           settings.windowSize, settings.frameSize, settings.fileMean / 1e3, settings.thinkMean / 1e6, settings.seed);
+    printf("  transfers     %llu done, %.3f GB, goodput %.2f Mbit/s\n", transfersDone, bytesDelivered / 1e9,
+           bytesDelivered * 8 / seconds / 1e6);
+    printf("  link          %llu frames, utilization %.1f%%, %llu dropped by the full buffer\n", framesOnLink,
+           linkBytes * 8 / seconds / settings.bandwidth * 100, queueDrops);
+    printf("  loss          %llu frames, %llu ACKs\n", lossDrops, ackDrops);
+    printf("  resends       %llu, %.2f%% of %llu new frames: %llu overtaken, %llu timed out\n", resends,
+           firstSends > 0 ? 100.0 * resends / firstSends : 0, firstSends, overtakenResends, expiredResends);
+    printf("  completion    mean %.1f ms, p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+           completionCount > 0 ? completionSum / completionCount : 0, Percentile(0.5), Percentile(0.9),
+           Percentile(0.99), Percentile(1));
+    // The only line that depends on the machine goes to stderr, so that runs with the same options can be diffed
+    fprintf(stderr, "  simulation    %llu events in %.2f s, %.1f million events/s, %.0fx real time\n", eventsRun,
+            wallSeconds, eventsRun / wallSeconds / 1e6, seconds / wallSeconds);
+
+    free(completionTimes);
+    free(events);
+    free(connections);
+    return EXIT_SUCCESS;
+}
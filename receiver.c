@@ -12,10 +12,22 @@
  * Roundtime, average time for sending / ACKing packets:----- 20    
  * Error generator:------------------------------------------ 25   
  * Reading packets from the receiver:------------------------ 30
+ * Pipeline queue depths, once a second:--------------------- 45
+ * Sending the receiver SIGUSR1 prints the queue depths and reorder memory use at any debug level.
+ * '--budget=<kB>' after the debug level caps the memory all reorder buffers together may use.
+ * '--port=<port>' listens somewhere else than LISTENING_PORT, so that several receivers can share a host.
+ * Resumable transfers keep a journal in "received/.transfer-<id>" until they are done.
+ * Delta transfers rebuild a file from the newest copy of the same name another connection left in "received".
+ * Striped transfers come in over several connections at once and are put together in "received/<group>".
+ * Multiplexed streams share one connection, and each is written as soon as its own frames are in order.
+ * A sender on the same host hands over its data frames through a shared memory ring instead of the socket.
+ * A sender with several addresses may spread a connection's frames over subflows that join it, see MAX_SUBFLOWS.
  * 
  * Description: 
  * Setups a socket, listens for and manage connections to senders. Uses checksums to check for errors, reorganize data when needed etc.
  * Then writes the received data to a text file in the folder "received"
+ * Runs as a pipeline of three threads connected by rings: the network stage only reads the socket, the processing
+ * stage verifies, reorders and ACKs, and the writer stage does the file I/O.
  */
 
 #include <sys/socket.h>
@@ -23,25 +35,153 @@
 #include <stdlib.h>
 #include <string.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <zconf.h>
 #include <sys/stat.h>
 #include <semaphore.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <stddef.h>
+#include <endian.h>
+#include <netinet/udp.h>
+#include <fcntl.h>
+#include <dirent.h>
 
 #include "common.h"
+#include "crc32c.h"
+#include "spscring.h"
+#include "fec.h"
+#include "delta.h"
+#include "compression.h"
+#include "sharedring.h"
+#include "receivewindow.h"
 
 #define MIN_ACCEPTED_WINDOW_SIZE 1
 #define MAX_ACCEPTED_WINDOW_SIZE 16
 #define MIN_ACCEPTED_FRAME_SIZE 10
-#define MAX_ACCEPTED_FRAME_SIZE 65535
+#define MAX_ACCEPTED_FRAME_SIZE MAX_FRAME_DATA_LENGTH
 
 #define CONNECTION_STATUS_PENDING 1
 #define CONNECTION_STATUS_ACTIVE 2
 
-typedef struct bufferedPacketList bufferedPacketList;
-struct bufferedPacketList
+// How many session tickets we remember. When full, the oldest ones are forgotten first.
+#define SESSION_TICKET_CACHE_SIZE 256
+
+// The receive buffer is grown to hold at least this many milliseconds of the measured incoming traffic
+#define RECEIVE_BUFFER_MILLISECONDS 50
+
+// Capacity of each ring between the pipeline stages
+#define PIPELINE_RING_SIZE 256
+
+// Default for how much memory all reorder buffers together may use, in kB. Change it with --budget=<kB>.
+#define REORDER_MEMORY_BUDGET (64 * 1024)
+
+// Resumable transfers: the writer stage fsyncs the file it is writing and records how much of it is on disk in the
+// transfer's journal whenever this many bytes have been written since the last time, and at every new file.
+//Change JOURNAL_SYNC_INTERVAL to trade the data a resumed transfer sends again for fewer fsync() calls
+#define JOURNAL_SYNC_INTERVAL (8 * 1024 * 1024)
+#define JOURNAL_MAGIC 0x4c4e524au
+
+// A finished striped transfer is remembered this many seconds, so a stripe whose FIN+ACK got lost can ask again
+//Change STRIPE_GROUP_LINGER to remember finished striped transfers longer or shorter
+#define STRIPE_GROUP_LINGER 60
+
+#define SIGNATURE_HASHING 0
+#define SIGNATURE_READY 1
+
+// One datagram on its way through the pipeline. The network stage receives into it, the processing stage verifies
+// it and either keeps it in a reorder buffer or hands it to the writer stage, and the buffer then goes back to the
+// network stage through one of the free rings.
+typedef struct receivedDatagram receivedDatagram;
+struct receivedDatagram
+{
+    struct sockaddr_in senderAddress;
+    unsigned int senderAddressLength;
+    int length;         // Bytes received, of this datagram alone if the kernel coalesced several
+    int connectionID;   // Filled in by the processing stage for the writer stage
+    int compact;        // Only allocated as large as its packet (see StoreBufferedData()), can't be received into
+    packet packet;
+};
+
+// A frame in a connection's reorder buffer, see receivewindow.h
+typedef struct bufferedFrame bufferedFrame;
+struct bufferedFrame
+{
+    receivedDatagram* datagram;
+    int delivered;      // Already handed to the writer stage, see DeliverStreamFrames(). Only the header is kept.
+};
+
+// A sender's shared memory ring, see sharedring.h. The processing stage maps it when it accepts the SYN and hands it
+// to the network stage through attachRing. When the connection goes away the processing stage sets detached, and the
+// network stage unmaps it the next time it looks.
+typedef struct attachedRing attachedRing;
+struct attachedRing
+{
+    sharedRing ring;
+    struct sockaddr_in senderAddress;   // What the ring's datagrams count as coming from
+    atomic_int detached;
+    attachedRing* next;                 // Only the network stage touches it
+};
+
+// A frame that arrives as fragments is put together in here until every fragment is in
+typedef struct partialFrame partialFrame;
+struct partialFrame
+{
+    unsigned short sequence;
+    byte fragmentCount;
+    unsigned short fragmentSize;
+    unsigned long long fragmentsReceived;   // Bit i is set once fragment i is in
+    receivedDatagram* datagram;             // The whole frame, each fragment is copied straight to its place
+    long cost;                              // What it counts for against the reorder budget
+    partialFrame* next;
+};
+
+// Forward error correction state of one group of frames, see MAX_FEC_GROUP_SIZE. Every frame of the group the
+// connection takes in is XORed into its class right away, so nothing has to be kept around for the rebuilding.
+typedef struct fecGroup fecGroup;
+struct fecGroup
 {
-    packet storedData;
-    bufferedPacketList* next;
+    unsigned short base;            // Sequence of the group's first frame
+    unsigned int framesIn;          // Bit i is set once frame base + i has been XORed into its class
+    byte parityIn;                  // Bit j is set once class j's PARITY frame has been XORed into it
+    fecParity classes[MAX_FEC_PARITY_COUNT];
+    long cost;                      // What the classes count for against the reorder budget
+    fecGroup* next;
+};
+
+// A resumable transfer's journal. Since frames are written strictly in order, what has been received is always a
+// prefix of the data stream, so the file being written and how much of it is on disk is all there is to record.
+// The journal file holds two of these, written in turns, so that one is always whole if the receiver dies mid-write.
+typedef struct transferJournal transferJournal;
+struct transferJournal
+{
+    unsigned int magic;
+    unsigned int generation;    // The slot with the higher generation is the current one
+    unsigned int transferID;
+    int connectionID;           // A resumed transfer gets the same id, so that its files end up in the same directory
+    int filesStarted;           // CONTROL_NEXTFILE frames written so far
+    long long offset;           // Bytes of the last file started that are on disk
+    char fileName[CONTROL_FILENAME_LENGTH + 1];
+    unsigned int crc;           // CRC32C of everything before it
+};
+
+// The signature of a basis for a delta transfer (see CONTROL_DELTAFILE). Created by the processing stage when a
+// sender asks for it, and filled in by a thread of its own so that hashing a large file doesn't hold up the pipeline.
+// Everything from state on is guarded by signatureMutex.
+typedef struct signatureJob signatureJob;
+struct signatureJob
+{
+    int connectionID;
+    char fileName[CONTROL_FILENAME_LENGTH + 1];
+    unsigned short request;             // Sequence number of the sender's request, the replies carry it
+    struct sockaddr_in address;         // Where the replies go
+    unsigned int addressLength;
+    byte integrity;
+    int state;                          // SIGNATURE_HASHING or SIGNATURE_READY
+    int abandoned;                      // The connection is gone, the hashing thread frees the job when it is done
+    int basisID;                        // Connection that wrote the basis, -1 if there is none
+    fileSignature signature;
 };
 
 typedef struct connection connection;
@@ -51,16 +191,263 @@ struct connection
     in_port_t port;
     byte status;
     int id;
-    unsigned short sequence;
-    bufferedPacketList* packetList;
+    receiveWindow window;       // Next sequence expected and the reorder buffer, of the window negotiated at connection
+    partialFrame* partialFrames;
+    long bufferedBytes;         // Memory the reorder buffer and partialFrames take up, counted against the budget
+    unsigned short frameSize;   // Negotiated at connection, the sender may change it with CONTROL_FRAMESIZE
+    byte integrity;             // Negotiated at connection, packets protected any other way are dropped
+    byte fecGroupSize;          // Negotiated at connection, 0 if the sender sends no parity
+    byte fecParityCount;
+    fecGroup* fecGroups;
+    byte codec;                 // Negotiated at connection, CODEC_NONE if the sender doesn't compress
+    unsigned int transferID;    // From the SYN, 0 if the transfer isn't resumable
+    int resumeFiles;            // Where the SYN+ACK told the sender to continue, see SYN_RESUME_DATA_LENGTH
+    long long resumeOffset;
+    signatureJob* signatureJob;         // The last signature asked for, NULL if none
+    unsigned short streamSequences[MAX_STREAMS]; // The next frame each stream is waiting for
+    attachedRing* sharedRing;   // NULL unless the data frames come through shared memory
+    unsigned int joinKey;       // What a subflow has to show to join the connection, see MAX_SUBFLOWS
+    int subflowCount;           // Subflows that joined, besides the connection's own address
+    struct
+    {
+        in_addr_t address;
+        in_port_t port;
+    } subflows[MAX_SUBFLOWS - 1];
 
     connection* next;
 };
 
+// The writer stage's side of a connection. Only the writer thread touches these.
+typedef struct connectionOutput connectionOutput;
+struct connectionOutput
+{
+    int id;
+    int stream;                                 // Every stream of a connection has its own, see MAX_STREAMS
+    char fileName[CONTROL_FILENAME_LENGTH + 1]; // Set by CONTROL_NEXTFILE, empty while writing to the default file
+    FILE* file;                                 // Kept open between frames, NULL until something is written
+    int journal;                                // File descriptor, -1 if the transfer isn't resumable
+    transferJournal journalState;               // What the journal says once the file is synced
+    long long unsyncedBytes;                    // Written since the journal was last updated
+    FILE* basis;                                // What CONTROL_COPY copies from, set by CONTROL_DELTAFILE
+    unsigned int stripeGroup;                   // Set by CONTROL_STRIPE, 0 if the connection isn't a stripe
+    int stripeIndex;
+    int stripeCount;
+    int stripeFile;                             // File descriptor the stripe writes to, -1 if none
+    long long stripeOffset;                     // Where the next byte of the stripe goes
+    connectionOutput* next;
+};
+
+// A file name a connection has written to, see ClaimFileName(). Only the writer thread touches these.
+typedef struct startedFile startedFile;
+struct startedFile
+{
+    int id;
+    char fileName[CONTROL_FILENAME_LENGTH + 1];
+    startedFile* next;
+};
+
+// The FIN+ACKs of a striped transfer, held back until the FIN of every stripe is in. Only the writer touches these.
+typedef struct stripeGroup stripeGroup;
+struct stripeGroup
+{
+    unsigned int id;
+    int stripeCount;
+    int finished;               // Stripes whose FIN is in
+    time_t completed;           // When the last FIN came in, 0 before that
+    struct
+    {
+        int held;
+        struct sockaddr_in address;
+        unsigned int addressLength;
+        unsigned short sequence;
+        byte integrity;
+    } fins[MAX_STRIPES];
+    stripeGroup* next;
+};
+
+// A session ticket lets a sender that connected before skip the wait for SYN+ACK. It is only valid from the same
+// address, with the parameters it was issued for, and can be used once; every SYN+ACK carries a new one.
+typedef struct sessionTicket sessionTicket;
+struct sessionTicket
+{
+    unsigned int ticket; // 0 if the slot is unused
+    in_addr_t address;
+    byte windowSize;
+    unsigned short frameSize;
+    time_t expiry;
+};
+
 int socket_fd;
-connection* connectionList = NULL;
+connection* connectionList = NULL; // Only the processing stage touches the connections
+int connectionCount = 0;
+connectionOutput* outputList = NULL;
+startedFile* startedFiles = NULL;
+stripeGroup* stripeGroups = NULL;
+sessionTicket ticketCache[SESSION_TICKET_CACHE_SIZE];
+int nextTicketSlot = 0;
+
+// The pipeline: network stage -> processRing -> processing stage -> writeRing -> writer stage.
+// Spent buffers go back to the network stage, each stage that frees them has its own ring so they stay SPSC.
+spscRing processRing;
+spscRing writeRing;
+spscRing processedFreeRing;
+spscRing writtenFreeRing;
+spscRing attachRing;                // Shared memory rings the processing stage has mapped, see attachedRing
+attachedRing* sharedRings = NULL;   // The rings the network stage reads
+
+// Stage counters, printed together with the queue depths
+atomic_ulong datagramsReceived = 0;
+atomic_ulong coalescedReceives = 0; // recvmsg() calls that returned more than one datagram (UDP_GRO)
+atomic_ulong datagramsShared = 0; // Taken from shared memory rings instead of the socket
+atomic_ulong datagramsDropped = 0;
+atomic_ulong acksSent = 0;
+atomic_ulong framesWritten = 0;
+atomic_ulong framesRebuilt = 0; // From parity, without waiting for a resend
+atomic_ulong framesAheadOfSequence = 0; // Written before frames of other streams that came ahead of them were in
+atomic_ulong bytesWritten = 0;
+atomic_int statisticsRequested = 0; // Set by SIGUSR1
+
+// Memory budget for the reorder buffers of all connections together. Every connection gets an equal share of it,
+// and its advertised window only covers the frames that fit in what is left of its share. Frames that arrive
+// anyway are dropped without an ACK so that the sender resends them once there is room.
+long reorderMemoryBudget = REORDER_MEMORY_BUDGET * 1024L;
+atomic_long reorderMemoryUsed = 0;
+atomic_long reorderMemoryPeak = 0;
+atomic_ulong framesOverBudget = 0;
+
+pthread_mutex_t signatureMutex = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned int IssueSessionTicket(const struct sockaddr_in* address, byte windowSize, unsigned short frameSize)
+{
+    unsigned int ticket;
+    do
+    {
+        ticket = ((unsigned int) random() << 16) ^ (unsigned int) random();
+    }
+    while (ticket == 0);
+
+    sessionTicket* slot = &ticketCache[nextTicketSlot];
+    nextTicketSlot = (nextTicketSlot + 1) % SESSION_TICKET_CACHE_SIZE;
+    slot->ticket = ticket;
+    slot->address = address->sin_addr.s_addr;
+    slot->windowSize = windowSize;
+    slot->frameSize = frameSize;
+    slot->expiry = time(NULL) + SESSION_TICKET_LIFETIME;
+    return ticket;
+}
+
+// Returns 1 and uses up the ticket if it is valid for this sender and these parameters, 0 otherwise
+
+int RedeemSessionTicket(unsigned int ticket, const struct sockaddr_in* address, byte windowSize,
+                        unsigned short frameSize)
+{
+    for (int i = 0; i < SESSION_TICKET_CACHE_SIZE; i++)
+    {
+        sessionTicket* slot = &ticketCache[i];
+        if (slot->ticket == ticket && ticket != 0)
+        {
+            int valid = (slot->address == address->sin_addr.s_addr && slot->windowSize == windowSize &&
+                         slot->frameSize == frameSize && slot->expiry > time(NULL));
+            slot->ticket = 0;
+            return valid;
+        }
+    }
+    return 0;
+}
+
+// Gives a spent datagram back to the network stage through the calling stage's free ring
+
+void ReleaseDatagram(spscRing* freeRing, receivedDatagram* datagram)
+{
+    if (datagram->compact || !SpscRingTryPush(freeRing, datagram))
+        free(datagram);
+}
+
+// Returns a datagram buffer for the network stage to receive into, recycling spent ones when there are any
+
+receivedDatagram* AcquireDatagram()
+{
+    receivedDatagram* datagram;
+    if ((datagram = SpscRingTryPop(&processedFreeRing)) != NULL ||
+        (datagram = SpscRingTryPop(&writtenFreeRing)) != NULL)
+        return datagram;
+    if ((datagram = malloc(sizeof(receivedDatagram))) == NULL)
+    {
+        CRASHWITHERROR("AcquireDatagram() malloc failed");
+    }
+    datagram->compact = 0;
+    return datagram;
+}
+
+void PrintPipelineStatistics()
+{
+    printf(CYN"Pipeline:"RESET" received %lu (%lu coalesced reads, %lu through shared memory), dropped %lu, rebuilt"
+           " %lu, ACKs sent %lu, frames written %lu (%lu bytes, %lu ahead of other streams)\n",
+           atomic_load(&datagramsReceived), atomic_load(&coalescedReceives), atomic_load(&datagramsShared), atomic_load(&datagramsDropped),
+           atomic_load(&framesRebuilt),
+           atomic_load(&acksSent), atomic_load(&framesWritten), atomic_load(&bytesWritten),
+           atomic_load(&framesAheadOfSequence));
+    SpscRingPrintStatistics(&processRing);
+    SpscRingPrintStatistics(&writeRing);
+    SpscRingPrintStatistics(&processedFreeRing);
+    SpscRingPrintStatistics(&writtenFreeRing);
+    printf(CYN"Reorder memory:"RESET" %ld of %ld kB in use, peak %ld kB, %lu frames dropped over budget\n",
+           atomic_load(&reorderMemoryUsed) / 1024, reorderMemoryBudget / 1024, atomic_load(&reorderMemoryPeak) / 1024,
+           atomic_load(&framesOverBudget));
+}
+
+// The part of the reorder budget each connection may use
+
+long ReorderMemoryShare()
+{
+    return connectionCount > 0 ? reorderMemoryBudget / connectionCount : reorderMemoryBudget;
+}
+
+// Size of a datagram allocated just large enough for this much data
+
+size_t CompactDatagramSize(int dataLength)
+{
+    return sizeof(receivedDatagram) - DATA_BUFFER_SIZE + dataLength;
+}
+
+// What keeping a frame with this much data in a reorder buffer costs
+
+long ReorderMemoryCost(int dataLength)
+{
+    return sizeof(bufferedFrame) + CompactDatagramSize(dataLength);
+}
+
+int ReorderMemoryFits(const connection* clientConnection, long cost)
+{
+    return clientConnection->bufferedBytes + cost <= ReorderMemoryShare() &&
+           atomic_load(&reorderMemoryUsed) + cost <= reorderMemoryBudget;
+}
+
+void ChargeReorderMemory(connection* clientConnection, long cost)
+{
+    clientConnection->bufferedBytes += cost;
+    long used = atomic_fetch_add(&reorderMemoryUsed, cost) + cost;
+    if (used > atomic_load(&reorderMemoryPeak))
+        atomic_store(&reorderMemoryPeak, used);
+}
+
+void RefundReorderMemory(connection* clientConnection, long cost)
+{
+    clientConnection->bufferedBytes -= cost;
+    atomic_fetch_sub(&reorderMemoryUsed, cost);
+}
 
-int AddConnection(struct sockaddr_in* address)
+// Grows the socket's receive buffer so that every connection can have a full window in flight at once
+void SizeReceiveBufferForConnections()
+{
+    int bytesNeeded = 0;
+    for (connection* cursor = connectionList; cursor != NULL; cursor = cursor->next)
+        bytesNeeded += cursor->window.windowSize * FrameSocketBufferCost(cursor->frameSize, DEFAULT_PATH_MTU);
+    GrowSocketBuffer(socket_fd, SO_RCVBUF, bytesNeeded);
+}
+
+int AddConnection(struct sockaddr_in* address, byte windowSize, unsigned short frameSize, byte integrity,
+                  byte fecGroupSize, byte fecParityCount)
 {
     connection* newConnection;
     if ((newConnection = malloc(sizeof(connection))) == NULL)
@@ -73,8 +460,22 @@ int AddConnection(struct sockaddr_in* address)
     newConnection->port = address->sin_port;
     newConnection->status = CONNECTION_STATUS_PENDING;
     newConnection->id = random() % 10000000;
-    newConnection->sequence = 0;
-    newConnection->packetList = NULL;
+    ReceiveWindowInitialize(&newConnection->window, windowSize, 0);
+    newConnection->partialFrames = NULL;
+    newConnection->bufferedBytes = 0;
+    newConnection->frameSize = frameSize;
+    newConnection->integrity = integrity;
+    newConnection->fecGroupSize = fecGroupSize;
+    newConnection->fecParityCount = fecParityCount;
+    newConnection->fecGroups = NULL;
+    newConnection->codec = CODEC_NONE;
+    newConnection->transferID = 0;
+    newConnection->resumeFiles = 0;
+    newConnection->resumeOffset = 0;
+    newConnection->signatureJob = NULL;
+    newConnection->sharedRing = NULL;
+    newConnection->joinKey = ((unsigned int) random() << 16) ^ (unsigned int) random();
+    newConnection->subflowCount = 0;
     newConnection->next = NULL;
 
     connection* lastConnection = connectionList;
@@ -86,7 +487,9 @@ int AddConnection(struct sockaddr_in* address)
             lastConnection = lastConnection->next;
         lastConnection->next = newConnection;
     }
+    connectionCount++;
 
+    SizeReceiveBufferForConnections();
     return 1;
 }
 
@@ -101,127 +504,1342 @@ connection* FindConnection(const struct sockaddr_in* socketAddress)
         if (lastConnection->address == socketAddress->sin_addr.s_addr &&
             lastConnection->port == socketAddress->sin_port)
             return lastConnection;
+        for (int i = 0; i < lastConnection->subflowCount; i++)
+        {
+            if (lastConnection->subflows[i].address == socketAddress->sin_addr.s_addr &&
+                lastConnection->subflows[i].port == socketAddress->sin_port)
+                return lastConnection;
+        }
         lastConnection = lastConnection->next;
     }
     return NULL;
 }
 
+// Lets go of a connection's signature job. One that is still being hashed is left for its thread to free.
+
+void ReleaseSignatureJob(signatureJob* job)
+{
+    if (job == NULL)
+        return;
+    pthread_mutex_lock(&signatureMutex);
+    int hashing = (job->state == SIGNATURE_HASHING);
+    job->abandoned = 1;
+    pthread_mutex_unlock(&signatureMutex);
+    if (!hashing)
+    {
+        FreeSignature(&job->signature);
+        free(job);
+    }
+}
+
 int RemoveConnectionByID(int id)
 {
-    connection* lastConnection = connectionList;
-    if (lastConnection == NULL)
+    connection** link = &connectionList;
+    while (*link != NULL)
+    {
+        if ((*link)->id == id)
+        {
+            connection* removedConnection = *link;
+            *link = removedConnection->next;
+            receiveWindow* window = &removedConnection->window;
+            for (int offset = 0; offset <= window->windowSize; offset++)
+            {
+                bufferedFrame* frame = ReceiveWindowFrame(window, window->expected + offset);
+                if (frame == NULL)
+                    continue;
+                ReleaseDatagram(&processedFreeRing, frame->datagram);
+                free(frame);
+            }
+            while (removedConnection->partialFrames != NULL)
+            {
+                partialFrame* nextFrame = removedConnection->partialFrames->next;
+                free(removedConnection->partialFrames->datagram);
+                free(removedConnection->partialFrames);
+                removedConnection->partialFrames = nextFrame;
+            }
+            while (removedConnection->fecGroups != NULL)
+            {
+                fecGroup* nextGroup = removedConnection->fecGroups->next;
+                for (int i = 0; i < MAX_FEC_PARITY_COUNT; i++)
+                    FecParityFree(&removedConnection->fecGroups->classes[i]);
+                free(removedConnection->fecGroups);
+                removedConnection->fecGroups = nextGroup;
+            }
+            ReleaseSignatureJob(removedConnection->signatureJob);
+            if (removedConnection->sharedRing != NULL)
+                atomic_store_explicit(&removedConnection->sharedRing->detached, 1, memory_order_release);
+            atomic_fetch_sub(&reorderMemoryUsed, removedConnection->bufferedBytes);
+            connectionCount--;
+            memset(removedConnection, 0, sizeof(connection));
+            free(removedConnection);
+            return 1;
+        }
+        link = &((*link)->next);
+    }
+    return 0;
+}
+
+// Opens the file the connection is currently writing to. That is "./received/<id>", or
+// "./received/<id>/<name>" once the sender has named a file with CONTROL_NEXTFILE. The mode is fopen()'s, "w" for a
+// file that is starting over and "a" for one that is being written on.
+
+FILE* OpenConnectionFile(const connectionOutput* output, const char* mode)
+{
+    FILE* file;
+    char* fileName;
+    fileName = malloc(50 + CONTROL_FILENAME_LENGTH);
+    mkdir("received", 0777);
+    if (output->fileName[0] == '\0')
+        sprintf(fileName, "./received/%d", output->id);
+    else
+    {
+        sprintf(fileName, "./received/%d", output->id);
+        mkdir(fileName, 0777);
+        sprintf(fileName, "./received/%d/%s", output->id, output->fileName);
+    }
+    if ((file = fopen(fileName, mode)) == NULL)
+    {
+        CRASHWITHERROR("Couldn't open file to write");
+    }
+    free(fileName);
+    return file;
+}
+
+void JournalPath(char* path, unsigned int transferID)
+{
+    sprintf(path, "./received/.transfer-%08x", transferID);
+}
+
+// Reads the current slot of a transfer's journal. Returns 1 if there is one, 0 if the transfer is new.
+
+int ReadJournal(unsigned int transferID, transferJournal* journal)
+{
+    char path[64];
+    JournalPath(path, transferID);
+    int journalFile;
+    if ((journalFile = open(path, O_RDONLY)) == -1)
+        return 0;
+
+    int found = 0;
+    for (int slot = 0; slot < 2; slot++)
+    {
+        transferJournal candidate;
+        if (pread(journalFile, &candidate, sizeof(candidate), slot * sizeof(candidate)) == sizeof(candidate) &&
+            candidate.magic == JOURNAL_MAGIC && candidate.transferID == transferID &&
+            candidate.crc == Crc32c(0, &candidate, offsetof(transferJournal, crc)) &&
+            (!found || candidate.generation > journal->generation))
+        {
+            candidate.fileName[CONTROL_FILENAME_LENGTH] = '\0';
+            *journal = candidate;
+            found = 1;
+        }
+    }
+    close(journalFile);
+    return found;
+}
+
+// Makes what has been written to the current file durable, then records it in the journal's older slot
+
+void WriteJournal(connectionOutput* output)
+{
+    transferJournal* journal = &output->journalState;
+    if (output->file != NULL && (fflush(output->file) == EOF || fsync(fileno(output->file)) == -1))
+    { // The last journal entry still says how much is on disk for sure
+        DEBUGMESSAGE(0, YELTEXT("WARNING: ")"Couldn't sync '%s', not updating the journal of transfer %08x",
+                     output->fileName, journal->transferID);
+        return;
+    }
+    journal->generation++;
+    journal->crc = Crc32c(0, journal, offsetof(transferJournal, crc));
+    if (pwrite(output->journal, journal, sizeof(transferJournal), (journal->generation % 2) * sizeof(transferJournal)) !=
+        sizeof(transferJournal) || fdatasync(output->journal) == -1)
+    {
+        DEBUGMESSAGE(0, YELTEXT("WARNING: ")"Couldn't update the journal of transfer %08x", journal->transferID);
+    }
+    output->unsyncedBytes = 0;
+}
+
+int CopyPacket(const packet* src, packet* dest)
+{
+    dest->flags = src->flags;
+    dest->sequenceNumber = src->sequenceNumber;
+    dest->dataLength = src->dataLength;
+    dest->checksum = src->checksum;
+    for (int i = 0; i < src->dataLength; i++)
+        dest->data[i] = src->data[i];
+    return 1; // should return something else on fail but, uh, checking for fail in a simple function like this seems weird to do
+}
+
+// Keeps a copy of an out-of-order datagram in the connection's reorder buffer. The copy is only as large as the
+// packet in it, so a buffer full of small frames doesn't take up 64 kB per frame.
+// Returns 1 if it was stored, 0 if it doesn't fit in the connection's share of the reorder budget and -1 on error.
+
+int StoreBufferedData(connection* clientConnection, const receivedDatagram* datagramToStore)
+{
+    const packet* packetToStore = &datagramToStore->packet;
+    long cost = ReorderMemoryCost(packetToStore->dataLength);
+    if (!ReorderMemoryFits(clientConnection, cost))
         return 0;
 
-    while (lastConnection->next != NULL)
+    bufferedFrame* newFrame;
+    if ((newFrame = malloc(sizeof(bufferedFrame))) == NULL)
+    {
+        DEBUGMESSAGE(0, "StoreBufferedData malloc() failed");
+        return -1;
+    }
+    size_t datagramSize = CompactDatagramSize(packetToStore->dataLength);
+    if ((newFrame->datagram = malloc(datagramSize)) == NULL)
+    {
+        DEBUGMESSAGE(0, "StoreBufferedData malloc() failed");
+        free(newFrame);
+        return -1;
+    }
+    memcpy(newFrame->datagram, datagramToStore, datagramSize);
+    newFrame->datagram->compact = 1;
+    newFrame->delivered = 0;
+    ReceiveWindowStore(&clientConnection->window, packetToStore->sequenceNumber, newFrame);
+    ChargeReorderMemory(clientConnection, cost);
+    return 1;
+}
+
+// Takes the frame the connection expects next out of its reorder buffer, NULL if it isn't there
+
+bufferedFrame* RetrieveBufferedData(connection* clientConnection)
+{
+    bufferedFrame* frame = ReceiveWindowTakeNext(&clientConnection->window);
+    if (frame != NULL)
+        RefundReorderMemory(clientConnection, ReorderMemoryCost(frame->datagram->packet.dataLength));
+    return frame;
+}
+
+// Turns a file name from the sender into one that is safe to create in the connection's directory
+
+void SanitizeFileName(char* fileName, const byte* name, int nameLength)
+{
+    if (nameLength > CONTROL_FILENAME_LENGTH)
+        nameLength = CONTROL_FILENAME_LENGTH;
+    memcpy(fileName, name, nameLength);
+    fileName[nameLength] = '\0';
+
+    // Only keep the base name, a sender shouldn't be able to write outside of its own directory
+    for (int i = 0; i < nameLength; i++)
+    {
+        if (fileName[i] == '/')
+            fileName[i] = '_';
+    }
+    if (strcmp(fileName, ".") == 0 || strcmp(fileName, "..") == 0 || fileName[0] == '\0')
+        strcpy(fileName, "_");
+}
+
+// Closes the files a connection is writing to and reading from
+
+void CloseOutputFiles(connectionOutput* output)
+{
+    if (output->file != NULL)
+    {
+        if (output->journal != -1)
+            fsync(fileno(output->file)); // The journal is about to say the file is done
+        fclose(output->file);
+        output->file = NULL;
+    }
+    if (output->basis != NULL)
+    {
+        fclose(output->basis);
+        output->basis = NULL;
+    }
+    if (output->stripeFile != -1)
+    {
+        close(output->stripeFile);
+        output->stripeFile = -1;
+    }
+}
+
+// Returns 1 if the connection has already started a file of that name
+
+int FileStarted(int id, const char* fileName)
+{
+    for (startedFile* cursor = startedFiles; cursor != NULL; cursor = cursor->next)
+    {
+        if (cursor->id == id && strcmp(cursor->fileName, fileName) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Remembers the name of a file the connection writes to. A name it has used before gets ".1", ".2" and so on added,
+// so that files with the same base name from different directories don't overwrite each other.
+
+void ClaimFileName(connectionOutput* output)
+{
+    char baseName[CONTROL_FILENAME_LENGTH + 1];
+    strcpy(baseName, output->fileName);
+    for (int copy = 1; FileStarted(output->id, output->fileName); copy++)
+    {
+        char suffix[16];
+        int suffixLength = sprintf(suffix, ".%d", copy);
+        snprintf(output->fileName, sizeof(output->fileName), "%.*s%s", CONTROL_FILENAME_LENGTH - suffixLength,
+                 baseName, suffix);
+    }
+    if (strcmp(baseName, output->fileName) != 0)
+    {
+        DEBUGMESSAGE(0, YELTEXT("WARNING: ")"Connection %d already wrote a file named '%s', writing to '%s' instead",
+                     output->id, baseName, output->fileName);
+    }
+
+    startedFile* newFile;
+    if ((newFile = malloc(sizeof(startedFile))) == NULL)
+    {
+        CRASHWITHERROR("ClaimFileName() malloc failed");
+    }
+    newFile->id = output->id;
+    strcpy(newFile->fileName, output->fileName);
+    newFile->next = startedFiles;
+    startedFiles = newFile;
+}
+
+// Closes the file being written and starts writing to a new one, for CONTROL_NEXTFILE and CONTROL_DELTAFILE. The new
+// file starts out empty, whatever an earlier transfer or a transfer that died left under its name.
+
+void StartFile(connectionOutput* output, const byte* name, int nameLength)
+{
+    CloseOutputFiles(output);
+    SanitizeFileName(output->fileName, name, nameLength);
+    ClaimFileName(output);
+
+    DEBUGMESSAGE(1, GRNTEXT("Connection %d now writing to file '%s'"), output->id, output->fileName);
+    output->file = OpenConnectionFile(output, "w"); // Make sure empty files get created too
+    if (output->journal != -1)
+    {
+        output->journalState.filesStarted++;
+        output->journalState.offset = 0;
+        strcpy(output->journalState.fileName, output->fileName);
+        WriteJournal(output);
+    }
+}
+
+// Appends data to the file being written and keeps the journal up with it
+
+void WriteOutput(connectionOutput* output, const byte* data, int length)
+{
+    if (output->stripeFile != -1)
+    { // Stripes are written as they are, at their place in the file
+        if (pwrite(output->stripeFile, data, length, output->stripeOffset) != length)
+        {
+            DEBUGMESSAGE(0, YELTEXT("WARNING: ")"Couldn't write stripe %d of '%s'", output->stripeIndex,
+                         output->fileName);
+        }
+        output->stripeOffset += length;
+        atomic_fetch_add_explicit(&bytesWritten, length, memory_order_relaxed);
+        return;
+    }
+    if (output->file == NULL)
+        output->file = OpenConnectionFile(output, "a");
+    size_t written = fwrite(data, 1, length, output->file);
+    if (written != (size_t) length)
+    {
+        DEBUGMESSAGE(0, YELTEXT("WARNING: ")"Couldn't write %d bytes to '%s' of connection %d", length - (int) written,
+                     output->fileName, output->id);
+    }
+    if (output->journal != -1 && written > 0)
+    {
+        output->journalState.offset += written;
+        output->unsyncedBytes += written;
+        if (output->unsyncedBytes >= JOURNAL_SYNC_INTERVAL)
+            WriteJournal(output);
+    }
+    atomic_fetch_add_explicit(&bytesWritten, length, memory_order_relaxed);
+}
+
+// Starts writing one stripe of a file, for CONTROL_STRIPE. Every stripe makes sure the file has its full size, so
+// that the stripes can be written in any order.
+
+void StartStripe(connectionOutput* output, const packet* controlPacket)
+{
+    unsigned int group;
+    unsigned long long fileSize, start;
+    memcpy(&group, controlPacket->data + 1, 4);
+    memcpy(&fileSize, controlPacket->data + 7, 8);
+    memcpy(&start, controlPacket->data + 15, 8);
+    group = ntohl(group);
+    fileSize = be64toh(fileSize);
+    start = be64toh(start);
+    int index = controlPacket->data[5];
+    int count = controlPacket->data[6];
+    if (group < STRIPE_GROUP_MIN || count > MAX_STRIPES || index >= count || start > fileSize)
+    {
+        DEBUGMESSAGE(0, YELTEXT("WARNING: ")"Connection %d sent a stripe that makes no sense, ignoring it", output->id);
+        return;
+    }
+
+    CloseOutputFiles(output);
+    SanitizeFileName(output->fileName, controlPacket->data + STRIPE_HEADER_LENGTH,
+                     controlPacket->dataLength - STRIPE_HEADER_LENGTH);
+    output->stripeGroup = group;
+    output->stripeIndex = index;
+    output->stripeCount = count;
+    output->stripeOffset = start;
+
+    char fileName[50 + CONTROL_FILENAME_LENGTH];
+    struct stat fileStatus;
+    mkdir("received", 0777);
+    sprintf(fileName, "./received/%u", group);
+    mkdir(fileName, 0777);
+    sprintf(fileName, "./received/%u/%s", group, output->fileName);
+    if ((output->stripeFile = open(fileName, O_WRONLY | O_CREAT, 0644)) == -1)
+    {
+        CRASHWITHERROR("Couldn't open file to write");
+    }
+    if (fstat(output->stripeFile, &fileStatus) == 0 && fileStatus.st_size < (long long) fileSize &&
+        ftruncate(output->stripeFile, fileSize) == -1)
+    {
+        DEBUGMESSAGE(0, YELTEXT("WARNING: ")"Couldn't size '%s'", fileName);
+    }
+    DEBUGMESSAGE(1, GRNTEXT("Connection %d writing stripe %d of %d of '%s' from byte %llu"), output->id, index + 1,
+                 count, fileName, start);
+}
+
+// Opens the basis a CONTROL_DELTAFILE frame says the new file is built from. The receiver only ever appends to
+// its files, so a basis that grew since it was hashed still has the blocks the sender refers to.
+
+void OpenBasis(connectionOutput* output, const packet* controlPacket)
+{
+    int basisID;
+    unsigned long long basisSize;
+    memcpy(&basisID, controlPacket->data + 1, 4);
+    memcpy(&basisSize, controlPacket->data + 5, 8);
+    basisID = ntohl(basisID);
+    basisSize = be64toh(basisSize);
+
+    char basisName[50 + CONTROL_FILENAME_LENGTH];
+    struct stat basisStatus;
+    sprintf(basisName, "./received/%d/%s", basisID, output->fileName);
+    if ((output->basis = fopen(basisName, "rb")) == NULL || fstat(fileno(output->basis), &basisStatus) == -1 ||
+        basisStatus.st_size < (long long) basisSize)
+    {
+        DEBUGMESSAGE(0, YELTEXT("WARNING: ")"Basis '%s' of '%s' is gone or shorter than it was, the file will be "
+                     "missing the parts copied from it", basisName, output->fileName);
+    }
+    else
     {
-        if (lastConnection->next->id == id)
+        DEBUGMESSAGE(1, GRNTEXT("Connection %d builds '%s' from '%s'"), output->id, output->fileName, basisName);
+    }
+}
+
+// Copies the ranges of a CONTROL_COPY frame from the basis to the file being written
+
+void CopyFromBasis(connectionOutput* output, const packet* controlPacket)
+{
+    static byte copyBuffer[DATA_BUFFER_SIZE];
+    for (int entry = 1; entry + DELTA_COPY_LENGTH <= controlPacket->dataLength; entry += DELTA_COPY_LENGTH)
+    {
+        unsigned long long basisOffset;
+        unsigned int length;
+        memcpy(&basisOffset, controlPacket->data + entry, 8);
+        memcpy(&length, controlPacket->data + entry + 8, 4);
+        basisOffset = be64toh(basisOffset);
+        length = ntohl(length);
+        if (output->basis == NULL || fseeko(output->basis, basisOffset, SEEK_SET) == -1)
+            continue;
+        while (length > 0)
         {
-            connection* nextInLine = lastConnection->next->next;
-            memset(lastConnection->next, 0, sizeof(connection));
-            free(lastConnection->next);
-            lastConnection->next = nextInLine;
+            size_t bytesRead = fread(copyBuffer, 1, length < sizeof(copyBuffer) ? length : sizeof(copyBuffer),
+                                     output->basis);
+            if (bytesRead == 0)
+                break;
+            WriteOutput(output, copyBuffer, bytesRead);
+            length -= bytesRead;
+        }
+    }
+}
+
+// Handles an in-sequence CONTROL frame. Returns 1 if the opcode was understood, 0 otherwise.
+
+int HandleControlFrame(connectionOutput* output, const packet* controlPacket)
+{
+    if (controlPacket->dataLength < 1)
+        return 0;
+
+    switch (controlPacket->data[0])
+    {
+        case CONTROL_NEXTFILE:
+            StartFile(output, controlPacket->data + 1, controlPacket->dataLength - 1);
             return 1;
+        case CONTROL_DELTAFILE:
+            if (controlPacket->dataLength < DELTA_FILE_HEADER_LENGTH)
+                return 0;
+            StartFile(output, controlPacket->data + DELTA_FILE_HEADER_LENGTH,
+                      controlPacket->dataLength - DELTA_FILE_HEADER_LENGTH);
+            OpenBasis(output, controlPacket);
+            return 1;
+        case CONTROL_COPY:
+            CopyFromBasis(output, controlPacket);
+            return 1;
+        case CONTROL_STRIPE:
+            if (controlPacket->dataLength < STRIPE_HEADER_LENGTH)
+                return 0;
+            StartStripe(output, controlPacket);
+            return 1;
+        case CONTROL_FRAMESIZE:
+            return 1; // Already acted on by the processing stage when it was delivered
+        default:
+            DEBUGMESSAGE(1, YELTEXT("WARNING: ")"Unknown control opcode %d", controlPacket->data[0]);
+            return 0;
+    }
+}
+
+// Finds the writer's state for a stream of a connection, creating it the first time the stream has something to write
+
+connectionOutput* FindOutput(int id, int stream)
+{
+    for (connectionOutput* cursor = outputList; cursor != NULL; cursor = cursor->next)
+    {
+        if (cursor->id == id && cursor->stream == stream)
+            return cursor;
+    }
+
+    connectionOutput* newOutput;
+    if ((newOutput = calloc(1, sizeof(connectionOutput))) == NULL)
+    {
+        CRASHWITHERROR("FindOutput() calloc failed");
+    }
+    newOutput->id = id;
+    newOutput->stream = stream;
+    newOutput->journal = -1;
+    newOutput->stripeFile = -1;
+    newOutput->next = outputList;
+    outputList = newOutput;
+    return newOutput;
+}
+
+// Forgets the writer's state for every stream of a connection
+
+void RemoveOutput(int id)
+{
+    connectionOutput** link = &outputList;
+    while (*link != NULL)
+    {
+        if ((*link)->id == id)
+        {
+            connectionOutput* removedOutput = *link;
+            *link = removedOutput->next;
+            if (removedOutput->file != NULL)
+                fclose(removedOutput->file);
+            if (removedOutput->journal != -1)
+                close(removedOutput->journal);
+            if (removedOutput->basis != NULL)
+                fclose(removedOutput->basis);
+            if (removedOutput->stripeFile != -1)
+                close(removedOutput->stripeFile);
+            free(removedOutput);
+            continue;
+        }
+        link = &((*link)->next);
+    }
+    startedFile** fileLink = &startedFiles;
+    while (*fileLink != NULL)
+    {
+        if ((*fileLink)->id == id)
+        {
+            startedFile* removedFile = *fileLink;
+            *fileLink = removedFile->next;
+            free(removedFile);
+            continue;
+        }
+        fileLink = &((*fileLink)->next);
+    }
+}
+
+// Switches the connection to the frame size in a CONTROL_FRAMESIZE frame. Only called once the frame is in order,
+// so every frame before it was sent with the old size and every frame after it with the new one.
+
+void ChangeFrameSize(connection* clientConnection, const packet* controlPacket)
+{
+    unsigned short newFrameSize;
+    if (controlPacket->dataLength < 3)
+        return;
+    memcpy(&newFrameSize, controlPacket->data + 1, 2);
+    newFrameSize = ntohs(newFrameSize);
+    if (newFrameSize < MIN_ACCEPTED_FRAME_SIZE || newFrameSize > MAX_ACCEPTED_FRAME_SIZE)
+    {
+        DEBUGMESSAGE(1, YELTEXT("WARNING: ")"Connection %d asked for frame size %d, keeping %d", clientConnection->id,
+                     newFrameSize, clientConnection->frameSize);
+        return;
+    }
+    DEBUGMESSAGE(1, GRNTEXT("Connection %d changes frame size from %d to %d at sequence %d"), clientConnection->id,
+                 clientConnection->frameSize, newFrameSize, controlPacket->sequenceNumber);
+    clientConnection->frameSize = newFrameSize;
+    SizeReceiveBufferForConnections();
+}
+
+// Passes an in-order datagram on to the writer stage, which writes its data or acts on its control frame
+
+void DeliverPacket(connection* clientConnection, receivedDatagram* datagramToDeliver)
+{
+    const packet* deliveredPacket = &datagramToDeliver->packet;
+    if (deliveredPacket->flags == PACKETFLAG_CONTROL && deliveredPacket->dataLength >= 1 &&
+        deliveredPacket->data[0] == CONTROL_FRAMESIZE)
+        ChangeFrameSize(clientConnection, deliveredPacket);
+
+    if (deliveredPacket->stream != 0)
+        clientConnection->streamSequences[deliveredPacket->stream]++;
+    datagramToDeliver->connectionID = clientConnection->id;
+    SpscRingPush(&writeRing, datagramToDeliver);
+}
+
+// Hands every buffered frame whose stream has all the frames before it to the writer stage, ahead of the frames of
+// other streams still missing in front of it. The frames of a stream are buffered in the order of their stream
+// sequences, so one pass finds them all. What stays in the reorder buffer is the header, which keeps the frame's
+// place until the connection's own sequence gets to it.
+
+void DeliverStreamFrames(connection* clientConnection)
+{
+    receiveWindow* window = &clientConnection->window;
+    int found = 0;
+    for (int offset = 1; offset <= window->windowSize && found < window->bufferedFrames; offset++)
+    {
+        bufferedFrame* cursor = ReceiveWindowFrame(window, window->expected + offset);
+        if (cursor == NULL)
+            continue;
+        found++;
+        const packet* bufferedPacket = &cursor->datagram->packet;
+        if (cursor->delivered || bufferedPacket->stream == 0 ||
+            bufferedPacket->streamSequence != clientConnection->streamSequences[bufferedPacket->stream])
+            continue;
+
+        receivedDatagram* placeholder;
+        if ((placeholder = malloc(CompactDatagramSize(0))) == NULL)
+        {
+            DEBUGMESSAGE(0, "DeliverStreamFrames malloc() failed");
+            return;
+        }
+        memcpy(placeholder, cursor->datagram, CompactDatagramSize(0));
+        placeholder->packet.dataLength = 0;
+        DEBUGMESSAGE(2, "Delivering sequence %d of stream %d ahead of sequence %d", bufferedPacket->sequenceNumber,
+                     bufferedPacket->stream, window->expected);
+        RefundReorderMemory(clientConnection, ReorderMemoryCost(bufferedPacket->dataLength) - ReorderMemoryCost(0));
+        clientConnection->streamSequences[bufferedPacket->stream]++;
+        cursor->datagram->connectionID = clientConnection->id;
+        SpscRingPush(&writeRing, cursor->datagram);
+        cursor->datagram = placeholder;
+        cursor->delivered = 1;
+        atomic_fetch_add_explicit(&framesAheadOfSequence, 1, memory_order_relaxed);
+    }
+}
+
+// How many frames, counting from the next one it expects, the connection has room for. That's the next frame itself,
+// plus the reorder buffer, capped by what still fits in the socket buffer, in the writer stage's queue and in the
+// connection's share of the reorder budget. A slow disk thereby slows the sender down instead of making the kernel
+// drop datagrams.
+
+int AdvertisedWindow(const connection* clientConnection)
+{
+    int room = SocketReceiveBufferFree(socket_fd) /
+               FrameSocketBufferCost(clientConnection->frameSize, DEFAULT_PATH_MTU);
+    int writerSpace = (int) (writeRing.capacity - SpscRingDepth(&writeRing)) - 1;
+    if (writerSpace < room)
+        room = writerSpace;
+    long budgetFrames = (ReorderMemoryShare() - clientConnection->bufferedBytes) /
+                        ReorderMemoryCost(clientConnection->frameSize);
+    if (budgetFrames < room)
+        room = budgetFrames > 0 ? (int) budgetFrames : 0;
+    return ReceiveWindowAdvertised(&clientConnection->window, room);
+}
+
+// ACKs a data packet, advertising the connection's current receive window along with it. A frame that is only
+// partly in is ACKed with a bitmap of the fragments we have instead (fragmentsReceived), 0 ACKs the whole frame.
+
+void SendACK(const connection* clientConnection, unsigned short sequence, unsigned long long fragmentsReceived,
+             struct sockaddr_in* senderAddress, unsigned int senderAddressLength)
+{
+    byte windowData[ACK_FRAGMENTS_DATA_LENGTH];
+    unsigned short nextExpected = htons(clientConnection->window.expected);
+    unsigned short advertisedWindow = htons(AdvertisedWindow(clientConnection));
+    memcpy(windowData, &nextExpected, 2);
+    memcpy(windowData + 2, &advertisedWindow, 2);
+    int dataLength = ACK_WINDOW_DATA_LENGTH;
+    if (fragmentsReceived != 0)
+    {
+        unsigned long long fragmentBits = htobe64(fragmentsReceived);
+        memcpy(windowData + ACK_WINDOW_DATA_LENGTH, &fragmentBits, 8);
+        dataLength = ACK_FRAGMENTS_DATA_LENGTH;
+    }
+
+    packet packetToSend;
+    memset(&packetToSend, 0, PACKET_HEADER_LENGTH);
+    WritePacket(&packetToSend, PACKETFLAG_ACK, windowData, dataLength, sequence);
+    packetToSend.integrity = clientConnection->integrity;
+    SendPacket(socket_fd, &packetToSend, senderAddress, senderAddressLength);
+    atomic_fetch_add_explicit(&acksSent, 1, memory_order_relaxed);
+}
+
+// Copies a fragment into the frame it belongs to. Returns the whole frame once its last missing fragment is in, and
+// NULL while pieces are still missing or if the fragment had to be dropped. Once the sender is through with its
+// first round (the last fragment is in), every fragment we get is ACKed with what we have, so that only the missing
+// ones get resent.
+
+receivedDatagram* AddFragment(connection* clientConnection, const receivedDatagram* fragment,
+                              struct sockaddr_in* senderAddress, unsigned int senderAddressLength)
+{
+    const packet* fragmentPacket = &fragment->packet;
+    if (fragmentPacket->fragmentCount > MAX_FRAGMENTS || fragmentPacket->fragmentIndex >= fragmentPacket->fragmentCount ||
+        fragmentPacket->dataLength > fragmentPacket->fragmentSize ||
+        (fragmentPacket->fragmentIndex < fragmentPacket->fragmentCount - 1 &&
+         fragmentPacket->dataLength != fragmentPacket->fragmentSize) ||
+        fragmentPacket->fragmentSize * (fragmentPacket->fragmentCount - 1) +
+        (fragmentPacket->fragmentIndex == fragmentPacket->fragmentCount - 1 ? fragmentPacket->dataLength : 1) >
+        DATA_BUFFER_SIZE) // Only the last fragment tells how long the frame is
+    {
+        DEBUGMESSAGE(1, YELTEXT("WARNING: ")"Malformed fragment %d/%d of sequence %d", fragmentPacket->fragmentIndex,
+                     fragmentPacket->fragmentCount, fragmentPacket->sequenceNumber);
+        return NULL;
+    }
+
+    partialFrame** link = &clientConnection->partialFrames;
+    while (*link != NULL && ((*link)->sequence != fragmentPacket->sequenceNumber ||
+                             (*link)->datagram->packet.flags != fragmentPacket->flags))
+        link = &((*link)->next); // A PARITY frame shares its sequence number with a data frame
+    partialFrame* frame = *link;
+
+    if (frame == NULL)
+    {
+        size_t datagramSize = CompactDatagramSize(fragmentPacket->fragmentSize * fragmentPacket->fragmentCount);
+        long cost = sizeof(partialFrame) + datagramSize;
+        if ((fragmentPacket->flags != PACKETFLAG_PARITY &&
+             ReceiveWindowClassify(&clientConnection->window, fragmentPacket->sequenceNumber) ==
+             RECEIVE_WINDOW_BEYOND) ||
+            !ReorderMemoryFits(clientConnection, cost))
+        {
+            DEBUGMESSAGE(1, YELTEXT("WARNING: ")"No room for fragments of sequence %d, dropping them",
+                         fragmentPacket->sequenceNumber);
+            atomic_fetch_add_explicit(&framesOverBudget, 1, memory_order_relaxed);
+            return NULL;
         }
+        if ((frame = calloc(1, sizeof(partialFrame))) == NULL || (frame->datagram = malloc(datagramSize)) == NULL)
+        {
+            DEBUGMESSAGE(0, "AddFragment malloc() failed");
+            free(frame);
+            return NULL;
+        }
+        memcpy(frame->datagram, fragment, offsetof(receivedDatagram, packet) + PACKET_HEADER_LENGTH);
+        frame->datagram->compact = 1;
+        frame->sequence = fragmentPacket->sequenceNumber;
+        frame->fragmentCount = fragmentPacket->fragmentCount;
+        frame->fragmentSize = fragmentPacket->fragmentSize;
+        frame->cost = cost;
+        ChargeReorderMemory(clientConnection, cost);
+        frame->next = clientConnection->partialFrames;
+        clientConnection->partialFrames = frame;
+        link = &clientConnection->partialFrames;
+    }
+    else if (frame->fragmentCount != fragmentPacket->fragmentCount ||
+             frame->fragmentSize != fragmentPacket->fragmentSize)
+    {
+        DEBUGMESSAGE(1, YELTEXT("WARNING: ")"Fragment of sequence %d doesn't match the ones before it",
+                     fragmentPacket->sequenceNumber);
+        return NULL;
+    }
+
+    unsigned long long fragmentBit = 1ull << fragmentPacket->fragmentIndex;
+    if ((frame->fragmentsReceived & fragmentBit) == 0)
+    {
+        memcpy(frame->datagram->packet.data + fragmentPacket->fragmentIndex * frame->fragmentSize,
+               fragmentPacket->data, fragmentPacket->dataLength);
+        frame->fragmentsReceived |= fragmentBit;
+        if (fragmentPacket->fragmentIndex == frame->fragmentCount - 1)
+            frame->datagram->packet.dataLength = fragmentPacket->fragmentIndex * frame->fragmentSize +
+                                                 fragmentPacket->dataLength;
     }
+
+    unsigned long long allFragments = frame->fragmentCount == 64 ? ~0ull : (1ull << frame->fragmentCount) - 1;
+    if (frame->fragmentsReceived == allFragments)
+    {
+        receivedDatagram* wholeFrame = frame->datagram;
+        DEBUGMESSAGE(2, "Sequence %d put together from %d fragments", frame->sequence, frame->fragmentCount);
+        wholeFrame->packet.fragmentIndex = 0;
+        wholeFrame->packet.fragmentCount = 1;
+        wholeFrame->packet.fragmentSize = wholeFrame->packet.dataLength;
+        *link = frame->next;
+        RefundReorderMemory(clientConnection, frame->cost);
+        free(frame);
+        return wholeFrame;
+    }
+    if ((frame->fragmentsReceived & (1ull << (frame->fragmentCount - 1))) && fragmentPacket->flags != PACKETFLAG_PARITY)
+        SendACK(clientConnection, frame->sequence, frame->fragmentsReceived, senderAddress, senderAddressLength);
+    return NULL;
+}
+
+// Forgets the fragments collected for a frame, once it has turned up some other way
+
+void DropPartialFrame(connection* clientConnection, unsigned short sequence, byte flags)
+{
+    for (partialFrame** link = &clientConnection->partialFrames; *link != NULL; link = &((*link)->next))
+    {
+        partialFrame* frame = *link;
+        if (frame->sequence == sequence && frame->datagram->packet.flags == flags)
+        {
+            *link = frame->next;
+            RefundReorderMemory(clientConnection, frame->cost);
+            free(frame->datagram);
+            free(frame);
+            return;
+        }
+    }
+}
+
+// Sequence number of the first frame of the FEC group a frame belongs to
+
+unsigned short FecGroupBase(const connection* clientConnection, unsigned short sequence)
+{
+    return sequence & ~(clientConnection->fecGroupSize - 1);
+}
+
+// Finds the FEC state of the group starting at 'base', creating it if asked to and if the reorder budget allows.
+// Returns NULL if there is none.
+
+fecGroup* FindFecGroup(connection* clientConnection, unsigned short base, int create)
+{
+    for (fecGroup* cursor = clientConnection->fecGroups; cursor != NULL; cursor = cursor->next)
+    {
+        if (cursor->base == base)
+            return cursor;
+    }
+    if (!create || !ReorderMemoryFits(clientConnection, sizeof(fecGroup)))
+        return NULL;
+
+    fecGroup* newGroup;
+    if ((newGroup = calloc(1, sizeof(fecGroup))) == NULL)
+    {
+        DEBUGMESSAGE(0, "FindFecGroup() calloc failed");
+        return NULL;
+    }
+    newGroup->base = base;
+    newGroup->cost = sizeof(fecGroup);
+    ChargeReorderMemory(clientConnection, newGroup->cost);
+    newGroup->next = clientConnection->fecGroups;
+    clientConnection->fecGroups = newGroup;
+    return newGroup;
+}
+
+// XORs a frame or a PARITY packet into a class of its group, charging the reorder budget for whatever the class has
+// to grow by. Returns 0, or -1 if it couldn't be added.
+
+int AddToFecClass(connection* clientConnection, fecGroup* group, int parityClass, const packet* addedPacket)
+{
+    fecParity* parity = &group->classes[parityClass];
+    int length = addedPacket->dataLength;
+    if (addedPacket->flags == PACKETFLAG_PARITY)
+        length -= FEC_PARITY_HEADER_LENGTH;
+    long growth = length > parity->capacity ? length - parity->capacity : 0;
+    if (growth > 0 && !ReorderMemoryFits(clientConnection, growth))
+        return -1;
+
+    int retval = addedPacket->flags == PACKETFLAG_PARITY ? FecParityAddParity(parity, addedPacket) :
+                 FecParityAdd(parity, addedPacket);
+    if (retval == -1)
+        return -1;
+    group->cost += growth;
+    ChargeReorderMemory(clientConnection, growth);
     return 0;
 }
 
-FILE* OpenConnectionFile(connection* clientConnection)
+// Called for every data frame the connection takes in for the first time. A frame that can't be added is simply left
+// out, the class then never counts as missing just one frame and nothing is rebuilt from it.
+
+void FecFrameAccepted(connection* clientConnection, const packet* acceptedPacket)
+{
+    if (clientConnection->fecGroupSize == 0)
+        return;
+    unsigned short base = FecGroupBase(clientConnection, acceptedPacket->sequenceNumber);
+    int offset = (unsigned short) (acceptedPacket->sequenceNumber - base);
+    fecGroup* group = FindFecGroup(clientConnection, base, 1);
+    if (group == NULL || (group->framesIn & (1u << offset)))
+        return;
+    if (AddToFecClass(clientConnection, group, offset % clientConnection->fecParityCount, acceptedPacket) == 0)
+        group->framesIn |= 1u << offset;
+}
+
+// Whether a PARITY packet numbered 'sequence' can still be of use: its group isn't all in yet and isn't so far
+// ahead that the sender couldn't have sent it.
+
+int FecParityWanted(const connection* clientConnection, unsigned short sequence)
+{
+    if (clientConnection->fecGroupSize == 0)
+        return 0;
+    unsigned short base = FecGroupBase(clientConnection, sequence);
+    return (unsigned short) (sequence - base) < clientConnection->fecParityCount &&
+           SEQUENCE_AFTER(base + clientConnection->fecGroupSize, clientConnection->window.expected) &&
+           !SEQUENCE_AFTER(base, clientConnection->window.expected + clientConnection->window.windowSize);
+}
+
+void FecParityArrived(connection* clientConnection, const packet* parityPacket)
+{
+    unsigned short base = FecGroupBase(clientConnection, parityPacket->sequenceNumber);
+    int parityClass = (unsigned short) (parityPacket->sequenceNumber - base);
+    fecGroup* group = FindFecGroup(clientConnection, base, 1);
+    if (group == NULL || (group->parityIn & (1u << parityClass)))
+        return;
+    if (AddToFecClass(clientConnection, group, parityClass, parityPacket) == 0)
+        group->parityIn |= 1u << parityClass;
+}
+
+// Frees the FEC state of every group that has been delivered in full, along with any of its parity frames that
+// never got all their fragments in
+
+void PruneFecGroups(connection* clientConnection)
+{
+    fecGroup** link = &clientConnection->fecGroups;
+    while (*link != NULL)
+    {
+        fecGroup* group = *link;
+        if (SEQUENCE_AFTER(group->base + clientConnection->fecGroupSize, clientConnection->window.expected))
+        {
+            link = &group->next;
+            continue;
+        }
+        for (int parityClass = 0; parityClass < clientConnection->fecParityCount; parityClass++)
+        {
+            if ((group->parityIn & (1u << parityClass)) == 0)
+                DropPartialFrame(clientConnection, group->base + parityClass, PACKETFLAG_PARITY);
+            FecParityFree(&group->classes[parityClass]);
+        }
+        RefundReorderMemory(clientConnection, group->cost);
+        *link = group->next;
+        free(group);
+    }
+}
+
+// Takes a whole data frame in: delivers it if it is the next one, keeps it in the reorder buffer if it is ahead, and
+// ACKs it. Returns 1 if the connection kept the datagram, 0 if the caller still has to release it.
+
+int AcceptFrame(connection* clientConnection, receivedDatagram* datagram, struct sockaddr_in* senderAddress,
+                unsigned int senderAddressLength)
+{
+    const packet* packetBuffer = &datagram->packet;
+    unsigned short sequenceNumber = packetBuffer->sequenceNumber;
+    int kept = 0;
+
+    if (packetBuffer->stream >= MAX_STREAMS)
+    {
+        DEBUGMESSAGE(1, YELTEXT("WARNING: ")"Sequence %d belongs to stream %d, which can't exist", sequenceNumber,
+                     packetBuffer->stream);
+        return 0;
+    }
+    receiveWindow* window = &clientConnection->window;
+    int place = ReceiveWindowClassify(window, sequenceNumber);
+    if (place == RECEIVE_WINDOW_NEXT)
+    {
+        DEBUGMESSAGE(0, GRNTEXT("Received in-order packet, sequence %d"), sequenceNumber);
+        FecFrameAccepted(clientConnection, packetBuffer);
+        DeliverPacket(clientConnection, datagram);
+        ReceiveWindowDelivered(window);
+        kept = 1;
+
+        if (window->bufferedFrames > 0)
+        {
+            DEBUGMESSAGE(0, YELTEXT("Retrieving buffered data, looking for %d"), window->expected);
+            if (debugLevel == DEBUGLEVEL_REORDER)
+            {
+                printf(YELTEXT("Current packet storage: "));
+                for (int offset = 0; offset <= window->windowSize; offset++)
+                {
+                    if (ReceiveWindowFrame(window, window->expected + offset) != NULL)
+                        printf(YELTEXT("%d "), (unsigned short) (window->expected + offset));
+                }
+                printf("\n");
+            }
+            bufferedFrame* retrievedFrame;
+            while ((retrievedFrame = RetrieveBufferedData(clientConnection)) != NULL)
+            {
+                DEBUGMESSAGE(0, GRNTEXT("Retrieved packet at sequence %d"),
+                             retrievedFrame->datagram->packet.sequenceNumber);
+                if (retrievedFrame->delivered)
+                    free(retrievedFrame->datagram); // Its stream got it already
+                else
+                    DeliverPacket(clientConnection, retrievedFrame->datagram);
+                free(retrievedFrame);
+            }
+        }
+    }
+    else if (place == RECEIVE_WINDOW_BUFFERED)
+    {
+        DEBUGMESSAGE_EXACT(DEBUGLEVEL_REORDER, "Packet with seq %d already in buffer\n", sequenceNumber);
+    }
+    else if (place == RECEIVE_WINDOW_AHEAD && StoreBufferedData(clientConnection, datagram) == 1)
+    {
+        DEBUGMESSAGE(0, YELTEXT("Storing packet with sequence %d"), sequenceNumber);
+        FecFrameAccepted(clientConnection, packetBuffer); // The reorder buffer has its own copy
+    }
+    else if (place != RECEIVE_WINDOW_BEHIND)
+    { // Beyond the window, or no room for it. Not ACKing it makes the sender resend it later
+        DEBUGMESSAGE(1, YELTEXT("WARNING: ")"No room for packet with sequence %d, dropping it", sequenceNumber);
+        atomic_fetch_add_explicit(&framesOverBudget, 1, memory_order_relaxed);
+        return 0;
+    }
+    else
+    {
+        DEBUGMESSAGE(1, YELTEXT("WARNING: ")"Received packet with sequence number %d but looking for %d or greater",
+                     sequenceNumber, window->expected);
+    }
+    if (window->bufferedFrames > 0)
+        DeliverStreamFrames(clientConnection);
+    SendACK(clientConnection, sequenceNumber, 0, senderAddress, senderAddressLength);
+    return kept;
+}
+
+// Rebuilds every frame of the group at 'base' that its parity makes up for, and takes them in as if they had
+// arrived. Taking one in can make the next one rebuildable, so this goes on until nothing more can be done.
+
+void RecoverLostFrames(connection* clientConnection, unsigned short base, struct sockaddr_in* senderAddress,
+                       unsigned int senderAddressLength)
+{
+    while (1)
+    {
+        fecGroup* group = FindFecGroup(clientConnection, base, 0);
+        if (group == NULL)
+            return;
+
+        int missingOffset = -1;
+        for (int parityClass = 0; parityClass < clientConnection->fecParityCount && missingOffset == -1; parityClass++)
+        {
+            if ((group->parityIn & (1u << parityClass)) == 0)
+                continue;
+            int missingCount = 0;
+            for (int offset = parityClass; offset < clientConnection->fecGroupSize;
+                 offset += clientConnection->fecParityCount)
+            {
+                if ((group->framesIn & (1u << offset)) == 0)
+                {
+                    missingCount++;
+                    missingOffset = offset;
+                }
+            }
+            if (missingCount != 1)
+                missingOffset = -1;
+        }
+        if (missingOffset == -1)
+            return;
+
+        fecParity* parity = &group->classes[missingOffset % clientConnection->fecParityCount];
+        unsigned short sequence = base + missingOffset;
+        group->framesIn |= 1u << missingOffset; // Whatever happens next, this class is done
+        receivedDatagram* rebuilt;
+        if ((rebuilt = malloc(CompactDatagramSize(parity->length))) == NULL)
+        {
+            DEBUGMESSAGE(0, "RecoverLostFrames malloc() failed");
+            return;
+        }
+        rebuilt->senderAddress = *senderAddress;
+        rebuilt->senderAddressLength = senderAddressLength;
+        rebuilt->compact = 1;
+        int place = ReceiveWindowClassify(&clientConnection->window, sequence);
+        if (FecParityRebuild(parity, &rebuilt->packet, sequence) == -1 || place == RECEIVE_WINDOW_BEHIND ||
+            place == RECEIVE_WINDOW_BUFFERED)
+        { // Nothing was lost after all, the class got the frame without it being accounted for
+            free(rebuilt);
+            continue;
+        }
+        rebuilt->length = PACKET_HEADER_LENGTH + rebuilt->packet.dataLength;
+        DEBUGMESSAGE(1, GRNTEXT("Rebuilt sequence %d from parity"), sequence);
+        atomic_fetch_add_explicit(&framesRebuilt, 1, memory_order_relaxed);
+        DropPartialFrame(clientConnection, sequence, rebuilt->packet.flags);
+        if (!AcceptFrame(clientConnection, rebuilt, senderAddress, senderAddressLength))
+            free(rebuilt);
+    }
+}
+
+// Finds the basis for a delta transfer of a file: the most recently written file of that name that another connection
+// received. Returns that connection's id, or -1 if there is none.
+
+int FindBasis(const signatureJob* job, char* basisName)
+{
+    DIR* directory;
+    if ((directory = opendir("./received")) == NULL)
+        return -1;
+
+    int basisID = -1;
+    time_t newest = 0;
+    struct dirent* entry;
+    while ((entry = readdir(directory)) != NULL)
+    {
+        char* end;
+        long id = strtol(entry->d_name, &end, 10);
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9' || *end != '\0' || id == job->connectionID)
+            continue;
+        char candidate[50 + CONTROL_FILENAME_LENGTH];
+        struct stat candidateStatus;
+        sprintf(candidate, "./received/%ld/%s", id, job->fileName);
+        if (stat(candidate, &candidateStatus) == 0 && S_ISREG(candidateStatus.st_mode) &&
+            (basisID == -1 || candidateStatus.st_mtime > newest))
+        {
+            basisID = id;
+            newest = candidateStatus.st_mtime;
+            strcpy(basisName, candidate);
+        }
+    }
+    closedir(directory);
+    return basisID;
+}
+
+// Sends up to DELTA_SIGNATURE_BURST replies to a signature request, starting at firstBlock. Only a header goes out
+// while the basis is still being hashed, or if there is nothing from firstBlock on. Call with signatureMutex held.
+
+void SendSignatureBurst(const signatureJob* job, int firstBlock)
+{
+    datagramBatch* batch;
+    packet* reply;
+    if ((batch = malloc(sizeof(datagramBatch))) == NULL || (reply = malloc(sizeof(packet))) == NULL)
+    {
+        CRASHWITHERROR("SendSignatureBurst() malloc failed");
+    }
+    InitializeBatch(batch, socket_fd, &job->address, job->addressLength);
+
+    const fileSignature* signature = &job->signature;
+    int hashing = (job->state == SIGNATURE_HASHING);
+    if (firstBlock < 0 || firstBlock > signature->blockCount)
+        firstBlock = signature->blockCount;
+    for (int i = 0; i < DELTA_SIGNATURE_BURST; i++)
+    {
+        int first = firstBlock + i * DELTA_SIGNATURE_ENTRIES;
+        int count = hashing ? 0 : signature->blockCount - first;
+        if (count > DELTA_SIGNATURE_ENTRIES)
+            count = DELTA_SIGNATURE_ENTRIES;
+        if (i > 0 && count <= 0)
+            break;
+        if (count < 0)
+            count = 0;
+
+        unsigned long long fileSize = htobe64(signature->fileSize);
+        unsigned int header[4] = {htonl(hashing ? 0 : DeltaBlockSize(signature->fileSize)),
+                                  htonl(signature->blockCount), htonl(first), htonl(job->basisID)};
+        WritePacket(reply, PACKETFLAG_SIGNATURE | PACKETFLAG_ACK, NULL, 0, job->request);
+        memcpy(reply->data, &fileSize, 8);
+        memcpy(reply->data + 8, header, sizeof(header));
+        for (int j = 0; j < count; j++)
+        {
+            const blockSignature* block = &signature->blocks[first + j];
+            unsigned int rolling = htonl(block->rolling);
+            unsigned long long strong = htobe64(block->strong);
+            byte* entry = reply->data + DELTA_SIGNATURE_HEADER_LENGTH + j * DELTA_SIGNATURE_ENTRY_LENGTH;
+            memcpy(entry, &rolling, 4);
+            memcpy(entry + 4, &strong, 8);
+        }
+        reply->dataLength = DELTA_SIGNATURE_HEADER_LENGTH + count * DELTA_SIGNATURE_ENTRY_LENGTH;
+        reply->fragmentSize = reply->dataLength;
+        reply->integrity = job->integrity;
+        BatchPacket(batch, reply);
+    }
+    FlushBatch(batch);
+    free(reply);
+    free(batch);
+}
+
+// Signature job thread: hashes the basis with DeltaThreadCount() threads, then answers the request that started it
+
+void* HashBasis(signatureJob* job)
 {
-    FILE* file;
-    char* fileName;
-    fileName = malloc(50);
-    mkdir("received", 0777);
-    sprintf(fileName, "./received/%d", clientConnection->id);
-    if ((file = fopen(fileName, "a")) == NULL)
+    char basisName[50 + CONTROL_FILENAME_LENGTH];
+    fileSignature signature;
+    memset(&signature, 0, sizeof(signature));
+    int basisID = FindBasis(job, basisName);
+    if (basisID != -1 && ComputeSignature(basisName, &signature, DeltaThreadCount()) == -1)
+        basisID = -1;
+    if (basisID != -1)
     {
-        CRASHWITHERROR("Couldn't open file to write");
+        DEBUGMESSAGE(1, GRNTEXT("Connection %d: '%s' hashed into %d blocks of %d bytes"), job->connectionID, basisName,
+                     signature.blockCount, signature.blockSize);
     }
-    free(fileName);
-    return file;
-}
 
-int CopyPacket(const packet* src, packet* dest)
-{
-    dest->flags = src->flags;
-    dest->sequenceNumber = src->sequenceNumber;
-    dest->dataLength = src->dataLength;
-    dest->checksum = src->checksum;
-    for (int i = 0; i < src->dataLength; i++)
-        dest->data[i] = src->data[i];
-    return 1; // should return something else on fail but, uh, checking for fail in a simple function like this seems weird to do
+    pthread_mutex_lock(&signatureMutex);
+    job->signature = signature;
+    job->basisID = basisID;
+    job->state = SIGNATURE_READY;
+    int abandoned = job->abandoned;
+    if (!abandoned)
+        SendSignatureBurst(job, 0); // Under the lock, so that the job can't be freed while this is going on
+    pthread_mutex_unlock(&signatureMutex);
+    if (abandoned)
+    {
+        FreeSignature(&job->signature);
+        free(job);
+    }
+    return NULL;
 }
 
-int StoreBufferedData(connection* clientConnection, const packet* packetToStore)
+// Answers a SIGNATURE request: starts hashing the basis if it is a file we haven't been asked about yet, and otherwise
+// sends the part of the signature asked for (or that the hashing isn't done).
+
+void HandleSignatureRequest(connection* clientConnection, const packet* request,
+                            const struct sockaddr_in* senderAddress, unsigned int senderAddressLength)
 {
-    bufferedPacketList* newListItem;
-    if ((newListItem = malloc(sizeof(bufferedPacketList))) == NULL)
+    if (request->dataLength < 5)
+        return;
+    unsigned int firstBlock;
+    char fileName[CONTROL_FILENAME_LENGTH + 1];
+    memcpy(&firstBlock, request->data, 4);
+    firstBlock = ntohl(firstBlock);
+    SanitizeFileName(fileName, request->data + 4, request->dataLength - 4);
+
+    signatureJob* job = clientConnection->signatureJob;
+    if (job != NULL && job->request == request->sequenceNumber && strcmp(job->fileName, fileName) == 0)
     {
-        DEBUGMESSAGE(0, "StoreBufferedData malloc() failed");
-        return -1;
+        pthread_mutex_lock(&signatureMutex);
+        SendSignatureBurst(job, firstBlock);
+        pthread_mutex_unlock(&signatureMutex);
+        return;
     }
 
-    CopyPacket(packetToStore, &(newListItem->storedData));
-    newListItem->next = NULL;
+    ReleaseSignatureJob(job);
+    if ((job = calloc(1, sizeof(signatureJob))) == NULL)
+    {
+        CRASHWITHERROR("HandleSignatureRequest() calloc failed");
+    }
+    job->connectionID = clientConnection->id;
+    strcpy(job->fileName, fileName);
+    job->request = request->sequenceNumber;
+    job->address = *senderAddress;
+    job->addressLength = senderAddressLength;
+    job->integrity = clientConnection->integrity;
+    job->state = SIGNATURE_HASHING;
+    job->basisID = -1;
+    clientConnection->signatureJob = job;
 
-    bufferedPacketList* listPointer = clientConnection->packetList;
-    if (listPointer == NULL)
+    pthread_t hashingThread;
+    if (pthread_create(&hashingThread, NULL, (void*) HashBasis, job) != 0)
     {
-        clientConnection->packetList = newListItem;
-        return 1;
+        CRASHWITHERROR("pthread_create(HashBasis) failed");
     }
-    else
+    pthread_detach(hashingThread);
+    DEBUGMESSAGE(1, "Connection %d asked for the signature of '%s'", clientConnection->id, fileName);
+}
+
+// Sets a new connection up to journal a resumable transfer. If the transfer has a journal already, the connection
+// takes over the id it had and continues where the journal says, and the writer stage is told to cut the file
+// back to that point. A connection of the same transfer that is still around belongs to a sender that died.
+
+void StartTransfer(connection* clientConnection, unsigned int transferID)
+{
+    connection* cursor = connectionList;
+    while (cursor != NULL)
     {
-        int listPointerSequence = listPointer->storedData.sequenceNumber;
-        if (packetToStore->sequenceNumber < listPointerSequence)
+        connection* nextConnection = cursor->next;
+        if (cursor != clientConnection && cursor->transferID == transferID)
         {
-            newListItem->next = clientConnection->packetList;
-            clientConnection->packetList = newListItem;
-            return 1;
+            DEBUGMESSAGE(1, YELTEXT("Connection %d of transfer %08x is taken over by a new one"), cursor->id,
+                         transferID);
+            RemoveConnectionByID(cursor->id);
         }
+        cursor = nextConnection;
+    }
 
-        while (listPointer->next != NULL)
+    clientConnection->transferID = transferID;
+    transferJournal journal;
+    if (ReadJournal(transferID, &journal))
+    {
+        char fileName[50 + CONTROL_FILENAME_LENGTH];
+        struct stat fileStatus;
+        sprintf(fileName, "./received/%d/%s", journal.connectionID, journal.fileName);
+        if (journal.filesStarted == 0 || (stat(fileName, &fileStatus) == 0 && fileStatus.st_size >= journal.offset))
         {
-            listPointerSequence = listPointer->next->storedData.sequenceNumber;
-            if (packetToStore->sequenceNumber < listPointerSequence)
-            {
-                newListItem->next = listPointer->next;
-                listPointer->next = newListItem;
-                return 1;
-            }
-            listPointer = listPointer->next;
+            clientConnection->id = journal.connectionID;
+            clientConnection->resumeFiles = journal.filesStarted;
+            clientConnection->resumeOffset = journal.offset;
+            DEBUGMESSAGE(0, GRNTEXT("Resuming transfer %08x")" as connection %d, from file %d, byte %lld",
+                         transferID, journal.connectionID, journal.filesStarted, journal.offset);
+        }
+        else
+        {
+            DEBUGMESSAGE(0, YELTEXT("Transfer %08x")" lost '%s', starting it over", transferID, fileName);
         }
-        listPointer->next = newListItem;
-        return 1;
     }
+
+    int nameLength = clientConnection->resumeFiles > 0 ? strlen(journal.fileName) : 0;
+    receivedDatagram* note;
+    if ((note = malloc(CompactDatagramSize(16 + nameLength))) == NULL)
+    {
+        CRASHWITHERROR("StartTransfer() malloc failed");
+    }
+    note->compact = 1;
+    note->connectionID = clientConnection->id;
+    memset(&note->packet, 0, PACKET_HEADER_LENGTH);
+    note->packet.flags = PACKETFLAG_SYN | PACKETFLAG_CONTROL; // Never delivered from the network, see StartJournal()
+    memcpy(note->packet.data, &transferID, 4);
+    memcpy(note->packet.data + 4, &clientConnection->resumeFiles, 4);
+    memcpy(note->packet.data + 8, &clientConnection->resumeOffset, 8);
+    memcpy(note->packet.data + 16, journal.fileName, nameLength);
+    note->packet.dataLength = 16 + nameLength;
+    SpscRingPush(&writeRing, note);
 }
 
-bufferedPacketList* RetrieveBufferedData(connection* clientConnection)
+// Maps the shared memory ring a SYN offers, see SYN_SHARED_RING_DATA_LENGTH. Returns NULL if the sender isn't on this
+// host after all, or the ring can't be mapped; the connection then gets its data frames over the socket.
+
+attachedRing* AttachSharedRing(const packet* synPacket, const struct sockaddr_in* senderAddress)
 {
-    if (clientConnection->packetList != NULL)
+    if (!SharedRingPeerIsLocal(senderAddress))
+        return NULL;
+    unsigned int pid, fd;
+    unsigned long long token;
+    memcpy(&pid, synPacket->data + SYN_TICKET_DATA_LENGTH, 4);
+    memcpy(&fd, synPacket->data + SYN_TICKET_DATA_LENGTH + 4, 4);
+    memcpy(&token, synPacket->data + SYN_TICKET_DATA_LENGTH + 8, 8);
+
+    attachedRing* attached;
+    if ((attached = malloc(sizeof(attachedRing))) == NULL)
     {
-        int firstBufferedSequence = clientConnection->packetList->storedData.sequenceNumber;
-        if (clientConnection->sequence == firstBufferedSequence)
-        {
-            bufferedPacketList* packetList = clientConnection->packetList;
-            clientConnection->packetList = clientConnection->packetList->next;
-            return packetList;
-        }
+        DEBUGMESSAGE(0, "AttachSharedRing malloc() failed");
+        return NULL;
     }
-    return NULL;
+    if (SharedRingAttach(&attached->ring, ntohl(pid), ntohl(fd), be64toh(token)) == -1)
+    {
+        free(attached);
+        return NULL;
+    }
+    attached->senderAddress = *senderAddress;
+    atomic_init(&attached->detached, 0);
+    attached->next = NULL;
+    return attached;
 }
 
-int CheckBufferedDataForSequence(connection* clientConnection, unsigned short sequence)
+// Takes a subflow into the connection whose join key its SYN+CONTROL holds, see MAX_SUBFLOWS, and answers it.
+// A resent join is answered again.
+
+void JoinSubflow(const packet* joinPacket, const struct sockaddr_in* senderAddress, unsigned int senderAddressLength)
 {
-    bufferedPacketList* bufferCursor = clientConnection->packetList;
-    while (bufferCursor != NULL)
+    if (joinPacket->dataLength < SUBFLOW_JOIN_DATA_LENGTH)
+        return;
+    unsigned int joinKey;
+    memcpy(&joinKey, joinPacket->data, 4);
+    joinKey = ntohl(joinKey);
+    connection* clientConnection = connectionList;
+    while (clientConnection != NULL && clientConnection->joinKey != joinKey)
+        clientConnection = clientConnection->next;
+    connection* owner = FindConnection(senderAddress);
+    if (clientConnection == NULL || (owner != NULL && owner != clientConnection))
     {
-        if (bufferCursor->storedData.sequenceNumber == sequence)
-            return 1;
-        else
-            bufferCursor = bufferCursor->next;
+        DEBUGMESSAGE(1, YELTEXT("WARNING: ")"Subflow from %s:%d can't join, the key fits no connection or the address"
+                     " belongs to another one", inet_ntoa(senderAddress->sin_addr), ntohs(senderAddress->sin_port));
+        return;
     }
-    return 0;
+    if (owner == NULL)
+    {
+        if (clientConnection->subflowCount == MAX_SUBFLOWS - 1)
+        {
+            DEBUGMESSAGE(1, YELTEXT("WARNING: ")"Connection %d already has %d subflows", clientConnection->id,
+                         MAX_SUBFLOWS);
+            return;
+        }
+        clientConnection->subflows[clientConnection->subflowCount].address = senderAddress->sin_addr.s_addr;
+        clientConnection->subflows[clientConnection->subflowCount].port = senderAddress->sin_port;
+        clientConnection->subflowCount++;
+        DEBUGMESSAGE(0, GRNTEXT("Subflow from %s:%d joined connection %d"), inet_ntoa(senderAddress->sin_addr),
+                     ntohs(senderAddress->sin_port), clientConnection->id);
+    }
+
+    packet packetToSend;
+    WritePacket(&packetToSend, PACKETFLAG_SYN | PACKETFLAG_CONTROL | PACKETFLAG_ACK, (void*) joinPacket->data,
+                SUBFLOW_JOIN_DATA_LENGTH, joinPacket->sequenceNumber);
+    packetToSend.integrity = clientConnection->integrity;
+    SendPacket(socket_fd, &packetToSend, senderAddress, senderAddressLength);
 }
 
 int ReceiveConnection(const packet* connectionRequestPacket, struct sockaddr_in senderAddress,
@@ -236,7 +1854,7 @@ int ReceiveConnection(const packet* connectionRequestPacket, struct sockaddr_in
     if (packetBuffer.flags & PACKETFLAG_SYN)
     {
         DEBUGMESSAGE(0, YELTEXT("Client connecting..."));
-        byte packetData[3];
+        byte packetData[SYN_DATA_LENGTH];
         DEBUGMESSAGE(3, "SYN: Flags "
                 GRN
                 "OK"
@@ -296,18 +1914,122 @@ int ReceiveConnection(const packet* connectionRequestPacket, struct sockaddr_in
             return -1;
         }
 
+        // A resent SYN gets the answer the first one got
+        int parametersAccepted = (requestedWindowSize == suggestedWindowSize &&
+                                  requestedFrameSize == suggestedFrameSize);
+
+        // The sender has been sending since it sent a SYN with a ticket. Until a ticket is redeemed there is no
+        // connection, so those frames are dropped; a rejected ticket gets a SYN+NAK and the sender starts over
+        // without one. A resent SYN presents the ticket its connection already used up.
+        unsigned int ticket = 0;
+        if (packetBuffer.dataLength >= SYN_TICKET_DATA_LENGTH)
+            memcpy(&ticket, packetBuffer.data + SYN_DATA_LENGTH, 4);
+        int ticketRejected = 0;
+        if (ticket != 0 && FindConnection(&senderAddress) == NULL) // A ticket of 0 is a shared memory offer without one
+        {
+            if (RedeemSessionTicket(ntohl(ticket), &senderAddress, requestedWindowSize, requestedFrameSize))
+            {
+                DEBUGMESSAGE(0, GRNTEXT("Session ticket accepted")", sender is already sending");
+            }
+            else
+            {
+                DEBUGMESSAGE(1, YELTEXT("Unknown or expired session ticket")", dropping what the sender sent on it");
+                ticketRejected = 1;
+            }
+        }
+
+        attachedRing* sharedRing = NULL;
+        if (FindConnection(&senderAddress) != NULL)
+            sharedRing = FindConnection(&senderAddress)->sharedRing;
+        else if (parametersAccepted && !ticketRejected && packetBuffer.dataLength >= SYN_SHARED_RING_DATA_LENGTH)
+            sharedRing = AttachSharedRing(&packetBuffer, &senderAddress);
+
         packetData[0] = suggestedWindowSize;
         byte* suggestedFrameSizeBytes = (byte*) &suggestedFrameSize;
         packetData[1] = suggestedFrameSizeBytes[0];
         packetData[2] = suggestedFrameSizeBytes[1];
 
-        if (requestedWindowSize == suggestedWindowSize && requestedFrameSize == suggestedFrameSize)
+        // Every algorithm we know is fine with us, anything else (or a sender that doesn't ask) gets the checksum
+        byte integrity = INTEGRITY_CHECKSUM16;
+        if (packetBuffer.dataLength >= SYN_DATA_LENGTH && packetBuffer.data[3] <= INTEGRITY_CRC32C)
+            integrity = packetBuffer.data[3];
+        packetData[3] = integrity;
+        DEBUGMESSAGE(3, "SYN: Integrity %s", IntegrityName(integrity));
+
+        // A FEC group is no larger than the window, so that all of it can be in flight when its parity goes out, and
+        // has at least one frame per parity class
+        byte fecGroupSize = 0, fecParityCount = 0;
+        if (packetBuffer.dataLength >= SYN_DATA_LENGTH && packetBuffer.data[4] > 1 && packetBuffer.data[5] > 0 &&
+            sharedRing == NULL)
+        {
+            fecGroupSize = 1;
+            while (fecGroupSize * 2 <= packetBuffer.data[4] && fecGroupSize * 2 <= suggestedWindowSize &&
+                   fecGroupSize * 2 <= MAX_FEC_GROUP_SIZE)
+                fecGroupSize *= 2;
+            fecParityCount = packetBuffer.data[5];
+            if (fecParityCount > MAX_FEC_PARITY_COUNT)
+                fecParityCount = MAX_FEC_PARITY_COUNT;
+            if (fecParityCount > fecGroupSize)
+                fecParityCount = fecGroupSize;
+        }
+        packetData[4] = fecGroupSize;
+        packetData[5] = fecParityCount;
+        DEBUGMESSAGE(3, "SYN: FEC %d parity frames per %d frames", fecParityCount, fecGroupSize);
+
+        unsigned int transferID = 0;
+        if (packetBuffer.dataLength >= SYN_DATA_LENGTH)
+            memcpy(&transferID, packetBuffer.data + 6, 4);
+        memcpy(packetData + 6, &transferID, 4); // Echoed as it came, so that the sender knows we journal it
+        transferID = ntohl(transferID);
+
+        byte codec = CODEC_NONE;
+        if (packetBuffer.dataLength >= SYN_DATA_LENGTH && packetBuffer.data[10] <= CODEC_LZ && sharedRing == NULL)
+            codec = packetBuffer.data[10];
+        packetData[10] = codec;
+        DEBUGMESSAGE(3, "SYN: Codec %d", codec);
+
+        if (parametersAccepted && !ticketRejected)
         {
             DEBUGMESSAGE(0, "Parameters accepted, sending "GRNTEXT("SYN+ACK"));
+            if (FindConnection(&senderAddress) == NULL) // Otherwise this is a resent SYN, the sender may be sending already
+            {
+                AddConnection(&senderAddress, suggestedWindowSize, suggestedFrameSize, integrity, fecGroupSize,
+                              fecParityCount);
+                FindConnection(&senderAddress)->codec = codec;
+                if (transferID != 0)
+                    StartTransfer(FindConnection(&senderAddress), transferID);
+                if (sharedRing != NULL)
+                {
+                    DEBUGMESSAGE(0, GRNTEXT("Sender is on this host")", taking its data frames from shared memory");
+                    FindConnection(&senderAddress)->sharedRing = sharedRing;
+                    SpscRingPush(&attachRing, sharedRing);
+                }
+            }
+            connection* clientConnection = FindConnection(&senderAddress);
+
+            byte synAckData[SYN_JOIN_KEY_DATA_LENGTH];
+            memcpy(synAckData, packetData, SYN_DATA_LENGTH);
+            unsigned int newTicket = htonl(IssueSessionTicket(&senderAddress, suggestedWindowSize, suggestedFrameSize));
+            memcpy(synAckData + SYN_DATA_LENGTH, &newTicket, 4);
+            unsigned int resumeFiles = htonl(clientConnection->resumeFiles);
+            unsigned long long resumeOffset = htobe64(clientConnection->resumeOffset);
+            memcpy(synAckData + SYN_TICKET_DATA_LENGTH, &resumeFiles, 4);
+            memcpy(synAckData + SYN_TICKET_DATA_LENGTH + 4, &resumeOffset, 8);
+            synAckData[SYN_RESUME_DATA_LENGTH] = (sharedRing != NULL);
+            unsigned int joinKey = htonl(clientConnection->joinKey);
+            memcpy(synAckData + SYN_SHARED_RING_ACK_LENGTH, &joinKey, 4);
             WritePacket(&packetToSend, PACKETFLAG_SYN | PACKETFLAG_ACK,
+                        synAckData, sizeof(synAckData), packetBuffer.sequenceNumber);
+            packetToSend.integrity = integrity;
+            SendPacket(socket_fd, &packetToSend, &senderAddress, senderAddressLength);
+        }
+        else if (ticketRejected)
+        {
+            DEBUGMESSAGE(0, "Session ticket rejected, sending "REDTEXT("SYN+NAK"));
+            WritePacket(&packetToSend, PACKETFLAG_SYN | PACKETFLAG_NAK,
                         packetData, sizeof(packetData), packetBuffer.sequenceNumber);
+            packetToSend.integrity = integrity;
             SendPacket(socket_fd, &packetToSend, &senderAddress, senderAddressLength);
-            AddConnection(&senderAddress);
         }
         else
         {
@@ -331,6 +2053,7 @@ int ReceiveConnection(const packet* connectionRequestPacket, struct sockaddr_in
             DEBUGMESSAGE(0, "Sending suggestion for window: %d and frame: %d", suggestedWindowSize, suggestedFrameSize);
             WritePacket(&packetToSend, PACKETFLAG_SYN | PACKETFLAG_NAK,
                         packetData, sizeof(packetData), packetBuffer.sequenceNumber);
+            packetToSend.integrity = integrity;
             SendPacket(socket_fd, &packetToSend, &senderAddress, senderAddressLength);
         }
 
@@ -344,124 +2067,290 @@ int ReceiveConnection(const packet* connectionRequestPacket, struct sockaddr_in
     return 0;
 }
 
+// The gso_size the kernel attached to a coalesced read, or 0 if the read holds a single datagram
+
+int CoalescedSegmentSize(struct msghdr* message)
+{
+    for (struct cmsghdr* controlMessage = CMSG_FIRSTHDR(message); controlMessage != NULL;
+         controlMessage = CMSG_NXTHDR(message, controlMessage))
+    {
+        if (controlMessage->cmsg_level == SOL_UDP && controlMessage->cmsg_type == UDP_GRO)
+        {
+            int segmentSize;
+            memcpy(&segmentSize, CMSG_DATA(controlMessage), sizeof(segmentSize));
+            return segmentSize;
+        }
+    }
+    return 0;
+}
+
+// With UDP_GRO the kernel may hand us a run of datagrams from one sender in a single read, every one segmentSize
+// bytes long but the last. The ones after the first are copied into buffers of their own, then they all go to
+// processRing in the order they were sent.
+
+void PushReceivedDatagrams(receivedDatagram* datagram, int length, int segmentSize)
+{
+    if (segmentSize <= 0 || segmentSize >= length)
+    {
+        datagram->length = length;
+        atomic_fetch_add_explicit(&datagramsReceived, 1, memory_order_relaxed);
+        SpscRingPush(&processRing, datagram);
+        return;
+    }
+
+    int segments = (length + segmentSize - 1) / segmentSize;
+    receivedDatagram* split[segments];
+    split[0] = datagram;
+    datagram->length = segmentSize;
+    for (int i = 1; i < segments; i++)
+    {
+        int offset = i * segmentSize;
+        split[i] = AcquireDatagram();
+        split[i]->senderAddress = datagram->senderAddress;
+        split[i]->senderAddressLength = datagram->senderAddressLength;
+        split[i]->length = (length - offset < segmentSize) ? length - offset : segmentSize;
+        memcpy(&split[i]->packet, (byte*) &datagram->packet + offset, split[i]->length);
+    }
+    atomic_fetch_add_explicit(&coalescedReceives, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&datagramsReceived, segments, memory_order_relaxed);
+    for (int i = 0; i < segments; i++)
+        SpscRingPush(&processRing, split[i]);
+}
+
+// Moves what is waiting in the shared memory rings into processRing, as if it had come in over the socket, taking up
+// newly attached rings and unmapping detached ones on the way. At most PIPELINE_RING_SIZE datagrams are taken from
+// each ring per call, so that a busy ring doesn't keep the socket waiting. Returns how many were taken.
+
+int ReadSharedRings()
+{
+    attachedRing* attached;
+    while ((attached = SpscRingTryPop(&attachRing)) != NULL)
+    {
+        attached->next = sharedRings;
+        sharedRings = attached;
+    }
+
+    int taken = 0;
+    attachedRing** link = &sharedRings;
+    while ((attached = *link) != NULL)
+    {
+        if (atomic_load_explicit(&attached->detached, memory_order_acquire))
+        {
+            *link = attached->next;
+            SharedRingClose(&attached->ring);
+            free(attached);
+            continue;
+        }
+        const byte* record;
+        int length;
+        for (int i = 0; i < PIPELINE_RING_SIZE && (record = SharedRingPeek(&attached->ring, &length)) != NULL; i++)
+        {
+            receivedDatagram* datagram = AcquireDatagram();
+            memcpy(&datagram->packet, record, length);
+            SharedRingRelease(&attached->ring, length);
+            datagram->senderAddress = attached->senderAddress;
+            datagram->senderAddressLength = sizeof(attached->senderAddress);
+            datagram->length = length;
+            SpscRingPush(&processRing, datagram);
+            taken++;
+        }
+        link = &attached->next;
+    }
+    atomic_fetch_add_explicit(&datagramsReceived, taken, memory_order_relaxed);
+    atomic_fetch_add_explicit(&datagramsShared, taken, memory_order_relaxed);
+    return taken;
+}
+
+// Tells the senders of every shared memory ring that the network stage is about to block on the socket, so that they
+// wake it up with an empty datagram. Returns 0 if a ring got something in the meantime and it shouldn't block.
+
+int SharedRingsIdle()
+{
+    int idle = 1;
+    for (attachedRing* attached = sharedRings; attached != NULL; attached = attached->next)
+        idle &= SharedRingPrepareToWait(&attached->ring);
+    return idle;
+}
+
+// Network stage: does nothing but move datagrams from the socket and the shared memory rings into processRing, so
+// that the kernel's receive buffer is drained even while the other stages are busy. Also prints the pipeline
+// statistics when asked to.
+
 void ReadIncomingMessages()
 {
     DEBUGMESSAGE(0, "Receiver initiated. Listening for packets...");
-    struct sockaddr_in senderAddress;
-    memset(&senderAddress, 0, sizeof(struct sockaddr_in));
-    unsigned int senderAddressLength = sizeof(senderAddress);
 
-    packet packetBuffer;
-    memset(&packetBuffer, 0, sizeof(packet));
+    // Measures incoming traffic so the receive buffer can be grown to match it
+    struct timespec measurementStart;
+    clock_gettime(CLOCK_MONOTONIC, &measurementStart);
+    long bytesSinceMeasurementStart = 0;
+
+    receivedDatagram* datagram = NULL;
+    char control[CMSG_SPACE(sizeof(int))];
+    while (1)
+    {
+        if (datagram == NULL)
+            datagram = AcquireDatagram();
+        struct iovec iov = {&datagram->packet, sizeof(packet)};
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_name = &datagram->senderAddress;
+        message.msg_namelen = sizeof(datagram->senderAddress);
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        // Only block when no ring has anything, an empty datagram wakes us up when one of them gets something
+        int wait = (ReadSharedRings() == 0 && SharedRingsIdle());
+        int length = recvmsg(socket_fd, &message, wait ? 0 : MSG_DONTWAIT);
+        if (wait)
+        {
+            for (attachedRing* attached = sharedRings; attached != NULL; attached = attached->next)
+                SharedRingStopWaiting(&attached->ring);
+        }
+        if (length > 0)
+        {
+            datagram->senderAddressLength = message.msg_namelen;
+            bytesSinceMeasurementStart += length + SOCKET_BUFFER_OVERHEAD;
+            PushReceivedDatagrams(datagram, length, CoalescedSegmentSize(&message));
+            datagram = NULL;
+        }
+        else if (length < 0 && errno != EINTR && errno != EAGAIN)
+        {
+            DEBUGMESSAGE(0, "recvmsg() in ReadIncomingMessages() failed");
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > measurementStart.tv_sec)
+        {
+            double elapsed = (now.tv_sec - measurementStart.tv_sec) + (now.tv_nsec - measurementStart.tv_nsec) / 1e9;
+            GrowSocketBuffer(socket_fd, SO_RCVBUF,
+                             (int) (bytesSinceMeasurementStart / elapsed * RECEIVE_BUFFER_MILLISECONDS / 1000));
+            measurementStart = now;
+            bytesSinceMeasurementStart = 0;
+            if (debugLevel == DEBUGLEVEL_PIPELINE)
+                PrintPipelineStatistics();
+        }
+        if (atomic_exchange(&statisticsRequested, 0))
+            PrintPipelineStatistics();
+    }
+}
+
+// Processing stage: verifies datagrams, keeps track of the connections, reorders frames and ACKs them. ACKs go out
+// as soon as a frame is verified, writing it is left to the writer stage.
 
+void* ProcessIncomingMessages()
+{
     while (1)
     {
-        int retval = 0;
-        retval = ReceivePacket(socket_fd, &packetBuffer, &senderAddress, &senderAddressLength);
+        receivedDatagram* datagram = SpscRingPop(&processRing);
+        packet* packetBuffer = &datagram->packet;
+        struct sockaddr_in senderAddress = datagram->senderAddress;
+        unsigned int senderAddressLength = datagram->senderAddressLength;
+
+        int retval = VerifyPacket(packetBuffer, datagram->length);
+        if (retval < 0)
+            atomic_fetch_add_explicit(&datagramsDropped, 1, memory_order_relaxed);
+
+        if (retval > 0 && packetBuffer->flags != PACKETFLAG_SYN)
+        { // A corrupted integrity byte could otherwise get a packet checked by the weaker algorithm
+            connection* clientConnection = FindConnection(&senderAddress);
+            if (clientConnection != NULL && packetBuffer->integrity != clientConnection->integrity)
+            {
+                DEBUGMESSAGE(2, "Dropped packet protected by %s, connection %d uses %s",
+                             IntegrityName(packetBuffer->integrity), clientConnection->id,
+                             IntegrityName(clientConnection->integrity));
+                retval = -1;
+                atomic_fetch_add_explicit(&datagramsDropped, 1, memory_order_relaxed);
+            }
+        }
+
         if (retval > 0)
         {
-            if (packetBuffer.flags == 0)
+            if ((packetBuffer->flags & PACKETFLAGS_HANDSHAKE) == 0)
             {
                 connection* clientConnection = FindConnection(&senderAddress);
-                FILE* file;
 
                 if (clientConnection == NULL)
                 {
                     DEBUGMESSAGE(0, YELTEXT("Received message from invalid client"));
                 }
+                else if (packetBuffer->flags == PACKETFLAG_SIGNATURE)
+                {
+                    HandleSignatureRequest(clientConnection, packetBuffer, &senderAddress, senderAddressLength);
+                }
+                else if ((packetBuffer->flags & PACKETFLAG_COMPRESSED) && clientConnection->codec == CODEC_NONE)
+                {
+                    DEBUGMESSAGE(1, YELTEXT("WARNING: ")"Connection %d sent a compressed frame without a codec",
+                                 clientConnection->id);
+                }
                 else
                 {
-                    if (packetBuffer.sequenceNumber == clientConnection->sequence)
+                    int isParity = packetBuffer->flags == PACKETFLAG_PARITY;
+                    if (isParity && !FecParityWanted(clientConnection, packetBuffer->sequenceNumber))
                     {
-                        DEBUGMESSAGE(0, GRNTEXT("Received in-order packet, sequence %d"), clientConnection->sequence);
-                        file = OpenConnectionFile(clientConnection);
-                        fprintf(file, "%s", packetBuffer.data);
-                        clientConnection->sequence++;
-
-                        bufferedPacketList* retrievedPacketList;
-                        if (clientConnection->packetList != NULL)
-                        {
-                            DEBUGMESSAGE(0, YELTEXT("Retrieving buffered data, looking for %d"),
-                                         clientConnection->sequence);
-                            if (debugLevel == DEBUGLEVEL_REORDER)
-                            {
-                                printf(YELTEXT("Current packet storage: "));
-                                retrievedPacketList = clientConnection->packetList;
-                                while (retrievedPacketList != NULL)
-                                {
-                                    printf(YELTEXT("%d "), retrievedPacketList->storedData.sequenceNumber);
-                                    retrievedPacketList = retrievedPacketList->next;
-                                }
-                                printf("\n");
-                            }
-                            retrievedPacketList = RetrieveBufferedData(clientConnection);
-                            while (retrievedPacketList != NULL)
-                            {
-                                DEBUGMESSAGE(0, GRNTEXT("Retrieved packet at sequence %d"),
-                                             retrievedPacketList->storedData.sequenceNumber);
-                                fprintf(file, "%s", retrievedPacketList->storedData.data);
-                                clientConnection->sequence++;
-                                free(retrievedPacketList);
-                                retrievedPacketList = RetrieveBufferedData(clientConnection);
-                            }
-                        }
-                        fclose(file);
+                        DEBUGMESSAGE(2, "Parity %d not needed", packetBuffer->sequenceNumber);
+                        ReleaseDatagram(&processedFreeRing, datagram);
+                        continue;
                     }
 
-                    else if (packetBuffer.sequenceNumber > clientConnection->sequence)
-                    {
-                        if (CheckBufferedDataForSequence(clientConnection, packetBuffer.sequenceNumber))
-                        {
-                            DEBUGMESSAGE_EXACT(DEBUGLEVEL_REORDER, "Packet with seq %d already in buffer\n", packetBuffer.sequenceNumber);
-                        }
-                        else
-                        {
-                            DEBUGMESSAGE(0, YELTEXT("Storing packet with sequence %d"),
-                                         packetBuffer.sequenceNumber);
-                            StoreBufferedData(clientConnection, &packetBuffer);
-                        }
+                    int place = ReceiveWindowClassify(&clientConnection->window, packetBuffer->sequenceNumber);
+                    if (packetBuffer->fragmentCount > 1 &&
+                        (isParity || (place != RECEIVE_WINDOW_BEHIND && place != RECEIVE_WINDOW_BUFFERED)))
+                    { // A piece of a frame we don't have yet. Carry on with the whole frame once it is complete.
+                        receivedDatagram* wholeFrame = AddFragment(clientConnection, datagram, &senderAddress,
+                                                                   senderAddressLength);
+                        ReleaseDatagram(&processedFreeRing, datagram);
+                        if ((datagram = wholeFrame) == NULL)
+                            continue;
+                        packetBuffer = &datagram->packet;
                     }
-                    else
+
+                    unsigned short groupBase = 0;
+                    if (clientConnection->fecGroupSize > 0)
+                        groupBase = FecGroupBase(clientConnection, packetBuffer->sequenceNumber);
+                    if (isParity)
+                        FecParityArrived(clientConnection, packetBuffer);
+                    else if (AcceptFrame(clientConnection, datagram, &senderAddress, senderAddressLength))
+                        datagram = NULL;
+                    if (clientConnection->fecGroupSize > 0)
                     {
-                        DEBUGMESSAGE(1, YELTEXT("WARNING: ")
-                                "Received packet with sequence number %d but looking for %d or greater",
-                                     packetBuffer.sequenceNumber, clientConnection->sequence);
+                        RecoverLostFrames(clientConnection, groupBase, &senderAddress, senderAddressLength);
+                        PruneFecGroups(clientConnection);
                     }
-                    packet packetToSend;
-                    memset(&packetToSend, 0, sizeof(packet));
-                    WritePacket(&packetToSend, PACKETFLAG_ACK, NULL, 0,
-                                packetBuffer.sequenceNumber);
-                    SendPacket(socket_fd, &packetToSend, &senderAddress, senderAddressLength);
                 }
             }
-            else if (packetBuffer.flags == PACKETFLAG_FIN)
+            else if (packetBuffer->flags == PACKETFLAG_FIN)
             { // Oh lordy, kill it with fire
                 connection* clientConnection = FindConnection(&senderAddress);
-                FILE* file;
 
                 if (clientConnection == NULL)
-                {
-                    DEBUGMESSAGE(0, YELTEXT("Received message from invalid client"));
+                { // Maybe a stripe that missed its FIN+ACK, which only the writer stage can tell
+                    datagram->connectionID = -1;
+                    datagram->senderAddress = senderAddress;
+                    datagram->senderAddressLength = senderAddressLength;
+                    SpscRingPush(&writeRing, datagram);
+                    datagram = NULL;
                 }
                 else
                 {
-                    file = OpenConnectionFile(clientConnection);
-                    fprintf(file, "%s\n", packetBuffer.data);
-                    fclose(file);
-                    DEBUGMESSAGE(0, "FINished writing to file %d", clientConnection->id);
-
-                    packet packetToSend;
-                    memset(&packetToSend, 0, sizeof(packet));
-                    WritePacket(&packetToSend, PACKETFLAG_FIN | PACKETFLAG_ACK, NULL, 0, packetBuffer.sequenceNumber);
-                    SendPacket(socket_fd, &packetToSend, &senderAddress, senderAddressLength);
+                    // The writer stage answers with FIN+ACK once everything before it is written
+                    datagram->connectionID = clientConnection->id;
+                    SpscRingPush(&writeRing, datagram);
+                    datagram = NULL;
                     RemoveConnectionByID(clientConnection->id);
                 }
             }
-            else if (packetBuffer.flags == PACKETFLAG_SYN)
+            else if (packetBuffer->flags == PACKETFLAG_SYN)
+            {
+                ReceiveConnection(packetBuffer, senderAddress, senderAddressLength);
+            }
+            else if (packetBuffer->flags == (PACKETFLAG_SYN | PACKETFLAG_CONTROL))
             {
-                ReceiveConnection(&packetBuffer, senderAddress, senderAddressLength);
+                JoinSubflow(packetBuffer, &senderAddress, senderAddressLength);
             }
-            else if (packetBuffer.flags == PACKETFLAG_ACK)
+            else if (packetBuffer->flags == PACKETFLAG_ACK)
             {
                 connection* clientConnection = FindConnection(&senderAddress);
                 if (clientConnection != NULL && clientConnection->status == CONNECTION_STATUS_PENDING)
@@ -474,19 +2363,283 @@ void ReadIncomingMessages()
                     DEBUGMESSAGE(0, YELTEXT("Received message from invalid client"));
                 }
             }
-            if (packetBuffer.sequenceNumber == 10E25)
-                break; // compiler whines about endless loops without this bit
+        }
+        if (datagram != NULL) // Nobody took it over
+            ReleaseDatagram(&processedFreeRing, datagram);
+    }
+    return NULL;
+}
+
+// Acts on the processing stage's note that a resumable transfer has connected: opens its journal and, if it is
+// resumed, cuts the file it was writing back to what the SYN+ACK told the sender. Anything written after that point,
+// also by a connection of the same transfer that was still around, will be sent again.
+
+void StartJournal(connectionOutput* output, const packet* notePacket)
+{
+    unsigned int transferID;
+    int filesStarted;
+    long long offset;
+    memcpy(&transferID, notePacket->data, 4);
+    memcpy(&filesStarted, notePacket->data + 4, 4);
+    memcpy(&offset, notePacket->data + 8, 8);
+
+    if (output->file != NULL)
+    {
+        fclose(output->file);
+        output->file = NULL;
+    }
+    if (output->journal != -1)
+        close(output->journal);
+
+    transferJournal previous;
+    unsigned int generation = ReadJournal(transferID, &previous) ? previous.generation : 0;
+    memset(&output->journalState, 0, sizeof(transferJournal));
+    output->journalState.magic = JOURNAL_MAGIC;
+    output->journalState.generation = generation;
+    output->journalState.transferID = transferID;
+    output->journalState.connectionID = output->id;
+    output->journalState.filesStarted = filesStarted;
+    output->journalState.offset = offset;
+    output->fileName[0] = '\0';
+    if (filesStarted > 0)
+    {
+        memcpy(output->fileName, notePacket->data + 16, notePacket->dataLength - 16);
+        output->fileName[notePacket->dataLength - 16] = '\0';
+        strcpy(output->journalState.fileName, output->fileName);
+        if (!FileStarted(output->id, output->fileName))
+            ClaimFileName(output);
+        output->file = OpenConnectionFile(output, "a");
+        if (ftruncate(fileno(output->file), offset) == -1)
+        {
+            DEBUGMESSAGE(0, YELTEXT("WARNING: ")"Couldn't truncate '%s'", output->fileName);
+        }
+    }
+
+    char path[64];
+    mkdir("received", 0777);
+    JournalPath(path, transferID);
+    if ((output->journal = open(path, O_WRONLY | O_CREAT, 0644)) == -1)
+    {
+        DEBUGMESSAGE(0, YELTEXT("WARNING: ")"Couldn't open '%s', transfer %08x can't be resumed", path, transferID);
+        return;
+    }
+    WriteJournal(output);
+    DEBUGMESSAGE(1, GRNTEXT("Connection %d journals transfer %08x from file %d, byte %lld"), output->id, transferID,
+                 filesStarted, offset);
+}
+
+void SendFinACK(const struct sockaddr_in* address, unsigned int addressLength, unsigned short sequence, byte integrity)
+{
+    packet packetToSend;
+    memset(&packetToSend, 0, sizeof(packet));
+    WritePacket(&packetToSend, PACKETFLAG_FIN | PACKETFLAG_ACK, NULL, 0, sequence);
+    packetToSend.integrity = integrity;
+    SendPacket(socket_fd, &packetToSend, address, addressLength);
+}
+
+// Notes that a stripe has sent its FIN, which means all of it is written. Once every stripe of the group has, each
+// of them gets its FIN+ACK.
+
+void StripeFinished(unsigned int group, int index, int count, const receivedDatagram* fin)
+{
+    stripeGroup** link = &stripeGroups;
+    while (*link != NULL && (*link)->id != group)
+        link = &((*link)->next);
+    stripeGroup* finishing = *link;
+    if (finishing == NULL)
+    {
+        if ((finishing = calloc(1, sizeof(stripeGroup))) == NULL)
+        {
+            CRASHWITHERROR("StripeFinished() calloc failed");
+        }
+        finishing->id = group;
+        finishing->stripeCount = count;
+        finishing->next = stripeGroups;
+        stripeGroups = finishing;
+        link = &stripeGroups;
+    }
+    if (!finishing->fins[index].held)
+        finishing->finished++;
+    finishing->fins[index].held = 1;
+    finishing->fins[index].address = fin->senderAddress;
+    finishing->fins[index].addressLength = fin->senderAddressLength;
+    finishing->fins[index].sequence = fin->packet.sequenceNumber;
+    finishing->fins[index].integrity = fin->packet.integrity;
+    DEBUGMESSAGE(1, "Stripe %d of %d of group %u is in", index + 1, finishing->stripeCount, group);
+    if (finishing->finished < finishing->stripeCount)
+        return;
+
+    DEBUGMESSAGE(0, GRNTEXT("Striped transfer %u complete")", all %d stripes are in", group, finishing->stripeCount);
+    finishing->completed = time(NULL);
+    for (int i = 0; i < finishing->stripeCount; i++)
+        SendFinACK(&finishing->fins[i].address, finishing->fins[i].addressLength, finishing->fins[i].sequence,
+                   finishing->fins[i].integrity);
+}
+
+// A FIN from a sender without a connection. If it is a stripe of a finished group whose FIN+ACK got lost, it gets it
+// again, anything else is ignored.
+
+void ResendStripeFinACK(const receivedDatagram* fin)
+{
+    stripeGroup** link = &stripeGroups;
+    while (*link != NULL)
+    {
+        stripeGroup* group = *link;
+        if (group->completed != 0 && time(NULL) - group->completed > STRIPE_GROUP_LINGER)
+        { // Done with, every stripe has had plenty of time to hear about it
+            *link = group->next;
+            free(group);
+            continue;
+        }
+        for (int i = 0; i < group->stripeCount; i++)
+        {
+            if (group->fins[i].held && group->fins[i].address.sin_addr.s_addr == fin->senderAddress.sin_addr.s_addr &&
+                group->fins[i].address.sin_port == fin->senderAddress.sin_port)
+            {
+                if (group->completed == 0)
+                {
+                    DEBUGMESSAGE(2, "Stripe %d of group %u is still waiting for the others", i + 1, group->id);
+                    return;
+                }
+                DEBUGMESSAGE(1, "Stripe %d of group %u asked again, resending FIN+ACK", i + 1, group->id);
+                SendFinACK(&group->fins[i].address, group->fins[i].addressLength, group->fins[i].sequence,
+                           group->fins[i].integrity);
+                return;
+            }
+        }
+        link = &group->next;
+    }
+    DEBUGMESSAGE(0, YELTEXT("Received message from invalid client"));
+}
+
+// Writer stage: writes in-order frames to their files and acts on control frames. Files stay open between frames
+// and are flushed whenever the queue runs dry.
+
+void* WriteIncomingData()
+{
+    while (1)
+    {
+        receivedDatagram* datagram = SpscRingPop(&writeRing);
+        const packet* packetToWrite = &datagram->packet;
+        if (datagram->connectionID == -1)
+        {
+            ResendStripeFinACK(datagram);
+            ReleaseDatagram(&writtenFreeRing, datagram);
+            continue;
+        }
+        connectionOutput* output = FindOutput(datagram->connectionID, packetToWrite->stream);
+
+        if (packetToWrite->flags == PACKETFLAG_FIN)
+        {
+            if (packetToWrite->dataLength > 0) // Batch mode senders send an empty FIN
+            {
+                if (output->file == NULL)
+                    output->file = OpenConnectionFile(output, "a");
+                if (fwrite(packetToWrite->data, 1, packetToWrite->dataLength, output->file) !=
+                    packetToWrite->dataLength || fputc('\n', output->file) == EOF)
+                {
+                    DEBUGMESSAGE(0, YELTEXT("WARNING: ")"Couldn't write the last message of connection %d",
+                                 output->id);
+                }
+            }
+            if (output->journal != -1)
+            { // The transfer is complete, nothing left to resume
+                char path[64];
+                JournalPath(path, output->journalState.transferID);
+                unlink(path);
+            }
+            unsigned int group = output->stripeGroup;
+            int index = output->stripeIndex, count = output->stripeCount;
+            RemoveOutput(output->id);
+            DEBUGMESSAGE(0, "FINished writing to file %d", datagram->connectionID);
+
+            // Only the connection's own algorithm got this far, so the FIN+ACK uses the FIN's
+            if (group != 0)
+                StripeFinished(group, index, count, datagram);
+            else
+                SendFinACK(&datagram->senderAddress, datagram->senderAddressLength, packetToWrite->sequenceNumber,
+                           packetToWrite->integrity);
+        }
+        else if (packetToWrite->flags == (PACKETFLAG_SYN | PACKETFLAG_CONTROL))
+        {
+            StartJournal(output, packetToWrite);
+        }
+        else if (packetToWrite->flags & PACKETFLAG_CONTROL)
+        {
+            HandleControlFrame(output, packetToWrite);
+        }
+        else if (packetToWrite->flags & PACKETFLAG_COMPRESSED)
+        {
+            static byte decompressed[DATA_BUFFER_SIZE];
+            unsigned short originalLength;
+            int length = -1;
+            if (packetToWrite->dataLength >= COMPRESSED_HEADER_LENGTH)
+            {
+                memcpy(&originalLength, packetToWrite->data, 2);
+                originalLength = ntohs(originalLength);
+                length = LzDecompress(packetToWrite->data + COMPRESSED_HEADER_LENGTH,
+                                      packetToWrite->dataLength - COMPRESSED_HEADER_LENGTH, decompressed, originalLength);
+            }
+            if (length == -1 || length != originalLength)
+            {
+                DEBUGMESSAGE(0, YELTEXT("WARNING: ")"Connection %d sent frame %d that doesn't decompress, it is lost",
+                             output->id, packetToWrite->sequenceNumber);
+            }
+            else
+            {
+                WriteOutput(output, decompressed, length);
+                atomic_fetch_add_explicit(&framesWritten, 1, memory_order_relaxed);
+            }
+        }
+        else
+        {
+            WriteOutput(output, packetToWrite->data, packetToWrite->dataLength);
+            atomic_fetch_add_explicit(&framesWritten, 1, memory_order_relaxed);
+        }
+        ReleaseDatagram(&writtenFreeRing, datagram);
+
+        if (SpscRingDepth(&writeRing) == 0)
+        {
+            for (connectionOutput* cursor = outputList; cursor != NULL; cursor = cursor->next)
+            {
+                if (cursor->file != NULL)
+                    fflush(cursor->file);
+            }
         }
     }
+    return NULL;
+}
+
+void RequestStatistics(int signalNumber)
+{
+    (void) signalNumber;
+    atomic_store(&statisticsRequested, 1);
 }
 
 int main(int argc, char* argv[])
 {
     srandom(time(NULL));
-    if (argc == 2)
+    if (argc >= 2)
     {
         debugLevel = strtol(argv[1], NULL, 10);
     }
+    int listeningPort = LISTENING_PORT;
+    for (int i = 2; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--budget=", 9) == 0)
+            reorderMemoryBudget = strtol(argv[i] + 9, NULL, 10) * 1024L;
+        else if (strncmp(argv[i], "--port=", 7) == 0 && (listeningPort = strtol(argv[i] + 7, NULL, 10)) > 0 &&
+                 listeningPort <= 65535)
+            continue;
+        else
+        {
+            printf("Usage: %s [debug level] [--budget=<kB>] [--port=<port>]\n", argv[0]);
+            printf("  --budget=<kB>  Memory all reorder buffers together may use (default %d)\n",
+                   REORDER_MEMORY_BUDGET);
+            printf("  --port=<port>  Port to listen on (default %d)\n", LISTENING_PORT);
+            exit(EXIT_FAILURE);
+        }
+    }
 
     socket_fd = InitializeSocket();
 
@@ -498,7 +2651,7 @@ int main(int argc, char* argv[])
 
     struct sockaddr_in socketAddress;
     socketAddress.sin_family = AF_INET;
-    socketAddress.sin_port = htons(LISTENING_PORT);
+    socketAddress.sin_port = htons(listeningPort);
     socketAddress.sin_addr.s_addr = INADDR_ANY;
     if (bind(socket_fd, (struct sockaddr*) &socketAddress, sizeof(socketAddress)) < 0)
     {
@@ -507,6 +2660,39 @@ int main(int argc, char* argv[])
 
     DEBUGMESSAGE(1, "Socket setup and bound successfully.");
 
+    // Let the kernel hand us runs of datagrams in one read, ReadIncomingMessages() splits them up again
+    if (setsockopt(socket_fd, SOL_UDP, UDP_GRO, &sockoptval, sizeof(sockoptval)) < 0)
+    {
+        DEBUGMESSAGE(1, "UDP_GRO not available, receiving one datagram per read");
+    }
+
+    if (SpscRingInitialize(&processRing, "network->process", PIPELINE_RING_SIZE) == -1 ||
+        SpscRingInitialize(&writeRing, "process->write", PIPELINE_RING_SIZE) == -1 ||
+        SpscRingInitialize(&processedFreeRing, "process->free", PIPELINE_RING_SIZE) == -1 ||
+        SpscRingInitialize(&writtenFreeRing, "write->free", PIPELINE_RING_SIZE) == -1 ||
+        SpscRingInitialize(&attachRing, "process->attach", PIPELINE_RING_SIZE) == -1)
+    {
+        CRASHWITHMESSAGE("Couldn't set up the pipeline");
+    }
+
+    // SIGUSR1 prints the pipeline statistics. Only this thread (the network stage) takes it, so that it interrupts
+    // recvmsg() and gets printed right away.
+    sigset_t statisticsSignal;
+    sigemptyset(&statisticsSignal);
+    sigaddset(&statisticsSignal, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &statisticsSignal, NULL);
+    pthread_t processingThread, writerThread;
+    if (pthread_create(&processingThread, NULL, ProcessIncomingMessages, NULL) != 0 ||
+        pthread_create(&writerThread, NULL, WriteIncomingData, NULL) != 0)
+    {
+        CRASHWITHERROR("pthread_create() failed");
+    }
+    pthread_sigmask(SIG_UNBLOCK, &statisticsSignal, NULL);
+    struct sigaction statisticsAction;
+    memset(&statisticsAction, 0, sizeof(statisticsAction));
+    statisticsAction.sa_handler = RequestStatistics;
+    sigaction(SIGUSR1, &statisticsAction, NULL);
+
     ReadIncomingMessages();
 
     return 0;
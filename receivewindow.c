@@ -0,0 +1,64 @@
+/* File: receivewindow.c
+ *
+ * Description:
+ * The receiving side of one connection as a state machine, see receivewindow.h.
+ */
+
+#include "receivewindow.h"
+
+void ReceiveWindowInitialize(receiveWindow* window, byte windowSize, unsigned short firstSequence)
+{
+    memset(window, 0, sizeof(receiveWindow));
+    window->windowSize = windowSize;
+    window->expected = firstSequence;
+}
+
+int ReceiveWindowClassify(const receiveWindow* window, unsigned short sequence)
+{
+    unsigned short offset = sequence - window->expected;
+    if (offset == 0)
+        return RECEIVE_WINDOW_NEXT;
+    if (!SEQUENCE_AFTER(sequence, window->expected))
+        return RECEIVE_WINDOW_BEHIND;
+    if (offset > window->windowSize)
+        return RECEIVE_WINDOW_BEYOND;
+    return window->buffered[RECEIVE_WINDOW_SLOT(sequence)] != NULL ? RECEIVE_WINDOW_BUFFERED : RECEIVE_WINDOW_AHEAD;
+}
+
+void ReceiveWindowStore(receiveWindow* window, unsigned short sequence, void* frame)
+{
+    window->buffered[RECEIVE_WINDOW_SLOT(sequence)] = frame;
+    window->bufferedFrames++;
+}
+
+void* ReceiveWindowFrame(const receiveWindow* window, unsigned short sequence)
+{
+    unsigned short offset = sequence - window->expected;
+    if (offset > window->windowSize)
+        return NULL;
+    return window->buffered[RECEIVE_WINDOW_SLOT(sequence)];
+}
+
+void ReceiveWindowDelivered(receiveWindow* window)
+{
+    window->expected++;
+}
+
+void* ReceiveWindowTakeNext(receiveWindow* window)
+{
+    int slot = RECEIVE_WINDOW_SLOT(window->expected);
+    void* frame = window->buffered[slot];
+    if (frame == NULL)
+        return NULL;
+    window->buffered[slot] = NULL;
+    window->bufferedFrames--;
+    window->expected++;
+    return frame;
+}
+
+int ReceiveWindowAdvertised(const receiveWindow* window, int room)
+{
+    if (room > window->windowSize)
+        room = window->windowSize;
+    return 1 + (room > 0 ? room : 0);
+}
@@ -0,0 +1,51 @@
+/* File: receivewindow.h
+ *
+ * Description:
+ * The receiving side of one connection as a state machine without sockets, threads or clocks: which sequence number
+ * comes next, which frames ahead of it fit the window, and putting the ones that arrive early back in order. The window
+ * only keeps pointers to whatever the caller holds a frame in, and hands them back once the frames before them are in.
+ * The caller does the I/O and owns the memory. receiver.c keeps its reorder buffer in it, ProtoSim its model receivers.
+ */
+
+#ifndef DVA218_LAB3B_RECEIVEWINDOW_H
+#define DVA218_LAB3B_RECEIVEWINDOW_H
+
+#include "common.h"
+
+// The window size is a byte, so this many slots always tell apart every frame a window can hold
+#define RECEIVE_WINDOW_SLOTS 256
+#define RECEIVE_WINDOW_SLOT(sequence) ((sequence) % RECEIVE_WINDOW_SLOTS)
+
+#define RECEIVE_WINDOW_NEXT 0       // The frame the window expects next
+#define RECEIVE_WINDOW_AHEAD 1      // Ahead of the next one, within the window and not buffered yet
+#define RECEIVE_WINDOW_BUFFERED 2   // Ahead of the next one and already buffered
+#define RECEIVE_WINDOW_BEYOND 3     // Further ahead than the window reaches
+#define RECEIVE_WINDOW_BEHIND 4     // Before the next one, so already taken in
+
+typedef struct receiveWindow receiveWindow;
+struct receiveWindow
+{
+    byte windowSize;            // Negotiated, the most frames ahead of expected that may be buffered
+    unsigned short expected;    // Next sequence to be taken in order
+    int bufferedFrames;         // Frames in buffered
+    void* buffered[RECEIVE_WINDOW_SLOTS]; // The caller's frames ahead of expected, NULL where none has arrived
+};
+
+void ReceiveWindowInitialize(receiveWindow* window, byte windowSize, unsigned short firstSequence);
+
+// Where a frame with this sequence number stands, one of the RECEIVE_WINDOW_ values
+int ReceiveWindowClassify(const receiveWindow* window, unsigned short sequence);
+// Buffers a frame that ReceiveWindowClassify() found RECEIVE_WINDOW_AHEAD
+void ReceiveWindowStore(receiveWindow* window, unsigned short sequence, void* frame);
+// The frame buffered for this sequence number, NULL if there is none
+void* ReceiveWindowFrame(const receiveWindow* window, unsigned short sequence);
+
+// Moves on past the expected frame, which the caller took in without buffering it
+void ReceiveWindowDelivered(receiveWindow* window);
+// Takes the expected frame out of the buffer and moves on past it. Returns NULL if it hasn't arrived yet.
+void* ReceiveWindowTakeNext(receiveWindow* window);
+
+// The window to advertise: the expected frame plus the buffer, or plus 'room' frames if the caller has less than that
+int ReceiveWindowAdvertised(const receiveWindow* window, int room);
+
+#endif //DVA218_LAB3B_RECEIVEWINDOW_H
@@ -12,6 +12,22 @@
  * Roundtime, average time for sending / ACKing packets:----- 20    
  * Error generator:------------------------------------------ 25   
  * Reading packets from the receiver:------------------------ 30
+ * Pacing, how late paced frames leave:--------------------- 40
+ *
+ * Options such as '--rate=<kB/s>' go between the debug level and the files. An unknown option prints the full list.
+ *
+ * Batch mode: './sender X file1 file2 directory ...' skips the menu and sends every listed file (and every regular
+ * file inside a listed directory) back to back over one connection, then disconnects. With '--resume', running the
+ * same command again after a crash continues where the receiver's journal says instead of starting over.
+ * With '--fanout=<receivers>' the batch goes to several receivers at once, built and checksummed only once.
+ * With '--stripes=<n>' the batch is sent by n processes at once, each over its own connection with its own share of
+ * every file.
+ * With '--streams=<n>' up to n files are multiplexed over the connection at once, and '--urgent=<path>' sends files
+ * ahead of and faster than the rest.
+ * A receiver on the same host gets the data frames through shared memory instead of the socket, unless '--no-shm'.
+ * With '--path=<source>-<destination>' (once per extra path) the frames are spread over several address pairs.
+ * A file argument of '-' sends standard input, packing small writes into full frames (see '--coalesce=<ms>'). It
+ * can't be combined with '--fanout'.
  * 
  * Description: 
  * Request connection to the receiver, sends everything within the text file "message" to the receiver through a TCP like implementation
@@ -27,14 +43,26 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <math.h>
-#include <semaphore.h>
+#include <limits.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <endian.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <errno.h>
+#include <sched.h>
 
 #include "common.h"
-
-void* ThreadedACKTimeout(timeoutHandlerData* timeoutData);
+#include "crc32c.h"
+#include "fec.h"
+#include "delta.h"
+#include "compression.h"
+#include "fanout.h"
+#include "sharedring.h"
+#include "sendwindow.h"
 
 void* ThreadedSYNTimeout(timeoutHandlerData* timeoutData);
+void ResendFrame(void* context, unsigned short sequence);
 
 int socket_fd;
 int connectionStatus = -1;
@@ -45,19 +73,219 @@ unsigned short frameSize = 500;
 struct sockaddr_in receiverAddress;
 struct sockaddr_in senderAddress;
 
-sem_t ackSemaphore;
-
-sem_t windowSemaphore;
-int lowestSequenceAwaited = -1;
+// The connection's frames in flight, round trip, resend timeout, congestion window and the receiver's advertised
+// window, see sendwindow.h. It runs on MonotonicMicroseconds() and takes no lock: SendStreamFrame() is its sending
+// thread, ReadPackets() its acknowledging thread and ResendTimeouts() its timer thread. windowMutex is only there for
+// the condition waits, SendStreamFrame() waits on windowCondition for room and ResendTimeouts() on resendCondition for
+// the next frame to time out.
+sendWindow connectionWindow;
+pthread_mutex_t windowMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t windowCondition;
+pthread_cond_t resendCondition;
+atomic_int waitingForWindow = 0;
+int frameSlots[ACK_TABLE_SIZE]; // The dataBufferArray slot of each frame in flight, set before it goes out
+
+// Broadcast whenever connectionStatus, KillThreads or negotiationAttempt change, or when the last missing ACK arrives.
+// Waiters check their condition with stateMutex held, so a change made right before SignalStateChange() is never missed.
+pthread_mutex_t stateMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t stateCondition;
+int negotiationAttempt = 0; // Bumped by every NegotiateConnection() so that SYN timeouts from earlier attempts stop
+atomic_int synAnsweredAttempt = 0; // Set to negotiationAttempt when the receiver answers our SYN, stops its timeout
+
+// Session tickets let a returning sender skip the wait for SYN+ACK and send data in its first flight.
+// The receiver hands one out in every SYN+ACK; we keep the latest in SESSION_TICKET_FILE, with the window and frame
+// sizes it was issued for and the ones that were asked for then. Only a sender asking for the same presents it.
+#define SESSION_TICKET_FILE ".session_ticket"
+int useSessionTickets = 1;
+byte requestedWindowSize; // What --window and --frame asked for, before the receiver had its say
+unsigned short requestedFrameSize;
+int usingSessionTicket = 0; // This session started sending before the SYN+ACK arrived
+byte synData[SYN_SHARED_RING_DATA_LENGTH]; // What the current SYN carries, ThreadedSYNTimeout resends the same thing
+int synDataLength = SYN_DATA_LENGTH;
+int pathMTU = DEFAULT_PATH_MTU; // Frames are split into fragments that fit in this, set with --mtu=<bytes>
+int desiredIntegrity = INTEGRITY_CRC32C; // Asked for in the SYN, packetIntegrity switches to what the receiver accepts
+atomic_long ackedBytes = 0; // Throughput measurement for sizing the send buffer
+
+// Adaptive frame size: SendFile() re-picks the fragment length and frameSize every FRAME_ADAPT_INTERVAL datagrams
+// from how many of them had to be resent. Counted by SendWireImage() and ResendFrame(), reset by AdaptFrameSize().
+int adaptiveFrameSize = 1; // Turned off with --fixed-frame
+int adaptiveFragmentLength = 0; // Fragment data length new frames use if it is below what pathMTU allows, 0 for none
+atomic_long adaptDatagramsSent = 0;   // Including resends
+atomic_long adaptDatagramsResent = 0;
+atomic_long adaptBytesSent = 0;       // Wire bytes of adaptDatagramsSent, gives their average length
+struct
+{
+    double weight, length, failure, lengthSquared, lengthFailure; // Decayed sums for the least squares fit
+    double beta; // Per byte failure term, negative until datagrams of different lengths have been seen
+} adaptFit = {0, 0, 0, 0, 0, -1};
+
+// Forward error correction, see MAX_FEC_GROUP_SIZE. Asked for with --fec=<group>/<parity>, used once the SYN+ACK
+// says the receiver agrees, so frames sent on a session ticket before that go without parity.
+byte desiredFecGroupSize = 0;
+byte desiredFecParityCount = 0;
+atomic_int fecGroupSize = 0; // Stored after fecParityCount by ReadPackets(), 0 while there is no FEC
+int fecParityCount = 0;
+fecParity fecClasses[MAX_FEC_PARITY_COUNT]; // The current group's parity so far, only SendFrame() touches these
+int fecGroupStarted = 0; // The current group's first frame is in fecClasses, groups started before FEC are skipped
+unsigned long fecParitySent = 0;
+
+// Resumable batch transfers (--resume): the SYN carries an id derived from the files being sent, and the SYN+ACK
+// says how far a receiver that journaled an earlier attempt of the same transfer got. Set by ReadPackets() before
+// it lets ConnectToReceiver() return.
+int resumableTransfer = 0;
+unsigned int transferID = 0;
+int resumeFiles = 0; // Files the receiver has started, the last of them continues at resumeOffset
+long long resumeOffset = 0;
+
+// Payload compression (--compress), see CODEC_LZ. Used once the SYN+ACK agrees to the codec. Frames that don't get
+// shorter make the ones after them skip compression, for twice as many frames every time it happens again in a row.
+byte desiredCodec = CODEC_NONE;
+atomic_int frameCodec = CODEC_NONE; // Set by ReadPackets()
+int compressionSkip = 0;            // Frames left to send without trying
+int compressionBackoff = 0;         // What compressionSkip is set to the next time a frame doesn't shrink
+unsigned long framesCompressed = 0, framesNotCompressed = 0;
+unsigned long long compressionBytesIn = 0, compressionBytesOut = 0;
+
+// Striped batch transfers (--stripes=<n>): the sender forks one process per stripe, each with its own socket,
+// handshake and window, and stripe i sends part i of every file (see CONTROL_STRIPE). Set in the child processes.
+int stripeCount = 1;
+int stripeIndex = -1;           // -1 when not striping
+unsigned int stripeGroup = 0;
+int batchFailed = 0;            // What the process exits with, a stripe that isn't told its transfer is done fails
+
+// One-to-many transfers (--fanout=<receivers>), see fanout.h. Batch mode then sends to all of them at once instead of
+// to addressString.
+struct sockaddr_in fanoutAddresses[MAX_FANOUT_RECEIVERS];
+int fanoutCount = 0;
+
+// Multiplexed batch transfers (--streams=<n>), see MAX_STREAMS: up to n files are sent at once over the connection,
+// interleaved frame by frame by SendStreams(), so that a large file doesn't hold up the small ones behind it.
+// Files named with --urgent=<path> go first and get STREAM_URGENT_PRIORITY times the share of the others.
+#define MAX_URGENT_PATHS 16
+int streamCount = 1;
+char* urgentPaths[MAX_URGENT_PATHS];
+int urgentPathCount = 0;
+unsigned short streamSequences[MAX_STREAMS]; // Stream sequence the next frame of each stream gets
+
+// A stream SendStreams() is sending a file over. Deficit round robin: every round a stream with a file gets its
+// quantum of bytes added to its deficit, and sends frames for as long as the deficit covers them.
+typedef struct outgoingStream outgoingStream;
+struct outgoingStream
+{
+    unsigned short id;
+    FILE* file;         // NULL while the stream has no file to send
+    const char* path;
+    int priority;       // The stream's quantum is this many frames per round
+    long deficit;       // Bytes the stream may still send this round
+    int frames;
+};
+
+// Streaming sources: a batch argument of '-' sends standard input as a file named "stdin". Whatever each read() returns
+// is packed into frames of frameSize the way Nagle's algorithm packs small writes into segments: a partial frame only
+// goes out at once if nothing is waiting for an ACK, and otherwise at the latest coalesceDeadline after its first byte.
+//Change COALESCE_DEADLINE_USEC to let small writes wait longer for more data to share their frame
+#define COALESCE_DEADLINE_USEC 20000
+long coalesceDeadline = COALESCE_DEADLINE_USEC; // Set with --coalesce=<ms>, 0 sends every read as it comes
+unsigned long coalescedReads = 0, coalescedFrames = 0, coalescedDeadlineFrames = 0;
+
+// Delta transfers (--delta), see CONTROL_DELTAFILE. The main thread asks for the signature of the receiver's copy of
+// a file and ReadPackets() puts the replies to the current request together in here, under stateMutex.
+int deltaTransfers = 0;
+struct
+{
+    unsigned short request;     // Sequence number of the current request, 0 while there is none
+    int replies;                // Replies of any kind to it so far
+    int noBasis;                // The receiver has no copy of the file
+    int basisID;
+    fileSignature signature;    // blocks is NULL until the first reply that has any
+    byte* blockReceived;        // One byte per block
+} pendingSignature;
+
+// Same-host data path, see sharedring.h. The SYN offers the ring when the receiver is on this host, and once the
+// SYN+ACK accepts it every frame goes in there instead of in a batch. The sending thread and ResendFrame() take turns
+// at it under sharedRingMutex.
+int useSharedRing = 1; // Turned off with --no-shm
+sharedRing dataRing = {NULL, NULL, 0, -1, 0, 0, 0};
+atomic_int sharedRingActive = 0; // Set by ReadPackets()
+pthread_mutex_t sharedRingMutex = PTHREAD_MUTEX_INITIALIZER;
+unsigned long framesShared = 0, sharedRingFull = 0;
+
+// Multipath, see MAX_SUBFLOWS. Subflow 0 is the connection's own path over socket_fd, every '--path' adds one with a
+// socket bound to its source address. SendStreamFrame() gives each new frame to the subflow with the lowest round
+// trip that has room in its congestion window, the frame's ACK is counted on the subflow that sent it, and a frame
+// whose timeout runs out goes out again over the fastest other subflow. Every subflow has its own round trip and
+// congestion window, the sliding window and the receiver window still limit them all together.
+//Change SUBFLOW_INITIAL_WINDOW to let new subflows start with more frames in flight
+#define SUBFLOW_INITIAL_WINDOW 2
+typedef struct subflow subflow;
+struct subflow
+{
+    struct sockaddr_in source;
+    struct sockaddr_in destination;
+    int socket_fd;
+    datagramBatch* batch;
+    atomic_int joined;                  // Set by ReadPackets() when the receiver answers the join
+    _Atomic double roundTime;           // Smoothed, in microseconds, 0 until the first sample
+    _Atomic double congestionWindow;    // In frames
+    _Atomic double slowStartThreshold;
+    atomic_int inFlight;
+    atomic_llong reducedAt;             // When the window was last cut, so that it is cut once per round trip
+    atomic_ulong framesSent, framesLost;
+};
+subflow subflows[MAX_SUBFLOWS];
+int subflowCount = 1;
+unsigned int joinKey = 0; // From the SYN+ACK
+atomic_int frameSubflow[ACK_TABLE_SIZE];    // Which subflow a frame waiting for its ACK was sent over, -1 once ACKed
+atomic_llong frameSentAt[ACK_TABLE_SIZE];   // In microseconds, 0 once the frame has been resent (Karn's rule)
+atomic_int waitingForSubflow = 0;
+
+// New frames collect in here and go out in as few sendmsg() calls as possible. SendFrame() flushes it before it
+// waits for anything, so a frame never sits in it while the sender is blocked.
+datagramBatch frameBatch;
+
+packet* dataBufferArray = NULL; // One slot per window position, holds the frames that are still waiting for an ACK
+int bufferSlot = 0;
+
+// A data frame the way it went out: one finished datagram per fragment, header and checksum or CRC32C trailer
+// included, back to back. Every datagram but the last is datagramLength bytes long. ResendFrame() resends straight
+// from it instead of copying the frame out of dataBufferArray and sealing it all over again.
+typedef struct wireImage wireImage;
+struct wireImage
+{
+    int fragmentCount;
+    int datagramLength;
+    int length;
+    atomic_int readers;     // ResendFrame() calls resending from it, SendStreamFrame() waits for them before reusing it
+    byte datagrams[MAX_FRAME_DATA_LENGTH + MAX_FRAGMENTS * (PACKET_HEADER_LENGTH + CRC32C_TRAILER_LENGTH)];
+};
+wireImage* wireImages = NULL; // One per dataBufferArray slot
+
+// What ResendFrame() resends with. ReadPackets() and ResendTimeouts() both resend, so each has its own.
+typedef struct resender resender;
+struct resender
+{
+    ACKmngr* ACKsPointer;
+    datagramBatch batch;
+    packet frame;           // A whole frame for the shared memory ring
+};
+
+// Pacing: new frames are spread out at windowSize frames per averageRoundTime, or at pacingRateCap if that is lower.
+// Only SendFrame() touches these, so they need no locking.
+double pacingRateCap = 0; // Bytes per second, 0 means no cap. Set with --rate=<kB/s> or menu option 6
+double pacingTokens = 0;  // Bytes we may send right now
+struct timespec pacingLastRefill;
+int pacingDelayedFrames = 0;
+double pacingTotalDrift = 0; // How late delayed frames left compared to their schedule, in microseconds
+double pacingWorstDrift = 0;
 
 char* addressString = "127.0.0.1";
 
-// Change BASE_AVERAGE in order to lower or raise the number of samples that the average runtime manager bases its results on
-#define BASE_AVERAGE 5
-sem_t roundTimeSemaphore;
-float roundTime;
-float averageRoundTime = 10000;
-struct roundTimeHandler timeStamper[50];
+//Change MIN_AVERAGE_ROUND_TIME and MAX_AVERAGE_ROUND_TIME to change the round trips pacing and the send buffer assume
+#define MIN_AVERAGE_ROUND_TIME 300
+#define MAX_AVERAGE_ROUND_TIME 3000
+// connectionWindow's smoothed round trip in microseconds, kept between the two, for pacing and the send buffer.
+// ReadPackets() updates it with every sample.
+_Atomic float averageRoundTime = 10000;
 
 byte desiredWindowSize;
 unsigned short desiredFrameSize;
@@ -67,7 +295,7 @@ unsigned short suggestedFrameSize;
 #define MIN_ACCEPTED_WINDOW_SIZE 1
 #define MAX_ACCEPTED_WINDOW_SIZE 16
 #define MIN_ACCEPTED_FRAME_SIZE 1
-#define MAX_ACCEPTED_FRAME_SIZE 65535
+#define MAX_ACCEPTED_FRAME_SIZE MAX_FRAME_DATA_LENGTH
 
 //Change MAX_MESSAGE_LENGTH in order to accommodate larger text files
 #define MAX_MESSAGE_LENGTH 20000
@@ -75,14 +303,94 @@ unsigned short suggestedFrameSize;
 //Change MAX_TIMEOUT_RETRIES in order to either allow less or more retries before a packet stops running timeouts and resends
 #define MAX_TIMEOUT_RETRIES 99999
 
-//
-#define TIMEOUT_USLEEP_TIME (averageRoundTime * 4)
+//Change PACING_BURST_FRAMES to let the pacer send more (or fewer) frames back to back after an idle period
+#define PACING_BURST_FRAMES 2
+
+//Change MAX_FIN_RETRIES to control how many times batch mode resends its FIN before giving up on the FIN+ACK
+#define MAX_FIN_RETRIES 10
+
+//Change FRAME_ADAPT_INTERVAL to re-pick the frame size more (or less) often, counted in datagrams sent
+#define FRAME_ADAPT_INTERVAL 512
+//Change MIN_ADAPTIVE_FRAGMENT_LENGTH to stop fragments from getting smaller than this however bad the link gets
+#define MIN_ADAPTIVE_FRAGMENT_LENGTH 64
+//Change FRAME_ADAPT_DECAY to make the adaptive frame size forget old intervals faster (lower) or slower (higher)
+#define FRAME_ADAPT_DECAY 0.75
+//Change DATAGRAM_COST_BYTES to weigh the per-datagram work of both programs more or less against the bytes sent.
+//It counts as that many extra header bytes.
+#define DATAGRAM_COST_BYTES 64
+
+//Change RESEND_IDLE_WAIT to make ResendTimeouts() notice KillThreads sooner or later while nothing is in flight
+#define RESEND_IDLE_WAIT 100000
+
+//Change MAX_COMPRESSION_BACKOFF to retry compressing data that didn't compress more or less often
+#define MAX_COMPRESSION_BACKOFF 64
+//Change MIN_COMPRESSED_FRAME to leave out frames too short to be worth it
+#define MIN_COMPRESSED_FRAME 64
+
+//Change STRIPE_FIN_WAIT_SECONDS to wait longer or shorter for the other stripes once this one is done
+#define STRIPE_FIN_WAIT_SECONDS 120
+#define STRIPE_FIN_RESEND_SECONDS 1
+
+//Change DELTA_SIGNATURE_RETRIES to give up on a receiver that doesn't answer signature requests sooner or later
+#define DELTA_SIGNATURE_RETRIES 10
+
+//Change STREAM_URGENT_PRIORITY to give the files named with --urgent a larger or smaller share of a multiplexed batch
+#define STREAM_URGENT_PRIORITY 8
 
 //---------------------------------------------------------------------------------------------------------------
 
+// Loads the cached session ticket for addressString. Returns 1 and fills in the parameters it was issued for if
+// there is one that hasn't expired yet and was handed out when we asked for requestedWindowSize and
+// requestedFrameSize, 0 otherwise.
+
+int LoadSessionTicket(unsigned int* ticket, byte* ticketWindowSize, unsigned short* ticketFrameSize)
+{
+    FILE* fp;
+    if ((fp = fopen(SESSION_TICKET_FILE, "r")) == NULL)
+        return 0;
+
+    char address[64];
+    int askedWindow, askedFrame, window, frame;
+    long expiry;
+    int found = (fscanf(fp, "%63s %d %d %d %d %u %ld", address, &askedWindow, &askedFrame, &window, &frame, ticket,
+                        &expiry) == 7 &&
+                 strcmp(address, addressString) == 0 && expiry > time(NULL) &&
+                 window >= MIN_ACCEPTED_WINDOW_SIZE && window <= MAX_ACCEPTED_WINDOW_SIZE &&
+                 frame >= MIN_ACCEPTED_FRAME_SIZE && frame <= MAX_ACCEPTED_FRAME_SIZE);
+    fclose(fp);
+    if (found && (askedWindow != requestedWindowSize || askedFrame != requestedFrameSize))
+    { // It would quietly replace this run's --window and --frame with what the receiver gave other ones
+        DEBUGMESSAGE(1, "Session ticket was issued for window:%d and frame:%d, not using it", askedWindow, askedFrame);
+        found = 0;
+    }
+    if (found)
+    {
+        *ticketWindowSize = window;
+        *ticketFrameSize = frame;
+    }
+    return found;
+}
+
+void SaveSessionTicket(unsigned int ticket, byte ticketWindowSize, unsigned short ticketFrameSize)
+{
+    if (!useSessionTickets)
+        return;
+    FILE* fp;
+    if ((fp = fopen(SESSION_TICKET_FILE, "w")) == NULL)
+    {
+        DEBUGMESSAGE(1, YELTEXT("Couldn't save session ticket"));
+        return;
+    }
+    fprintf(fp, "%s %d %d %d %d %u %ld\n", addressString, requestedWindowSize, requestedFrameSize, ticketWindowSize,
+            ticketFrameSize, ticket, (long) time(NULL) + SESSION_TICKET_LIFETIME);
+    fclose(fp);
+}
+
+//---------------------------------------------------------------------------------------------------------------
 // Function that negotiates the three way handshake between the sender and receiver, negotiation window & frame size etc.
+// A non-zero ticket is presented to the receiver, see SESSION_TICKET_FILE.
 
-int NegotiateConnection(byte windowSizeToRequest, unsigned short frameSizeToRequest, ACKmngr* ACKsPointer)
+int NegotiateConnection(byte windowSizeToRequest, unsigned short frameSizeToRequest, unsigned int ticket)
 {
     desiredWindowSize = windowSizeToRequest;
     desiredFrameSize = frameSizeToRequest;
@@ -114,119 +422,515 @@ int NegotiateConnection(byte windowSizeToRequest, unsigned short frameSizeToRequ
     // 'packet' struct defined in common.h
     packet packetToSend;
 
-    byte packetData[3];
-    packetData[0] = desiredWindowSize;
+    synData[0] = desiredWindowSize;
     byte* desiredFrameSizeBytes = (byte*) (&desiredFrameSize);
-    packetData[1] = desiredFrameSizeBytes[0];
-    packetData[2] = desiredFrameSizeBytes[1];
-    WritePacket(&packetToSend, PACKETFLAG_SYN, (void*) packetData, 3, 0);
+    synData[1] = desiredFrameSizeBytes[0];
+    synData[2] = desiredFrameSizeBytes[1];
+    synData[3] = desiredIntegrity;
+    synData[4] = desiredFecGroupSize;
+    synData[5] = desiredFecParityCount;
+    unsigned int transferIDBytes = htonl(transferID);
+    memcpy(synData + 6, &transferIDBytes, 4);
+    synData[10] = desiredCodec;
+    synDataLength = SYN_DATA_LENGTH;
+    if (ticket != 0)
+    {
+        unsigned int ticketBytes = htonl(ticket);
+        memcpy(synData + SYN_DATA_LENGTH, &ticketBytes, 4);
+        synDataLength = SYN_TICKET_DATA_LENGTH;
+    }
+    if (useSharedRing && retval == 1 && subflowCount == 1 &&
+        (dataRing.header != NULL || (SharedRingPeerIsLocal(&receiverAddress) && SharedRingCreate(&dataRing) == 0)))
+    {
+        unsigned int ticketBytes = htonl(ticket);
+        unsigned int pid = htonl(getpid());
+        unsigned int fd = htonl(dataRing.fd);
+        unsigned long long token = htobe64(dataRing.header->token);
+        memcpy(synData + SYN_DATA_LENGTH, &ticketBytes, 4);
+        memcpy(synData + SYN_TICKET_DATA_LENGTH, &pid, 4);
+        memcpy(synData + SYN_TICKET_DATA_LENGTH + 4, &fd, 4);
+        memcpy(synData + SYN_TICKET_DATA_LENGTH + 8, &token, 8);
+        synDataLength = SYN_SHARED_RING_DATA_LENGTH;
+    }
+    WritePacket(&packetToSend, PACKETFLAG_SYN, (void*) synData, synDataLength, 0);
 
     timeoutHandlerData* timeoutData;
     if ((timeoutData = malloc(sizeof(timeoutHandlerData))) == NULL)
     {
         CRASHWITHERROR("malloc for timeoutHandlerData in NegotiateConnection() failed");
     }
-    ACKsPointer->Table[0] = 0;
     timeoutData->sequenceNumber = 0;
-    timeoutData->flags = PACKETFLAG_SYN;
-    timeoutData->ACKsPointer = ACKsPointer;
+    pthread_mutex_lock(&stateMutex);
+    timeoutData->negotiationAttempt = ++negotiationAttempt;
+    pthread_mutex_unlock(&stateMutex);
 
     pthread_t timeoutThread;
     pthread_create(&timeoutThread, NULL, (void*) ThreadedSYNTimeout, timeoutData);
+    pthread_detach(timeoutThread);
     SendPacket(socket_fd, &packetToSend, &receiverAddress, receiverAddressLength);
     return 0;
 }
 
 //---------------------------------------------------------------------------------------------------------------
-// The function that continously updates the roundTime average, this value is then used as a base for the timeouts
+// Wakes up everyone waiting on stateCondition. Call it right after changing the state they are waiting for.
+
+void SignalStateChange()
+{
+    pthread_mutex_lock(&stateMutex);
+    pthread_cond_broadcast(&stateCondition);
+    pthread_mutex_unlock(&stateMutex);
+}
 
-float roundTimeManager()
+// The CLOCK_MONOTONIC time timeoutUsec microseconds from now, for timed waits on stateCondition
+
+void DeadlineIn(long timeoutUsec, struct timespec* deadline)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeoutUsec / 1000000;
+    deadline->tv_nsec += (timeoutUsec % 1000000) * 1000;
+    if (deadline->tv_nsec >= 1000000000)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+// Waits until KillThreads is 1, or until timeoutUsec microseconds have passed. Returns 1 if KillThreads is set.
+
+int WaitForShutdown(long timeoutUsec)
 {
-    memset(timeStamper, 0, 50 * 8);
-    float roundTimeTable[BASE_AVERAGE];
-    memset(roundTimeTable, 0, sizeof(float) * BASE_AVERAGE);
-    float lastReportedRoundTime = 0;
-    int i = 0;
-    int divider = 0; // Used when dividing the sum of all samples, necessary to avoid dividing by '0' and to alow averages based on less then the full sample group
-    int roundTimeSemCounter = 0;
-    DEBUGMESSAGE_EXACT(DEBUGLEVEL_ROUNDTIME, CYNTEXT("roundTimeManager thread up and running, waiting for roundTimeSemaphore\n"));
+    struct timespec deadline;
+    DeadlineIn(timeoutUsec, &deadline);
 
+    pthread_mutex_lock(&stateMutex);
     while (KillThreads != 1)
     {
-        if (KillThreads == 1)
+        if (pthread_cond_timedwait(&stateCondition, &stateMutex, &deadline) != 0)
+            break; // Timed out
+    }
+    int killed = (KillThreads == 1);
+    pthread_mutex_unlock(&stateMutex);
+    return killed;
+}
+
+// How long to wait for an answer before asking again, in microseconds: connectionWindow's resend timeout, which is
+// SEND_WINDOW_INITIAL_TIMEOUT until a round trip has been measured
+
+long ResendTimeout()
+{
+    return (long) (connectionWindow.timeout * connectionWindow.backoff);
+}
+
+//---------------------------------------------------------------------------------------------------------------
+// Multipath subflows, see MAX_SUBFLOWS
+
+long long MonotonicMicroseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// Sends everything batched for any subflow
+void FlushFrameBatches()
+{
+    FlushBatch(&frameBatch);
+    for (int i = 1; i < subflowCount; i++)
+        FlushBatch(subflows[i].batch);
+}
+
+// Parses '<source>-<destination>' into a new subflow. Returns 0 if it is malformed or there are too many.
+
+int AddSubflow(const char* path)
+{
+    char source[INET_ADDRSTRLEN];
+    const char* dash = strchr(path, '-');
+    if (subflowCount == MAX_SUBFLOWS || dash == NULL || dash - path >= INET_ADDRSTRLEN)
+        return 0;
+    memcpy(source, path, dash - path);
+    source[dash - path] = '\0';
+    subflow* flow = &subflows[subflowCount];
+    memset(flow, 0, sizeof(*flow));
+    flow->source.sin_family = AF_INET;
+    flow->destination.sin_family = AF_INET;
+    flow->destination.sin_port = htons(LISTENING_PORT);
+    if (inet_pton(AF_INET, source, &flow->source.sin_addr) != 1 ||
+        inet_pton(AF_INET, dash + 1, &flow->destination.sin_addr) != 1)
+        return 0;
+    subflowCount++;
+    return 1;
+}
+
+// Opens a socket bound to each subflow's source address, leaving out the ones that can't be bound to.
+// Has to run before ReadPackets() starts, which waits on all of them.
+
+void OpenSubflows()
+{
+    subflows[0].socket_fd = socket_fd;
+    subflows[0].batch = &frameBatch;
+    int opened = 1;
+    for (int i = 0; i < subflowCount; i++)
+    {
+        subflow* flow = &subflows[i];
+        atomic_store(&flow->congestionWindow, SUBFLOW_INITIAL_WINDOW);
+        atomic_store(&flow->slowStartThreshold, windowSize);
+        if (i == 0)
         {
-            printf(RED"------------roundTimeManager KillThreads: ["RESET" %d "RED"]------------\n"RESET, KillThreads);
-            printf(RED"------------roundTimeManager thread shutting down------------\n"RESET);
-            usleep(1000);
-            pthread_exit(NULL);
+            atomic_store(&flow->joined, 1);
+            continue;
         }
-        sem_getvalue(&roundTimeSemaphore, &roundTimeSemCounter);
-        for (int a = 0; a < windowSize; a++)
+        if ((flow->socket_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+            bind(flow->socket_fd, (struct sockaddr*) &flow->source, sizeof(flow->source)) == -1)
         {
-            if (roundTime != lastReportedRoundTime)
-            {
-                roundTimeTable[i] = roundTime;
-                i++;
-                if (i == BASE_AVERAGE)
-                {
-                    i = 0;
-                }
-                averageRoundTime = 0;
-                for (int u = 0; u < BASE_AVERAGE; u++)
-                {
-                    if (roundTimeTable[u] != 0)
-                    {
-                        divider++;
-                        averageRoundTime += roundTimeTable[u];
-                    }
-                }
-                if (divider > 0)
-                {
-                    averageRoundTime = (averageRoundTime / divider);
-
-                    DEBUGMESSAGE_EXACT(DEBUGLEVEL_ROUNDTIME, CYN
-                            "averageRoundTime set to: ["
-                            RESET
-                            " %.0f "
-                            CYN
-                            "]     using: ["
-                            RESET
-                            " %d "
-                            CYN
-                            "] samples.  SemCounter: ["
-                            RESET
-                            " %d "
-                            CYN
-                            "]\n"
-                            RESET, averageRoundTime, divider, roundTimeSemCounter);
-                    divider = 0;
-
-                }
-                if (averageRoundTime < 300)
-                {
-                    averageRoundTime = 300;
-                }
-                else if (averageRoundTime > 3000)
-                {
-                    averageRoundTime = 3000;
-                }
-                lastReportedRoundTime = roundTime;
-            }
-            else
-            {
-                DEBUGMESSAGE_EXACT(DEBUGLEVEL_ROUNDTIME, CYN
-                        "."
-                        RESET);
-            }
+            DEBUGMESSAGE(0, YELTEXT("WARNING: ")"Can't send from %s (%s), leaving that path out",
+                         inet_ntoa(flow->source.sin_addr), strerror(errno));
+            if (flow->socket_fd >= 0)
+                close(flow->socket_fd);
+            continue;
+        }
+        if ((flow->batch = malloc(sizeof(datagramBatch))) == NULL)
+        {
+            CRASHWITHERROR("malloc() for a subflow batch in OpenSubflows() failed");
+        }
+        InitializeBatch(flow->batch, flow->socket_fd, &flow->destination, sizeof(flow->destination));
+        subflows[opened++] = *flow;
+    }
+    subflowCount = opened;
+    for (int i = 0; i < ACK_TABLE_SIZE; i++)
+        atomic_init(&frameSubflow[i], -1);
+}
+
+// Joins every subflow to the connection with the key from the SYN+ACK. Subflows the receiver doesn't answer are
+// never scheduled.
+
+void JoinSubflows()
+{
+    subflows[0].destination = receiverAddress;
+    if (joinKey == 0)
+    {
+        DEBUGMESSAGE(0, YELTEXT("WARNING: ")"The receiver doesn't take subflows, sending over one path");
+        return;
+    }
+    unsigned int joinKeyBytes = htonl(joinKey);
+    packet joinPacket;
+    for (int attempt = 0; attempt <= MAX_TIMEOUT_RETRIES && KillThreads != 1; attempt++)
+    {
+        int unjoined = 0;
+        for (int i = 1; i < subflowCount; i++)
+        {
+            if (atomic_load(&subflows[i].joined))
+                continue;
+            WritePacket(&joinPacket, PACKETFLAG_SYN | PACKETFLAG_CONTROL, &joinKeyBytes, SUBFLOW_JOIN_DATA_LENGTH, 0);
+            SendPacket(subflows[i].socket_fd, &joinPacket, &subflows[i].destination, sizeof(subflows[i].destination));
+            unjoined++;
         }
+        if (unjoined == 0)
+            break;
 
-        DEBUGMESSAGE_EXACT(DEBUGLEVEL_ROUNDTIME, "\n");
-        sem_wait(&roundTimeSemaphore);
+        struct timespec deadline;
+        DeadlineIn(ResendTimeout(), &deadline);
+        pthread_mutex_lock(&stateMutex);
+        while (unjoined > 0 && KillThreads != 1)
+        {
+            unjoined = 0;
+            for (int i = 1; i < subflowCount; i++)
+                unjoined += !atomic_load(&subflows[i].joined);
+            if (unjoined > 0 && pthread_cond_timedwait(&stateCondition, &stateMutex, &deadline) != 0)
+                break; // Timed out, send the joins that weren't answered again
+        }
+        pthread_mutex_unlock(&stateMutex);
+    }
+    for (int i = 1; i < subflowCount; i++)
+    {
+        if (!atomic_load(&subflows[i].joined))
+        {
+            DEBUGMESSAGE(0, YELTEXT("WARNING: ")"Subflow %d never joined, not sending over it", i);
+        }
     }
+}
 
-    printf(RED"------------roundTimeManager thread shutting down------------\n"RESET);
-    usleep(1000);
-    pthread_exit(NULL);
+// The joined subflow with the lowest round trip other than exclude, counting the ones without a sample yet as the
+// fastest so that every subflow gets measured. With needRoom, only subflows with room in their congestion window.
+// Returns -1 if there is none.
+
+int FastestSubflow(int exclude, int needRoom)
+{
+    int fastest = -1;
+    for (int i = 0; i < subflowCount; i++)
+    {
+        subflow* flow = &subflows[i];
+        if (i == exclude || !atomic_load(&flow->joined) ||
+            (needRoom && atomic_load(&flow->inFlight) >= atomic_load(&flow->congestionWindow)))
+            continue;
+        if (fastest < 0 || atomic_load(&flow->roundTime) < atomic_load(&subflows[fastest].roundTime))
+            fastest = i;
+    }
+    return fastest;
+}
+
+// Picks the subflow a new frame goes out over, waiting until one has room in its congestion window.
+// Returns its index.
+
+int ScheduleSubflow(unsigned short sequence)
+{
+    if (subflowCount == 1)
+        return 0;
+    int chosen;
+    while ((chosen = FastestSubflow(-1, 1)) < 0 && KillThreads != 1)
+    {
+        FlushFrameBatches(); // The frames in there are what the ACKs that open a window up are waiting for
+        struct timespec deadline;
+        DeadlineIn((long) averageRoundTime, &deadline);
+        pthread_mutex_lock(&stateMutex);
+        atomic_store(&waitingForSubflow, 1);
+        if (FastestSubflow(-1, 1) < 0 && KillThreads != 1)
+            pthread_cond_timedwait(&stateCondition, &stateMutex, &deadline);
+        atomic_store(&waitingForSubflow, 0);
+        pthread_mutex_unlock(&stateMutex);
+    }
+    if (chosen < 0)
+        chosen = 0;
+    atomic_fetch_add(&subflows[chosen].inFlight, 1);
+    atomic_fetch_add_explicit(&subflows[chosen].framesSent, 1, memory_order_relaxed);
+    atomic_store(&frameSentAt[ACK_SLOT(sequence)], MonotonicMicroseconds());
+    atomic_store(&frameSubflow[ACK_SLOT(sequence)], chosen);
+    return chosen;
+}
+
+// Called by ReadPackets() for every newly ACKed frame: takes a round trip sample from it and grows the congestion
+// window of the subflow it was sent over, slow start below the threshold and one frame per round trip above it.
+
+void SubflowACKed(unsigned short sequence)
+{
+    int flowIndex = atomic_exchange(&frameSubflow[ACK_SLOT(sequence)], -1);
+    if (flowIndex < 0)
+        return;
+    subflow* flow = &subflows[flowIndex];
+    atomic_fetch_sub(&flow->inFlight, 1);
+    long long sentAt = atomic_exchange(&frameSentAt[ACK_SLOT(sequence)], 0);
+    if (sentAt != 0)
+    {
+        double sample = MonotonicMicroseconds() - sentAt;
+        double smoothed = atomic_load(&flow->roundTime);
+        atomic_store(&flow->roundTime, smoothed == 0 ? sample : (7 * smoothed + sample) / 8);
+    }
+    double window = atomic_load(&flow->congestionWindow);
+    window += window < atomic_load(&flow->slowStartThreshold) ? 1 : 1 / window;
+    atomic_store(&flow->congestionWindow, window < windowSize ? window : windowSize);
+    if (atomic_load(&waitingForSubflow))
+        SignalStateChange();
+}
+
+// Called by ResendFrame() before it resends a frame: counts the loss on the subflow that sent it,
+// cutting that subflow's window at most once per round trip, and moves the frame to the fastest other subflow.
+// Returns the subflow to resend it over.
+
+int SubflowLost(unsigned short sequence)
+{
+    int slot = ACK_SLOT(sequence);
+    int lostIndex = atomic_load(&frameSubflow[slot]);
+    if (lostIndex < 0)
+        return 0; // ACKed meanwhile
+    subflow* lost = &subflows[lostIndex];
+    atomic_store(&frameSentAt[slot], 0);
+    atomic_fetch_add_explicit(&lost->framesLost, 1, memory_order_relaxed);
+    long long now = MonotonicMicroseconds();
+    long long reducedAt = atomic_load(&lost->reducedAt);
+    double roundTime = atomic_load(&lost->roundTime) > 0 ? atomic_load(&lost->roundTime) : averageRoundTime;
+    if (now - reducedAt > roundTime && atomic_compare_exchange_strong(&lost->reducedAt, &reducedAt, now))
+    {
+        double threshold = atomic_load(&lost->congestionWindow) / 2;
+        atomic_store(&lost->slowStartThreshold, threshold > 1 ? threshold : 1);
+        atomic_store(&lost->congestionWindow, threshold > 1 ? threshold : 1);
+    }
+
+    int chosen = FastestSubflow(lostIndex, 0);
+    if (chosen < 0 || !atomic_compare_exchange_strong(&frameSubflow[slot], &lostIndex, chosen))
+        return lostIndex;
+    atomic_fetch_sub(&lost->inFlight, 1);
+    atomic_fetch_add(&subflows[chosen].inFlight, 1);
+    return chosen;
+}
+
+// Waits until a datagram is waiting on any subflow's socket. Returns the subflow's index, or -1 after a while
+// without any, so that the caller gets to check KillThreads.
+
+int PollSubflows()
+{
+    static int next = 0;
+    struct pollfd sockets[MAX_SUBFLOWS];
+    for (int i = 0; i < subflowCount; i++)
+    {
+        sockets[i].fd = subflows[i].socket_fd;
+        sockets[i].events = POLLIN;
+    }
+    if (poll(sockets, subflowCount, 100) <= 0)
+        return -1;
+    for (int i = 0; i < subflowCount; i++)
+    { // Take turns, so that a busy subflow can't hold up the others' ACKs
+        int index = (next + i) % subflowCount;
+        if (sockets[index].revents != 0)
+        {
+            next = index + 1;
+            return index;
+        }
+    }
+    return -1;
+}
+
+//---------------------------------------------------------------------------------------------------------------
+// Grows the send buffer to fit a full window, or twice the measured bandwidth-delay product if that is larger.
+// Throughput is measured from ACKed bytes over at least 100 ms.
+
+void SizeSendBuffer()
+{
+    static struct timespec measurementStart;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (measurementStart.tv_sec == 0 && measurementStart.tv_nsec == 0)
+        measurementStart = now;
+
+    double elapsed = (now.tv_sec - measurementStart.tv_sec) + (now.tv_nsec - measurementStart.tv_nsec) / 1e9;
+    int bytesNeeded = windowSize * FrameSocketBufferCost(frameSize, pathMTU);
+    if (elapsed >= 0.1)
+    {
+        double throughput = atomic_exchange(&ackedBytes, 0) / elapsed;
+        double bandwidthDelayProduct = throughput * (averageRoundTime / 1000000.0);
+        if (2 * bandwidthDelayProduct > bytesNeeded)
+            bytesNeeded = (int) (2 * bandwidthDelayProduct);
+        measurementStart = now;
+    }
+    GrowSocketBuffer(socket_fd, SO_SNDBUF, bytesNeeded);
+}
+
+//---------------------------------------------------------------------------------------------------------------
+// Adopts the negotiated parameters and opens the window. Called once per session, either when the SYN+ACK arrives
+// or right away when a session ticket lets us send in the first flight.
+
+void EstablishConnection(byte negotiatedWindowSize, unsigned short negotiatedFrameSize)
+{
+    windowSize = negotiatedWindowSize;
+    frameSize = negotiatedFrameSize;
+    // Until the first ACK tells us otherwise, the receiver has room for one window. Nothing is in flight yet, so the
+    // threads sharing connectionWindow find nothing to do in it while it opens.
+    SendWindowOpen(&connectionWindow, windowSize, connectionWindow.next);
+    SizeSendBuffer();
+    connectionStatus = 1; // connectionStatus set to "connected"
+    SignalStateChange();
+    printf(GRN"Connection to Receiver Established!\n"RESET);
+    DEBUGMESSAGE(1, "Packets protected by %s%s%s", IntegrityName(packetIntegrity),
+                 packetIntegrity == INTEGRITY_CRC32C ? ", using " : "",
+                 packetIntegrity == INTEGRITY_CRC32C ? Crc32cImplementation() : "");
+}
+
+//---------------------------------------------------------------------------------------------------------------
+// Adds a SIGNATURE+ACK reply to pendingSignature if it answers the current request, see CONTROL_DELTAFILE
+
+void HandleSignatureReply(const packet* reply)
+{
+    if (reply->dataLength < DELTA_SIGNATURE_HEADER_LENGTH)
+        return;
+    unsigned long long fileSize;
+    unsigned int header[4];
+    memcpy(&fileSize, reply->data, 8);
+    memcpy(header, reply->data + 8, sizeof(header));
+    fileSize = be64toh(fileSize);
+    int blockSize = ntohl(header[0]);
+    int blockCount = ntohl(header[1]);
+    int firstBlock = ntohl(header[2]);
+    int basisID = ntohl(header[3]);
+    int entries = (reply->dataLength - DELTA_SIGNATURE_HEADER_LENGTH) / DELTA_SIGNATURE_ENTRY_LENGTH;
+
+    pthread_mutex_lock(&stateMutex);
+    fileSignature* signature = &pendingSignature.signature;
+    if (pendingSignature.request == 0 || reply->sequenceNumber != pendingSignature.request)
+    {
+        pthread_mutex_unlock(&stateMutex);
+        DEBUGMESSAGE(2, "Signature reply %d isn't for the current request", reply->sequenceNumber);
+        return;
+    }
+    pendingSignature.replies++;
+    if (blockSize > 0 && blockCount == 0)
+        pendingSignature.noBasis = 1;
+    else if (blockSize > 0 && signature->blocks == NULL)
+    { // The first reply with blocks in it says how many there are
+        if (blockSize == DeltaBlockSize(fileSize) && blockCount > 0 &&
+            (unsigned long long) blockCount == fileSize / blockSize &&
+            (signature->blocks = malloc(sizeof(blockSignature) * blockCount)) != NULL &&
+            (pendingSignature.blockReceived = calloc(blockCount, 1)) != NULL)
+        {
+            signature->fileSize = fileSize;
+            signature->blockSize = blockSize;
+            signature->blockCount = blockCount;
+            pendingSignature.basisID = basisID;
+        }
+        else
+        {
+            free(signature->blocks);
+            signature->blocks = NULL;
+        }
+    }
+    if (signature->blocks != NULL && blockSize == signature->blockSize && blockCount == signature->blockCount &&
+        firstBlock >= 0 && firstBlock <= blockCount - entries)
+    {
+        for (int i = 0; i < entries; i++)
+        {
+            const byte* entry = reply->data + DELTA_SIGNATURE_HEADER_LENGTH + i * DELTA_SIGNATURE_ENTRY_LENGTH;
+            unsigned int rolling;
+            unsigned long long strong;
+            memcpy(&rolling, entry, 4);
+            memcpy(&strong, entry + 4, 8);
+            signature->blocks[firstBlock + i].rolling = ntohl(rolling);
+            signature->blocks[firstBlock + i].strong = be64toh(strong);
+            pendingSignature.blockReceived[firstBlock + i] = 1;
+        }
+    }
+    pthread_cond_broadcast(&stateCondition);
+    pthread_mutex_unlock(&stateMutex);
+}
+
+// Takes the ACK for one frame in flight, see SendWindowAcknowledge(). Only ReadPackets() calls it. Returns 0 if the
+// frame wasn't waiting for one.
+
+int AcknowledgeFrame(ACKmngr* ACKsPointer, unsigned short sequence, long long now)
+{
+    if (!SendWindowAcknowledge(&connectionWindow, sequence, now))
+        return 0;
+    atomic_fetch_add_explicit(&ackedBytes, frameSize, memory_order_relaxed);
+    if (subflowCount > 1)
+        SubflowACKed(sequence);
+    if (atomic_fetch_sub_explicit(&ACKsPointer->Missing, 1, memory_order_acq_rel) == 1)
+        SignalStateChange(); // WaitForACKs() may be waiting for exactly this
+    if (connectionWindow.roundTime > 0)
+    {
+        double roundTime = connectionWindow.roundTime;
+        averageRoundTime = roundTime < MIN_AVERAGE_ROUND_TIME ? MIN_AVERAGE_ROUND_TIME
+                         : roundTime > MAX_AVERAGE_ROUND_TIME ? MAX_AVERAGE_ROUND_TIME : roundTime;
+    }
+    DEBUGMESSAGE(0, "ACK received for sequence %d. Missing ACKs: %d", sequence, ACKsPointer->Missing);
+    DEBUGMESSAGE_EXACT(DEBUGLEVEL_READPACKETS, CYN
+            "ACK: ["
+            RESET
+            " %d "
+            CYN
+            "] Received     ACKs.Missing:["
+            RESET
+            " %d "
+            CYN
+            "]\n"
+            RESET, sequence, ACKsPointer->Missing);
+    DEBUGMESSAGE_EXACT(DEBUGLEVEL_ROUNDTIME, CYN
+            "Round trip: ["
+            RESET
+            " %.1f "
+            CYN
+            "] Timeout: ["
+            RESET
+            " %.0f x %d "
+            CYN
+            "]\n"
+            RESET, connectionWindow.roundTime, connectionWindow.timeout, connectionWindow.backoff);
+    return 1;
 }
 
 //---------------------------------------------------------------------------------------------------------------
@@ -238,146 +942,199 @@ void* ReadPackets(ACKmngr* ACKsPointer)
 
     packet packetBuffer;
     unsigned int senderAddressLength = sizeof(senderAddress);
+    resender resending; // For the frames a later one overtook
+    resending.ACKsPointer = ACKsPointer;
+    InitializeBatch(&resending.batch, socket_fd, &receiverAddress, sizeof(receiverAddress));
 
     while (KillThreads != 1)
     {
-        ReceivePacket(socket_fd, &packetBuffer, &senderAddress, &senderAddressLength); // Thread gets stuck here on shutdown?
+        int from = 0;
+        if (subflowCount > 1 && (from = PollSubflows()) < 0)
+            continue;
+        int retval = ReceivePacket(subflows[from].socket_fd, &packetBuffer, &senderAddress, &senderAddressLength); // Thread gets stuck here on shutdown?
         if (KillThreads == 1)
         {
             printf(RED"------------ReadPackets KillThreads: ["RESET" %d "RED"]------------\n"RESET, KillThreads);
             printf(RED"------------ReadPackets thread shutting down------------\n"RESET);
-            usleep(1000);
             pthread_exit(NULL);
         }
+        if (retval < 0)
+            continue; // Corrupted, its timeout takes care of it
+        if (connectionStatus == 1 && packetBuffer.integrity != packetIntegrity)
+        { // A corrupted integrity byte could otherwise get a packet checked by the weaker algorithm
+            DEBUGMESSAGE(2, "Dropped packet protected by %s, connection uses %s",
+                         IntegrityName(packetBuffer.integrity), IntegrityName(packetIntegrity));
+            continue;
+        }
         switch (packetBuffer.flags)
         {
             case PACKETFLAG_ACK:
-                sem_wait(&ackSemaphore);
+            {
                 unsigned short packetSequenceNumber = packetBuffer.sequenceNumber;
-                if (ACKsPointer->Table[packetSequenceNumber] == 0)
+                long long now = MonotonicMicroseconds();
+                if (packetBuffer.dataLength >= ACK_WINDOW_DATA_LENGTH)
                 {
-                    ACKsPointer->Table[packetSequenceNumber] = 1;
-                    ACKsPointer->Missing--;
-                    DEBUGMESSAGE(0, "ACK received for sequence %d. Missing ACKs: %d", packetSequenceNumber, ACKsPointer->Missing);
-
-                    DEBUGMESSAGE_EXACT(DEBUGLEVEL_READPACKETS, CYN
-                            "ACK: ["
-                            RESET
-                            " %d "
-                            CYN
-                            "] Received     ACKs.Missing:["
-                            RESET
-                            " %d "
-                            CYN
-                            "]\n"
-                            RESET, packetSequenceNumber, ACKsPointer->Missing);
-                    //-------------------------------------------- Updating the roundTime
-                    DEBUGMESSAGE_EXACT(DEBUGLEVEL_ROUNDTIME, CYN
-                            "Updating the roundTime----------------------------\n"
-                            RESET);
-                    for (int i = 0; i < 50; i++)
-                    {
-                        if (timeStamper[i].sequence == packetSequenceNumber)
-                        {
-                            gettimeofday(&(timeStamper[i].timeStampEnd), NULL); //--------------------------------------TIMESTAMPEND
-                            roundTime = (timeStamper[i].timeStampEnd.tv_usec - timeStamper[i].timeStampStart.tv_usec);
-                            sem_post(&roundTimeSemaphore);
-                            DEBUGMESSAGE_EXACT(DEBUGLEVEL_ROUNDTIME, CYN
-                                    " -timeStamper["
-                                    RESET
-                                    "%d"
-                                    CYN
-                                    "].timeStampStart: ["
-                                    RESET
-                                    " %ld "
-                                    CYN
-                                    "]\n"
-                                    RESET, i, (timeStamper[i].timeStampStart.tv_usec));
-                            DEBUGMESSAGE_EXACT(DEBUGLEVEL_ROUNDTIME, CYN
-                                    " -timeStamper["
-                                    RESET
-                                    "%d"
-                                    CYN
-                                    "].timeStampEnd: ["
-                                    RESET
-                                    " %ld "
-                                    CYN
-                                    "]\n"
-                                    RESET, i, (timeStamper[i].timeStampEnd.tv_usec));
-                            DEBUGMESSAGE_EXACT(DEBUGLEVEL_ROUNDTIME, CYN
-                                    " -roundtime: ["
-                                    RESET
-                                    " %.1f "
-                                    CYN
-                                    "]\n"
-                                    RESET, roundTime);
-                            break;
-                        }
-                        else
-                        {
-                            DEBUGMESSAGE_EXACT(DEBUGLEVEL_ROUNDTIME, CYN
-                                    "."
-                                    RESET);
-                        }
-                    }
-                    DEBUGMESSAGE_EXACT(DEBUGLEVEL_ROUNDTIME, CYN
-                            "----------------------------------------------\n"
-                            RESET);
-                    //--------------------------------------------
-
-                    while (ACKsPointer->Table[lowestSequenceAwaited] == 1)
-                    {
-                        sem_post(&windowSemaphore);
-                        ACKsPointer->Table[lowestSequenceAwaited] = -1; // No longer waiting for ACK on this sequenceNumber
-                        lowestSequenceAwaited++;
-                        DEBUGMESSAGE(0, GRNTEXT("Sliding window moving up. Lowest awaited is now: ")
-                                "%d", lowestSequenceAwaited);
-                    }
+                    unsigned short nextExpected, advertisedWindow;
+                    memcpy(&nextExpected, packetBuffer.data, 2);
+                    memcpy(&advertisedWindow, packetBuffer.data + 2, 2);
+                    nextExpected = ntohs(nextExpected);
+                    advertisedWindow = ntohs(advertisedWindow);
+                    SendWindowAdvertised(&connectionWindow, nextExpected, advertisedWindow);
+                    // Everything before nextExpected is in, even the frames whose own ACKs got lost
+                    while (connectionWindow.base != connectionWindow.next &&
+                           SEQUENCE_AFTER(nextExpected, connectionWindow.base))
+                        AcknowledgeFrame(ACKsPointer, connectionWindow.base, now);
                 }
-                else
+                if (packetBuffer.dataLength >= ACK_FRAGMENTS_DATA_LENGTH)
+                { // Only part of the frame is in, remember which fragments so that ResendFrame() resends just the rest
+                    unsigned long long fragmentsReceived;
+                    memcpy(&fragmentsReceived, packetBuffer.data + ACK_WINDOW_DATA_LENGTH, 8);
+                    fragmentsReceived = be64toh(fragmentsReceived);
+                    if (SendWindowInFlight(&connectionWindow, packetSequenceNumber))
+                        atomic_fetch_or(&ACKsPointer->Fragments[ACK_SLOT(packetSequenceNumber)], fragmentsReceived);
+                    DEBUGMESSAGE(2, "Fragment ACK for sequence %d: %016llx", packetSequenceNumber, fragmentsReceived);
+                }
+                else if (!AcknowledgeFrame(ACKsPointer, packetSequenceNumber, now))
                 {
                     DEBUGMESSAGE(3, YELTEXT("WARNING: ")
-                            "Received ACK packet for sequenceNumber not waiting for ACK");
-                    DEBUGMESSAGE(3, "  Got sequenceNumber %d (which is on status %d)", packetSequenceNumber, ACKsPointer->Table[packetSequenceNumber]);
+                            "Received ACK packet for sequenceNumber %d not waiting for ACK", packetSequenceNumber);
+                }
+                else if (subflowCount == 1)
+                { // Subflows deliver out of order, so only a single path can tell a lost frame from a late one
+                    int overtaken = SendWindowResendOvertaken(&connectionWindow, packetSequenceNumber, now, ResendFrame,
+                                                              &resending);
+                    FlushBatch(&resending.batch);
+                    if (overtaken > 0)
+                    {
+                        DEBUGMESSAGE(1, "%d frames overtaken by #%d resent", overtaken, packetSequenceNumber);
+                    }
+                }
+                if (atomic_load(&waitingForWindow) && SendWindowHasRoom(&connectionWindow))
+                { // SendStreamFrame() sets waitingForWindow before it checks, and holds windowMutex until it waits
+                    pthread_mutex_lock(&windowMutex);
+                    pthread_cond_broadcast(&windowCondition);
+                    pthread_mutex_unlock(&windowMutex);
                 }
-                sem_post(&ackSemaphore);
                 break;
+            }
             case (PACKETFLAG_SYN | PACKETFLAG_ACK):
                 suggestedWindowSize = packetBuffer.data[0];
                 suggestedFrameSize = ntohs((packetBuffer.data[1] * 256) + packetBuffer.data[2]);
-                ACKsPointer->Table[0] = -1;
+                atomic_store(&synAnsweredAttempt, negotiationAttempt);
                 DEBUGMESSAGE(3, "SYN+ACK: Flags "
                         GRNTEXT("OK"));
+                // Receivers that don't know about integrity algorithms send three bytes and use the checksum
+                packetIntegrity = packetBuffer.dataLength >= SYN_DATA_LENGTH ? packetBuffer.data[3] : INTEGRITY_CHECKSUM16;
+                if (packetBuffer.dataLength >= SYN_DATA_LENGTH && atomic_load(&fecGroupSize) == 0 &&
+                    packetBuffer.data[4] > 0 && packetBuffer.data[4] <= MAX_FEC_GROUP_SIZE &&
+                    (packetBuffer.data[4] & (packetBuffer.data[4] - 1)) == 0 && packetBuffer.data[5] > 0 &&
+                    packetBuffer.data[5] <= MAX_FEC_PARITY_COUNT && packetBuffer.data[5] <= packetBuffer.data[4])
+                {
+                    fecParityCount = packetBuffer.data[5];
+                    atomic_store(&fecGroupSize, packetBuffer.data[4]);
+                    DEBUGMESSAGE(1, "SYN+ACK: FEC with %d parity frames per %d frames", fecParityCount,
+                                 packetBuffer.data[4]);
+                }
+                if (packetBuffer.dataLength >= SYN_DATA_LENGTH && packetBuffer.data[10] != CODEC_NONE &&
+                    packetBuffer.data[10] == desiredCodec && atomic_load(&frameCodec) == CODEC_NONE)
+                {
+                    atomic_store(&frameCodec, packetBuffer.data[10]);
+                    DEBUGMESSAGE(1, "SYN+ACK: Compressing data frames with codec %d", packetBuffer.data[10]);
+                }
+                if (packetBuffer.dataLength >= SYN_TICKET_DATA_LENGTH)
+                {
+                    unsigned int ticket;
+                    memcpy(&ticket, packetBuffer.data + SYN_DATA_LENGTH, 4);
+                    SaveSessionTicket(ntohl(ticket), suggestedWindowSize, suggestedFrameSize);
+                }
+                if (packetBuffer.dataLength >= SYN_RESUME_DATA_LENGTH && transferID != 0 && connectionStatus != 1)
+                {
+                    unsigned int echoedTransferID, files;
+                    unsigned long long offset;
+                    memcpy(&echoedTransferID, packetBuffer.data + 6, 4);
+                    memcpy(&files, packetBuffer.data + SYN_TICKET_DATA_LENGTH, 4);
+                    memcpy(&offset, packetBuffer.data + SYN_TICKET_DATA_LENGTH + 4, 8);
+                    if (ntohl(echoedTransferID) == transferID)
+                    {
+                        resumeFiles = ntohl(files);
+                        resumeOffset = be64toh(offset);
+                    }
+                }
+                if (packetBuffer.dataLength >= SYN_SHARED_RING_ACK_LENGTH &&
+                    packetBuffer.data[SYN_RESUME_DATA_LENGTH] == 1 && dataRing.header != NULL &&
+                    !atomic_exchange(&sharedRingActive, 1))
+                {
+                    DEBUGMESSAGE(1, "SYN+ACK: Receiver is on this host, sending data frames through shared memory");
+                }
+                if (packetBuffer.dataLength >= SYN_JOIN_KEY_DATA_LENGTH)
+                {
+                    memcpy(&joinKey, packetBuffer.data + SYN_SHARED_RING_ACK_LENGTH, 4);
+                    joinKey = ntohl(joinKey);
+                }
+                if (connectionStatus == 1)
+                {
+                    if (suggestedWindowSize == desiredWindowSize && suggestedFrameSize == desiredFrameSize &&
+                        (frameSize != suggestedFrameSize || windowSize != suggestedWindowSize))
+                    { // We fell back from a rejected session ticket, new frames use the renegotiated sizes. The
+                      // receiver never suggests a larger window than we asked for, which is all dataBufferArray holds.
+                        frameSize = suggestedFrameSize;
+                        if (suggestedWindowSize < windowSize)
+                        {
+                            windowSize = suggestedWindowSize;
+                            SendWindowResize(&connectionWindow, windowSize);
+                        }
+                        DEBUGMESSAGE(1, "SYN+ACK: Continuing with renegotiated window %d and frame size %d", windowSize,
+                                     frameSize);
+                    }
+                    else
+                    {
+                        DEBUGMESSAGE(3, "SYN+ACK: Already connected, ignoring duplicate");
+                    }
+                    break;
+                }
                 if (suggestedWindowSize == desiredWindowSize && suggestedFrameSize == desiredFrameSize)
                 {
                     DEBUGMESSAGE(2, "SYN+ACK: Data "
                             GRNTEXT("OK"));
-                    windowSize = suggestedWindowSize;
-                    frameSize = suggestedFrameSize;
-                    connectionStatus = 1; // connectionStatus set to "connected"
-                    if (sem_init(&windowSemaphore, 0, windowSize) == -1)
-                    {
-                        CRASHWITHERROR("Semaphore initialization failed");
-                    }
-                    printf(GRN"Connection to Receiver Established!\n"RESET);
-
-                    usleep(5000);
+                    EstablishConnection(suggestedWindowSize, suggestedFrameSize);
                 }
                 else
                 {
-                    ACKsPointer->Table[0] = -1;
                     connectionStatus = -1; // connectionStatus set to "not connected"
+                    SignalStateChange();
                     DEBUGMESSAGE(2, "SYN+ACK: Data "
                             REDTEXT("NOT OK."));
                     DEBUGMESSAGE(0, "SYN+ACK: Suggested parameters don't match desired ones. Data corrupted?");
                 }
                 break;
+            case (PACKETFLAG_SIGNATURE | PACKETFLAG_ACK):
+                HandleSignatureReply(&packetBuffer);
+                break;
+            case (PACKETFLAG_SYN | PACKETFLAG_CONTROL | PACKETFLAG_ACK):
+            {
+                unsigned int joinKeyBytes = htonl(joinKey);
+                if (from > 0 && packetBuffer.dataLength >= SUBFLOW_JOIN_DATA_LENGTH &&
+                    memcmp(packetBuffer.data, &joinKeyBytes, 4) == 0 && !atomic_exchange(&subflows[from].joined, 1))
+                {
+                    DEBUGMESSAGE(1, "Subflow %d from %s joined", from, inet_ntoa(subflows[from].source.sin_addr));
+                    SignalStateChange();
+                }
+                break;
+            }
             case (PACKETFLAG_SYN | PACKETFLAG_NAK):
                 suggestedWindowSize = packetBuffer.data[0];
                 suggestedFrameSize = ntohs((packetBuffer.data[1] * 256) + packetBuffer.data[2]);
+                atomic_store(&synAnsweredAttempt, negotiationAttempt);
                 DEBUGMESSAGE(3, "SYN+NAK: Flags "
                         GRNTEXT("OK"));
-                if (suggestedWindowSize == desiredWindowSize && suggestedFrameSize == desiredFrameSize)
+                if (usingSessionTicket && connectionStatus == 1)
+                { // Frames sent in the first flight were dropped, their timeouts resend them once we are through
+                    DEBUGMESSAGE(0, YELTEXT("SYN+NAK: Session ticket rejected, falling back to a full handshake"));
+                    remove(SESSION_TICKET_FILE);
+                    usingSessionTicket = 0;
+                    NegotiateConnection(suggestedWindowSize, suggestedFrameSize, 0);
+                }
+                else if (suggestedWindowSize == desiredWindowSize && suggestedFrameSize == desiredFrameSize)
                 {
                     DEBUGMESSAGE(0, "SYN+NAK: Data "
                             REDTEXT("VERY NOT OK."));
@@ -393,35 +1150,41 @@ void* ReadPackets(ACKmngr* ACKsPointer)
                     DEBUGMESSAGE(0, "SYN+NAK: Trying again with parameters window:%d and frame:%d",
                                  suggestedWindowSize, suggestedFrameSize);
 
-                    ACKsPointer->Table[0] = -1;
-                    sleep(1);
-                    NegotiateConnection(suggestedWindowSize, suggestedFrameSize, ACKsPointer);
+                    NegotiateConnection(suggestedWindowSize, suggestedFrameSize, 0);
                 }
                 else
                 {
                     DEBUGMESSAGE(1, "SYN+ACK: Data "
                             REDTEXT("NOT OK."));
                     DEBUGMESSAGE(0, "SYN+ACK: Suggested parameters out of bounds. Connection impossible.");
-                    ACKsPointer->Table[0] = -1;
+                    connectionStatus = -1; // connectionStatus set to "not connected"
+                    SignalStateChange();
                 }
                 break;
             case PACKETFLAG_FIN:
-                usleep(1); // we can't do assignments as the first line of a case so we do, well, nothing first
+            {
                 packet packetToSend;
                 WritePacket(&packetToSend, PACKETFLAG_FIN | PACKETFLAG_ACK, NULL, 0, packetBuffer.sequenceNumber);
                 SendPacket(socket_fd, &packetToSend, &senderAddress, senderAddressLength);
                 KillThreads = 1;
+                SignalStateChange();
+                pthread_mutex_lock(&windowMutex); // SendStreamFrame() may be waiting for room that never comes
+                pthread_cond_broadcast(&windowCondition);
+                pthread_mutex_unlock(&windowMutex);
                 printf(RED"------------ReadPackets KillThreads: ["RESET" %d "RED"]------------\n"RESET, KillThreads);
                 printf(RED"------------ReadPackets thread shutting down------------\n"RESET);
-                usleep(1000);
                 pthread_exit(NULL);
+            }
             case (PACKETFLAG_FIN | PACKETFLAG_ACK):
                 if (KillThreads == 0) // are we waiting for a FIN+ACK?
                 {
                     KillThreads = 1;
+                    SignalStateChange();
+                    pthread_mutex_lock(&windowMutex);
+                    pthread_cond_broadcast(&windowCondition);
+                    pthread_mutex_unlock(&windowMutex);
                     printf(RED"------------ReadPackets KillThreads: ["RESET" %d "RED"]------------\n"RESET, KillThreads);
                     printf(RED"------------ReadPackets thread shutting down------------\n"RESET);
-                    usleep(1000);
                     pthread_exit(NULL);
                 }
                 else
@@ -437,19 +1200,16 @@ void* ReadPackets(ACKmngr* ACKsPointer)
 
 
     printf(RED"------------ReadPackets thread shutting down------------\n"RESET);
-    usleep(1000);
     pthread_exit(NULL);
 }
 //---------------------------------------------------------------------------------------------------------------
 
 void PrintMenu()
 {
-    int roundTimeSemCounter = 0;
-    sem_getvalue(&roundTimeSemaphore, &roundTimeSemCounter);
-
     printf(YEL"--------------------------\n"RESET);
-    printf(YEL"Welcome!  "RESET YEL"\n[%d]   Roundtime Average:["RESET" %.1f "YEL"]us\n"RESET, roundTimeSemCounter, averageRoundTime);
+    printf(YEL"Welcome!  "RESET YEL"\nRoundtime Average:["RESET" %.1f "YEL"]us\n"RESET, (double) averageRoundTime);
     printf(YEL"Packet-   Loss:["RESET" %d "YEL"]    Corrupt:["RESET" %d "YEL"]\n", loss, corrupt);
+    printf(YEL"Pacing-   Rate cap:["RESET" %.0f "YEL"]kB/s (0 = none)\n", pacingRateCap / 1000);
     printf(YEL"--------------------------\n"RESET);
     printf(GRN"[ "RESET"1"GRN" ]: Connect to Receiver\n"RESET);
     printf(CYN"[ "RESET"2"CYN" ]: Send Message\n"RESET);
@@ -457,6 +1217,7 @@ void PrintMenu()
     printf(RED"--------------------------\n"RESET);
     printf(RED"[ "RESET"4"RED" ]: Update Packet Loss chance\n"RESET);
     printf(RED"[ "RESET"5"RED" ]: Update Packet Corruption chance\n"RESET);
+    printf(RED"[ "RESET"6"RED" ]: Update Pacing rate cap\n"RESET);
     printf(RED"[ "RESET"2049"RED" ]: End program\n"RESET);
     printf(YEL"--------------------------\n"RESET);
 }
@@ -495,68 +1256,215 @@ void LoadMessageFromFile(char readstring[MAX_MESSAGE_LENGTH])
 }
 
 //---------------------------------------------------------------------------------------------------------------
+// How much data each fragment of a new frame carries: what fits in pathMTU, or less if AdaptFrameSize() found that
+// to work better. Stored in the frame's fragmentSize, so that resends cut it up the same way.
 
-void* ThreadedACKTimeout(timeoutHandlerData* timeoutData)
+int NewFrameFragmentLength(int frameLength)
 {
-    // Transfer values into statically allocated memory so we can free the dynamic memory
-    ACKmngr* ACKsPointer = timeoutData->ACKsPointer;
-    int sequenceNumber = timeoutData->sequenceNumber;
-    packet* dataBufferArray = timeoutData->dataBufferArray;
-    int bufferSlot = timeoutData->bufferSlot;
-    byte flags = timeoutData->flags;
-    free(timeoutData);
-
-    int numPreviousTimeouts = 0;
+    int fragmentDataLength = FragmentDataLength(frameLength, pathMTU);
+    if (adaptiveFragmentLength > 0 && adaptiveFragmentLength < fragmentDataLength &&
+        FragmentCount(frameLength, adaptiveFragmentLength) <= MAX_FRAGMENTS)
+        fragmentDataLength = adaptiveFragmentLength;
+    return fragmentDataLength;
+}
 
-    DEBUGMESSAGE(3, "ThreadedACKTimeout for seq %d started", sequenceNumber);
+// Puts a whole frame in the shared memory ring instead, fragments only matter on the network. The receiver is woken
+// up if it is waiting for the socket. Returns 1 if the frame went in, 0 if the ring is full or the Error Generator
+// lost it; its timeout then sends it again.
 
-    packet* packetToSend;
-    if ((packetToSend = malloc(sizeof(packet))) == NULL)
+int SendSharedFrame(const packet* frame)
+{
+    pthread_mutex_lock(&sharedRingMutex);
+    packet* record = (packet*) SharedRingReserve(&dataRing, PACKET_HEADER_LENGTH + frame->dataLength +
+                                                            CRC32C_TRAILER_LENGTH);
+    if (record == NULL)
     {
-        printf("Sequencenumber for malloc fail: %d\n", sequenceNumber);
-        CRASHWITHERROR("malloc() for packetToSend in ThreadedACKTimeout() failed");
+        sharedRingFull++;
+        pthread_mutex_unlock(&sharedRingMutex);
+        DEBUGMESSAGE(2, YELTEXT("Shared memory ring full")", sequence %d has to wait for its timeout",
+                     frame->sequenceNumber);
+        return 0;
     }
-
-    usleep(TIMEOUT_USLEEP_TIME);
-    while (ACKsPointer->Table[sequenceNumber] == 0 && numPreviousTimeouts <= MAX_TIMEOUT_RETRIES && KillThreads != 1)
+    memcpy(record, frame, PACKET_HEADER_LENGTH + frame->dataLength);
+    record->fragmentIndex = 0;
+    record->fragmentCount = 1;
+    record->fragmentSize = frame->dataLength;
+    int length = SealPacket(record);
+    if (ErrorGenerator(record) == 0)
     {
-        numPreviousTimeouts++;
-        WritePacket(packetToSend, flags, dataBufferArray[bufferSlot].data, frameSize, sequenceNumber);
-
-        //---------------------------------------------------------------------------------------------------------------
-        for (int i = 0; i < 50; i++)
-        {
-            if (timeStamper[i].sequence == sequenceNumber)
-            {
-                gettimeofday(&(timeStamper[i].timeStampStart), NULL); //--------------------------------------UPDATE TIMESTAMPSTART
-                break;
-            }
-        }
+        SharedRingCancel(&dataRing);
+        pthread_mutex_unlock(&sharedRingMutex);
+        return 0;
+    }
+    int wake = SharedRingCommit(&dataRing, length);
+    framesShared++;
+    pthread_mutex_unlock(&sharedRingMutex);
+
+    if (wake)
+        sendto(socket_fd, "", 0, 0, (struct sockaddr*) &receiverAddress, sizeof(receiverAddress));
+    atomic_fetch_add_explicit(&adaptBytesSent, length, memory_order_relaxed);
+    atomic_fetch_add_explicit(&adaptDatagramsSent, 1, memory_order_relaxed);
+    return 1;
+}
 
-        //---------------------------------------------------------------------------------------------------------------
+// Cuts a frame into one datagram per fragment of frame->fragmentSize bytes and seals each of them into image.
+// The fragments are all the same length but the last, so a whole frame fits in one batch.
 
-        DEBUGMESSAGE(1, REDTEXT("TIMEOUT")
-                " for packet #%d. Resending...", sequenceNumber);
-        SendPacket(socket_fd, packetToSend, &receiverAddress, sizeof(receiverAddress));
-        usleep(TIMEOUT_USLEEP_TIME);
+void SealWireImage(wireImage* image, const packet* frame)
+{
+    int fragmentDataLength = frame->fragmentSize;
+    image->fragmentCount = FragmentCount(frame->dataLength, fragmentDataLength);
+    image->length = 0;
+    for (int i = 0; i < image->fragmentCount; i++)
+    {
+        int offset = i * fragmentDataLength;
+        int length = frame->dataLength - offset < fragmentDataLength ? frame->dataLength - offset : fragmentDataLength;
+        packet* fragment = (packet*) (image->datagrams + image->length);
+        WritePacket(fragment, frame->flags, (void*) (frame->data + offset), length, frame->sequenceNumber);
+        fragment->fragmentIndex = i;
+        fragment->fragmentCount = image->fragmentCount;
+        fragment->fragmentSize = fragmentDataLength;
+        fragment->stream = frame->stream;
+        fragment->streamSequence = frame->streamSequence;
+        int datagramLength = SealPacket(fragment);
+        if (i == 0)
+            image->datagramLength = datagramLength;
+        image->length += datagramLength;
     }
-    if (numPreviousTimeouts >= MAX_TIMEOUT_RETRIES)
+}
+
+// Adds the datagrams of a sealed frame to the batch as they are, leaving out the fragments whose bit is set in
+// fragmentsToSkip. Returns how many fragments were added.
+
+int SendWireImage(datagramBatch* batch, const wireImage* image, unsigned long long fragmentsToSkip)
+{
+    int fragmentsSent = 0;
+    long bytesSent = 0;
+    for (int i = 0; i < image->fragmentCount; i++)
     {
-        for (int i = 0; i < 5; i++)
+        if (fragmentsToSkip & (1ull << i))
+            continue;
+        int offset = i * image->datagramLength;
+        int length = i == image->fragmentCount - 1 ? image->length - offset : image->datagramLength;
+        BatchDatagram(batch, image->datagrams + offset, length);
+        fragmentsSent++;
+        bytesSent += IP_UDP_HEADER_LENGTH + length;
+    }
+    atomic_fetch_add_explicit(&adaptBytesSent, bytesSent, memory_order_relaxed);
+    atomic_fetch_add_explicit(&adaptDatagramsSent, fragmentsSent, memory_order_relaxed);
+    return fragmentsSent;
+}
+
+// Sends a frame for the first time, through the shared memory ring if there is one and as fragments sealed into
+// image otherwise
+
+void SendNewFrame(datagramBatch* batch, wireImage* image, const packet* frame)
+{
+    if (atomic_load_explicit(&sharedRingActive, memory_order_relaxed))
+    {
+        SendSharedFrame(frame);
+        return;
+    }
+    SealWireImage(image, frame);
+    SendWireImage(batch, image, 0);
+}
+
+//---------------------------------------------------------------------------------------------------------------
+
+// Sends a frame in flight again, only the fragments the receiver hasn't reported having. connectionWindow calls it
+// from ReadPackets() and ResendTimeouts(), each with its own resender as the context. The caller flushes the batch.
+// The frame's ACK may come in at any time, and once it has SendStreamFrame() may reuse the frame's slot, so the frame
+// is only sent if it is still in flight once we are a reader of its wire image, or have copied it out of
+// dataBufferArray.
+
+void ResendFrame(void* context, unsigned short sequence)
+{
+    resender* resending = context;
+    ACKmngr* ACKsPointer = resending->ACKsPointer;
+    int slot = frameSlots[ACK_SLOT(sequence)];
+
+    int fragmentCount, fragmentsSent;
+    if (atomic_load_explicit(&sharedRingActive, memory_order_relaxed))
+    { // The ring takes whole frames, which its wire image isn't
+        packet* frame = &resending->frame;
+        WritePacket(frame, dataBufferArray[slot].flags, dataBufferArray[slot].data, dataBufferArray[slot].dataLength,
+                    sequence);
+        frame->fragmentSize = dataBufferArray[slot].fragmentSize;
+        frame->stream = dataBufferArray[slot].stream;
+        frame->streamSequence = dataBufferArray[slot].streamSequence;
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!SendWindowInFlight(&connectionWindow, sequence))
+            return;
+        DEBUGMESSAGE(1, REDTEXT("Resending")" packet #%d", sequence);
+        fragmentCount = 1;
+        fragmentsSent = SendSharedFrame(frame);
+    }
+    else
+    {
+        wireImage* image = &wireImages[slot];
+        atomic_fetch_add(&image->readers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!SendWindowInFlight(&connectionWindow, sequence))
         {
-            printf(RED"MAX TIMEOUT RETRIES REACHED!\n"RESET);
+            atomic_fetch_sub(&image->readers, 1);
+            return;
         }
+        DEBUGMESSAGE(1, REDTEXT("Resending")" packet #%d", sequence);
+        unsigned long long fragmentsReceived = atomic_load(&ACKsPointer->Fragments[ACK_SLOT(sequence)]);
+        fragmentCount = image->fragmentCount;
+        if (fragmentsReceived == 0 && fragmentCount > 1)
+        { // We don't know what got through. Probe with the last fragment, the receiver answers with what it has.
+            fragmentsReceived = ~(1ull << (fragmentCount - 1));
+        }
+        if (subflowCount > 1)
+        {
+            subflow* flow = &subflows[SubflowLost(sequence)];
+            FlushBatch(&resending->batch); // The frame before may have gone out over another subflow
+            InitializeBatch(&resending->batch, flow->socket_fd, &flow->destination, sizeof(flow->destination));
+        }
+        fragmentsSent = SendWireImage(&resending->batch, image, fragmentsReceived);
+        atomic_fetch_sub(&image->readers, 1);
+    }
+    atomic_fetch_add_explicit(&adaptDatagramsResent, fragmentsSent, memory_order_relaxed);
+    if (fragmentCount > 1)
+    {
+        DEBUGMESSAGE(2, "Resent %d of %d fragments of packet #%d", fragmentsSent, fragmentCount, sequence);
     }
+}
 
-    free(packetToSend);
-    DEBUGMESSAGE_NONEWLINE(3, MAG
-            "-Timeout thread ["
-            RESET
-            " %d "
-            MAG
-            "] Exit-"
-            RESET
-            "\n", sequenceNumber);
+// Resends the frames whose timeout has run out and keeps the send buffer sized, from ConnectToReceiver() until
+// KillThreads is set. It sleeps until the oldest frame in flight is due, SendStreamFrame() wakes it up when a frame
+// goes out with nothing else in flight.
+
+void* ResendTimeouts(ACKmngr* ACKsPointer)
+{
+    DEBUGMESSAGE(3, "ResendTimeouts thread running");
+    resender resending;
+    resending.ACKsPointer = ACKsPointer;
+    InitializeBatch(&resending.batch, socket_fd, &receiverAddress, sizeof(receiverAddress));
+    while (KillThreads != 1)
+    {
+        if (connectionStatus == 1)
+            SizeSendBuffer();
+
+        long long now = MonotonicMicroseconds();
+        int expired = SendWindowResendExpired(&connectionWindow, now, ResendFrame, &resending);
+        FlushBatch(&resending.batch);
+        if (expired > 0)
+        {
+            DEBUGMESSAGE(1, REDTEXT("TIMEOUT")" for %d packets, timeout now %.0f us", expired,
+                         connectionWindow.timeout * connectionWindow.backoff);
+        }
+        // Looked for with windowMutex held, so that a frame SendStreamFrame() sends after this wakes us up
+        pthread_mutex_lock(&windowMutex);
+        long long expiry = SendWindowNextExpiry(&connectionWindow);
+        long wait = expiry < 0 || expiry - now > RESEND_IDLE_WAIT ? RESEND_IDLE_WAIT : (long) (expiry - now);
+        struct timespec deadline;
+        DeadlineIn(wait, &deadline);
+        pthread_cond_timedwait(&resendCondition, &windowMutex, &deadline);
+        pthread_mutex_unlock(&windowMutex);
+    }
+    DEBUGMESSAGE(3, "ResendTimeouts thread shutting down");
     pthread_exit(NULL);
 }
 
@@ -565,16 +1473,10 @@ void* ThreadedACKTimeout(timeoutHandlerData* timeoutData)
 void* ThreadedSYNTimeout(timeoutHandlerData* timeoutData)
 {
     // Transfer values into statically allocated memory so we can free the dynamic memory
-    ACKmngr* ACKsPointer = timeoutData->ACKsPointer;
     int sequenceNumber = timeoutData->sequenceNumber;
+    int attempt = timeoutData->negotiationAttempt;
     free(timeoutData);
 
-    byte packetData[3];
-    packetData[0] = desiredWindowSize;
-    byte* desiredFrameSizeBytes = (byte*) (&desiredFrameSize);
-    packetData[1] = desiredFrameSizeBytes[0];
-    packetData[2] = desiredFrameSizeBytes[1];
-
     int numPreviousTimeouts = 0;
 
     DEBUGMESSAGE(3, "ThreadedSYNTimeout for seq %d started", sequenceNumber);
@@ -586,26 +1488,15 @@ void* ThreadedSYNTimeout(timeoutHandlerData* timeoutData)
         CRASHWITHERROR("malloc() for packetToSend in ThreadedSYNTimeout() failed");
     }
 
-    usleep(TIMEOUT_USLEEP_TIME);
-    while (ACKsPointer->Table[sequenceNumber] == 0 && numPreviousTimeouts <= MAX_TIMEOUT_RETRIES && KillThreads != 1)
+    usleep(ResendTimeout());
+    // Data frames may already be using sequence 0 (see SESSION_TICKET_FILE), so the SYN has its own answered marker
+    while (atomic_load(&synAnsweredAttempt) != attempt && numPreviousTimeouts <= MAX_TIMEOUT_RETRIES &&
+           KillThreads != 1 && attempt == negotiationAttempt)
     {
         numPreviousTimeouts++;
-        WritePacket(packetToSend, PACKETFLAG_SYN, packetData, 3, sequenceNumber);
-
-        //---------------------------------------------------------------------------------------------------------------
-        for (int i = 0; i < 50; i++)
-        {
-            if (timeStamper[i].sequence == sequenceNumber)
-            {
-                gettimeofday(&(timeStamper[i].timeStampStart), NULL); //--------------------------------------UPDATE TIMESTAMPSTART
-                break;
-            }
-        }
-
-        //---------------------------------------------------------------------------------------------------------------
-
+        WritePacket(packetToSend, PACKETFLAG_SYN, synData, synDataLength, sequenceNumber);
         SendPacket(socket_fd, packetToSend, &receiverAddress, sizeof(receiverAddress));
-        usleep(TIMEOUT_USLEEP_TIME);
+        usleep(ResendTimeout());
     }
     if (numPreviousTimeouts >= MAX_TIMEOUT_RETRIES)
     {
@@ -627,16 +1518,315 @@ void* ThreadedSYNTimeout(timeoutHandlerData* timeoutData)
     pthread_exit(NULL);
 }
 
+// Microseconds from a to b
+
+double TimespecDifference(const struct timespec* a, const struct timespec* b)
+{
+    return (b->tv_sec - a->tv_sec) * 1000000.0 + (b->tv_nsec - a->tv_nsec) / 1000.0;
+}
+
+// The rate SendFrame() paces new frames at, in bytes per second
+
+double PacingRate()
+{
+    double windowRate = (windowSize * (double) (PACKET_HEADER_LENGTH + frameSize)) / (averageRoundTime / 1000000.0);
+    if (pacingRateCap > 0 && pacingRateCap < windowRate)
+        return pacingRateCap;
+    return windowRate;
+}
+
+// Token bucket in front of SendFrame(). Sleeps until there are enough tokens for frameLength bytes, then uses them.
+// The bucket holds at most PACING_BURST_FRAMES frames, so an idle sender can't save up for a burst.
+
+void PaceFrame(int frameLength)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (pacingLastRefill.tv_sec == 0 && pacingLastRefill.tv_nsec == 0)
+        pacingLastRefill = now;
+
+    double rate = PacingRate();
+    double bucketDepth = PACING_BURST_FRAMES * (double) (PACKET_HEADER_LENGTH + frameSize);
+    pacingTokens += rate * TimespecDifference(&pacingLastRefill, &now) / 1000000.0;
+    if (pacingTokens > bucketDepth)
+        pacingTokens = bucketDepth;
+    pacingLastRefill = now;
+
+    if (pacingTokens < frameLength)
+    {
+        FlushFrameBatches(); // What is already batched was due before this frame
+        double waitUsec = (frameLength - pacingTokens) * 1000000.0 / rate;
+        struct timespec scheduled = now;
+        scheduled.tv_sec += (long) (waitUsec / 1000000);
+        scheduled.tv_nsec += (long) (fmod(waitUsec, 1000000) * 1000);
+        if (scheduled.tv_nsec >= 1000000000)
+        {
+            scheduled.tv_sec++;
+            scheduled.tv_nsec -= 1000000000;
+        }
+        int sleepError;
+        while ((sleepError = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &scheduled, NULL)) != 0)
+        {
+            if (sleepError != EINTR)
+            { // Anything else would come back right away every time
+                errno = sleepError;
+                CRASHWITHERROR("clock_nanosleep() in PaceFrame() failed");
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double drift = TimespecDifference(&scheduled, &now);
+        pacingDelayedFrames++;
+        pacingTotalDrift += drift;
+        if (drift > pacingWorstDrift)
+            pacingWorstDrift = drift;
+        DEBUGMESSAGE_EXACT(DEBUGLEVEL_PACING, CYN"Paced frame: waited ["RESET" %.1f "CYN"]us, drift ["RESET" %.1f "
+                CYN"]us at ["RESET" %.0f "CYN"]B/s\n"RESET, waitUsec, drift, rate);
+
+        pacingTokens += rate * TimespecDifference(&pacingLastRefill, &now) / 1000000.0;
+        pacingLastRefill = now;
+    }
+    pacingTokens -= frameLength;
+}
+
+void PrintPacingStatistics()
+{
+    if (framesCompressed > 0)
+    {
+        DEBUGMESSAGE(1, CYNTEXT("Compression: [")" %lu "CYNTEXT("] frames from [")" %llu "CYNTEXT("] to [")" %llu "
+                CYNTEXT("] bytes, [")" %lu "CYNTEXT("] sent as they were"), framesCompressed, compressionBytesIn,
+                     compressionBytesOut, framesNotCompressed);
+    }
+    if (fecParitySent > 0)
+    {
+        DEBUGMESSAGE(1, CYNTEXT("FEC: [")" %lu "CYNTEXT("] parity frames sent"), fecParitySent);
+    }
+    if (coalescedReads > 0)
+    {
+        DEBUGMESSAGE(1, CYNTEXT("Coalescing: [")" %lu "CYNTEXT("] reads in [")" %lu "CYNTEXT("] frames, [")" %lu "
+                CYNTEXT("] of them sent at the deadline"), coalescedReads, coalescedFrames, coalescedDeadlineFrames);
+    }
+    if (framesShared > 0)
+    {
+        DEBUGMESSAGE(1, CYNTEXT("Shared memory: [")" %lu "CYNTEXT("] frames, the ring was full [")" %lu "
+                CYNTEXT("] times"), framesShared, sharedRingFull);
+    }
+    for (int i = 0; i < subflowCount && subflowCount > 1; i++)
+    {
+        DEBUGMESSAGE(1, CYNTEXT("Subflow %d (%s): [")" %lu "CYNTEXT("] frames, [")" %lu "CYNTEXT("] lost, round trip [")
+                " %.1f "CYNTEXT("]us, window [")" %.1f "CYNTEXT("]"), i,
+                     i == 0 ? "primary" : inet_ntoa(subflows[i].source.sin_addr), subflows[i].framesSent,
+                     subflows[i].framesLost, (double) subflows[i].roundTime, (double) subflows[i].congestionWindow);
+    }
+    if (pacingDelayedFrames > 0)
+    {
+        DEBUGMESSAGE(1, CYNTEXT("Pacing: [")" %d "CYNTEXT("] frames delayed, average drift [")" %.1f "
+                CYNTEXT("]us, worst [")" %.1f "CYNTEXT("]us"), pacingDelayedFrames,
+                     pacingTotalDrift / pacingDelayedFrames, pacingWorstDrift);
+    }
+}
+
+// Adds a frame that was just sent to the parity of its FEC group. After the group's last frame, sends one PARITY
+// frame per class. They take the same pacing and batching as frames, but get no ACK and are never resent.
+
+void AddFrameToParity(const packet* frame)
+{
+    int groupSize = atomic_load(&fecGroupSize);
+    if (groupSize == 0)
+        return;
+    int offset = frame->sequenceNumber & (groupSize - 1);
+    if (offset == 0)
+    {
+        for (int i = 0; i < fecParityCount; i++)
+            FecParityReset(&fecClasses[i]);
+        fecGroupStarted = 1;
+    }
+    if (!fecGroupStarted)
+        return;
+    if (FecParityAdd(&fecClasses[offset % fecParityCount], frame) == -1)
+    {
+        DEBUGMESSAGE(0, "AddFrameToParity() out of memory, sending group without parity");
+        fecGroupStarted = 0;
+        return;
+    }
+    if (offset < groupSize - 1)
+        return;
+
+    static packet parityPacket; // Too large to have another one on the stack next to SendFrame()'s
+    static wireImage parityImage; // Parity frames are never resent, so one image does for all of them
+    for (int i = 0; i < fecParityCount; i++)
+    {
+        FecParityWrite(&fecClasses[i], &parityPacket, frame->sequenceNumber - offset + i);
+        parityPacket.fragmentSize = NewFrameFragmentLength(parityPacket.dataLength);
+        PaceFrame(PACKET_HEADER_LENGTH + parityPacket.dataLength);
+        SendNewFrame(&frameBatch, &parityImage, &parityPacket);
+        fecParitySent++;
+    }
+    DEBUGMESSAGE(2, "Sent %d parity frames for sequence %d to %d", fecParityCount, frame->sequenceNumber - offset,
+                 frame->sequenceNumber);
+    fecGroupStarted = 0;
+}
+
+// Compresses a data frame with the negotiated codec if that makes it shorter, pointing data at the result.
+// Returns the length to send.
+
+int CompressFrame(uint* flags, const void** data, int dataLength)
+{
+    static byte* compressedData = NULL;
+    if (*flags != 0 || atomic_load(&frameCodec) == CODEC_NONE || dataLength < MIN_COMPRESSED_FRAME)
+        return dataLength;
+    if (compressionSkip > 0)
+    {
+        compressionSkip--;
+        framesNotCompressed++;
+        return dataLength;
+    }
+    if (compressedData == NULL && (compressedData = malloc(MAX_FRAME_DATA_LENGTH)) == NULL)
+    {
+        CRASHWITHERROR("malloc() for compressedData in CompressFrame() failed");
+    }
+
+    int length = LzCompress(*data, dataLength, compressedData + COMPRESSED_HEADER_LENGTH,
+                            dataLength - COMPRESSED_HEADER_LENGTH - 1);
+    if (length == 0)
+    {
+        compressionSkip = compressionBackoff;
+        compressionBackoff = compressionBackoff == 0 ? 1 : compressionBackoff * 2;
+        if (compressionBackoff > MAX_COMPRESSION_BACKOFF)
+            compressionBackoff = MAX_COMPRESSION_BACKOFF;
+        framesNotCompressed++;
+        return dataLength;
+    }
+    compressionBackoff = 0;
+    unsigned short originalLength = htons(dataLength);
+    memcpy(compressedData, &originalLength, 2);
+    length += COMPRESSED_HEADER_LENGTH;
+    framesCompressed++;
+    compressionBytesIn += dataLength;
+    compressionBytesOut += length;
+    *flags = PACKETFLAG_COMPRESSED;
+    *data = compressedData;
+    return length;
+}
+
+// Waits for room in connectionWindow, then sends one frame of the data stream. The frame is kept in dataBufferArray
+// and wireImages until it has been ACKed so that ResendFrame() can resend it. Frames of a multiplexed stream (stream
+// not 0) are numbered in it as well, SendFrame() sends on the connection's own stream.
+
+void SendStreamFrame(ACKmngr* ACKsPointer, unsigned short stream, uint flags, const void* data,
+                     unsigned short dataLength)
+{
+    if (!SendWindowHasRoom(&connectionWindow))
+    { // The frames in the batch are what the ACKs that open the window up are waiting for
+        FlushFrameBatches();
+        DEBUGMESSAGE(2, YELTEXT("Window full, waiting before sending sequence %d"), connectionWindow.next);
+        pthread_mutex_lock(&windowMutex);
+        atomic_store(&waitingForWindow, 1);
+        while (!SendWindowHasRoom(&connectionWindow) && KillThreads != 1)
+            pthread_cond_wait(&windowCondition, &windowMutex);
+        atomic_store(&waitingForWindow, 0);
+        pthread_mutex_unlock(&windowMutex);
+    }
+    unsigned short seq = connectionWindow.next; // Only this thread moves it
+
+    if (dataBufferArray == NULL)
+    {
+        if ((dataBufferArray = malloc(sizeof(packet) * (windowSize))) == NULL ||
+            (wireImages = calloc(windowSize, sizeof(wireImage))) == NULL)
+        {
+            CRASHWITHERROR("malloc() for dataBufferArray in SendFrame() failed");
+        }
+    }
+    if (bufferSlot >= windowSize)
+        bufferSlot = 0; // if the condition is met, we would try to write outside our buffer. No good! Loop around!
+    dataLength = CompressFrame(&flags, &data, dataLength);
+
+    WritePacket(&dataBufferArray[bufferSlot], flags, (void*) data, dataLength, seq);
+    dataBufferArray[bufferSlot].fragmentSize = NewFrameFragmentLength(dataLength);
+    if (stream != 0)
+    {
+        dataBufferArray[bufferSlot].stream = stream;
+        dataBufferArray[bufferSlot].streamSequence = streamSequences[stream]++;
+    }
+
+    packet packetToSend;
+    WritePacket(&packetToSend, flags, dataBufferArray[bufferSlot].data, dataLength, seq);
+    packetToSend.fragmentSize = dataBufferArray[bufferSlot].fragmentSize;
+    packetToSend.stream = dataBufferArray[bufferSlot].stream;
+    packetToSend.streamSequence = dataBufferArray[bufferSlot].streamSequence;
+
+    DEBUGMESSAGE(3, BLUTEXT("----------------------Sending Packet:[")
+            " %d "
+            BLUTEXT("]   flags:[")
+            " %d "
+            BLUTEXT("]   dataLength:[")
+            " %d "
+            BLUTEXT("]"),
+                 packetToSend.sequenceNumber, flags, dataLength);
+
+    PaceFrame(PACKET_HEADER_LENGTH + dataLength);
+    int subflowIndex = ScheduleSubflow(seq);
+    int sharedRing = atomic_load_explicit(&sharedRingActive, memory_order_relaxed);
+    // The frame that last used the slot has been ACKed, but ResendFrame() may still be resending it
+    atomic_thread_fence(memory_order_seq_cst);
+    while (atomic_load(&wireImages[bufferSlot].readers) > 0)
+        sched_yield();
+    if (!sharedRing)
+        SealWireImage(&wireImages[bufferSlot], &packetToSend); // Before ResendFrame() can find the frame in flight
+
+    // The frame counts as in flight before it goes out, the ACK may arrive before the send returns. Its round trip and
+    // timeout count from here, after any wait for pacing or a subflow.
+    int idle = connectionWindow.base == seq;
+    frameSlots[ACK_SLOT(seq)] = bufferSlot;
+    atomic_store_explicit(&ACKsPointer->Fragments[ACK_SLOT(seq)], 0, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ACKsPointer->Missing, 1, memory_order_relaxed);
+    SendWindowSent(&connectionWindow, MonotonicMicroseconds());
+    if (idle)
+    { // ResendTimeouts() may be waiting RESEND_IDLE_WAIT for nothing
+        pthread_mutex_lock(&windowMutex);
+        pthread_cond_signal(&resendCondition);
+        pthread_mutex_unlock(&windowMutex);
+    }
+
+    DEBUGMESSAGE(0, YELTEXT("Message: [")
+            " %d "
+            YELTEXT("] Sent     ")
+            MAGTEXT("ACKs.Missing:[")
+            " %d "
+            MAGTEXT("]"),
+                 packetToSend.sequenceNumber, ACKsPointer->Missing);
+
+    if (sharedRing)
+        SendSharedFrame(&packetToSend);
+    else
+        SendWireImage(subflows[subflowIndex].batch, &wireImages[bufferSlot], 0);
+    AddFrameToParity(&packetToSend);
+
+    bufferSlot++;
+}
+
+void SendFrame(ACKmngr* ACKsPointer, uint flags, const void* data, unsigned short dataLength)
+{
+    SendStreamFrame(ACKsPointer, 0, flags, data, dataLength);
+}
+
+// Blocks until every frame handed to SendFrame() has been ACKed
+
+void WaitForACKs(ACKmngr* ACKsPointer)
+{
+    FlushFrameBatches();
+    pthread_mutex_lock(&stateMutex);
+    while (atomic_load(&ACKsPointer->Missing) > 0)
+        pthread_cond_wait(&stateCondition, &stateMutex);
+    pthread_mutex_unlock(&stateMutex);
+}
+
 void SlidingWindow(char* readstring, ACKmngr* ACKsPointer)
 {
     system("clear"); // Clean up the console
     DEBUGMESSAGE(2, YELTEXT("---[ Sending Message ]--- "));
     float messageDivided = 0;
     int packets = 0;
-    int seq = 0; // Keeps track of what frame the sliding window is currently managing
-    int stampID = 0;
-
-    int messageTracker = 0; // Tracks where we are located in the message that is currently being chopped up.
 
     // Figure out how many packets we need to send
     int messageLength = strlen(readstring);
@@ -652,146 +1842,1169 @@ void SlidingWindow(char* readstring, ACKmngr* ACKsPointer)
             " %d "
             YELTEXT("] frames"), windowSize);
 
-    unsigned int receiverAddressLength = sizeof(receiverAddress);
+    for (int i = 0; i < packets; i++)
+    { // The last frame only carries what is left of the message
+        int offset = i * frameSize;
+        int length = messageLength - offset < frameSize ? messageLength - offset : frameSize;
+        SendFrame(ACKsPointer, 0, readstring + offset, length);
+    }
 
-    packet* dataBufferArray;
-    dataBufferArray = malloc(sizeof(packet) * (windowSize));
-    if (dataBufferArray == NULL)
+    DEBUGMESSAGE(0, CYNTEXT("+------------------------------------+\n"
+                            "| All packets sent! Awaiting ACKs... |\n"
+                            "+------------------------------------+"));
+    WaitForACKs(ACKsPointer);
+    PrintPacingStatistics();
+}
+//---------------------------------------------------------------------------------------------------------------
+// Picks the datagram length that should give the best goodput for the failures seen so far, sends frames in
+// fragments of that length from now on, and sizes frames to match with a CONTROL_FRAMESIZE frame if that changes the
+// frame size enough. Runs once every FRAME_ADAPT_INTERVAL datagrams.
+//
+// A datagram of L bytes is assumed to get through with probability (1 - p) * e^(-beta * L): p covers what happens
+// to a datagram whatever its size (congestion drops, lost ACKs), beta what happens per byte (corruption). So
+// -ln(1 - failure rate) = -ln(1 - p) + beta * L, which is fitted over the intervals seen at different lengths.
+// Goodput per datagram is D / (D + H) * (1 - p) * e^(-beta * (D + H)) for D data bytes and H bytes of headers; p
+// doesn't move the peak, which is at D = (sqrt(H^2 + 4H / beta) - H) / 2. H includes DATAGRAM_COST_BYTES.
+// Only fragments are resent on their own, so frames are made as large as MAX_FRAGMENTS of them, growing (doubling
+// per interval, to keep the change gradual) and shrinking right away.
+
+void AdaptFrameSize(ACKmngr* ACKsPointer)
+{
+    long sent = atomic_load_explicit(&adaptDatagramsSent, memory_order_relaxed);
+    if (!adaptiveFrameSize || sent < FRAME_ADAPT_INTERVAL)
+        return;
+    long resent = atomic_exchange(&adaptDatagramsResent, 0);
+    double averageLength = (double) atomic_exchange(&adaptBytesSent, 0) / sent;
+    atomic_fetch_sub(&adaptDatagramsSent, sent);
+
+    double failureRate = (double) resent / sent;
+    if (failureRate > 0.9)
+        failureRate = 0.9; // Resends of resends can outnumber the datagrams of the interval
+    double failureTerm = -log(1 - failureRate);
+    adaptFit.weight = adaptFit.weight * FRAME_ADAPT_DECAY + 1;
+    adaptFit.length = adaptFit.length * FRAME_ADAPT_DECAY + averageLength;
+    adaptFit.failure = adaptFit.failure * FRAME_ADAPT_DECAY + failureTerm;
+    adaptFit.lengthSquared = adaptFit.lengthSquared * FRAME_ADAPT_DECAY + averageLength * averageLength;
+    adaptFit.lengthFailure = adaptFit.lengthFailure * FRAME_ADAPT_DECAY + averageLength * failureTerm;
+
+    double meanLength = adaptFit.length / adaptFit.weight;
+    double lengthVariance = adaptFit.lengthSquared / adaptFit.weight - meanLength * meanLength;
+    if (lengthVariance > (0.05 * meanLength) * (0.05 * meanLength))
+    { // Seen at lengths different enough to tell the two kinds of failure apart
+        double covariance = adaptFit.lengthFailure / adaptFit.weight - meanLength * adaptFit.failure / adaptFit.weight;
+        adaptFit.beta = covariance > 0 ? covariance / lengthVariance : 0;
+    }
+
+    int headerLength = IP_UDP_HEADER_LENGTH + PACKET_HEADER_LENGTH + DATAGRAM_COST_BYTES +
+                       (packetIntegrity == INTEGRITY_CRC32C ? CRC32C_TRAILER_LENGTH : 0);
+    int pathDataLength = FragmentDataLength(0, pathMTU); // Largest fragment pathMTU allows
+    double bestDataLength;
+    if (adaptFit.beta < 0)
+    { // Everything so far was sent at one length. If anything failed, try half of it to see whether that helps.
+        double currentDataLength = averageLength - (headerLength - DATAGRAM_COST_BYTES);
+        bestDataLength = failureRate > 0 ? currentDataLength / 2 : pathDataLength;
+    }
+    else if (adaptFit.beta > 0)
+        bestDataLength = (sqrt((double) headerLength * headerLength + 4 * headerLength / adaptFit.beta) -
+                          headerLength) / 2;
+    else
+        bestDataLength = pathDataLength;
+    if (bestDataLength < MIN_ADAPTIVE_FRAGMENT_LENGTH)
+        bestDataLength = MIN_ADAPTIVE_FRAGMENT_LENGTH;
+    adaptiveFragmentLength = bestDataLength < pathDataLength ? (int) bestDataLength : 0;
+
+    int newFrameSize = MAX_ACCEPTED_FRAME_SIZE;
+    if (bestDataLength * MAX_FRAGMENTS < newFrameSize)
+        newFrameSize = (int) bestDataLength * MAX_FRAGMENTS;
+    if (newFrameSize > frameSize * 2)
+        newFrameSize = frameSize * 2;
+
+    DEBUGMESSAGE(2, "Frame size: %ld of %ld datagrams of %.0f bytes resent, per byte failure %.2e, best data length "
+                    "%.0f", resent, sent, averageLength, adaptFit.beta, bestDataLength);
+    if (abs(newFrameSize - frameSize) * 8 < frameSize)
+        return; // Within an eighth, not worth a control frame
+
+    byte controlData[3];
+    unsigned short newFrameSizeBytes = htons(newFrameSize);
+    controlData[0] = CONTROL_FRAMESIZE;
+    memcpy(controlData + 1, &newFrameSizeBytes, 2);
+    SendFrame(ACKsPointer, PACKETFLAG_CONTROL, controlData, 3);
+    DEBUGMESSAGE(1, GRNTEXT("Frame size changed from [")" %d "GRNTEXT("] to [")" %d "GRNTEXT("] at failure rate %.3f"),
+                 frameSize, newFrameSize, failureRate);
+    frameSize = newFrameSize;
+}
+
+//---------------------------------------------------------------------------------------------------------------
+// Asks the receiver for the signature of its copy of a file, DELTA_SIGNATURE_BURST datagrams at a time from the first
+// block still missing, until pendingSignature has all of it. Returns 1 if it does, 0 if the receiver has no copy or
+// stops answering.
+
+int RequestSignature(const char* fileName, int fileNameLength)
+{
+    static unsigned short request = 0;
+    packet requestPacket;
+    byte requestData[4 + CONTROL_FILENAME_LENGTH];
+    memcpy(requestData + 4, fileName, fileNameLength);
+    FlushFrameBatches(); // Nothing is sent while we wait, so don't keep the frames in it waiting too
+
+    pthread_mutex_lock(&stateMutex);
+    FreeSignature(&pendingSignature.signature);
+    free(pendingSignature.blockReceived);
+    pendingSignature.blockReceived = NULL;
+    pendingSignature.replies = 0;
+    pendingSignature.noBasis = 0;
+    if (++request == 0)
+        request = 1;
+    pendingSignature.request = request;
+
+    int firstMissing = 0;
+    int unansweredRequests = 0;
+    int complete = 0;
+    while (KillThreads != 1 && !pendingSignature.noBasis && unansweredRequests < DELTA_SIGNATURE_RETRIES)
     {
-        CRASHWITHERROR("malloc() for dataBufferArray in SlidingWindow() failed");
+        int blockCount = pendingSignature.signature.blockCount;
+        while (pendingSignature.blockReceived != NULL && firstMissing < blockCount &&
+               pendingSignature.blockReceived[firstMissing])
+            firstMissing++;
+        if (pendingSignature.blockReceived != NULL && firstMissing == blockCount)
+        {
+            complete = 1;
+            break;
+        }
+
+        unsigned int firstBlock = htonl(firstMissing);
+        memcpy(requestData, &firstBlock, 4);
+        WritePacket(&requestPacket, PACKETFLAG_SIGNATURE, requestData, 4 + fileNameLength, request);
+        SendPacket(socket_fd, &requestPacket, &receiverAddress, sizeof(receiverAddress));
+
+        // Wait for the whole burst, or as long as a frame waits for its ACK
+        int replies = pendingSignature.replies;
+        int burstEnd = firstMissing + DELTA_SIGNATURE_BURST * DELTA_SIGNATURE_ENTRIES;
+        struct timespec deadline;
+        DeadlineIn(ResendTimeout(), &deadline);
+        while (KillThreads != 1 && !pendingSignature.noBasis)
+        {
+            if (pendingSignature.blockReceived != NULL)
+            {
+                int end = burstEnd < pendingSignature.signature.blockCount ? burstEnd : pendingSignature.signature.blockCount;
+                while (firstMissing < end && pendingSignature.blockReceived[firstMissing])
+                    firstMissing++;
+                if (firstMissing == end)
+                    break;
+            }
+            if (pthread_cond_timedwait(&stateCondition, &stateMutex, &deadline) != 0)
+                break; // Timed out
+        }
+        unansweredRequests = (pendingSignature.replies == replies) ? unansweredRequests + 1 : 0;
     }
+    pendingSignature.request = 0;
+    pthread_mutex_unlock(&stateMutex);
 
-    packet* packetToSend;
-    if ((packetToSend = malloc(sizeof(packet))) == NULL)
+    if (!complete && !pendingSignature.noBasis)
     {
-        CRASHWITHERROR("malloc() for packetToSend in SlidingWindow() failed");
+        DEBUGMESSAGE(0, YELTEXT("No signature of '%s' from the receiver, sending all of it"), fileName);
     }
+    return complete;
+}
 
-    int bufferSlot = 0;
+// Queues a file as a delta against the basis in pendingSignature: a CONTROL_DELTAFILE frame, then CONTROL_COPY
+// frames for what the basis has and data frames of exactly the bytes it doesn't. Returns the number of frames queued,
+// or -1 if the delta couldn't be worked out.
 
-    if (lowestSequenceAwaited == -1)
-        lowestSequenceAwaited = seq;
-    else
-        seq = lowestSequenceAwaited;
+int SendFileDelta(FILE* fp, const char* path, const char* fileName, int fileNameLength, ACKmngr* ACKsPointer)
+{
+    deltaScript script;
+    if (ComputeDelta(path, &pendingSignature.signature, &script, DeltaThreadCount()) == -1)
+        return -1;
 
-    for (int i = 0; i < packets; i++)
+    byte* frameData;
+    byte* copyData;
+    if ((frameData = malloc(MAX_ACCEPTED_FRAME_SIZE)) == NULL || (copyData = malloc(MAX_ACCEPTED_FRAME_SIZE)) == NULL)
+    {
+        CRASHWITHERROR("malloc() for frameData in SendFileDelta() failed");
+    }
+    int basisID = htonl(pendingSignature.basisID);
+    unsigned long long basisSize = htobe64(pendingSignature.signature.fileSize);
+    frameData[0] = CONTROL_DELTAFILE;
+    memcpy(frameData + 1, &basisID, 4);
+    memcpy(frameData + 5, &basisSize, 8);
+    memcpy(frameData + DELTA_FILE_HEADER_LENGTH, fileName, fileNameLength);
+    SendFrame(ACKsPointer, PACKETFLAG_CONTROL, frameData, DELTA_FILE_HEADER_LENGTH + fileNameLength);
+
+    int frames = 0;
+    int copyLength = 1;
+    copyData[0] = CONTROL_COPY;
+    for (int i = 0; i <= script.count; i++)
+    {
+        const deltaOperation* operation = (i < script.count) ? &script.operations[i] : NULL;
+        long long copied = 0;
+        while (operation != NULL && operation->basisOffset >= 0 && copied < operation->length)
+        { // Lengths are only four bytes on the wire
+            long long length = operation->length - copied;
+            if (length > 0x40000000)
+                length = 0x40000000;
+            if (copyLength + DELTA_COPY_LENGTH > frameSize && copyLength > 1)
+            {
+                SendFrame(ACKsPointer, PACKETFLAG_CONTROL, copyData, copyLength);
+                copyLength = 1;
+            }
+            unsigned long long basisOffset = htobe64(operation->basisOffset + copied);
+            unsigned int copyLengthBytes = htonl(length);
+            memcpy(copyData + copyLength, &basisOffset, 8);
+            memcpy(copyData + copyLength + 8, &copyLengthBytes, 4);
+            copyLength += DELTA_COPY_LENGTH;
+            copied += length;
+        }
+        if (operation != NULL && operation->basisOffset >= 0)
+            continue;
+
+        if (copyLength > 1)
+        { // Copies have to be in before the data that follows them
+            SendFrame(ACKsPointer, PACKETFLAG_CONTROL, copyData, copyLength);
+            copyLength = 1;
+        }
+        if (operation == NULL)
+            break;
+        if (fseeko(fp, operation->offset, SEEK_SET) == -1)
+        {
+            CRASHWITHERROR("SendFileDelta() couldn't seek in the file");
+        }
+        long long remaining = operation->length;
+        while (remaining > 0)
+        {
+            AdaptFrameSize(ACKsPointer);
+            size_t bytesRead = fread(frameData, 1, remaining < frameSize ? remaining : frameSize, fp);
+            if (bytesRead == 0)
+                break; // The file got shorter since the delta was worked out
+            SendFrame(ACKsPointer, 0, frameData, bytesRead);
+            remaining -= bytesRead;
+            frames++;
+        }
+    }
+
+    DEBUGMESSAGE(0, GRNTEXT("'%s' as a delta: [")" %lld "GRNTEXT("] bytes copied from the receiver's copy, [")" %lld "
+                 GRNTEXT("] sent in [")" %d "GRNTEXT("] frames"), path, script.copiedBytes, script.literalBytes, frames);
+    free(frameData);
+    free(copyData);
+    FreeDeltaScript(&script);
+    return frames;
+}
+
+//---------------------------------------------------------------------------------------------------------------
+// Sends what a streaming source writes until it closes, see coalesceDeadline. Returns the number of data frames.
+
+int SendCoalesced(int source_fd, const char* fileName, ACKmngr* ACKsPointer)
+{
+    byte controlData[1 + CONTROL_FILENAME_LENGTH];
+    controlData[0] = CONTROL_NEXTFILE;
+    memcpy(controlData + 1, fileName, strlen(fileName));
+    SendFrame(ACKsPointer, PACKETFLAG_CONTROL, controlData, 1 + strlen(fileName));
+
+    byte* frameData;
+    if ((frameData = malloc(MAX_ACCEPTED_FRAME_SIZE)) == NULL) // AdaptFrameSize() may change frameSize on the way
+    {
+        CRASHWITHERROR("malloc() for frameData in SendCoalesced() failed");
+    }
+    int pending = 0;
+    struct timespec pendingSince, now;
+    unsigned long framesBefore = coalescedFrames;
+    while (1)
+    {
+        int timeout = -1;
+        if (pending > 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double waited = TimespecDifference(&pendingSince, &now);
+            if (waited >= coalesceDeadline)
+            { // Even if the source keeps writing, the first of the pending bytes have waited long enough
+                SendFrame(ACKsPointer, 0, frameData, pending);
+                coalescedFrames++;
+                coalescedDeadlineFrames++;
+                pending = 0;
+                continue;
+            }
+            timeout = (int) ((coalesceDeadline - waited + 999) / 1000);
+        }
+        FlushFrameBatches(); // The source may not write again for a while
+        struct pollfd sourcePoll = {source_fd, POLLIN, 0};
+        if (poll(&sourcePoll, 1, timeout) == 0)
+            continue; // The deadline of the pending bytes has passed
+
+        if (pending == 0)
+            AdaptFrameSize(ACKsPointer);
+        ssize_t bytesRead = read(source_fd, frameData + pending, frameSize - pending);
+        if (bytesRead == -1 && errno == EINTR)
+            continue;
+        if (bytesRead <= 0)
+            break;
+        if (pending == 0)
+            clock_gettime(CLOCK_MONOTONIC, &pendingSince);
+        pending += bytesRead;
+        coalescedReads++;
+        if (pending == frameSize || coalesceDeadline == 0 || atomic_load(&ACKsPointer->Missing) == 0)
+        {
+            SendFrame(ACKsPointer, 0, frameData, pending);
+            coalescedFrames++;
+            pending = 0;
+        }
+    }
+    if (pending > 0)
+    {
+        SendFrame(ACKsPointer, 0, frameData, pending);
+        coalescedFrames++;
+    }
+    free(frameData);
+    DEBUGMESSAGE(1, GRNTEXT("Sent '%s' in [")" %lu "GRNTEXT("] frames"), fileName, coalescedFrames - framesBefore);
+    return coalescedFrames - framesBefore;
+}
+
+// Queues a whole file into the data stream, preceded by a CONTROL_NEXTFILE frame carrying its name. A resumed
+// transfer passes the resumeOffset of the file the receiver has half of instead of -1, which sends the rest of it
+// without announcing it again. With --delta, a file the receiver already has a copy of goes out as a delta instead.
+// Doesn't wait for the tail of the file to be ACKed, so the next file can be packetized right away.
+// Returns the number of data frames queued, or -1 if the file couldn't be read.
+
+int SendFile(const char* path, ACKmngr* ACKsPointer, long long startOffset)
+{
+    if (strcmp(path, "-") == 0)
+        return SendCoalesced(STDIN_FILENO, "stdin", ACKsPointer);
+
+    FILE* fp;
+    if ((fp = fopen(path, "rb")) == NULL)
+    {
+        DEBUGMESSAGE(0, YELTEXT("Couldn't open file '%s', skipping it"), path);
+        return -1;
+    }
+    if (startOffset >= 0)
+    {
+        if (fseeko(fp, startOffset, SEEK_SET) == -1)
+        {
+            CRASHWITHERROR("SendFile() couldn't seek to where the transfer resumes");
+        }
+        DEBUGMESSAGE(0, GRNTEXT("Resuming '%s' at byte %lld"), path, startOffset);
+    }
+
+    const char* fileName = strrchr(path, '/');
+    fileName = (fileName == NULL) ? path : fileName + 1;
+    int fileNameLength = strlen(fileName);
+    if (fileNameLength > CONTROL_FILENAME_LENGTH)
+        fileNameLength = CONTROL_FILENAME_LENGTH;
+
+    if (startOffset < 0 && deltaTransfers && RequestSignature(fileName, fileNameLength))
+    {
+        int frames = SendFileDelta(fp, path, fileName, fileNameLength, ACKsPointer);
+        if (frames >= 0)
+        {
+            fclose(fp);
+            return frames;
+        }
+        rewind(fp);
+    }
+
+    if (startOffset < 0)
+    {
+        byte controlData[1 + CONTROL_FILENAME_LENGTH];
+        controlData[0] = CONTROL_NEXTFILE;
+        memcpy(controlData + 1, fileName, fileNameLength);
+        SendFrame(ACKsPointer, PACKETFLAG_CONTROL, controlData, 1 + fileNameLength);
+    }
+
+    byte* frameData;
+    if ((frameData = malloc(MAX_ACCEPTED_FRAME_SIZE)) == NULL) // AdaptFrameSize() may change frameSize on the way
+    {
+        CRASHWITHERROR("malloc() for frameData in SendFile() failed");
+    }
+
+    int frames = 0;
+    size_t bytesRead;
+    while (1)
+    {
+        AdaptFrameSize(ACKsPointer);
+        if ((bytesRead = fread(frameData, 1, frameSize, fp)) == 0)
+            break;
+        SendFrame(ACKsPointer, 0, frameData, bytesRead);
+        frames++;
+    }
+
+    free(frameData);
+    fclose(fp);
+    DEBUGMESSAGE(1, GRNTEXT("Queued '%s' in [")" %d "GRNTEXT("] frames"), path, frames);
+    return frames;
+}
+
+//---------------------------------------------------------------------------------------------------------------
+// Queues this process's stripe of a file: a CONTROL_STRIPE frame saying where it goes, then its bytes in data frames
+// of exactly their length. Stripes that get no bytes of a small file still send the CONTROL_STRIPE frame, so that
+// the receiver knows every stripe of the transfer. Returns the number of data frames queued, or -1 if the file
+// couldn't be read.
+
+int SendStripe(const char* path, ACKmngr* ACKsPointer)
+{
+    FILE* fp;
+    struct stat fileStatus;
+    if ((fp = fopen(path, "rb")) == NULL || fstat(fileno(fp), &fileStatus) == -1)
+    {
+        DEBUGMESSAGE(0, YELTEXT("Couldn't open file '%s', skipping it"), path);
+        if (fp != NULL)
+            fclose(fp);
+        return -1;
+    }
+    long long fileSize = fileStatus.st_size;
+    long long start = fileSize * stripeIndex / stripeCount;
+    long long end = fileSize * (stripeIndex + 1) / stripeCount;
+
+    const char* fileName = strrchr(path, '/');
+    fileName = (fileName == NULL) ? path : fileName + 1;
+    int fileNameLength = strlen(fileName);
+    if (fileNameLength > CONTROL_FILENAME_LENGTH)
+        fileNameLength = CONTROL_FILENAME_LENGTH;
+
+    byte* frameData;
+    if ((frameData = malloc(MAX_ACCEPTED_FRAME_SIZE)) == NULL)
+    {
+        CRASHWITHERROR("malloc() for frameData in SendStripe() failed");
+    }
+    unsigned int group = htonl(stripeGroup);
+    unsigned long long fileSizeBytes = htobe64(fileSize);
+    unsigned long long startBytes = htobe64(start);
+    frameData[0] = CONTROL_STRIPE;
+    memcpy(frameData + 1, &group, 4);
+    frameData[5] = stripeIndex;
+    frameData[6] = stripeCount;
+    memcpy(frameData + 7, &fileSizeBytes, 8);
+    memcpy(frameData + 15, &startBytes, 8);
+    memcpy(frameData + STRIPE_HEADER_LENGTH, fileName, fileNameLength);
+    SendFrame(ACKsPointer, PACKETFLAG_CONTROL, frameData, STRIPE_HEADER_LENGTH + fileNameLength);
+
+    int frames = 0;
+    if (fseeko(fp, start, SEEK_SET) == -1)
+    {
+        CRASHWITHERROR("SendStripe() couldn't seek to its stripe");
+    }
+    for (long long position = start; position < end;)
     {
-        sem_wait(&windowSemaphore);
+        AdaptFrameSize(ACKsPointer);
+        size_t bytesRead = fread(frameData, 1, end - position < frameSize ? end - position : frameSize, fp);
+        if (bytesRead == 0)
+            break; // The file got shorter since we looked
+        SendFrame(ACKsPointer, 0, frameData, bytesRead);
+        position += bytesRead;
+        frames++;
+    }
+
+    free(frameData);
+    fclose(fp);
+    DEBUGMESSAGE(1, GRNTEXT("Stripe %d queued bytes %lld to %lld of '%s' in [")" %d "GRNTEXT("] frames"), stripeIndex,
+                 start, end, path, frames);
+    return frames;
+}
 
-        if (bufferSlot == windowSize)
-            bufferSlot = 0; // if the condition is met, we would try to write outside our buffer. No good! Loop around!
+//---------------------------------------------------------------------------------------------------------------
+// Opens the next file of a multiplexed batch on a stream and announces it there with a CONTROL_NEXTFILE frame.
+// Returns 1, or 0 if the file couldn't be read.
+
+int StartStreamFile(outgoingStream* stream, const char* path, int priority, ACKmngr* ACKsPointer)
+{
+    if ((stream->file = fopen(path, "rb")) == NULL)
+    {
+        DEBUGMESSAGE(0, YELTEXT("Couldn't open file '%s', skipping it"), path);
+        return 0;
+    }
+
+    const char* fileName = strrchr(path, '/');
+    fileName = (fileName == NULL) ? path : fileName + 1;
+    int fileNameLength = strlen(fileName);
+    if (fileNameLength > CONTROL_FILENAME_LENGTH)
+        fileNameLength = CONTROL_FILENAME_LENGTH;
+
+    byte controlData[1 + CONTROL_FILENAME_LENGTH];
+    controlData[0] = CONTROL_NEXTFILE;
+    memcpy(controlData + 1, fileName, fileNameLength);
+    SendStreamFrame(ACKsPointer, stream->id, PACKETFLAG_CONTROL, controlData, 1 + fileNameLength);
+    stream->path = path;
+    stream->priority = priority;
+    stream->frames = 0;
+    return 1;
+}
 
-        for (int j = messageTracker; j < (frameSize + messageTracker); j++)
-        { // Fill up the outgoing packet with data
-            dataBufferArray[bufferSlot].data[j - messageTracker] = readstring[j];
+//---------------------------------------------------------------------------------------------------------------
+// Queues the files over streamCount multiplexed streams at once, see MAX_STREAMS. A stream takes the next file of
+// the list whenever it is through with one, and deficit round robin picks whose frame enters the window next: every
+// round, each stream with a file gets its priority in frames added to its deficit, so n busy streams of the same
+// priority get 1/n of the connection each, whatever their frame sizes. The first urgentCount files get
+// STREAM_URGENT_PRIORITY, the rest 1. SendStreamFrame() waiting for room in the window is what paces the rounds.
+// Returns the number of files queued.
+
+int SendStreams(char** fileList, int fileCount, int urgentCount, ACKmngr* ACKsPointer)
+{
+    outgoingStream streams[MAX_STREAMS];
+    memset(streams, 0, sizeof(streams));
+    for (int i = 0; i < streamCount; i++)
+        streams[i].id = i + 1;
+
+    byte* frameData;
+    if ((frameData = malloc(MAX_ACCEPTED_FRAME_SIZE)) == NULL) // AdaptFrameSize() may change frameSize on the way
+    {
+        CRASHWITHERROR("malloc() for frameData in SendStreams() failed");
+    }
+
+    int nextFile = 0;
+    int filesQueued = 0;
+    int busy = 1;
+    while (busy)
+    {
+        busy = 0;
+        for (int i = 0; i < streamCount; i++)
+        {
+            outgoingStream* stream = &streams[i];
+            while (stream->file == NULL && nextFile < fileCount)
+            {
+                StartStreamFile(stream, fileList[nextFile], nextFile < urgentCount ? STREAM_URGENT_PRIORITY : 1,
+                                ACKsPointer);
+                nextFile++;
+            }
+            if (stream->file == NULL)
+                continue;
+            busy = 1;
+
+            stream->deficit += (long) stream->priority * frameSize;
+            while (stream->deficit >= frameSize)
+            {
+                AdaptFrameSize(ACKsPointer);
+                size_t bytesRead = fread(frameData, 1, frameSize, stream->file);
+                if (bytesRead > 0)
+                {
+                    SendStreamFrame(ACKsPointer, stream->id, 0, frameData, bytesRead);
+                    stream->deficit -= frameSize;
+                    stream->frames++;
+                }
+                if (bytesRead < frameSize)
+                { // The file is done. A stream that has nothing left to send starts the next round from nothing.
+                    DEBUGMESSAGE(1, GRNTEXT("Queued '%s' on stream %d in [")" %d "GRNTEXT("] frames"), stream->path,
+                                 stream->id, stream->frames);
+                    fclose(stream->file);
+                    stream->file = NULL;
+                    stream->deficit = 0;
+                    filesQueued++;
+                    break;
+                }
+            }
+        }
+    }
+
+    free(frameData);
+    return filesQueued;
+}
+
+// Forks a process per stripe and waits for all of them. Only the children return, each with its own socket and
+// stripeIndex set; the parent exits with success only if every stripe got its FIN+ACK.
+
+void ForkStripes()
+{
+    stripeGroup = STRIPE_GROUP_MIN + random() % (0x7fffffff - STRIPE_GROUP_MIN);
+    DEBUGMESSAGE(0, CYNTEXT("Striping the transfer over %d connections, group %u"), stripeCount, stripeGroup);
+    fflush(stdout);
+
+    pid_t children[MAX_STRIPES];
+    for (int i = 0; i < stripeCount; i++)
+    {
+        if ((children[i] = fork()) == -1)
+        {
+            CRASHWITHERROR("fork() failed in ForkStripes()");
+        }
+        if (children[i] == 0)
+        {
+            stripeIndex = i;
+            useSessionTickets = 0; // A ticket can only be used once, and they would all present the same one
+            close(socket_fd);
+            socket_fd = InitializeSocket(); // A flow, and an RSS queue on the receiver, of its own
+            InitializeBatch(&frameBatch, socket_fd, &receiverAddress, sizeof(receiverAddress));
+            srandom(time(NULL) ^ (getpid() << 8));
+            return;
         }
+    }
+
+    int failedStripes = 0;
+    for (int i = 0; i < stripeCount; i++)
+    {
+        int status;
+        if (waitpid(children[i], &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+            failedStripes++;
+    }
+    if (failedStripes > 0)
+    {
+        DEBUGMESSAGE(0, REDTEXT("Striped transfer: %d of %d stripes failed"), failedStripes, stripeCount);
+        exit(EXIT_FAILURE);
+    }
+    DEBUGMESSAGE(0, GRNTEXT("Striped transfer: the receiver has all %d stripes"), stripeCount);
+    exit(EXIT_SUCCESS);
+}
 
-        WritePacket(packetToSend, 0, (void*) (dataBufferArray[bufferSlot].data), frameSize, seq);
+//---------------------------------------------------------------------------------------------------------------
+// Starts the helper threads and negotiates a connection, then waits for the negotiation to finish.
+// Returns the resulting connectionStatus.
+
+int ConnectToReceiver(ACKmngr* ACKsPointer, pthread_t* readPacketsThread, pthread_t* resendTimeoutsThread)
+{
+    subflows[0].socket_fd = socket_fd;
+    subflows[0].batch = &frameBatch;
+    if (subflowCount > 1 && subflows[1].batch == NULL)
+    {
+        useSessionTickets = 0; // The subflows need the join key from the SYN+ACK
+        OpenSubflows();
+    }
+    requestedWindowSize = windowSize;
+    requestedFrameSize = frameSize;
+    SendWindowInitialize(&connectionWindow, windowSize); // Before any of the threads sharing it run
+    // Create the thread checking for messages from the receiver------
+    DEBUGMESSAGE(0, YELTEXT("Setting up ReadPackets thread..."));
+    if (pthread_create(readPacketsThread, NULL, (void*) ReadPackets, ACKsPointer) != 0)
+    {
+        CRASHWITHERROR("pthread_create(ReadPackets) failed in ConnectToReceiver()");
+    }
+    //----------------------------------------------------------------
+    // Create the thread resending what times out------
+    DEBUGMESSAGE(0, YELTEXT("Setting up ResendTimeouts thread..."));
+    if (pthread_create(resendTimeoutsThread, NULL, (void*) ResendTimeouts, ACKsPointer) != 0)
+    {
+        CRASHWITHERROR("pthread_create(ResendTimeouts) failed in ConnectToReceiver()");
+    }
+    connectionStatus = 0; // connectionStatus set to "pending"
 
-        DEBUGMESSAGE(3, BLUTEXT("----------------------Sending Packet:[")
-                " %d "
-                BLUTEXT("]   seq:[")
-                " %d "
-                BLUTEXT("]   messageTracker:[")
-                " %d "
-                BLUTEXT("]"),
-                     packetToSend->sequenceNumber, seq, messageTracker);
+    unsigned int ticket;
+    byte ticketWindowSize;
+    unsigned short ticketFrameSize;
+    // A resumable transfer has to hear where to continue before it sends anything, a ticket wouldn't save any time
+    if (useSessionTickets && transferID == 0 && LoadSessionTicket(&ticket, &ticketWindowSize, &ticketFrameSize))
+    {
+        DEBUGMESSAGE(0, "Presenting session ticket, sending right away with window:%d and frame:%d",
+                     ticketWindowSize, ticketFrameSize);
+        usingSessionTicket = 1;
+        packetIntegrity = desiredIntegrity; // Only receivers that know every algorithm we do hand out tickets
+        NegotiateConnection(ticketWindowSize, ticketFrameSize, ticket);
+        EstablishConnection(ticketWindowSize, ticketFrameSize);
+        return connectionStatus;
+    }
 
-        //-------------------------------------------------------------
+    DEBUGMESSAGE(0, "Attempting connection negotiation with parameters window:%d and frame:%d",
+                 windowSize, frameSize);
+    NegotiateConnection(windowSize, frameSize, 0);
+
+    pthread_mutex_lock(&stateMutex);
+    while (connectionStatus == 0)
+        pthread_cond_wait(&stateCondition, &stateMutex);
+    int status = connectionStatus;
+    pthread_mutex_unlock(&stateMutex);
+    if (status == 1 && subflowCount > 1)
+        JoinSubflows();
+    return status;
+}
 
-        //Providing timestamps for the roundTimeManager to use
-        timeStamper[stampID].sequence = packetToSend->sequenceNumber;
-        gettimeofday(&(timeStamper[stampID].timeStampStart), NULL); //--------------------------------------TIMESTAMPSTART
-        //--------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------
+// Handles one '--name=value' command line option. Returns 1 if it was understood, 0 otherwise.
 
-        stampID++;
-        if (stampID == 50)
+int ParseOption(const char* argument)
+{
+    if (strncmp(argument, "--rate=", 7) == 0)
+    {
+        pacingRateCap = strtod(argument + 7, NULL) * 1000.0;
+        return 1;
+    }
+    if (strncmp(argument, "--window=", 9) == 0)
+    { // Every frame in flight needs its own ACK_SLOT(), and the SYN carries the window in a byte
+        long window = strtol(argument + 9, NULL, 10);
+        if (window < 1 || window > ACK_TABLE_SIZE / 2 || window > UCHAR_MAX)
+            return 0;
+        windowSize = window;
+        return 1;
+    }
+    if (strncmp(argument, "--frame=", 8) == 0)
+    {
+        long frame = strtol(argument + 8, NULL, 10);
+        if (frame < 1 || frame > DATA_BUFFER_SIZE)
+            return 0;
+        frameSize = frame;
+        return 1;
+    }
+    if (strncmp(argument, "--mtu=", 6) == 0)
+    {
+        pathMTU = strtol(argument + 6, NULL, 10);
+        return 1;
+    }
+    if (strcmp(argument, "--integrity=crc32c") == 0)
+    {
+        desiredIntegrity = INTEGRITY_CRC32C;
+        return 1;
+    }
+    if (strcmp(argument, "--integrity=checksum16") == 0)
+    {
+        desiredIntegrity = INTEGRITY_CHECKSUM16;
+        return 1;
+    }
+    if (strcmp(argument, "--no-ticket") == 0)
+    {
+        useSessionTickets = 0;
+        return 1;
+    }
+    if (strcmp(argument, "--no-gso") == 0)
+    {
+        atomic_store(&segmentationOffload, 0);
+        return 1;
+    }
+    if (strcmp(argument, "--no-shm") == 0)
+    {
+        useSharedRing = 0;
+        return 1;
+    }
+    if (strcmp(argument, "--fixed-frame") == 0)
+    {
+        adaptiveFrameSize = 0;
+        return 1;
+    }
+    if (strcmp(argument, "--resume") == 0)
+    {
+        resumableTransfer = 1;
+        return 1;
+    }
+    if (strncmp(argument, "--stripes=", 10) == 0)
+    {
+        stripeCount = strtol(argument + 10, NULL, 10);
+        return stripeCount >= 1 && stripeCount <= MAX_STRIPES;
+    }
+    if (strncmp(argument, "--streams=", 10) == 0)
+    {
+        streamCount = strtol(argument + 10, NULL, 10);
+        return streamCount >= 1 && streamCount < MAX_STREAMS;
+    }
+    if (strncmp(argument, "--urgent=", 9) == 0)
+    {
+        if (urgentPathCount == MAX_URGENT_PATHS)
+            return 0;
+        urgentPaths[urgentPathCount++] = (char*) argument + 9;
+        return 1;
+    }
+    if (strncmp(argument, "--fanout=", 9) == 0)
+    {
+        fanoutCount = ParseFanoutReceivers(argument + 9, fanoutAddresses, MAX_FANOUT_RECEIVERS);
+        return fanoutCount > 0;
+    }
+    if (strncmp(argument, "--coalesce=", 11) == 0)
+    {
+        coalesceDeadline = strtol(argument + 11, NULL, 10) * 1000L;
+        return coalesceDeadline >= 0;
+    }
+    if (strncmp(argument, "--path=", 7) == 0)
+        return AddSubflow(argument + 7);
+    if (strcmp(argument, "--compress") == 0)
+    {
+        desiredCodec = CODEC_LZ;
+        return 1;
+    }
+    if (strcmp(argument, "--delta") == 0)
+    {
+        deltaTransfers = 1;
+        return 1;
+    }
+    if (strncmp(argument, "--fec=", 6) == 0)
+    {
+        char* parityCount;
+        long groupSize = strtol(argument + 6, &parityCount, 10);
+        if (*parityCount != '/' || groupSize < 1 || groupSize > MAX_FEC_GROUP_SIZE)
+            return 0;
+        long count = strtol(parityCount + 1, NULL, 10);
+        if (count < 1 || count > groupSize || count > MAX_FEC_PARITY_COUNT)
+            return 0;
+        desiredFecGroupSize = groupSize;
+        desiredFecParityCount = count;
+        return 1;
+    }
+    return 0;
+}
+
+void PrintUsage(const char* programName)
+{
+    printf("Usage: %s [debug level] [options] [file or directory ...]\n", programName);
+    printf("Options:\n");
+    printf("  --rate=<kB/s>    Never send faster than this\n");
+    printf("  --window=<n>     Window size to request, in frames (1 to %d)\n",
+           ACK_TABLE_SIZE / 2 < UCHAR_MAX ? ACK_TABLE_SIZE / 2 : UCHAR_MAX);
+    printf("  --frame=<bytes>  Frame size to request (1 to %d), file transfers adapt it to the link from there\n",
+           DATA_BUFFER_SIZE);
+    printf("  --mtu=<bytes>    Path MTU, larger frames are sent as fragments that fit in it (default %d)\n",
+           DEFAULT_PATH_MTU);
+    printf("  --integrity=<alg> Packet integrity check, crc32c (default) or checksum16\n");
+    printf("  --no-ticket      Always do the full handshake, don't use or save session tickets\n");
+    printf("  --fixed-frame    Keep the negotiated frame size for the whole session\n");
+    printf("  --fec=<k>/<m>    Send m parity frames per k frames (k up to %d, m up to %d), the receiver rebuilds\n"
+           "                   one lost frame in every m consecutive ones without waiting for a resend\n",
+           MAX_FEC_GROUP_SIZE, MAX_FEC_PARITY_COUNT);
+    printf("  --resume         Let the receiver journal a batch transfer, so that running the same command again\n"
+           "                   after a crash continues where it got to\n");
+    printf("  --compress       Compress data frames one by one (LZ), leaving out the ones that don't shrink\n");
+    printf("  --delta          Send only what changed in files the receiver got before, and copy the rest from its\n"
+           "                   earlier copy\n");
+    printf("  --stripes=<n>    Send the files over n connections at once (up to %d), each with a part of every file\n",
+           MAX_STRIPES);
+    printf("  --streams=<n>    Send up to n files at once over the connection (up to %d), taking turns frame by frame\n",
+           MAX_STREAMS - 1);
+    printf("  --urgent=<path>  Send this file or directory first, with %d times the share of the others when\n"
+           "                   multiplexed with --streams (may be given up to %d times)\n", STREAM_URGENT_PRIORITY,
+           MAX_URGENT_PATHS);
+    printf("  --fanout=<list>  Send the files to several receivers at once, a comma separated list of addresses with\n"
+           "                   an optional :<port> each (up to %d)\n", MAX_FANOUT_RECEIVERS);
+    printf("  --no-gso         Send every datagram with its own sendto() instead of batching them with UDP_SEGMENT\n");
+    printf("  --coalesce=<ms>  How long bytes from standard input ('-' as a file) may wait for more to fill their\n"
+           "                   frame while frames are in flight (default %d, 0 sends every read at once)\n",
+           COALESCE_DEADLINE_USEC / 1000);
+    printf("  --no-shm         Send the data frames over the socket even when the receiver is on this host\n");
+    printf("  --path=<source>-<destination> Also send frames from one local address to one of the receiver's, over\n"
+           "                   whichever path is fastest (may be given up to %d times)\n", MAX_SUBFLOWS - 1);
+}
+
+//---------------------------------------------------------------------------------------------------------------
+// Expands the command line arguments into a list of files. Directories contribute the regular files
+// directly inside them, in alphabetical order. Returns the number of files in fileList.
+
+int CollectBatchFiles(char** arguments, int argumentCount, char*** fileList)
+{
+    int fileCount = 0;
+    int listSize = argumentCount;
+    if ((*fileList = malloc(sizeof(char*) * listSize)) == NULL)
+    {
+        CRASHWITHERROR("malloc() for fileList in CollectBatchFiles() failed");
+    }
+
+    for (int i = 0; i < argumentCount; i++)
+    {
+        struct stat fileStatus;
+        if (strcmp(arguments[i], "-") == 0)
+            fileStatus.st_mode = S_IFIFO; // Standard input, see SendCoalesced()
+        else if (stat(arguments[i], &fileStatus) < 0)
         {
-            stampID = 0;
+            DEBUGMESSAGE(0, YELTEXT("Couldn't find '%s', skipping it"), arguments[i]);
+            continue;
         }
-        sem_wait(&ackSemaphore);
 
-        timeoutHandlerData* timeoutHandler;
-        if ((timeoutHandler = malloc(sizeof(timeoutHandlerData))) == NULL)
+        if (S_ISDIR(fileStatus.st_mode))
         {
-            CRASHWITHERROR("malloc for timeoutHandler in SlidingWindow() failed");
+            struct dirent** entries;
+            int entryCount = scandir(arguments[i], &entries, NULL, alphasort);
+            if (entryCount < 0)
+            {
+                DEBUGMESSAGE(0, YELTEXT("Couldn't read directory '%s', skipping it"), arguments[i]);
+                continue;
+            }
+            for (int j = 0; j < entryCount; j++)
+            {
+                char* path;
+                if ((path = malloc(strlen(arguments[i]) + strlen(entries[j]->d_name) + 2)) == NULL)
+                {
+                    CRASHWITHERROR("malloc() for path in CollectBatchFiles() failed");
+                }
+                sprintf(path, "%s/%s", arguments[i], entries[j]->d_name);
+                free(entries[j]);
+
+                if (stat(path, &fileStatus) < 0 || !S_ISREG(fileStatus.st_mode))
+                {
+                    free(path);
+                    continue;
+                }
+                if (fileCount == listSize)
+                {
+                    listSize *= 2;
+                    if ((*fileList = realloc(*fileList, sizeof(char*) * listSize)) == NULL)
+                    {
+                        CRASHWITHERROR("realloc() for fileList in CollectBatchFiles() failed");
+                    }
+                }
+                (*fileList)[fileCount++] = path;
+            }
+            free(entries);
         }
-        timeoutHandler->bufferSlot = bufferSlot;
-        timeoutHandler->sequenceNumber = seq;
-        timeoutHandler->ACKsPointer = ACKsPointer;
-        timeoutHandler->dataBufferArray = dataBufferArray;
-        timeoutHandler->flags = packetToSend->flags;
+        else
+        {
+            if (fileCount == listSize)
+            {
+                listSize *= 2;
+                if ((*fileList = realloc(*fileList, sizeof(char*) * listSize)) == NULL)
+                {
+                    CRASHWITHERROR("realloc() for fileList in CollectBatchFiles() failed");
+                }
+            }
+            (*fileList)[fileCount++] = strdup(arguments[i]);
+        }
+    }
+    return fileCount;
+}
 
-        pthread_t timeoutThread;
-        pthread_create(&timeoutThread, NULL, (void*) ThreadedACKTimeout, timeoutHandler);
+// Whether two paths from CollectBatchFiles() name the same file, however they are spelled
 
-        DEBUGMESSAGE(0, YELTEXT("Message: [")
-                " %d "
-                YELTEXT("] Sent     ")
-                MAGTEXT("ACKs.Missing:[")
-                " %d "
-                MAGTEXT("]"),
-                     packetToSend->sequenceNumber, ACKsPointer->Missing);
+int SameBatchFile(const char* path, const char* otherPath)
+{
+    if (strcmp(path, "-") == 0 || strcmp(otherPath, "-") == 0)
+        return strcmp(path, otherPath) == 0;
+    struct stat fileStatus, otherStatus;
+    return stat(path, &fileStatus) == 0 && stat(otherPath, &otherStatus) == 0 &&
+           fileStatus.st_dev == otherStatus.st_dev && fileStatus.st_ino == otherStatus.st_ino;
+}
 
-        SendPacket(socket_fd, packetToSend, &receiverAddress, receiverAddressLength);
+// Id of a resumable transfer: the CRC32C of the names, sizes and modification times of its files, so that running the
+// same command again presents the same id, and changing any of the files starts the transfer over.
 
-        ACKsPointer->Table[seq] = 0;
-        (ACKsPointer->Missing)++;
+unsigned int TransferID(char** fileList, int fileCount)
+{
+    unsigned int crc = 0;
+    for (int i = 0; i < fileCount; i++)
+    {
+        struct stat fileStatus;
+        long long fileInformation[2] = {0, 0};
+        if (stat(fileList[i], &fileStatus) == 0)
+        {
+            fileInformation[0] = fileStatus.st_size;
+            fileInformation[1] = fileStatus.st_mtime;
+        }
+        crc = Crc32c(crc, fileList[i], strlen(fileList[i]) + 1);
+        crc = Crc32c(crc, fileInformation, sizeof(fileInformation));
+    }
+    return crc != 0 ? crc : 1; // 0 means not resumable
+}
 
-        sem_post(&ackSemaphore);
+// Sends the batch to every --fanout receiver at once, see fanout.h. Window, frame size and integrity apply to all of
+// them; what else a connection can negotiate isn't shared between receivers, so it is left out.
 
-        seq++;
-        bufferSlot++;
-        messageTracker += frameSize;
+void RunFanoutTransfer(char** fileList, int fileCount)
+{
+    if (resumableTransfer || deltaTransfers || stripeCount > 1 || streamCount > 1 || desiredCodec != CODEC_NONE ||
+        desiredFecGroupSize > 0)
+    {
+        DEBUGMESSAGE(0, YELTEXT("Batch mode: fan-out transfers don't resume, stripe, multiplex, compress, send deltas "
+                                "or FEC"));
+    }
+    fanoutOptions options = {socket_fd, windowSize, frameSize, desiredIntegrity, pathMTU};
+    int delivered = FanoutTransfer(&options, fanoutAddresses, fanoutCount, fileList, fileCount);
+    DEBUGMESSAGE(0, CYNTEXT("Batch mode: %d of %d receivers got every file"), delivered, fanoutCount);
+    batchFailed = delivered < fanoutCount;
+    for (int i = 0; i < fileCount; i++)
+        free(fileList[i]);
+    free(fileList);
+    KillThreads = 1;
+}
+
+// Non-interactive mode: sends every file back to back over a single connection, or several at once with --streams,
+// then closes it with a FIN.
+
+void RunBatchTransfer(char** arguments, int argumentCount, ACKmngr* ACKsPointer,
+                      pthread_t* readPacketsThread, pthread_t* resendTimeoutsThread)
+{
+    char** fileList;
+    int fileCount = CollectBatchFiles(arguments, argumentCount, &fileList);
+    int urgentCount = 0;
+    if (urgentPathCount > 0)
+    { // Urgent files go first
+        char** urgentList;
+        urgentCount = CollectBatchFiles(urgentPaths, urgentPathCount, &urgentList);
+        if ((urgentList = realloc(urgentList, sizeof(char*) * (urgentCount + fileCount + 1))) == NULL)
+        {
+            CRASHWITHERROR("realloc() for urgentList in RunBatchTransfer() failed");
+        }
+        int otherCount = 0;
+        for (int i = 0; i < fileCount; i++)
+        {
+            int urgent = 0;
+            for (int j = 0; j < urgentCount && !urgent; j++)
+                urgent = SameBatchFile(fileList[i], urgentList[j]);
+            if (urgent)
+            { // Already queued as an urgent file
+                DEBUGMESSAGE(1, "Batch mode: '%s' is urgent, sending it only once", fileList[i]);
+                free(fileList[i]);
+                continue;
+            }
+            urgentList[urgentCount + otherCount++] = fileList[i];
+        }
+        free(fileList);
+        fileList = urgentList;
+        fileCount = urgentCount + otherCount;
+    }
+    if (fileCount == 0)
+    {
+        KillThreads = 1;
+        DEBUGMESSAGE(0, YELTEXT("Batch mode: no files to send"));
+        return;
+    }
+    for (int i = 0; i < fileCount; i++)
+    {
+        if (strcmp(fileList[i], "-") == 0 && fanoutCount > 0)
+        { // Every receiver has to be able to get a resend of any frame, and FanoutTransfer() reads files as files
+            DEBUGMESSAGE(0, YELTEXT("Batch mode: standard input can't be fanned out"));
+            for (int j = 0; j < fileCount; j++)
+                free(fileList[j]);
+            free(fileList);
+            batchFailed = 1;
+            KillThreads = 1;
+            return;
+        }
+        if (strcmp(fileList[i], "-") == 0 && (resumableTransfer || stripeCount > 1 || streamCount > 1))
+        {
+            DEBUGMESSAGE(0, YELTEXT("Batch mode: standard input can't be resumed, striped or multiplexed, sending "
+                                    "one file at a time over one connection"));
+            resumableTransfer = 0;
+            stripeCount = 1;
+            streamCount = 1;
+        }
+    }
+    if (subflowCount > 1 && (fanoutCount > 0 || stripeCount > 1))
+    {
+        DEBUGMESSAGE(0, YELTEXT("Batch mode: fan-out and striped transfers use one path per connection"));
+        subflowCount = 1;
+    }
+    if (fanoutCount > 0)
+    {
+        RunFanoutTransfer(fileList, fileCount);
+        return;
+    }
+
+    if (streamCount > 1 && (resumableTransfer || deltaTransfers || stripeCount > 1))
+    {
+        DEBUGMESSAGE(0, YELTEXT("Batch mode: multiplexed streams are neither resumable, deltas nor striped, sending "
+                                "one file at a time"));
+        streamCount = 1;
+    }
+    if (stripeCount > 1)
+    {
+        if (resumableTransfer || deltaTransfers)
+        {
+            DEBUGMESSAGE(0, YELTEXT("Batch mode: striped transfers are neither resumable nor deltas"));
+            resumableTransfer = 0;
+            deltaTransfers = 0;
+        }
+        ForkStripes();
+    }
+    if (resumableTransfer)
+    {
+        transferID = TransferID(fileList, fileCount);
+        DEBUGMESSAGE(1, "Batch mode: transfer id %08x", transferID);
+    }
+    if (ConnectToReceiver(ACKsPointer, readPacketsThread, resendTimeoutsThread) != 1)
+    {
+        CRASHWITHMESSAGE("Batch mode: connection negotiation failed");
+    }
+    if (resumeFiles > 0)
+    {
+        DEBUGMESSAGE(0, GRNTEXT("Batch mode: receiver already has %d of %d files, resuming"), resumeFiles - 1, fileCount);
+    }
+
+    if (streamCount > 1)
+        SendStreams(fileList, fileCount, urgentCount, ACKsPointer);
+    else
+    {
+        for (int i = 0; i < fileCount; i++)
+        {
+            if (i < resumeFiles - 1)
+            {
+                DEBUGMESSAGE(1, "Skipping '%s', the receiver has all of it", fileList[i]);
+            }
+            else if (stripeIndex >= 0)
+                SendStripe(fileList[i], ACKsPointer);
+            else
+                SendFile(fileList[i], ACKsPointer, i == resumeFiles - 1 ? resumeOffset : -1);
+        }
+    }
+    for (int i = 0; i < fileCount; i++)
+        free(fileList[i]);
+    free(fileList);
+
+    DEBUGMESSAGE(0, CYNTEXT("Batch mode: all %d files sent, awaiting ACKs..."), fileCount);
+    WaitForACKs(ACKsPointer);
+    PrintPacingStatistics();
+
+    KillThreads = 0; // Set KillThreads to "pending"
+    packet endGame;
+    int finished = 0;
+    for (int attempt = 0; attempt < MAX_FIN_RETRIES && !finished; attempt++)
+    {
+        WritePacket(&endGame, PACKETFLAG_FIN, NULL, 0, 1);
+        SendPacket(socket_fd, &endGame, &receiverAddress, sizeof(receiverAddress));
+        DEBUGMESSAGE(1, "Waiting for FIN+ACK...");
+        finished = WaitForShutdown(ResendTimeout());
+    }
+    if (!finished && stripeIndex >= 0)
+    { // The receiver only answers once every stripe is in. Keep asking, in case the FIN+ACK is lost when it does.
+        DEBUGMESSAGE(0, CYNTEXT("Stripe %d done, waiting for the others..."), stripeIndex);
+        struct timespec start, now;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do
+        {
+            finished = WaitForShutdown(STRIPE_FIN_RESEND_SECONDS * 1000000L);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (!finished)
+                SendPacket(socket_fd, &endGame, &receiverAddress, sizeof(receiverAddress));
+        } while (!finished && now.tv_sec - start.tv_sec < STRIPE_FIN_WAIT_SECONDS);
+    }
+    if (!finished)
+    {
+        batchFailed = (stripeIndex >= 0);
+        DEBUGMESSAGE(0, YELTEXT("Batch mode: no FIN+ACK received, closing anyway"));
+        KillThreads = 1;
+        shutdown(socket_fd, SHUT_RDWR); // Unblocks ReadPackets, which is still stuck in recvfrom()
     }
-    DEBUGMESSAGE(0, CYNTEXT("+------------------------------------+\n"
-                            "| All packets sent! Awaiting ACKs... |\n"
-                            "+------------------------------------+"));
-    do
-    { usleep(100000); }
-    while (ACKsPointer->Missing > 0);
 }
 //---------------------------------------------------------------------------------------------------------------
 
 int main(int argc, char* argv[])
 {
-    system("clear");
     srandom(time(NULL));
-    if (argc == 2)
+    if (argc >= 2)
     {
         debugLevel = strtol(argv[1], NULL, 10);
     }
+    int firstFileArgument = 2;
+    while (firstFileArgument < argc && strncmp(argv[firstFileArgument], "--", 2) == 0)
+    {
+        if (!ParseOption(argv[firstFileArgument]))
+        {
+            PrintUsage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        firstFileArgument++;
+    }
+    int batchMode = (argc > firstFileArgument); // Any arguments after the options are files or directories to send
+    if (!batchMode)
+        system("clear");
     int command = 0;
     char c;
     char readstring[MAX_MESSAGE_LENGTH] = "\0";
 
     // Setup the ACK struct used for tracking ACKS----
     ACKmngr ACKs;
-    for (int y = 0; y < ACK_TABLE_SIZE; y++)
-    {
-        ACKs.Table[y] = -1;
-    }
-    ACKs.Missing = 0;
+    atomic_init(&ACKs.Missing, 0);
     //---------------------------------------------
 
     DEBUGMESSAGE(3, "Intializing socket...");
     socket_fd = InitializeSocket();
+    InitializeBatch(&frameBatch, socket_fd, &receiverAddress, sizeof(receiverAddress));
     DEBUGMESSAGE(1, "Socket setup successfully.");
 
     pthread_t readPacketsThread = 0;
-    pthread_t roundTimeManagerThread = 0;
-    if (sem_init(&roundTimeSemaphore, 0, 1) == -1)
+    pthread_t resendTimeoutsThread = 0;
+    pthread_condattr_t stateConditionAttributes; // Timed waits use CLOCK_MONOTONIC so clock adjustments don't affect them
+    pthread_condattr_init(&stateConditionAttributes);
+    pthread_condattr_setclock(&stateConditionAttributes, CLOCK_MONOTONIC);
+    if (pthread_cond_init(&stateCondition, &stateConditionAttributes) != 0 ||
+        pthread_cond_init(&windowCondition, &stateConditionAttributes) != 0 ||
+        pthread_cond_init(&resendCondition, &stateConditionAttributes) != 0)
     {
-        CRASHWITHERROR("Semaphore roundTimeSemaphore initialization failed in main()");
+        CRASHWITHMESSAGE("Condition variable initialization failed in main()");
     }
-    if (sem_init(&ackSemaphore, 0, 1) == -1)
+    pthread_condattr_destroy(&stateConditionAttributes);
+
+    if (batchMode)
     {
-        CRASHWITHERROR("Semaphore ackSemaphore initialization failed in main()");
+        RunBatchTransfer(argv + firstFileArgument, argc - firstFileArgument, &ACKs, &readPacketsThread,
+                         &resendTimeoutsThread);
     }
 
     while (KillThreads != 1)
     {
-        usleep(1000);
         int update = 0;
         //system("clear"); // Clean up the console
         //printf("%s\n", readstring);
@@ -813,31 +3026,7 @@ int main(int argc, char* argv[])
                 system("clear"); // Clean up the console
                 if (connectionStatus == -1)
                 {
-                    // Create the thread checking for messages from the receiver------
-                    DEBUGMESSAGE(0, YELTEXT("Setting up ReadPackets thread..."));
-                    if (pthread_create(&readPacketsThread, NULL, (void*) ReadPackets, &ACKs) != 0)
-                    {
-                        CRASHWITHERROR("pthread_create(ReadPackets) failed in main()");
-                    }
-                    usleep(5000);
-                    printf(GRN"Done!\n"RESET);
-                    //----------------------------------------------------------------
-                    // Create the thread managing the average roundtime calculation------
-                    DEBUGMESSAGE(0, YELTEXT("Setting up roundTimeManager thread..."));
-                    if (pthread_create(&roundTimeManagerThread, NULL, (void*) roundTimeManager, NULL) != 0)
-                    {
-                        CRASHWITHERROR("pthread_create(roundTimeManager) failed in main()");
-                    }
-                    usleep(5000);
-                    printf(GRN"Done!\n"RESET);
-                    connectionStatus = 0; // connectionStatus set to "pending"
-                    DEBUGMESSAGE(0, "Attempting connection negotiation with parameters window:%d and frame:%d",
-                                 windowSize, frameSize);
-                    NegotiateConnection(windowSize, frameSize, &ACKs);
-                    while (connectionStatus == 0)
-                    {
-                        usleep(100000);
-                    }
+                    ConnectToReceiver(&ACKs, &readPacketsThread, &resendTimeoutsThread);
                 }
                 else if (connectionStatus == 1)
                 {
@@ -856,14 +3045,11 @@ int main(int argc, char* argv[])
                 if (connectionStatus == 1)
                 {
                     //----------------------------------------------------------------
-                    usleep(5000);
                     printf(YEL"Reading message from file..."RESET);
                     LoadMessageFromFile(readstring);
-                    usleep(5000);
                     printf(GRN"Done!\n"RESET);
                     printf(YEL"Sending message!..."RESET);
                     SlidingWindow(readstring, &ACKs); // Send the Message
-                    usleep(1000);
                 }
                 else
                 {
@@ -889,6 +3075,13 @@ int main(int argc, char* argv[])
                 while ((c = getchar()) != '\n' && c != EOF); // Cleaning out the readbuffer
                 corrupt = update;
                 break;
+            case 6:
+                printf(RED"Input new rate cap (in kB/s, 0 for none): "RESET);
+                scanf("%s", commandBuffer);
+                update = strtol(commandBuffer, NULL, 10); // Get a command from the user
+                while ((c = getchar()) != '\n' && c != EOF); // Cleaning out the readbuffer
+                pacingRateCap = update * 1000.0;
+                break;
             case 2049:
                 system("clear");
                 if (connectionStatus == 1)
@@ -900,10 +3093,10 @@ int main(int argc, char* argv[])
                     {
                         CRASHWITHERROR("malloc() for endGame in case 2049 failed");
                     }
-                    WritePacket(endGame, PACKETFLAG_FIN, "byebye", frameSize, 1);
+                    WritePacket(endGame, PACKETFLAG_FIN, "byebye", strlen("byebye"), 1);
                     SendPacket(socket_fd, endGame, &receiverAddress, receiverAddressLength);
                     DEBUGMESSAGE(0, "Waiting for FIN+ACK...");
-                    sleep(1);
+                    WaitForShutdown(1000000);
                 }
                 else
                 {
@@ -918,15 +3111,12 @@ int main(int argc, char* argv[])
 
     //
     printf(YEL"SHUTTING DOWN....\n"RESET);
-    usleep(10000);
     close(socket_fd);
-    sem_post(&roundTimeSemaphore); // unstick the roundTimeManager thread
     printf("Thank you come again :D\n");
     pthread_join(readPacketsThread, NULL);
     DEBUGMESSAGE(3, "readPacketsThread joined");
-    pthread_join(roundTimeManagerThread, NULL);
-    DEBUGMESSAGE(3, "roundTimeManagerThread joined");
-    sleep(1);
+    pthread_join(resendTimeoutsThread, NULL);
+    DEBUGMESSAGE(3, "resendTimeoutsThread joined");
     //system("clear"); // Clean up the console
-    exit(EXIT_SUCCESS);
+    exit(batchFailed ? EXIT_FAILURE : EXIT_SUCCESS);
 }
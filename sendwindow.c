@@ -0,0 +1,238 @@
+/* File: sendwindow.c
+ *
+ * Description:
+ * The sending side of one connection as a state machine, see sendwindow.h. Nothing in here looks at a clock: every
+ * time is the caller's, in microseconds.
+ */
+
+#include "sendwindow.h"
+
+void SendWindowInitialize(sendWindow* window, byte windowSize)
+{
+    memset(window, 0, sizeof(sendWindow));
+    window->windowSize = windowSize;
+    window->timeout = SEND_WINDOW_INITIAL_TIMEOUT;
+    window->backoff = 1;
+}
+
+void SendWindowOpen(sendWindow* window, byte windowSize, unsigned short firstSequence)
+{
+    window->windowSize = windowSize;
+    window->backoff = 1;
+    window->congestionWindow = windowSize > SEND_WINDOW_INITIAL_CONGESTION ? SEND_WINDOW_INITIAL_CONGESTION
+                                                                           : windowSize;
+    window->slowStartThreshold = windowSize;
+    window->base = window->next = firstSequence;
+    window->windowCumulative = firstSequence;
+    window->windowLimit = firstSequence + windowSize;
+}
+
+void SendWindowResize(sendWindow* window, byte windowSize)
+{
+    window->windowSize = windowSize;
+    if (window->slowStartThreshold > windowSize)
+        window->slowStartThreshold = windowSize;
+    double congestionWindow = window->congestionWindow;
+    while (congestionWindow > windowSize &&
+           !atomic_compare_exchange_weak(&window->congestionWindow, &congestionWindow, windowSize))
+        ;
+}
+
+int SendWindowHasRoom(const sendWindow* window)
+{
+    unsigned short next = window->next;
+    return (unsigned short) (next - window->base) < (int) window->congestionWindow &&
+           SEQUENCE_AFTER(window->windowLimit, next);
+}
+
+void SendWindowSent(sendWindow* window, long long now)
+{
+    unsigned short next = window->next;
+    int slot = ACK_SLOT(next);
+    window->sentAt[slot] = now;
+    window->acked[slot] = 0;
+    window->resent[slot] = 0;
+    window->framesSent++;
+    window->next = next + 1; // Only now do the other threads see the frame
+}
+
+int SendWindowInFlight(const sendWindow* window, unsigned short sequence)
+{
+    unsigned short base = window->base;
+    return (unsigned short) (sequence - base) < (unsigned short) (window->next - base) &&
+           !window->acked[ACK_SLOT(sequence)];
+}
+
+static void Resend(sendWindow* window, unsigned short sequence, long long now, resendFunction resend, void* context)
+{
+    int slot = ACK_SLOT(sequence);
+    window->resent[slot] = 1; // Before sentAt, see SendWindowAcknowledge()
+    window->sentAt[slot] = now;
+    window->framesResent++;
+    resend(context, sequence);
+}
+
+// Halves the congestion window for a loss, once per round trip however many frames were lost in it. The thread that
+// moves reducedAt does the cutting, the acknowledging thread may be growing the window at the same time.
+
+static void ReduceCongestionWindow(sendWindow* window, long long now)
+{
+    long long reducedAt = window->reducedAt;
+    if (now - reducedAt <= window->roundTime ||
+        !atomic_compare_exchange_strong(&window->reducedAt, &reducedAt, now))
+        return;
+    double congestionWindow = window->congestionWindow;
+    double halved;
+    do
+    {
+        halved = congestionWindow / 2 > 1 ? congestionWindow / 2 : 1;
+    }
+    while (!atomic_compare_exchange_weak(&window->congestionWindow, &congestionWindow, halved));
+    window->slowStartThreshold = halved;
+}
+
+// Only ever called by the acknowledging thread, the others just read roundTime and timeout
+
+static void SampleRoundTime(sendWindow* window, double sample)
+{
+    double roundTime = window->roundTime;
+    if (roundTime == 0)
+    {
+        roundTime = sample;
+        window->roundTimeVariation = sample / 2;
+    }
+    else
+    {
+        double difference = roundTime > sample ? roundTime - sample : sample - roundTime;
+        window->roundTimeVariation = 0.75 * window->roundTimeVariation + 0.25 * difference;
+        roundTime = 0.875 * roundTime + 0.125 * sample;
+    }
+    window->roundTime = roundTime;
+    // RFC 6298's SRTT + max(G, 4 * RTTVAR): a round trip that hardly varies would otherwise leave no room for any
+    // delay at all
+    double timeout = roundTime + (4 * window->roundTimeVariation > SEND_WINDOW_GRANULARITY
+                                  ? 4 * window->roundTimeVariation : SEND_WINDOW_GRANULARITY);
+    if (timeout < SEND_WINDOW_MIN_TIMEOUT)
+        timeout = SEND_WINDOW_MIN_TIMEOUT;
+    else if (timeout > SEND_WINDOW_MAX_TIMEOUT)
+        timeout = SEND_WINDOW_MAX_TIMEOUT;
+    window->timeout = timeout;
+}
+
+void SendWindowAdvertised(sendWindow* window, unsigned short nextExpected, unsigned short advertisedWindow)
+{
+    if (SEQUENCE_AFTER(window->windowCumulative, nextExpected))
+        return;
+    window->windowCumulative = nextExpected;
+    window->windowLimit = nextExpected + advertisedWindow;
+}
+
+int SendWindowAcknowledge(sendWindow* window, unsigned short sequence, long long now)
+{
+    unsigned short base = window->base; // Nobody else moves it
+    if ((unsigned short) (sequence - base) >= (unsigned short) (window->next - base))
+        return 0; // Not in flight
+    int slot = ACK_SLOT(sequence);
+    byte acked = 0;
+    if (!atomic_compare_exchange_strong(&window->acked[slot], &acked, 1))
+        return 0; // A duplicate
+    // sentAt before resent: Resend() sets them the other way round, so if the frame doesn't look resent here, the
+    // time read is from before any resend and the ACK can only be for the first copy
+    long long sentAt = window->sentAt[slot];
+    if (!window->resent[slot])
+    { // Karn's rule: an ACK for a resent frame may be for either copy, so the timeout stays backed off until one that
+      // can be timed gets through
+        SampleRoundTime(window, now - sentAt);
+        window->backoff = 1;
+    }
+
+    double congestionWindow = window->congestionWindow;
+    double grown;
+    do
+    {
+        grown = congestionWindow < window->slowStartThreshold ? congestionWindow + 1
+                                                              : congestionWindow + 1 / congestionWindow;
+        if (grown > window->windowSize)
+            grown = window->windowSize;
+    }
+    while (!atomic_compare_exchange_weak(&window->congestionWindow, &congestionWindow, grown));
+
+    unsigned short next = window->next;
+    while (base != next && window->acked[ACK_SLOT(base)])
+        window->base = ++base;
+    return 1;
+}
+
+// A frame that was sent after the missing ones got there, so these were most likely lost. A resent frame only counts
+// as lost again once a frame sent after the resend has been ACKed.
+
+int SendWindowResendOvertaken(sendWindow* window, unsigned short ackedSequence, long long now, resendFunction resend,
+                              void* context)
+{
+    unsigned short base = window->base;
+    if ((unsigned short) (ackedSequence - base) >= (unsigned short) (window->next - base))
+        return 0;
+    long long ackedSentAt = window->sentAt[ACK_SLOT(ackedSequence)];
+    int lost = 0;
+    for (unsigned short sequence = base; sequence != ackedSequence; sequence++)
+    {
+        int slot = ACK_SLOT(sequence);
+        if (window->acked[slot] || window->sentAt[slot] >= ackedSentAt)
+            continue;
+        Resend(window, sequence, now, resend, context);
+        lost++;
+    }
+    if (lost > 0)
+        ReduceCongestionWindow(window, now);
+    return lost;
+}
+
+// Every time a frame runs out the congestion window is halved (once per round trip) and the timeout backed off, until
+// a frame that was only sent once is ACKed. Frames ACKed while this runs keep their acked flag, so a base read before
+// they were is still safe to start from.
+
+int SendWindowResendExpired(sendWindow* window, long long now, resendFunction resend, void* context)
+{
+    unsigned short next = window->next;
+    double timeout = window->timeout * window->backoff;
+    int expired = 0;
+    for (unsigned short sequence = window->base; sequence != next; sequence++)
+    {
+        int slot = ACK_SLOT(sequence);
+        if (window->acked[slot] || now - window->sentAt[slot] < timeout)
+            continue;
+        Resend(window, sequence, now, resend, context);
+        expired++;
+    }
+    if (expired > 0)
+    {
+        ReduceCongestionWindow(window, now);
+        SendWindowBackOff(window);
+    }
+    return expired;
+}
+
+long long SendWindowNextExpiry(const sendWindow* window)
+{
+    unsigned short next = window->next;
+    long long oldest = -1;
+    for (unsigned short sequence = window->base; sequence != next; sequence++)
+    {
+        int slot = ACK_SLOT(sequence);
+        long long sentAt = window->sentAt[slot];
+        if (!window->acked[slot] && (oldest == -1 || sentAt < oldest))
+            oldest = sentAt;
+    }
+    if (oldest == -1)
+        return -1;
+    // Rounded up, so that SendWindowResendExpired() finds the frame expired when it is called at this time
+    double wait = window->timeout * window->backoff;
+    return oldest + (long long) wait + ((long long) wait < wait);
+}
+
+void SendWindowBackOff(sendWindow* window)
+{
+    int backoff = window->backoff;
+    while (backoff < SEND_WINDOW_MAX_BACKOFF && !atomic_compare_exchange_weak(&window->backoff, &backoff, backoff * 2))
+        ;
+}
@@ -0,0 +1,91 @@
+/* File: sendwindow.h
+ *
+ * Description:
+ * The sending side of one connection as a state machine without sockets, threads or clocks: which frames may go out
+ * next, what an ACK does to the window, the round trip estimate and the resend timeout taken from it, the congestion
+ * window, and which frames have to be resent and when. The caller does the I/O. It hands the window the time with
+ * every event, in microseconds of whatever clock it runs on, and the window calls it back for every frame it wants
+ * resent. The sender and its fan-out run it on CLOCK_MONOTONIC and sockets, ProtoSim on a simulated clock and network.
+ */
+
+#ifndef DVA218_LAB3B_SENDWINDOW_H
+#define DVA218_LAB3B_SENDWINDOW_H
+
+#include "common.h"
+
+// Resend timeouts in microseconds: the first before any round trip has been measured (1 s, as in RFC 6298), and the
+// bounds of the measured one. The lower bound keeps the scheduling jitter of a busy host from passing for loss on a
+// fast link. Every time the timeout runs out it is doubled, up to SEND_WINDOW_MAX_BACKOFF times, and it stays doubled
+// until a frame that wasn't resent is ACKed.
+#define SEND_WINDOW_INITIAL_TIMEOUT 1000000
+#define SEND_WINDOW_MIN_TIMEOUT 2000
+#define SEND_WINDOW_MAX_TIMEOUT 1000000
+//Change SEND_WINDOW_GRANULARITY to change the least the timeout allows over the round trip (RFC 6298's G)
+#define SEND_WINDOW_GRANULARITY 1000
+//Change SEND_WINDOW_MAX_BACKOFF to back off further from a receiver that loses a lot
+#define SEND_WINDOW_MAX_BACKOFF 8
+//Change SEND_WINDOW_INITIAL_CONGESTION to let a new connection start with more frames in flight
+#define SEND_WINDOW_INITIAL_CONGESTION 2
+
+// Called for every frame the window wants sent again. The window has already counted it as resent.
+typedef void (*resendFunction)(void* context, unsigned short sequence);
+
+// A window can be shared by three threads without a lock, one per role:
+// - the sending thread calls SendWindowHasRoom() and SendWindowSent(), and is the only one that moves next;
+// - the acknowledging thread calls SendWindowAdvertised(), SendWindowAcknowledge(), SendWindowResendOvertaken() and
+//   SendWindowResize(), and is the only one that moves base;
+// - the timer thread calls SendWindowResendExpired(), SendWindowNextExpiry() and SendWindowBackOff().
+// SendWindowInitialize() and SendWindowOpen() come before any frame is in flight. An ACK claims its frame with a
+// compare-and-swap on acked. Two threads resending the same frame at once, or a frame whose ACK just came in, only
+// send it twice. The fan-out and ProtoSim play all three roles from one thread.
+typedef struct sendWindow sendWindow;
+struct sendWindow
+{
+    byte windowSize;            // Negotiated, the most frames that may be in flight
+    _Atomic unsigned short base;        // Oldest frame not ACKed yet
+    _Atomic unsigned short next;        // Next frame to go out for the first time
+    _Atomic unsigned short windowLimit; // The receiver's advertised window ends here, see ACK_WINDOW_DATA_LENGTH
+    _Atomic unsigned short windowCumulative; // Next expected sequence of the ACK windowLimit came from
+    _Atomic double congestionWindow;    // Frames that may be in flight, 1 to windowSize
+    _Atomic double slowStartThreshold;
+    _Atomic double roundTime;   // Smoothed, in microseconds, 0 until the first sample
+    double roundTimeVariation;
+    _Atomic double timeout;     // Microseconds, from the round trip
+    atomic_int backoff;         // What timeout is multiplied by, reset by every round trip sample
+    _Atomic long long reducedAt; // When congestionWindow was last cut, which happens once per round trip at most
+    unsigned long framesSent;
+    atomic_ulong framesResent;
+    _Atomic long long sentAt[ACK_TABLE_SIZE]; // When each frame in flight last went out
+    _Atomic byte acked[ACK_TABLE_SIZE];       // Stays set until SendWindowSent() reuses the slot
+    _Atomic byte resent[ACK_TABLE_SIZE];      // Resent frames give no round trip samples
+};
+
+// Sets up a window that is still shaking hands, SendWindowOpen() opens it once the receiver has agreed
+void SendWindowInitialize(sendWindow* window, byte windowSize);
+void SendWindowOpen(sendWindow* window, byte windowSize, unsigned short firstSequence);
+// Takes a new window size the receiver agreed to while frames are in flight. The ones beyond it stay in flight.
+void SendWindowResize(sendWindow* window, byte windowSize);
+
+// True if both the congestion window and the receiver's advertised window have room for window->next
+int SendWindowHasRoom(const sendWindow* window);
+// Records that window->next went out for the first time, and moves on to the one after it
+void SendWindowSent(sendWindow* window, long long now);
+// True if the frame has gone out and hasn't been ACKed
+int SendWindowInFlight(const sendWindow* window, unsigned short sequence);
+
+// Takes the receiver's advertised window from an ACK, unless an ACK that was sent after it got here first
+void SendWindowAdvertised(sendWindow* window, unsigned short nextExpected, unsigned short advertisedWindow);
+// Counts an ACK for one frame. Returns 1 if the frame was in flight, 0 for a duplicate or a frame never sent.
+int SendWindowAcknowledge(sendWindow* window, unsigned short sequence, long long now);
+
+// Resends the frames still missing that  went out before the one just ACKed. Returns how many.
+int SendWindowResendOvertaken(sendWindow* window, unsigned short ackedSequence, long long now, resendFunction resend,
+                              void* context);
+// Resends the frames that have been in flight longer than the timeout. Returns how many.
+int SendWindowResendExpired(sendWindow* window, long long now, resendFunction resend, void* context);
+// When SendWindowResendExpired() next has something to do, -1 if nothing is in flight
+long long SendWindowNextExpiry(const sendWindow* window);
+// Doubles the timeout, up to SEND_WINDOW_MAX_BACKOFF times, for a handshake that went unanswered
+void SendWindowBackOff(sendWindow* window);
+
+#endif //DVA218_LAB3B_SENDWINDOW_H
@@ -0,0 +1,204 @@
+/* File: sharedring.c
+ *
+ * Description:
+ * The shared memory ring of the same-host data path, see sharedring.h.
+ */
+
+#define _GNU_SOURCE
+#include "sharedring.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHARED_RING_HEADER_SPACE 4096
+#define RECORD_LENGTH(length) ((4u + (unsigned int) (length) + 7u) & ~7u)
+
+int SharedRingPeerIsLocal(const struct sockaddr_in* address)
+{
+    if ((ntohl(address->sin_addr.s_addr) >> 24) == 127)
+        return 1;
+
+    // Only addresses of our own interfaces can be bound to
+    int probe = socket(AF_INET, SOCK_DGRAM, 0);
+    if (probe < 0)
+        return 0;
+    struct sockaddr_in local = *address;
+    local.sin_port = 0;
+    int isLocal = bind(probe, (struct sockaddr*) &local, sizeof(local)) == 0;
+    close(probe);
+    return isLocal;
+}
+
+static int MapRing(sharedRing* ring, int fd)
+{
+    ring->mappedLength = SHARED_RING_HEADER_SPACE + SHARED_RING_SIZE;
+    void* mapping = mmap(NULL, ring->mappedLength, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+        return -1;
+    ring->header = mapping;
+    ring->records = (byte*) mapping + SHARED_RING_HEADER_SPACE;
+    ring->reservedSkip = 0;
+    ring->failed = 0;
+    return 0;
+}
+
+int SharedRingCreate(sharedRing* ring)
+{
+    int fd = memfd_create("lab3b-shared-ring", MFD_CLOEXEC);
+    if (fd < 0)
+    {
+        DEBUGMESSAGE(1, "memfd_create() failed (%s), no shared memory ring", strerror(errno));
+        return -1;
+    }
+    unsigned long long token;
+    if (ftruncate(fd, SHARED_RING_HEADER_SPACE + SHARED_RING_SIZE) == -1 || MapRing(ring, fd) == -1 ||
+        getrandom(&token, sizeof(token), 0) != sizeof(token))
+    {
+        DEBUGMESSAGE(1, "Couldn't set up the shared memory ring (%s)", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    ring->fd = fd;
+    ring->header->size = SHARED_RING_SIZE;
+    ring->header->token = token;
+    atomic_init(&ring->header->tail, 0);
+    atomic_init(&ring->header->head, 0);
+    atomic_init(&ring->header->consumerWaiting, 1); // The receiver doesn't look at the ring until it is woken
+    atomic_thread_fence(memory_order_release);
+    ring->header->magic = SHARED_RING_MAGIC;
+    return 0;
+}
+
+int SharedRingAttach(sharedRing* ring, int pid, int fd, unsigned long long token)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", pid, fd);
+    // Non-blocking, the name may be anything on a host that isn't the sender's, a FIFO included
+    int ringFd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (ringFd < 0)
+    {
+        DEBUGMESSAGE(1, "Couldn't open the sender's shared memory ring %s (%s)", path, strerror(errno));
+        return -1;
+    }
+    struct stat status;
+    if (fstat(ringFd, &status) == -1 || !S_ISREG(status.st_mode) ||
+        status.st_size < SHARED_RING_HEADER_SPACE + SHARED_RING_SIZE || MapRing(ring, ringFd) == -1)
+    {
+        close(ringFd);
+        return -1;
+    }
+    close(ringFd); // The mapping keeps it alive
+    ring->fd = -1;
+    if (ring->header->magic != SHARED_RING_MAGIC || ring->header->size != SHARED_RING_SIZE ||
+        ring->header->token != token)
+    {
+        DEBUGMESSAGE(1, "%s is not the sender's shared memory ring", path);
+        SharedRingClose(ring);
+        return -1;
+    }
+    return 0;
+}
+
+void SharedRingClose(sharedRing* ring)
+{
+    if (ring->header != NULL)
+        munmap(ring->header, ring->mappedLength);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    ring->header = NULL;
+    ring->records = NULL;
+    ring->fd = -1;
+}
+
+byte* SharedRingReserve(sharedRing* ring, int length)
+{
+    unsigned int tail = atomic_load_explicit(&ring->header->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring->header->head, memory_order_acquire);
+    unsigned int offset = tail & (SHARED_RING_SIZE - 1);
+    unsigned int recordLength = RECORD_LENGTH(length);
+    unsigned int skip = offset + recordLength > SHARED_RING_SIZE ? SHARED_RING_SIZE - offset : 0;
+    if (tail + skip + recordLength - head > SHARED_RING_SIZE)
+        return NULL;
+
+    if (skip > 0)
+    { // Records are eight byte aligned, so there is always room for the marker
+        unsigned int marker = SHARED_RING_WRAP;
+        memcpy(ring->records + offset, &marker, 4);
+        offset = 0;
+    }
+    ring->reservedSkip = skip;
+    ring->reservedOffset = offset;
+    return ring->records + offset + 4;
+}
+
+int SharedRingCommit(sharedRing* ring, int length)
+{
+    unsigned int recordDataLength = length;
+    memcpy(ring->records + ring->reservedOffset, &recordDataLength, 4);
+    unsigned int tail = atomic_load_explicit(&ring->header->tail, memory_order_relaxed);
+    // Sequentially consistent, so that the receiver either sees the record or has its flag seen here
+    atomic_store(&ring->header->tail, tail + ring->reservedSkip + RECORD_LENGTH(length));
+    ring->reservedSkip = 0;
+    return atomic_load(&ring->header->consumerWaiting) != 0 && atomic_exchange(&ring->header->consumerWaiting, 0);
+}
+
+void SharedRingCancel(sharedRing* ring)
+{
+    ring->reservedSkip = 0; // A wrap marker that was written is simply written again by the next record
+}
+
+const byte* SharedRingPeek(sharedRing* ring, int* length)
+{
+    unsigned int head = atomic_load_explicit(&ring->header->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->header->tail, memory_order_acquire);
+    while (head != tail && !ring->failed)
+    {
+        unsigned int offset = head & (SHARED_RING_SIZE - 1);
+        unsigned int recordDataLength;
+        memcpy(&recordDataLength, ring->records + offset, 4);
+        if (recordDataLength == SHARED_RING_WRAP)
+        {
+            head += SHARED_RING_SIZE - offset;
+            atomic_store_explicit(&ring->header->head, head, memory_order_release);
+            continue;
+        }
+        if (recordDataLength > sizeof(packet) || offset + RECORD_LENGTH(recordDataLength) > SHARED_RING_SIZE ||
+            tail - head < RECORD_LENGTH(recordDataLength))
+        {
+            DEBUGMESSAGE(0, YELTEXT("WARNING: ")"Shared memory ring holds a record of %u bytes, no longer reading it",
+                         recordDataLength);
+            ring->failed = 1;
+            break;
+        }
+        *length = recordDataLength;
+        return ring->records + offset + 4;
+    }
+    return NULL;
+}
+
+void SharedRingRelease(sharedRing* ring, int length)
+{
+    unsigned int head = atomic_load_explicit(&ring->header->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->header->head, head + RECORD_LENGTH(length), memory_order_release);
+}
+
+int SharedRingPrepareToWait(sharedRing* ring)
+{
+    if (ring->failed)
+        return 1;
+    atomic_store(&ring->header->consumerWaiting, 1);
+    if (atomic_load(&ring->header->tail) == atomic_load_explicit(&ring->header->head, memory_order_relaxed))
+        return 1;
+    atomic_store_explicit(&ring->header->consumerWaiting, 0, memory_order_relaxed);
+    return 0;
+}
+
+void SharedRingStopWaiting(sharedRing* ring)
+{
+    if (atomic_load_explicit(&ring->header->consumerWaiting, memory_order_relaxed))
+        atomic_store_explicit(&ring->header->consumerWaiting, 0, memory_order_relaxed);
+}
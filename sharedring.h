@@ -0,0 +1,75 @@
+/* File: sharedring.h
+ *
+ * Description:
+ * Same-host data path. When the receiver runs on the same host, the sender puts its data frames in a ring of
+ * datagrams in shared memory instead of sending them over the socket, which saves the two copies through the kernel
+ * and the system calls of every frame. The sender creates the ring in a memfd and names it in the SYN (see
+ * SYN_SHARED_RING_DATA_LENGTH), the receiver maps it through /proc/<pid>/fd/<fd> and checks the random token in it.
+ * Everything else, the handshake, ACKs, signature requests and the FIN, stays on UDP.
+ * The ring is single-producer single-consumer: every record is a four byte length followed by the datagram, padded to
+ * eight bytes, and a record that doesn't fit before the end of the ring leaves a SHARED_RING_WRAP marker and starts
+ * over at the beginning. Since the receiver also has to wait for the socket, it can't sleep on the ring itself: it
+ * sets consumerWaiting before it blocks, and the sender wakes it with an empty datagram when it finds the flag set.
+ * A full ring doesn't block the sender, the frame counts as lost and its timeout sends it again.
+ */
+
+#ifndef DVA218_LAB3B_SHAREDRING_H
+#define DVA218_LAB3B_SHAREDRING_H
+
+#include "common.h"
+#include <stdint.h>
+
+//Change SHARED_RING_SIZE to let more frames wait in the ring (a power of two, in bytes)
+#define SHARED_RING_SIZE (8 * 1024 * 1024)
+#define SHARED_RING_MAGIC 0x52484d53u
+#define SHARED_RING_WRAP 0xffffffffu
+
+// The first page of the memfd, the records follow it. Head and tail count bytes since the ring was created, wrapping
+// at 2^32, and sit on cache lines of their own so that the two sides don't take turns owning the same line.
+typedef struct sharedRingHeader sharedRingHeader;
+struct sharedRingHeader
+{
+    unsigned int magic;
+    unsigned int size;
+    unsigned long long token;
+    _Alignas(64) atomic_uint tail;          // Only the sender writes it
+    _Alignas(64) atomic_uint head;          // Only the receiver writes it
+    atomic_uint consumerWaiting;            // Set by the receiver before it blocks, cleared by whoever wakes it
+};
+
+typedef struct sharedRing sharedRing;
+struct sharedRing
+{
+    sharedRingHeader* header;
+    byte* records;
+    size_t mappedLength;
+    int fd;                     // The memfd on the sender's side, -1 on the receiver's
+    unsigned int reservedSkip;  // Bytes the record being written skips at the end of the ring
+    unsigned int reservedOffset; // Where the record being written starts
+    int failed;                 // The receiver found a record that can't be right and stopped reading
+};
+
+// True if the address belongs to this host, so that a ring would reach it
+int SharedRingPeerIsLocal(const struct sockaddr_in* address);
+
+// Sender: creates the ring. Returns -1 if the kernel has no memfd.
+int SharedRingCreate(sharedRing* ring);
+// Receiver: maps the ring process pid created as file descriptor fd, if its token matches. Returns -1 otherwise.
+int SharedRingAttach(sharedRing* ring, int pid, int fd, unsigned long long token);
+void SharedRingClose(sharedRing* ring);
+
+// Sender: returns where a datagram of up to length bytes goes, NULL if the ring is full. SharedRingCommit() hands it
+// to the receiver with its final length and returns 1 if the receiver has to be woken up, SharedRingCancel() drops it.
+byte* SharedRingReserve(sharedRing* ring, int length);
+int SharedRingCommit(sharedRing* ring, int length);
+void SharedRingCancel(sharedRing* ring);
+
+// Receiver: returns the oldest datagram and its length, NULL if the ring is empty. SharedRingRelease() gives its
+// space back to the sender.
+const byte* SharedRingPeek(sharedRing* ring, int* length);
+void SharedRingRelease(sharedRing* ring, int length);
+// Receiver: call before blocking on the socket. Returns 0 if something arrived meanwhile and it shouldn't block.
+int SharedRingPrepareToWait(sharedRing* ring);
+void SharedRingStopWaiting(sharedRing* ring);
+
+#endif //DVA218_LAB3B_SHAREDRING_H
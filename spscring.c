@@ -0,0 +1,114 @@
+/* File: spscring.c
+ *
+ * Description:
+ * Single-producer single-consumer ring, see spscring.h. The semaphores only make a thread sleep when the ring is
+ * empty or full, glibc's sem_post()/sem_wait() stay in user space as long as nobody has to wait.
+ */
+
+#include "spscring.h"
+#include "common.h"
+#include <errno.h>
+
+int SpscRingInitialize(spscRing* ring, const char* name, unsigned int capacity)
+{
+    unsigned int roundedCapacity = 1;
+    while (roundedCapacity < capacity)
+        roundedCapacity *= 2;
+
+    memset(ring, 0, sizeof(spscRing));
+    ring->name = name;
+    ring->capacity = roundedCapacity;
+    if ((ring->slots = calloc(roundedCapacity, sizeof(void*))) == NULL)
+    {
+        DEBUGMESSAGE(0, "SpscRingInitialize() calloc failed");
+        return -1;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    if (sem_init(&ring->items, 0, 0) == -1 || sem_init(&ring->space, 0, roundedCapacity) == -1)
+    {
+        DEBUGMESSAGE(0, "SpscRingInitialize() sem_init failed");
+        return -1;
+    }
+    return 0;
+}
+
+// Blocks until a semaphore can be taken, sem_wait() returns early if a signal arrives
+static void WaitForSemaphore(sem_t* semaphore)
+{
+    while (sem_wait(semaphore) != 0 && errno == EINTR)
+        ;
+}
+
+static void PutItem(spscRing* ring, void* item)
+{
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    ring->slots[tail & (ring->capacity - 1)] = item;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    sem_post(&ring->items);
+
+    unsigned int depth = tail + 1 - atomic_load_explicit(&ring->head, memory_order_acquire);
+    atomic_fetch_add_explicit(&ring->pushes, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ring->depthTotal, depth, memory_order_relaxed);
+    if (depth > atomic_load_explicit(&ring->maxDepth, memory_order_relaxed))
+        atomic_store_explicit(&ring->maxDepth, depth, memory_order_relaxed);
+}
+
+static void* TakeItem(spscRing* ring)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    void* item = ring->slots[head & (ring->capacity - 1)];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    sem_post(&ring->space);
+    return item;
+}
+
+void SpscRingPush(spscRing* ring, void* item)
+{
+    if (sem_trywait(&ring->space) != 0)
+    {
+        atomic_fetch_add_explicit(&ring->fullWaits, 1, memory_order_relaxed);
+        WaitForSemaphore(&ring->space);
+    }
+    PutItem(ring, item);
+}
+
+// Returns 1 if the item was pushed, 0 if the ring was full
+
+int SpscRingTryPush(spscRing* ring, void* item)
+{
+    if (sem_trywait(&ring->space) != 0)
+        return 0;
+    PutItem(ring, item);
+    return 1;
+}
+
+void* SpscRingPop(spscRing* ring)
+{
+    WaitForSemaphore(&ring->items);
+    return TakeItem(ring);
+}
+
+// Returns NULL if the ring is empty
+
+void* SpscRingTryPop(spscRing* ring)
+{
+    if (sem_trywait(&ring->items) != 0)
+        return NULL;
+    return TakeItem(ring);
+}
+
+unsigned int SpscRingDepth(spscRing* ring)
+{
+    return atomic_load_explicit(&ring->tail, memory_order_acquire) -
+           atomic_load_explicit(&ring->head, memory_order_acquire);
+}
+
+void SpscRingPrintStatistics(spscRing* ring)
+{
+    unsigned long pushes = atomic_load(&ring->pushes);
+    printf("  %-16s depth %4u/%-4u  average %6.1f  max %4u  pushes %8lu  waited for space %lu\n", ring->name,
+           SpscRingDepth(ring), ring->capacity,
+           pushes > 0 ? (double) atomic_load(&ring->depthTotal) / pushes : 0.0,
+           atomic_load(&ring->maxDepth), pushes, atomic_load(&ring->fullWaits));
+}
@@ -0,0 +1,44 @@
+/* File: spscring.h
+ *
+ * Description:
+ * Bounded single-producer single-consumer ring of pointers, used to hand buffers from one pipeline stage to the
+ * next. Exactly one thread may push and exactly one (other) thread may pop. Pushing to a full ring and popping from
+ * an empty one block; the Try variants don't.
+ * Every ring keeps queue depth statistics so that the stage that can't keep up shows up as the one with a deep queue.
+ */
+
+#ifndef DVA218_LAB3B_SPSCRING_H
+#define DVA218_LAB3B_SPSCRING_H
+
+#include <semaphore.h>
+#include <stdatomic.h>
+
+typedef struct spscRing spscRing;
+struct spscRing
+{
+    const char* name;
+    void** slots;
+    unsigned int capacity;  // Always a power of two
+    atomic_uint head;       // Next slot the consumer takes, only the consumer writes it
+    atomic_uint tail;       // Next slot the producer fills, only the producer writes it
+    sem_t items;            // Filled slots, the consumer sleeps on it when the ring is empty
+    sem_t space;            // Free slots, the producer sleeps on it when the ring is full
+
+    // Statistics, updated by the producer and read by anyone
+    atomic_ulong pushes;
+    atomic_ulong depthTotal;    // Sum of the depth seen by every push, divide by pushes for the average
+    atomic_uint maxDepth;
+    atomic_ulong fullWaits;     // Pushes that had to wait for the consumer
+};
+
+int SpscRingInitialize(spscRing* ring, const char* name, unsigned int capacity);
+
+void SpscRingPush(spscRing* ring, void* item);
+int SpscRingTryPush(spscRing* ring, void* item);
+void* SpscRingPop(spscRing* ring);
+void* SpscRingTryPop(spscRing* ring);
+
+unsigned int SpscRingDepth(spscRing* ring);
+void SpscRingPrintStatistics(spscRing* ring);
+
+#endif //DVA218_LAB3B_SPSCRING_H
@@ -0,0 +1,28 @@
+#!/bin/bash
+# Sends a file in frames of the largest size there is, each cut into fragments that fit a 1500 byte MTU, and checks
+# that the receiver puts every frame back together.
+# Usage: max_frame.sh <Sender> <Receiver>
+
+SENDER=$1
+RECEIVER=$2
+WORK=$(mktemp -d)
+trap 'kill $RECEIVER_PID 2>/dev/null; rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+mkdir input
+head -c 2000000 /dev/urandom > input/frames.bin
+
+"$RECEIVER" 0 > receiver.log 2>&1 &
+RECEIVER_PID=$!
+sleep 0.3
+
+# The socket path, since frames through shared memory aren't fragmented
+timeout 60 "$SENDER" 0 --frame=65487 --fixed-frame --mtu=1500 --no-shm input > sender.log 2>&1 ||
+    { echo "The transfer failed"; exit 1; }
+if ! grep "parameters" sender.log | tail -1 | grep -q "frame:65487"; then
+    echo "The receiver didn't accept the largest frame size:"
+    grep "frame:" sender.log
+    exit 1
+fi
+sleep 0.2
+cmp received/*/frames.bin input/frames.bin
@@ -0,0 +1,16 @@
+#!/bin/bash
+# Runs ProtoSim without loss at round trips above the old 20 ms first timeout and checks that next to nothing is
+# resent. A timeout that can't rise above the round trip resends every frame.
+# Usage: protosim_resends.sh <ProtoSim>
+
+PROTOSIM=$1
+for rtt in 25-25 50-50 1-100; do
+    line=$("$PROTOSIM" --hours=0.02 --loss=0 --rtt=$rtt | grep "^ *resends")
+    resends=$(echo "$line" | awk '{ print $2 + 0 }')
+    frames=$(echo "$line" | awk '{ print $5 + 0 }')
+    echo "round trips $rtt ms: $resends resends of $frames frames"
+    if [ -z "$resends" ] || [ "$frames" -eq 0 ] || [ $((resends * 1000)) -gt "$frames" ]; then
+        echo "More than 0.1% of the frames were resent without any loss"
+        exit 1
+    fi
+done
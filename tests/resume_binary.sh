@@ -0,0 +1,39 @@
+#!/bin/bash
+# Interrupts a resumable batch transfer of a file full of NUL bytes halfway, runs it again and checks that the
+# receiver ends up with exactly the file that was sent.
+# Usage: resume_binary.sh <Sender> <Receiver>
+
+SENDER=$1
+RECEIVER=$2
+WORK=$(mktemp -d)
+trap 'kill $RECEIVER_PID 2>/dev/null; rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+mkdir input
+for i in 1 2 3; do
+    head -c 4194304 /dev/zero
+    head -c 4194304 /dev/urandom
+done > input/nul.bin
+
+"$RECEIVER" 0 > receiver.log 2>&1 &
+RECEIVER_PID=$!
+sleep 0.3
+
+# 24 MB at 8 MB/s, so that the receiver has journalled part of it when the sender dies
+"$SENDER" 0 --resume --rate=8000 input > first.log 2>&1 &
+SENDER_PID=$!
+sleep 1.6
+{ kill -KILL $SENDER_PID && wait $SENDER_PID; } 2> /dev/null
+if [ -z "$(find received -name nul.bin -size +1c 2>/dev/null)" ]; then
+    echo "The first run wrote nothing"
+    exit 1
+fi
+
+timeout 60 "$SENDER" 0 --resume input > second.log 2>&1 || { echo "The second run failed"; exit 1; }
+sleep 0.2
+if ! grep -q "Resuming 'input/nul.bin' at byte [1-9]" second.log; then
+    echo "The second run didn't resume:"
+    grep "Resuming" second.log
+    exit 1
+fi
+cmp received/*/nul.bin input/nul.bin